@@ -0,0 +1,495 @@
+/*
+ * benchmark of sd_markdown_render with the HTML renderer over a generated
+ * corpus; linked with --wrap=malloc,calloc,realloc to count allocations,
+ * those of a first render with a new parser and those of a warm one
+ */
+
+#include "markdown.h"
+#include "html.h"
+#include "buffer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DOC_COUNT 8
+#define DEFAULT_ITERATIONS 20
+#define MAX_NESTING 16
+#define OUTPUT_UNIT 64
+
+/* allocation counters */
+
+static size_t malloc_count = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+	malloc_count++;
+
+	return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size)
+{
+	malloc_count++;
+
+	return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+	malloc_count++;
+
+	return __real_realloc(ptr, size);
+}
+
+/* document generators */
+
+static unsigned int next_random(unsigned int* seed)
+{
+	*seed = (*seed * 1103515245U) + 12345U;
+
+	return (*seed >> 16) & 0x7fff;
+}
+
+static const char* const WORDS[] = {
+	"the", "parser", "renders", "markdown", "into", "html", "with", "a",
+	"single", "pass", "over", "each", "block", "of", "text", "and", "its",
+	"spans", "sundown", "is", "fast", "enough", "for", "most", "documents",
+};
+
+static void put_words(struct buf* ob, unsigned int* seed, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		if (i != 0) {
+			bufputc(ob, ' ');
+		}
+
+		bufputs(ob, WORDS[next_random(seed) % (sizeof(WORDS) / sizeof(WORDS[0]))]);
+	}
+}
+
+/**
+ * words with the occasional emphasis, code span, link or entity
+ */
+static void put_prose(struct buf* ob, unsigned int* seed, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		unsigned int r = next_random(seed) % 40;
+
+		if (i != 0) {
+			bufputc(ob, ' ');
+		}
+
+		if (r == 0) {
+			BUFPUTSL(ob, "*");
+			put_words(ob, seed, 2);
+			BUFPUTSL(ob, "*");
+		} else if (r == 1) {
+			BUFPUTSL(ob, "**");
+			put_words(ob, seed, 2);
+			BUFPUTSL(ob, "**");
+		} else if (r == 2) {
+			BUFPUTSL(ob, "`code_span()`");
+		} else if (r == 3) {
+			BUFPUTSL(ob, "[a link](http://example.com/page \"title\")");
+		} else if (r == 4) {
+			BUFPUTSL(ob, "&amp; <em>inline</em>");
+		} else {
+			put_words(ob, seed, 1);
+		}
+	}
+}
+
+static void gen_prose(struct buf* ob, unsigned int* seed, size_t size)
+{
+	while (ob->size < size) {
+		if (next_random(seed) % 8 == 0) {
+			bufprintf(ob, "%.*s ", (int) (1 + next_random(seed) % 3), "###");
+			put_words(ob, seed, 4);
+			BUFPUTSL(ob, "\n\n");
+		}
+
+		put_prose(ob, seed, 40 + next_random(seed) % 80);
+		BUFPUTSL(ob, "\n\n");
+	}
+}
+
+/**
+ * a bit of every extension
+ */
+static void gen_extensions(struct buf* ob, unsigned int* seed, size_t size)
+{
+	unsigned int note = 0;
+
+	while (ob->size < size) {
+		switch (next_random(seed) % 8) {
+			case 0:
+				BUFPUTSL(ob, "| left | center | right |\n|:-----|:------:|------:|\n");
+
+				for (int i = 0; i < 4; ++i) {
+					BUFPUTSL(ob, "| ");
+					put_words(ob, seed, 2);
+					BUFPUTSL(ob, " | `x` | **1.5** |\n");
+				}
+
+				break;
+
+			case 1:
+				BUFPUTSL(ob, "```c\nint main(void)\n{\n\treturn 0;\n}\n```\n");
+
+				break;
+
+			case 2:
+				BUFPUTSL(ob, "see http://example.com/a_(b) or www.example.org and mail@example.com\n");
+
+				break;
+
+			case 3:
+				put_words(ob, seed, 3);
+				BUFPUTSL(ob, " ~~struck~~ ++inserted++ 2^10 and ^(a b) intra_word_emphasis\n");
+
+				break;
+
+			case 4:
+				put_words(ob, seed, 4);
+				bufprintf(ob, " with a note[^%u].\n\n[^%u]: ", note, note);
+				put_words(ob, seed, 12);
+				BUFPUTSL(ob, "\n");
+				note++;
+
+				break;
+
+			case 5:
+				BUFPUTSL(ob, "#Header without space\n");
+
+				break;
+
+			case 6:
+				/* lax spacing: a list right after a paragraph */
+				put_words(ob, seed, 8);
+				BUFPUTSL(ob, "\n- one\n- two\n");
+
+				break;
+
+			default:
+				put_prose(ob, seed, 30);
+				BUFPUTSL(ob, "\n");
+
+				break;
+		}
+
+		BUFPUTSL(ob, "\n");
+	}
+}
+
+static void gen_tables(struct buf* ob, unsigned int* seed, size_t size)
+{
+	while (ob->size < size) {
+		for (int i = 0; i < 12; ++i) {
+			BUFPUTSL(ob, "| col ");
+		}
+
+		BUFPUTSL(ob, "|\n");
+
+		for (int i = 0; i < 12; ++i) {
+			bufputs(ob, (i % 3 == 0) ? ("|:---") : ((i % 3 == 1) ? ("|:---:") : ("|---:")));
+		}
+
+		BUFPUTSL(ob, "|\n");
+
+		for (int row = 0; (row < 500) && (ob->size < size); ++row) {
+			for (int i = 0; i < 12; ++i) {
+				BUFPUTSL(ob, "| ");
+				put_words(ob, seed, 1 + next_random(seed) % 3);
+				bufputc(ob, ' ');
+			}
+
+			BUFPUTSL(ob, "|\n");
+		}
+
+		BUFPUTSL(ob, "\n");
+	}
+}
+
+static void gen_lists(struct buf* ob, unsigned int* seed, size_t size)
+{
+	while (ob->size < size) {
+		for (int depth = 0; depth < MAX_NESTING; ++depth) {
+			for (int i = 0; i < depth * 4; ++i) {
+				bufputc(ob, ' ');
+			}
+
+			bufputs(ob, (depth % 2 == 0) ? ("- ") : ("1. "));
+			put_prose(ob, seed, 8);
+			bufputc(ob, '\n');
+		}
+
+		bufputc(ob, '\n');
+	}
+}
+
+static void gen_quotes(struct buf* ob, unsigned int* seed, size_t size)
+{
+	while (ob->size < size) {
+		for (int depth = 1; depth <= MAX_NESTING; ++depth) {
+			for (int i = 0; i < depth; ++i) {
+				BUFPUTSL(ob, "> ");
+			}
+
+			put_prose(ob, seed, 12);
+			bufputc(ob, '\n');
+		}
+
+		bufputc(ob, '\n');
+	}
+}
+
+static void gen_refs(struct buf* ob, unsigned int* seed, size_t size)
+{
+	unsigned int refs = 0;
+
+	while (ob->size < size) {
+		for (int i = 0; i < 8; ++i) {
+			bufprintf(ob, "[ref %u]: http://example.com/%u \"Reference %u\"\n", refs + i, refs + i, refs + i);
+		}
+
+		bufputc(ob, '\n');
+
+		for (int i = 0; i < 8; ++i) {
+			put_words(ob, seed, 6);
+			bufprintf(ob, " [see this][ref %u] and [Ref %u] ", refs + (next_random(seed) % (i + 1)), refs + i);
+		}
+
+		BUFPUTSL(ob, "\n\n");
+		refs += 8;
+	}
+}
+
+/* pathological inputs */
+
+static void gen_emphasis(struct buf* ob, unsigned int* seed, size_t size)
+{
+	while (ob->size < size) {
+		bufputs(ob, (next_random(seed) % 2 == 0) ? ("*a **b ") : ("_a ~~b "));
+	}
+
+	bufputc(ob, '\n');
+}
+
+static void gen_html(struct buf* ob, unsigned int* seed, size_t size)
+{
+	while (ob->size < size) {
+		BUFPUTSL(ob, "<div>\n");
+		put_words(ob, seed, 10);
+		BUFPUTSL(ob, "\n\n");
+	}
+}
+
+static void gen_brackets(struct buf* ob, unsigned int* seed, size_t size)
+{
+	while (ob->size < size) {
+		BUFPUTSL(ob, "[a ");
+		put_words(ob, seed, 1);
+		bufputc(ob, ' ');
+	}
+
+	bufputc(ob, '\n');
+}
+
+struct bench_case
+{
+	const char* name;
+	void (*generate)(struct buf* ob, unsigned int* seed, size_t size);
+	unsigned int extensions;
+	size_t size;
+};
+
+static const struct bench_case CASES[] = {
+	{"prose", gen_prose, 0, 64 * 1024},
+	{"prose-autolink", gen_prose, MKDEXT_AUTOLINK, 64 * 1024},
+	{"extensions", gen_extensions, 0x3ff & ~MKDEXT_NO_INTRA_EMPHASIS, 64 * 1024},
+	{"no-intra-emphasis", gen_extensions, 0x3ff, 64 * 1024},
+	{"tables", gen_tables, MKDEXT_TABLES, 256 * 1024},
+	{"deep-lists", gen_lists, 0, 64 * 1024},
+	{"deep-quotes", gen_quotes, 0, 64 * 1024},
+	{"references", gen_refs, 0, 64 * 1024},
+	{"unclosed-emphasis", gen_emphasis, MKDEXT_STRIKETHROUGH, 16 * 1024},
+	{"unclosed-html", gen_html, 0, 16 * 1024},
+	{"unclosed-brackets", gen_brackets, 0, 16 * 1024},
+};
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (ts.tv_sec * 1e6) + (ts.tv_nsec / 1e3);
+}
+
+static int compare_double(const void* a, const void* b)
+{
+	double x = *(const double*) a;
+	double y = *(const double*) b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * renders every document of a case iterations times, returns 0 on success
+ */
+static int run_case(const struct bench_case* bench, unsigned int iterations)
+{
+	struct buf* docs[DOC_COUNT];
+	size_t samples_count = DOC_COUNT * iterations;
+	double* samples = malloc(samples_count * sizeof(double));
+	struct buf* ob = bufnew(OUTPUT_UNIT);
+
+	struct sd_callbacks callbacks;
+	struct html_renderopt options;
+	sdhtml_renderer(&callbacks, &options, 0);
+	struct sd_markdown* markdown = sd_markdown_new(bench->extensions, MAX_NESTING, &callbacks, &options);
+
+	if ((samples == NULL) || (ob == NULL) || (markdown == NULL)) {
+		free(samples);
+		bufrelease(ob);
+
+		if (markdown != NULL) {
+			sd_markdown_free(markdown);
+		}
+
+		return -1;
+	}
+
+	size_t input_size = 0;
+
+	for (unsigned int i = 0; i < DOC_COUNT; ++i) {
+		unsigned int seed = i + 1;
+
+		docs[i] = bufnew(1024);
+
+		if (docs[i] != NULL) {
+			bench->generate(docs[i], &seed, bench->size);
+			input_size += docs[i]->size;
+		}
+	}
+
+	/* allocations of a first render, from a new parser into a new output buffer */
+	size_t cold_mallocs = malloc_count;
+	size_t cold_count = 0;
+
+	for (unsigned int i = 0; i < DOC_COUNT; ++i) {
+		if (docs[i] == NULL) {
+			continue;
+		}
+
+		struct buf* cold_ob = bufnew(OUTPUT_UNIT);
+		struct sd_markdown* cold = sd_markdown_new(bench->extensions, MAX_NESTING, &callbacks, &options);
+
+		if ((cold_ob != NULL) && (cold != NULL)) {
+			sd_markdown_render(cold_ob, docs[i]->data, docs[i]->size, cold);
+			cold_count++;
+		}
+
+		if (cold != NULL) {
+			sd_markdown_free(cold);
+		}
+
+		bufrelease(cold_ob);
+	}
+
+	cold_mallocs = malloc_count - cold_mallocs;
+
+	/* warming the parser and the output buffer up */
+	for (unsigned int i = 0; i < DOC_COUNT; ++i) {
+		if (docs[i] != NULL) {
+			ob->size = 0;
+			sd_markdown_render(ob, docs[i]->data, docs[i]->size, markdown);
+		}
+	}
+
+	size_t mallocs = malloc_count;
+	double total = 0;
+	size_t n = 0;
+
+	for (unsigned int pass = 0; pass < iterations; ++pass) {
+		for (unsigned int i = 0; i < DOC_COUNT; ++i) {
+			if (docs[i] == NULL) {
+				continue;
+			}
+
+			double start = now_us();
+
+			ob->size = 0;
+			sd_markdown_render(ob, docs[i]->data, docs[i]->size, markdown);
+
+			samples[n] = now_us() - start;
+			total += samples[n++];
+		}
+	}
+
+	mallocs = malloc_count - mallocs;
+
+	if (n != 0) {
+		qsort(samples, n, sizeof(double), compare_double);
+
+		printf("%-20s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", bench->name, input_size / DOC_COUNT, (input_size * (double) iterations) / total, samples[n / 2], samples[((n * 99) / 100 < n) ? ((n * 99) / 100) : (n - 1)], (cold_count != 0) ? ((double) cold_mallocs / cold_count) : (0.0), (double) mallocs / n);
+	}
+
+	for (unsigned int i = 0; i < DOC_COUNT; ++i) {
+		bufrelease(docs[i]);
+	}
+
+	sd_markdown_free(markdown);
+	bufrelease(ob);
+	free(samples);
+
+	return 0;
+}
+
+/**
+ * runs the cases named on the command line, or all of them
+ */
+int main(int argc, char** argv)
+{
+	unsigned int iterations = DEFAULT_ITERATIONS;
+	int first = 1;
+
+	if ((argc > 2) && (strcmp(argv[1], "-n") == 0)) {
+		iterations = (unsigned int) atoi(argv[2]);
+		first = 3;
+	}
+
+	if (iterations == 0) {
+		fprintf(stderr, "Usage: %s [-n iterations] [case...]\n", argv[0]);
+
+		return 1;
+	}
+
+	/* allocations per render: of a first render with a new parser, and once it is warm */
+	printf("%-20s %8s %10s %10s %10s %10s %10s\n", "case", "bytes", "MB/s", "p50 us", "p99 us", "cold", "warm");
+
+	for (size_t i = 0; i < (sizeof(CASES) / sizeof(CASES[0])); ++i) {
+		int selected = (first >= argc);
+
+		for (int arg = first; arg < argc; ++arg) {
+			if (strcmp(argv[arg], CASES[i].name) == 0) {
+				selected = 1;
+			}
+		}
+
+		if ((selected != 0) && (run_case(&CASES[i], iterations) != 0)) {
+			fprintf(stderr, "Error: out of memory in %s\n", CASES[i].name);
+
+			return -1;
+		}
+	}
+
+	return 0;
+}
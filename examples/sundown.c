@@ -19,92 +19,806 @@
 #include "buffer.h"
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
 #define READ_UNIT 1024
 #define OUTPUT_UNIT 64
+#define BUFFER_GROWTH 150
+
+/* documents a thread may render ahead of the one being written */
+#define SLOTS_PER_THREAD 8
+
+/* outputs gathered into a single write */
+#define WRITE_BATCH 64
+
+/* largest values of -n, whose nesting recurses on the stack, and of -j */
+#define MAX_NESTING_LIMIT 256
+#define MAX_THREADS 1024
+
+struct flag_name
+{
+	const char* name;
+	unsigned int flag;
+};
+
+static const struct flag_name EXTENSION_NAMES[] = {
+	{"no-intra-emphasis", MKDEXT_NO_INTRA_EMPHASIS},
+	{"tables", MKDEXT_TABLES},
+	{"fenced-code", MKDEXT_FENCED_CODE},
+	{"autolink", MKDEXT_AUTOLINK},
+	{"strikethrough", MKDEXT_STRIKETHROUGH},
+	{"ins", MKDEXT_INS},
+	{"space-headers", MKDEXT_SPACE_HEADERS},
+	{"superscript", MKDEXT_SUPERSCRIPT},
+	{"lax-spacing", MKDEXT_LAX_SPACING},
+	{"footnotes", MKDEXT_FOOTNOTES},
+	{NULL, 0},
+};
+
+static const struct flag_name RENDER_NAMES[] = {
+	{"skip-html", HTML_SKIP_HTML},
+	{"skip-style", HTML_SKIP_STYLE},
+	{"skip-images", HTML_SKIP_IMAGES},
+	{"skip-links", HTML_SKIP_LINKS},
+	{"expand-tabs", HTML_EXPAND_TABS},
+	{"safelink", HTML_SAFELINK},
+	{"toc", HTML_TOC},
+	{"hard-wrap", HTML_HARD_WRAP},
+	{"xhtml", HTML_USE_XHTML},
+	{"escape", HTML_ESCAPE},
+	{"outline", HTML_OUTLINE},
+	{"smartypants", HTML_SMARTYPANTS},
+	{NULL, 0},
+};
 
 /**
- * main function, interfacing STDIO with the parser
+ * a document read from a file or standard input
  */
-int main(int argc, char** argv)
+struct input
 {
-	FILE* in_ = stdin;
+	const uint8_t* data;
+	size_t size;
 
-	/* opening the file if given from the command line */
-	if (argc > 1) {
-		in_ = fopen(argv[1], "r");
+	/* the data is either mapped or read into a buffer */
+	void* map;
+	struct buf* read;
+};
 
-		if (in_ == NULL) {
-			fprintf(stderr, "Unable to open input file \"%s\": %s\n", argv[1], strerror(errno));
+/**
+ * a rendered document waiting to be written, in the window of the batch
+ */
+struct slot
+{
+	struct buf* ob;
+	int status;
+	int done;
+};
 
-			return 1;
+/**
+ * inputs of a run, rendered by the threads and written in order
+ */
+struct batch
+{
+	char** paths;
+	size_t count;
+	const char* out_dir;
+	const struct sd_markdown_config* cfg;
+
+	/* renderer state every parser starts from, doc_header resetting it for each document */
+	const struct html_renderopt* options;
+
+	/* next input to render, first input not written yet, and what lies in between */
+	size_t next;
+	size_t written;
+	struct slot* slots;
+	size_t slot_count;
+	int failed;
+
+#if !defined(_WIN32)
+	pthread_mutex_t lock;
+	pthread_cond_t rendered;
+	pthread_cond_t freed;
+#endif
+};
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: sundown [-e extensions] [-r render-flags] [-n nesting] [-j threads] [-o dir] [file ...]\n");
+	fprintf(stderr, "  -e  comma-separated extensions: no-intra-emphasis, tables, fenced-code, autolink,\n");
+	fprintf(stderr, "      strikethrough, ins, space-headers, superscript, lax-spacing, footnotes\n");
+	fprintf(stderr, "  -r  comma-separated HTML flags: skip-html, skip-style, skip-images, skip-links,\n");
+	fprintf(stderr, "      expand-tabs, safelink, toc, hard-wrap, xhtml, escape, outline, smartypants\n");
+	fprintf(stderr, "  -n  maximum nesting of blocks and spans, 1 to 256, 16 by default\n");
+	fprintf(stderr, "  -j  rendering threads, 1 to 1024, one per CPU by default\n");
+	fprintf(stderr, "  -o  writes each file to dir, with an .html extension, instead of standard output;\n");
+	fprintf(stderr, "      files must then be given, standard input having no name, and have distinct\n");
+	fprintf(stderr, "      base names\n");
+}
+
+/**
+ * adds the flags named in a comma-separated list, returns -1 on an unknown name
+ */
+static int parse_flags(unsigned int* flags, const char* list, const struct flag_name* names)
+{
+	while (*list != '\0') {
+		size_t len = strcspn(list, ",");
+		const struct flag_name* name;
+
+		for (name = names; name->name != NULL; ++name) {
+			if ((strlen(name->name) == len) && (strncmp(name->name, list, len) == 0)) {
+				break;
+			}
 		}
-	}
 
-	/* reading everything */
-	struct buf* ib = bufnew(READ_UNIT);
+		if (name->name == NULL) {
+			fprintf(stderr, "Unknown flag \"%.*s\"\n", (int) len, list);
 
-	if (bufgrow(ib, READ_UNIT) != BUF_OK) {
-		fprintf(stderr, "Error: bufgrow()\n");
+			return -1;
+		}
 
-		if (in_ != stdin) {
-			fclose(in_);
+		*flags |= name->flag;
+		list += len;
+
+		if (*list == ',') {
+			list++;
 		}
+	}
 
-		bufrelease(ib);
+	return 0;
+}
+
+/**
+ * reads a whole decimal number between 1 and max, returns -1 on anything
+ * else, such as a sign, trailing characters or a value out of range
+ */
+static int parse_count(long* value, const char* text, long max)
+{
+	char* end = NULL;
 
+	errno = 0;
+
+	if ((text[0] >= '0') && (text[0] <= '9')) {
+		*value = strtol(text, &end, 10);
+	}
+
+	if ((end == NULL) || (*end != '\0') || (errno != 0) || (*value < 1) || (*value > max)) {
+		fprintf(stderr, "Invalid number \"%s\", expected 1 to %ld\n", text, max);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * reads a whole stream into a buffer
+ */
+static int read_stream(struct buf* ib, FILE* in_)
+{
+	if (bufgrow(ib, READ_UNIT) != BUF_OK) {
 		return -1;
 	}
 
-	int ret;
+	size_t ret;
 
 	while ((ret = fread(ib->data + ib->size, 1, ib->asize - ib->size, in_)) > 0) {
 		ib->size += ret;
 
 		if (bufgrow(ib, ib->size + READ_UNIT) != BUF_OK) {
-			fprintf(stderr, "Error: bufgrow()\n");
+			return -1;
+		}
+	}
+
+	return ferror(in_) ? (-1) : (0);
+}
+
+/**
+ * opens a document, mapping regular files; path is NULL for standard input
+ */
+static int input_open(struct input* in_, const char* path)
+{
+	in_->data = NULL;
+	in_->size = 0;
+	in_->map = NULL;
+	in_->read = NULL;
+
+#if !defined(_WIN32)
+	if (path != NULL) {
+		int fd = open(path, O_RDONLY);
+		struct stat st;
+
+		if (fd < 0) {
+			return -1;
+		}
+
+		if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode)) {
+			if (st.st_size != 0) {
+				void* map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+				if (map == MAP_FAILED) {
+					close(fd);
+
+					return -1;
+				}
+
+				in_->map = map;
+				in_->data = map;
+				in_->size = (size_t) st.st_size;
+			}
+
+			close(fd);
+
+			return 0;
+		}
+
+		close(fd);
+	}
+#endif
+
+	FILE* file = stdin;
+
+	if ((path != NULL) && ((file = fopen(path, "rb")) == NULL)) {
+		return -1;
+	}
+
+	in_->read = bufnew(READ_UNIT);
+
+	if (in_->read != NULL) {
+		bufsetgrowth(in_->read, BUFFER_GROWTH, SIZE_MAX);
+	}
+
+	int status = ((in_->read != NULL) && (read_stream(in_->read, file) == 0)) ? (0) : (-1);
+
+	if (file != stdin) {
+		fclose(file);
+	}
+
+	if (status == 0) {
+		in_->data = in_->read->data;
+		in_->size = in_->read->size;
+	}
+
+	return status;
+}
+
+static void input_close(struct input* in_)
+{
+#if !defined(_WIN32)
+	if (in_->map != NULL) {
+		munmap(in_->map, in_->size);
+	}
+#endif
+
+	bufrelease(in_->read);
+}
+
+/**
+ * writes the outputs to standard output in order
+ */
+static int write_stdout(struct buf** obs, size_t count)
+{
+#if !defined(_WIN32)
+	struct iovec iov[WRITE_BATCH];
+	size_t i = 0;
 
-			if (in_ != stdin) {
-				fclose(in_);
+	while (i < count) {
+		int n = 0;
+
+		while ((i < count) && (n < WRITE_BATCH)) {
+			iov[n].iov_base = obs[i]->data;
+			iov[n].iov_len = obs[i]->size;
+			n++;
+			i++;
+		}
+
+		struct iovec* v = iov;
+
+		while (n > 0) {
+			ssize_t w = writev(STDOUT_FILENO, v, n);
+
+			if (w < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+
+				return -1;
 			}
 
-			bufrelease(ib);
+			/* skipping what was written, a write may stop within an output */
+			while ((n > 0) && ((size_t) w >= v->iov_len)) {
+				w -= v->iov_len;
+				v++;
+				n--;
+			}
 
+			if (n > 0) {
+				v->iov_base = (char*) v->iov_base + w;
+				v->iov_len -= w;
+			}
+		}
+	}
+#else
+	for (size_t i = 0; i < count; ++i) {
+		if (fwrite(obs[i]->data, 1, obs[i]->size, stdout) != obs[i]->size) {
 			return -1;
 		}
 	}
 
-	if (in_ != stdin) {
-		fclose(in_);
+	fflush(stdout);
+#endif
+
+	return 0;
+}
+
+/**
+ * name of the output file of path, without its .html extension: its base
+ * name up to the last dot; returns its length
+ */
+static size_t output_name(const char* path, const char** name)
+{
+	const char* base = strrchr(path, '/');
+
+	base = (base != NULL) ? (base + 1) : (path);
+
+#if defined(_WIN32)
+	if (strrchr(base, '\\') != NULL) {
+		base = strrchr(base, '\\') + 1;
+	}
+#endif
+
+	const char* ext = strrchr(base, '.');
+
+	*name = base;
+
+	return ((ext != NULL) && (ext != base)) ? ((size_t) (ext - base)) : (strlen(base));
+}
+
+struct output_path
+{
+	const char* path;
+	const char* name;
+	size_t name_len;
+};
+
+static int compare_output(const void* a, const void* b)
+{
+	const struct output_path* x = a;
+	const struct output_path* y = b;
+	int cmp = memcmp(x->name, y->name, (x->name_len < y->name_len) ? (x->name_len) : (y->name_len));
+
+	return (cmp != 0) ? (cmp) : ((x->name_len > y->name_len) - (x->name_len < y->name_len));
+}
+
+/**
+ * makes sure no two inputs are written to the same output file, which
+ * would silently keep only one of them; returns 0 when they are not
+ */
+static int check_outputs(char** paths, size_t count)
+{
+	struct output_path* outputs = malloc(count * sizeof(struct output_path));
+	int status = 0;
+
+	if (outputs == NULL) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		outputs[i].path = paths[i];
+		outputs[i].name_len = output_name(paths[i], &outputs[i].name);
+	}
+
+	qsort(outputs, count, sizeof(struct output_path), compare_output);
+
+	for (size_t i = 1; i < count; ++i) {
+		if (compare_output(&outputs[i - 1], &outputs[i]) == 0) {
+			fprintf(stderr, "Input files \"%s\" and \"%s\" would both be written to \"%.*s.html\"\n", outputs[i - 1].path, outputs[i].path, (int) outputs[i].name_len, outputs[i].name);
+			status = -1;
+		}
+	}
+
+	free(outputs);
+
+	return status;
+}
+
+/**
+ * writes the output of path into dir, its extension replaced by .html
+ */
+static int write_file(const char* dir, const char* path, const struct buf* ob)
+{
+	const char* base;
+	size_t base_len = output_name(path, &base);
+	size_t dir_len = strlen(dir);
+	char* out_path = malloc(dir_len + base_len + sizeof("/.html"));
+
+	if (out_path == NULL) {
+		return -1;
+	}
+
+	memcpy(out_path, dir, dir_len);
+	out_path[dir_len] = '/';
+	memcpy(out_path + dir_len + 1, base, base_len);
+	memcpy(out_path + dir_len + 1 + base_len, ".html", sizeof(".html"));
+
+	FILE* out = fopen(out_path, "wb");
+	int status = -1;
+
+	if (out != NULL) {
+		status = (fwrite(ob->data, 1, ob->size, out) == ob->size) ? (0) : (-1);
+
+		if (fclose(out) != 0) {
+			status = -1;
+		}
+	}
+
+	if (status != 0) {
+		fprintf(stderr, "Unable to write output file \"%s\": %s\n", out_path, strerror(errno));
 	}
 
-	/* performing markdown parsing */
+	free(out_path);
+
+	return status;
+}
+
+/**
+ * renders input n of the batch into ob, writing it out when the batch goes to a directory
+ */
+static int render_input(struct batch* batch, size_t n, struct sd_markdown* md, struct buf* ob)
+{
+	const char* path = batch->paths[n];
+	struct input in_;
+
+	ob->size = 0;
+
+	if (input_open(&in_, path) != 0) {
+		fprintf(stderr, "Unable to open input file \"%s\": %s\n", (path != NULL) ? (path) : ("-"), strerror(errno));
+
+		return -1;
+	}
+
+	sd_markdown_render(ob, in_.data, in_.size, md);
+	input_close(&in_);
+
+	if ((batch->out_dir != NULL) && (path != NULL)) {
+		return write_file(batch->out_dir, path, ob);
+	}
+
+	return 0;
+}
+
+/**
+ * renders the batch on the calling thread
+ */
+static int batch_run_serial(struct batch* batch)
+{
+	struct html_renderopt options = *batch->options;
+	struct sd_markdown* md = sd_markdown_new_with_config(batch->cfg, &options);
 	struct buf* ob = bufnew(OUTPUT_UNIT);
 
-	struct sd_callbacks callbacks;
-	struct html_renderopt options;
-	sdhtml_renderer(&callbacks, &options, 0);
-	struct sd_markdown* markdown = sd_markdown_new(0, 16, &callbacks, &options);
+	if ((md == NULL) || (ob == NULL)) {
+		if (md != NULL) {
+			sd_markdown_free(md);
+		}
 
-	if (markdown != NULL) {
-		bufrelease(ib);
 		bufrelease(ob);
 
 		return -1;
 	}
 
-	sd_markdown_render(ob, ib->data, ib->size, markdown);
-	sd_markdown_free(markdown);
+	bufsetgrowth(ob, BUFFER_GROWTH, SIZE_MAX);
 
-	/* writing the result to stdout */
-	ret = fwrite(ob->data, 1, ob->size, stdout);
+	for (size_t n = 0; n < batch->count; ++n) {
+		if (render_input(batch, n, md, ob) != 0) {
+			batch->failed = 1;
+		} else if ((batch->out_dir == NULL) && (write_stdout(&ob, 1) != 0)) {
+			batch->failed = 1;
+
+			break;
+		}
+	}
 
-	/* cleanup */
-	bufrelease(ib);
+	sd_markdown_free(md);
 	bufrelease(ob);
 
-	return (ret < 0) ? (-1) : (0);
+	return 0;
+}
+
+#if !defined(_WIN32)
+/**
+ * renders inputs into the window of slots, at most slot_count ahead of the writer
+ */
+static void* batch_worker(void* arg)
+{
+	struct batch* batch = arg;
+	struct html_renderopt options = *batch->options;
+	struct sd_markdown* md = sd_markdown_new_with_config(batch->cfg, &options);
+
+	while (1) {
+		pthread_mutex_lock(&batch->lock);
+
+		while ((batch->next < batch->count) && (batch->next >= (batch->written + batch->slot_count))) {
+			pthread_cond_wait(&batch->freed, &batch->lock);
+		}
+
+		if (batch->next >= batch->count) {
+			pthread_mutex_unlock(&batch->lock);
+
+			break;
+		}
+
+		size_t n = batch->next++;
+
+		pthread_mutex_unlock(&batch->lock);
+
+		struct slot* slot = &batch->slots[n % batch->slot_count];
+
+		slot->status = (md != NULL) ? (render_input(batch, n, md, slot->ob)) : (-1);
+
+		pthread_mutex_lock(&batch->lock);
+		slot->done = 1;
+		pthread_cond_signal(&batch->rendered);
+		pthread_mutex_unlock(&batch->lock);
+	}
+
+	if (md != NULL) {
+		sd_markdown_free(md);
+	}
+
+	return NULL;
+}
+
+/**
+ * renders the batch on a pool of threads, one parser each, writing the outputs in order
+ */
+static int batch_run_threads(struct batch* batch, size_t threads)
+{
+	pthread_t* pool = calloc(threads, sizeof(pthread_t));
+
+	batch->slot_count = threads * SLOTS_PER_THREAD;
+	batch->slots = calloc(batch->slot_count, sizeof(struct slot));
+
+	if ((pool == NULL) || (batch->slots == NULL)) {
+		free(pool);
+		free(batch->slots);
+
+		return -1;
+	}
+
+	for (size_t i = 0; i < batch->slot_count; ++i) {
+		if ((batch->slots[i].ob = bufnew(OUTPUT_UNIT)) == NULL) {
+			batch->failed = 1;
+			batch->count = 0;
+
+			break;
+		}
+
+		bufsetgrowth(batch->slots[i].ob, BUFFER_GROWTH, SIZE_MAX);
+	}
+
+	pthread_mutex_init(&batch->lock, NULL);
+	pthread_cond_init(&batch->rendered, NULL);
+	pthread_cond_init(&batch->freed, NULL);
+
+	size_t started = 0;
+
+	while ((started < threads) && (pthread_create(&pool[started], NULL, batch_worker, batch) == 0)) {
+		started++;
+	}
+
+	if (started == 0) {
+		batch->failed = 1;
+		batch->count = 0;
+	}
+
+	/* writing the outputs in order as they are rendered, the directory outputs being already written */
+	while (batch->written < batch->count) {
+		struct buf* obs[WRITE_BATCH];
+		size_t n = 0;
+		size_t count = 0;
+
+		pthread_mutex_lock(&batch->lock);
+
+		while (batch->slots[batch->written % batch->slot_count].done == 0) {
+			pthread_cond_wait(&batch->rendered, &batch->lock);
+		}
+
+		while (((batch->written + n) < batch->count) && (n < WRITE_BATCH) && (n < batch->slot_count) && (batch->slots[(batch->written + n) % batch->slot_count].done != 0)) {
+			struct slot* slot = &batch->slots[(batch->written + n) % batch->slot_count];
+
+			/* an input which failed was reported, the ones after it are still written */
+			if (slot->status == 0) {
+				obs[count++] = slot->ob;
+			}
+
+			n++;
+		}
+
+		pthread_mutex_unlock(&batch->lock);
+
+		int write_status = 0;
+
+		if (batch->out_dir == NULL) {
+			write_status = write_stdout(obs, count);
+		}
+
+		pthread_mutex_lock(&batch->lock);
+
+		for (size_t i = 0; i < n; ++i) {
+			struct slot* slot = &batch->slots[(batch->written + i) % batch->slot_count];
+
+			if (slot->status != 0) {
+				batch->failed = 1;
+			}
+
+			slot->done = 0;
+		}
+
+		batch->written += n;
+
+		/* standard output is gone, the inputs left are not rendered */
+		if (write_status != 0) {
+			batch->failed = 1;
+			batch->count = batch->written;
+		}
+
+		pthread_cond_broadcast(&batch->freed);
+		pthread_mutex_unlock(&batch->lock);
+	}
+
+	for (size_t i = 0; i < started; ++i) {
+		pthread_join(pool[i], NULL);
+	}
+
+	pthread_mutex_destroy(&batch->lock);
+	pthread_cond_destroy(&batch->rendered);
+	pthread_cond_destroy(&batch->freed);
+
+	for (size_t i = 0; i < batch->slot_count; ++i) {
+		bufrelease(batch->slots[i].ob);
+	}
+
+	free(batch->slots);
+	free(pool);
+
+	return 0;
+}
+#endif
+
+/**
+ * main function, interfacing STDIO with the parser
+ */
+int main(int argc, char** argv)
+{
+	unsigned int extensions = 0;
+	unsigned int render_flags = 0;
+	long max_nesting = 16;
+	long threads = 0;
+	const char* out_dir = NULL;
+	int i;
+
+	/* parsing the options, given either as -xVALUE or -x VALUE */
+	for (i = 1; (i < argc) && (argv[i][0] == '-') && (argv[i][1] != '\0'); ++i) {
+		if (strcmp(argv[i], "--") == 0) {
+			i++;
+
+			break;
+		}
+
+		char opt = argv[i][1];
+		const char* value = (argv[i][2] != '\0') ? (argv[i] + 2) : (argv[i + 1]);
+
+		if ((strchr("ernjo", opt) == NULL) || (value == NULL)) {
+			usage();
+
+			return 1;
+		}
+
+		if (argv[i][2] == '\0') {
+			i++;
+		}
+
+		int status = 0;
+
+		switch (opt) {
+			case 'e':
+				status = parse_flags(&extensions, value, EXTENSION_NAMES);
+
+				break;
+
+			case 'r':
+				status = parse_flags(&render_flags, value, RENDER_NAMES);
+
+				break;
+
+			case 'n':
+				status = parse_count(&max_nesting, value, MAX_NESTING_LIMIT);
+
+				break;
+
+			case 'j':
+				status = parse_count(&threads, value, MAX_THREADS);
+
+				break;
+
+			default:
+				out_dir = value;
+
+				break;
+		}
+
+		if (status != 0) {
+			usage();
+
+			return 1;
+		}
+	}
+
+	/* standard input when no file is given, which has no name to write an output file after */
+	if ((i >= argc) && (out_dir != NULL)) {
+		usage();
+
+		return 1;
+	}
+
+	/* outputs named after their inputs, two of which may share a name */
+	if ((out_dir != NULL) && (check_outputs(argv + i, (size_t) (argc - i)) != 0)) {
+		return 1;
+	}
+
+	static char* no_paths[] = {NULL};
+	struct batch batch;
+
+	memset(&batch, 0x00, sizeof(batch));
+	batch.paths = (i < argc) ? (argv + i) : (no_paths);
+	batch.count = (i < argc) ? ((size_t) (argc - i)) : (1);
+	batch.out_dir = out_dir;
+
+	/* the parsers of all the threads share one configuration */
+	struct sd_callbacks callbacks;
+	struct html_renderopt options;
+
+	sdhtml_renderer(&callbacks, &options, render_flags);
+
+	struct sd_markdown_config* cfg = sd_markdown_config_new(extensions, (size_t) max_nesting, &callbacks);
+
+	if (cfg == NULL) {
+		return -1;
+	}
+
+	batch.cfg = cfg;
+	batch.options = &options;
+
+#if !defined(_WIN32)
+	if (threads == 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	if ((size_t) threads > batch.count) {
+		threads = (long) batch.count;
+	}
+
+	int status = (threads > 1) ? (batch_run_threads(&batch, (size_t) threads)) : (batch_run_serial(&batch));
+#else
+	int status = batch_run_serial(&batch);
+#endif
+
+	sd_markdown_config_free(cfg);
+
+	if (status != 0) {
+		return -1;
+	}
+
+	return (batch.failed != 0) ? (1) : (0);
 }
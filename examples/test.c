@@ -0,0 +1,1233 @@
+/*
+ * regression tests of the renderers, run by make test
+ */
+
+#include "markdown.h"
+#include "html.h"
+#include "buffer.h"
+#include "cache.h"
+#include "arena.h"
+#include "scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+#define MAX_NESTING 16
+#define OUTPUT_UNIT 64
+
+static int failures = 0;
+
+static void check(int ok, const char* name, const char* detail)
+{
+	if (ok == 0) {
+		fprintf(stderr, "FAIL %s: %s\n", name, detail);
+		failures++;
+	}
+}
+
+/**
+ * renders an excerpt of document into ob, with the prefix renders when
+ * prefix is set; returns the status of the render, and whether the
+ * excerpt was truncated in truncated when not NULL
+ */
+static int render_excerpt(struct buf* ob, const struct buf* document, unsigned int extensions, size_t max_size, unsigned int flags, int prefix, int* truncated)
+{
+	struct sd_callbacks callbacks;
+	struct excerpt_renderopt options;
+
+	sdhtml_excerpt_renderer(&callbacks, &options, max_size, flags);
+
+	/* without fork and join, the whole document is parsed */
+	if (prefix == 0) {
+		callbacks.fork = NULL;
+		callbacks.join = NULL;
+	}
+
+	struct sd_markdown* markdown = sd_markdown_new(extensions, MAX_NESTING, &callbacks, &options);
+
+	if (markdown == NULL) {
+		return -1;
+	}
+
+	int ret = sd_markdown_render(ob, document->data, document->size, markdown);
+
+	sd_markdown_free(markdown);
+
+	if (truncated != NULL) {
+		*truncated = options.truncated;
+	}
+
+	return ret;
+}
+
+/* extensions of the corpus, which uses all of their syntax */
+#define CORPUS_EXTENSIONS (MKDEXT_TABLES | MKDEXT_FENCED_CODE | MKDEXT_AUTOLINK | MKDEXT_STRIKETHROUGH | MKDEXT_SUPERSCRIPT | MKDEXT_FOOTNOTES)
+
+static int same(const struct buf* a, const struct buf* b)
+{
+	return (a->size == b->size) && ((a->size == 0) || (memcmp(a->data, b->data, a->size) == 0));
+}
+
+/**
+ * appends a document of count blocks of every kind, with references and
+ * footnotes used before and after their definitions
+ */
+static void put_corpus(struct buf* ob, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		switch (i % 14) {
+			case 0:
+				bufprintf(ob, "# Header %zu\n\n", i);
+
+				break;
+
+			case 1:
+				bufprintf(ob, "Some *emphasis*, **strong** and `code` with a [link][r%zu] and \"quotes\" in %zu.\n\n", i % 5, i);
+
+				break;
+
+			case 2:
+				bufprintf(ob, "- item %zu\n- item with [inline](http://example.com/%zu \"title\")\n  continued\n\n", i, i);
+
+				break;
+
+			case 3:
+				bufprintf(ob, "> quoted %zu\n> > nested ~~struck~~\n\n", i);
+
+				break;
+
+			case 4:
+				bufprintf(ob, "    code block %zu\n    <escaped> & stuff\n\n", i);
+
+				break;
+
+			case 5:
+				bufprintf(ob, "| a | b |\n|---|:-:|\n| %zu | x^2 |\n\n", i);
+
+				break;
+
+			case 6:
+				bufprintf(ob, "[r%zu]: http://example.com/ref%zu \"Ref\"\n\n", i % 5, i);
+
+				break;
+
+			case 7:
+				bufprintf(ob, "Visit http://www.example.com/%zu or mail me@example.com, it's 'fine'.\n\n", i);
+
+				break;
+
+			case 8:
+				bufprintf(ob, "```c\nint x = %zu;\n```\n\n", i);
+
+				break;
+
+			case 9:
+				bufprintf(ob, "<div>\nraw %zu\n</div>\n\n", i);
+
+				break;
+
+			case 10:
+				bufprintf(ob, "Footnote use[^n%zu] and &amp; &copy; entities -- dashes...\n\n", i % 3);
+
+				break;
+
+			case 11:
+				bufprintf(ob, "[^n%zu]: the note %zu\n\n", i % 3, i);
+
+				break;
+
+			case 12:
+				bufprintf(ob, "1. first %zu\n2. second\n\n   > inside\n\n", i);
+
+				break;
+
+			default:
+				bufprintf(ob, "Setext %zu\n------\n\n***\n\n", i);
+
+				break;
+		}
+	}
+}
+
+/* arena */
+
+static void test_arena(void)
+{
+	struct buf* document = bufnew(1024);
+	struct buf* expected = bufnew(OUTPUT_UNIT);
+	struct buf* ob = bufnew(OUTPUT_UNIT);
+	struct sd_arena arena;
+
+	struct sd_callbacks callbacks;
+	struct html_renderopt options;
+	sdhtml_renderer(&callbacks, &options, 0);
+	struct sd_markdown* markdown = sd_markdown_new(CORPUS_EXTENSIONS, MAX_NESTING, &callbacks, &options);
+
+	put_corpus(document, 200);
+	sd_markdown_render(expected, document->data, document->size, markdown);
+
+	/* the references and footnotes living in the caller's arena, reset between renders */
+	sd_arena_init(&arena, 256);
+	sd_markdown_set_arena(markdown, &arena);
+
+	for (int round = 0; round < 2; ++round) {
+		ob->size = 0;
+		sd_markdown_render(ob, document->data, document->size, markdown);
+		check(same(ob, expected), "arena", "a render in a caller-provided arena differs");
+		sd_arena_reset(&arena);
+	}
+
+	sd_markdown_set_arena(markdown, NULL);
+	sd_arena_free(&arena);
+
+	ob->size = 0;
+	sd_markdown_render(ob, document->data, document->size, markdown);
+	check(same(ob, expected), "arena", "a render after restoring the internal arena differs");
+
+	sd_markdown_free(markdown);
+	bufrelease(document);
+	bufrelease(expected);
+	bufrelease(ob);
+}
+
+/* streamed renders */
+
+/**
+ * sink appending to a buffer, failing once it holds limit bytes when limit is set
+ */
+struct stream_sink
+{
+	struct buf* ob;
+	size_t limit;
+	size_t writes;
+};
+
+static int stream_write(const uint8_t* data, size_t size, void* opaque)
+{
+	struct stream_sink* sink = opaque;
+
+	if ((sink->limit != 0) && (sink->ob->size >= sink->limit)) {
+		return -1;
+	}
+
+	bufput(sink->ob, data, size);
+	sink->writes++;
+
+	return 0;
+}
+
+static void test_stream(void)
+{
+	struct buf* document = bufnew(1024);
+	struct buf* expected = bufnew(OUTPUT_UNIT);
+	struct buf* staging = bufnew(OUTPUT_UNIT);
+	struct stream_sink sink = {bufnew(OUTPUT_UNIT), 0, 0};
+
+	struct sd_callbacks callbacks;
+	struct html_renderopt options;
+	sdhtml_renderer(&callbacks, &options, 0);
+	struct sd_markdown* markdown = sd_markdown_new(CORPUS_EXTENSIONS, MAX_NESTING, &callbacks, &options);
+
+	put_corpus(document, 200);
+	sd_markdown_render(expected, document->data, document->size, markdown);
+
+	int ret = sd_markdown_render_stream(staging, document->data, document->size, markdown, stream_write, &sink);
+
+	check((ret == 0) && same(sink.ob, expected), "stream", "the streamed output differs from a render");
+	check(sink.writes > 1, "stream", "the output was not written as it was rendered");
+	check(staging->size == 0, "stream", "the staging buffer was left with output");
+
+	/* a sink failing part of the way */
+	sink.ob->size = 0;
+	sink.limit = expected->size / 2;
+	ret = sd_markdown_render_stream(staging, document->data, document->size, markdown, stream_write, &sink);
+
+	check(ret == -1, "stream", "a failed write is not reported");
+
+	sd_markdown_free(markdown);
+	bufrelease(document);
+	bufrelease(expected);
+	bufrelease(staging);
+	bufrelease(sink.ob);
+}
+
+/* parallel renders */
+
+static void test_parallel(void)
+{
+	static const unsigned int FLAGS[] = {0, HTML_TOC, HTML_SMARTYPANTS, HTML_OUTLINE | HTML_USE_XHTML};
+	static const unsigned int THREADS[] = {2, 4, 3, 8, 1, 2};
+
+	struct buf* document = bufnew(1024);
+	struct buf* expected = bufnew(OUTPUT_UNIT);
+	struct buf* ob = bufnew(OUTPUT_UNIT);
+
+	put_corpus(document, 3000);
+
+	for (size_t f = 0; f < (sizeof(FLAGS) / sizeof(FLAGS[0])); ++f) {
+		struct sd_callbacks callbacks;
+		struct html_renderopt options;
+		sdhtml_renderer(&callbacks, &options, FLAGS[f]);
+		struct sd_markdown* markdown = sd_markdown_new(CORPUS_EXTENSIONS, MAX_NESTING, &callbacks, &options);
+
+		expected->size = 0;
+		sd_markdown_render(expected, document->data, document->size, markdown);
+
+		/* the same parser, its threads kept from one render to the next */
+		for (size_t t = 0; t < (sizeof(THREADS) / sizeof(THREADS[0])); ++t) {
+			ob->size = 0;
+
+			int ret = sd_markdown_render_parallel(ob, document->data, document->size, markdown, THREADS[t]);
+
+			check((ret == 0) && same(ob, expected), "parallel", "a parallel render differs from a serial one");
+		}
+
+		sd_markdown_free(markdown);
+	}
+
+	bufrelease(document);
+	bufrelease(expected);
+	bufrelease(ob);
+}
+
+/* incremental renders */
+
+/**
+ * replaces the first occurrence of from in document by to
+ */
+static void edit_document(struct buf* document, const char* from, const char* to)
+{
+	const char* at = strstr(bufcstr(document), from);
+
+	if (at == NULL) {
+		return;
+	}
+
+	struct buf* edited = bufnew(document->size + 64);
+	size_t offset = (size_t) (at - (const char*) document->data);
+
+	bufput(edited, document->data, offset);
+	bufputs(edited, to);
+	bufput(edited, document->data + offset + strlen(from), document->size - offset - strlen(from));
+
+	document->size = 0;
+	bufput(document, edited->data, edited->size);
+	bufrelease(edited);
+}
+
+/**
+ * renders each version of the corpus, as edited one edit after the other,
+ * in a session and on its own with the render flags
+ */
+static void test_session_edits(unsigned int flags, const char* const (*edits)[2], size_t count)
+{
+	struct buf* document = bufnew(1024);
+	struct buf* expected = bufnew(OUTPUT_UNIT);
+	struct buf* ob = bufnew(OUTPUT_UNIT);
+
+	struct sd_callbacks callbacks;
+	struct html_renderopt options;
+	struct html_renderopt session_options;
+	sdhtml_renderer(&callbacks, &options, flags);
+	sdhtml_renderer(&callbacks, &session_options, flags);
+	struct sd_markdown* markdown = sd_markdown_new(CORPUS_EXTENSIONS, MAX_NESTING, &callbacks, &options);
+	struct sd_markdown* session_markdown = sd_markdown_new(CORPUS_EXTENSIONS, MAX_NESTING, &callbacks, &session_options);
+	struct sd_markdown_session* session = sd_markdown_session_new(session_markdown);
+
+	put_corpus(document, 300);
+
+	for (size_t e = 0; e <= count; ++e) {
+		if ((e > 0) && (edits[e - 1][0][0] != '\0')) {
+			edit_document(document, edits[e - 1][0], edits[e - 1][1]);
+		}
+
+		expected->size = 0;
+		sd_markdown_render(expected, document->data, document->size, markdown);
+
+		ob->size = 0;
+
+		int ret = sd_markdown_session_render(ob, document->data, document->size, session);
+
+		check((ret == 0) && same(ob, expected), "session", "a session render differs from a render of the same version");
+	}
+
+	sd_markdown_session_free(session);
+	sd_markdown_free(session_markdown);
+	sd_markdown_free(markdown);
+	bufrelease(document);
+	bufrelease(expected);
+	bufrelease(ob);
+}
+
+static void test_session(void)
+{
+	/* a block, a reference used elsewhere, a header shifting the TOC numbering, a header
+	 * changing the outline level, a quote left open, and nothing */
+	static const char* const EDITS[][2] = {
+		{"quoted 17", "quoted seventeen"},
+		{"http://example.com/ref6", "http://example.org/changed"},
+		{"# Header 0", "# Header 0\n\n## Inserted"},
+		{"# Header 14", "### Header 14"},
+		{"quoted 31", "\"quoted 31"},
+		{"", ""},
+	};
+
+	static const unsigned int FLAGS[] = {HTML_TOC, HTML_OUTLINE, HTML_SMARTYPANTS};
+
+	for (size_t f = 0; f < (sizeof(FLAGS) / sizeof(FLAGS[0])); ++f) {
+		test_session_edits(FLAGS[f], EDITS, sizeof(EDITS) / sizeof(EDITS[0]));
+	}
+}
+
+/* batch renders */
+
+#define BATCH_COUNT 20
+
+static void test_batch(void)
+{
+	struct buf* documents[BATCH_COUNT];
+	const uint8_t* data[BATCH_COUNT];
+	size_t sizes[BATCH_COUNT];
+	size_t offsets[BATCH_COUNT + 1];
+	struct buf* expected = bufnew(OUTPUT_UNIT);
+	struct buf* ob = bufnew(OUTPUT_UNIT);
+
+	struct sd_callbacks callbacks;
+	struct html_renderopt options;
+	sdhtml_renderer(&callbacks, &options, 0);
+	struct sd_markdown* markdown = sd_markdown_new(CORPUS_EXTENSIONS, MAX_NESTING, &callbacks, &options);
+
+	for (size_t i = 0; i < BATCH_COUNT; ++i) {
+		documents[i] = bufnew(1024);
+		put_corpus(documents[i], i * 7);
+		data[i] = documents[i]->data;
+		sizes[i] = documents[i]->size;
+	}
+
+	/* the output of each document is that of its own render */
+	check(sd_markdown_render_batch(ob, offsets, data, sizes, BATCH_COUNT, markdown) == 0, "batch", "the batch fails");
+	check((offsets[0] == 0) && (offsets[BATCH_COUNT] == ob->size), "batch", "the offsets do not span the output");
+
+	for (size_t i = 0; i < BATCH_COUNT; ++i) {
+		expected->size = 0;
+		sd_markdown_render(expected, data[i], sizes[i], markdown);
+
+		if ((offsets[i] > offsets[i + 1]) || ((offsets[i + 1] - offsets[i]) != expected->size) || (memcmp(ob->data + offsets[i], expected->data, expected->size) != 0)) {
+			check(0, "batch", "a document renders differently in a batch");
+
+			break;
+		}
+	}
+
+	/* running out of room fails, and the offsets still span the output */
+	struct buf* small = bufnew(OUTPUT_UNIT);
+	bufsetgrowth(small, 150, ob->size / 2);
+	check(sd_markdown_render_batch(small, offsets, data, sizes, BATCH_COUNT, markdown) == -1, "batch", "a batch over the maximal size succeeds");
+	check((offsets[BATCH_COUNT] == small->size) && (small->size <= (ob->size / 2)), "batch", "the offsets do not span the output");
+
+	for (size_t i = 0; i < BATCH_COUNT; ++i) {
+		if (offsets[i] > offsets[i + 1]) {
+			check(0, "batch", "the offsets go backwards");
+
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < BATCH_COUNT; ++i) {
+		bufrelease(documents[i]);
+	}
+
+	sd_markdown_free(markdown);
+	bufrelease(small);
+	bufrelease(expected);
+	bufrelease(ob);
+}
+
+/* node output */
+
+static void test_nodes(void)
+{
+	static const struct sd_node EXPECTED[] = {
+		{MKDN_HEADER, 1, SD_NODE_ROOT, 0, 5},
+		{MKDN_TEXT, 0, 0, 0, 5},
+		{MKDN_PARAGRAPH, 0, SD_NODE_ROOT, 5, 11},
+		{MKDN_TEXT, 0, 2, 5, 6},
+		{MKDN_EMPHASIS, 0, 2, 11, 5},
+		{MKDN_TEXT, 0, 4, 11, 5},
+		{MKDN_LIST, 0, SD_NODE_ROOT, 16, 4},
+		{MKDN_LISTITEM, 0, 6, 16, 2},
+		{MKDN_TEXT, 0, 7, 16, 2},
+		{MKDN_LISTITEM, 0, 6, 18, 2},
+		{MKDN_TEXT, 0, 9, 18, 2},
+	};
+
+	static const char TEXT[] = "TitleHello worlda\nb\n";
+
+	struct buf* document = bufnew(1024);
+	struct sd_nodes* nodes = sd_nodes_new();
+
+	struct sd_callbacks callbacks;
+	struct html_renderopt options;
+	sdhtml_renderer(&callbacks, &options, 0);
+	struct sd_markdown* markdown = sd_markdown_new(CORPUS_EXTENSIONS, MAX_NESTING, &callbacks, &options);
+
+	bufputs(document, "# Title\n\nHello *world*\n\n- a\n- b\n");
+
+	int ret = sd_markdown_render_nodes(nodes, document->data, document->size, markdown);
+	int equal = (ret == 0) && (nodes->count == (sizeof(EXPECTED) / sizeof(EXPECTED[0])));
+
+	for (size_t i = 0; (equal != 0) && (i < nodes->count); ++i) {
+		const struct sd_node* a = &nodes->nodes[i];
+		const struct sd_node* b = &EXPECTED[i];
+
+		equal = (a->type == b->type) && (a->flags == b->flags) && (a->parent == b->parent) && (a->offset == b->offset) && (a->size == b->size);
+	}
+
+	check(equal, "nodes", "unexpected nodes");
+	check((nodes->text->size == (sizeof(TEXT) - 1)) && (memcmp(nodes->text->data, TEXT, sizeof(TEXT) - 1) == 0), "nodes", "unexpected text");
+
+	/* every node comes after its parent and lies within it */
+	document->size = 0;
+	put_corpus(document, 300);
+	ret = sd_markdown_render_nodes(nodes, document->data, document->size, markdown);
+	check((ret == 0) && (nodes->count != 0), "nodes", "the corpus gave no nodes");
+
+	for (size_t i = 0; i < nodes->count; ++i) {
+		const struct sd_node* node = &nodes->nodes[i];
+
+		if (node->parent == SD_NODE_ROOT) {
+			continue;
+		}
+
+		const struct sd_node* parent = &nodes->nodes[node->parent];
+
+		if ((node->parent >= i) || (node->offset < parent->offset) || ((node->offset + node->size) > (parent->offset + parent->size))) {
+			check(0, "nodes", "a node lies outside of its parent");
+
+			break;
+		}
+	}
+
+	sd_markdown_free(markdown);
+	sd_nodes_free(nodes);
+	bufrelease(document);
+}
+
+/* byte scanning */
+
+/**
+ * offset of the first member of set in data, byte by byte
+ */
+static size_t scan_reference(const struct sd_charset* set, const uint8_t* data, size_t size)
+{
+	size_t i = 0;
+
+	while ((i < size) && (sd_charset_has(set, data[i]) == 0)) {
+		i++;
+	}
+
+	return i;
+}
+
+static void test_scan(void)
+{
+	struct sd_charset sets[4];
+	uint8_t data[200];
+	unsigned int seed = 1;
+
+	/* a few members, a range, too many members to be vectorized, and none */
+	sd_charset_init(&sets[0]);
+	sd_charset_add(&sets[0], '*');
+	sd_charset_add(&sets[0], '\n');
+	sd_charset_add(&sets[0], 0xC3);
+
+	sd_charset_init(&sets[1]);
+	sd_charset_add(&sets[1], '<');
+	sd_charset_add_outside(&sets[1], 0x20, 0x7E);
+
+	sd_charset_init(&sets[2]);
+
+	for (unsigned int c = 'a'; c < ('a' + SD_CHARSET_MAX + 4); ++c) {
+		sd_charset_add(&sets[2], (uint8_t) c);
+	}
+
+	sd_charset_init(&sets[3]);
+
+	for (int round = 0; round < 50; ++round) {
+		/* sparse members, so that they fall anywhere in a vector or its tail */
+		for (size_t i = 0; i < sizeof(data); ++i) {
+			seed = (seed * 1103515245) + 12345;
+			data[i] = ((seed >> 16) % 40 == 0) ? ((uint8_t) (seed >> 8)) : ((uint8_t) ('A' + ((seed >> 16) % 26)));
+		}
+
+		for (size_t set = 0; set < (sizeof(sets) / sizeof(sets[0])); ++set) {
+			for (size_t offset = 0; offset < 40; ++offset) {
+				for (size_t size = 0; (offset + size) <= sizeof(data); size += 7) {
+					if (sd_scan(&sets[set], data + offset, size) != scan_reference(&sets[set], data + offset, size)) {
+						check(0, "scan", "sd_scan differs from a byte by byte scan");
+
+						return;
+					}
+				}
+			}
+		}
+	}
+}
+
+/* render status */
+
+static void test_render_out_of_room(void)
+{
+	struct buf* document = bufnew(1024);
+	struct buf* ob = bufnew(OUTPUT_UNIT);
+
+	struct sd_callbacks callbacks;
+	struct html_renderopt options;
+	sdhtml_renderer(&callbacks, &options, 0);
+	struct sd_markdown* markdown = sd_markdown_new(0, MAX_NESTING, &callbacks, &options);
+
+	for (int i = 0; i < 2000; ++i) {
+		bufprintf(document, "paragraph *%d* with some text\n\n", i);
+	}
+
+	/* the output does not fit, whether rendered at once or over threads */
+	bufsetgrowth(ob, 150, 16 * 1024);
+	check(sd_markdown_render(ob, document->data, document->size, markdown) == -1, "render_out_of_room", "a render cut short by the maximal size succeeds");
+
+	ob->size = 0;
+	check(sd_markdown_render_parallel(ob, document->data, document->size, markdown, 4) == -1, "render_out_of_room", "a parallel render cut short by the maximal size succeeds");
+
+	/* raising the maximal size */
+	ob->size = 0;
+	bufsetgrowth(ob, 150, 1024 * 1024);
+	check(sd_markdown_render(ob, document->data, document->size, markdown) == 0, "render_out_of_room", "a render within the maximal size fails");
+
+	sd_markdown_free(markdown);
+	bufrelease(document);
+	bufrelease(ob);
+}
+
+/* budgets */
+
+/**
+ * calls of done_after, and how many it lets through; done is handed the
+ * state of a fork while rendering from a prefix, so the counts are kept
+ * outside of the renderer state
+ */
+static size_t done_calls;
+static size_t done_limit;
+
+static int done_after(void* opaque)
+{
+	return (++done_calls > done_limit);
+}
+
+static void test_budget(void)
+{
+	struct buf* document = bufnew(1024);
+	struct buf* expected = bufnew(OUTPUT_UNIT);
+	struct buf* ob = bufnew(OUTPUT_UNIT);
+	struct sd_budget budget;
+
+	struct sd_callbacks callbacks;
+	struct html_renderopt options;
+	sdhtml_renderer(&callbacks, &options, 0);
+	struct sd_markdown* markdown = sd_markdown_new(CORPUS_EXTENSIONS, MAX_NESTING, &callbacks, &options);
+
+	put_corpus(document, 300);
+	sd_markdown_render(expected, document->data, document->size, markdown);
+
+	/* a budget the document fits in leaves the output alone */
+	memset(&budget, 0x00, sizeof(budget));
+	budget.max_output = expected->size * 2;
+	budget.max_triggers = document->size;
+	budget.max_time = 60ULL * 1000000000ULL;
+	sd_markdown_set_budget(markdown, &budget);
+	check(sd_markdown_render(ob, document->data, document->size, markdown) == 0, "budget", "a generous budget runs out");
+	check(same(ob, expected), "budget", "a generous budget changes the output");
+
+	/* each limit cuts the output short */
+	memset(&budget, 0x00, sizeof(budget));
+	budget.max_output = expected->size / 4;
+	sd_markdown_set_budget(markdown, &budget);
+	ob->size = 0;
+	check(sd_markdown_render(ob, document->data, document->size, markdown) == SD_BUDGET_EXCEEDED, "budget", "the output limit is ignored");
+	check(ob->size < expected->size, "budget", "the output limit leaves the output whole");
+
+	memset(&budget, 0x00, sizeof(budget));
+	budget.max_triggers = 10;
+	sd_markdown_set_budget(markdown, &budget);
+	ob->size = 0;
+	check(sd_markdown_render(ob, document->data, document->size, markdown) == SD_BUDGET_EXCEEDED, "budget", "the trigger limit is ignored");
+	check(ob->size < expected->size, "budget", "the trigger limit leaves the output whole");
+
+	sd_markdown_set_budget(markdown, NULL);
+	ob->size = 0;
+	check(sd_markdown_render(ob, document->data, document->size, markdown) == 0, "budget", "a removed budget still applies");
+	check(same(ob, expected), "budget", "a removed budget changes the output");
+
+	sd_markdown_free(markdown);
+
+	/* early termination by the renderer */
+	callbacks.done = done_after;
+	markdown = sd_markdown_new(CORPUS_EXTENSIONS, MAX_NESTING, &callbacks, &options);
+
+	done_calls = 0;
+	done_limit = (size_t) -1;
+	ob->size = 0;
+	check(sd_markdown_render(ob, document->data, document->size, markdown) == 0, "budget", "a render that is never done stops");
+	check(same(ob, expected), "budget", "a render that is never done differs");
+	check(done_calls != 0, "budget", "done is never called");
+
+	done_calls = 0;
+	done_limit = 3;
+	ob->size = 0;
+	check(sd_markdown_render(ob, document->data, document->size, markdown) == SD_BUDGET_EXCEEDED, "budget", "a done render goes on");
+	check(ob->size < expected->size, "budget", "a done render leaves the output whole");
+
+	sd_markdown_free(markdown);
+	bufrelease(document);
+	bufrelease(expected);
+	bufrelease(ob);
+}
+
+/* instrumentation */
+
+static void test_stats(void)
+{
+	struct buf* document = bufnew(1024);
+	struct buf* expected = bufnew(OUTPUT_UNIT);
+	struct buf* ob = bufnew(OUTPUT_UNIT);
+	struct sd_stats stats;
+
+	struct sd_callbacks callbacks;
+	struct html_renderopt options;
+	sdhtml_renderer(&callbacks, &options, 0);
+	struct sd_markdown* markdown = sd_markdown_new(0, MAX_NESTING, &callbacks, &options);
+
+	bufputs(document, "# one\n\n# two\n\nsome *emphasis* and a [link][r]\n\n[r]: http://example.com/\n");
+	sd_markdown_render(expected, document->data, document->size, markdown);
+
+	int ret = sd_markdown_set_stats(markdown, &stats);
+
+#ifdef SD_STATS
+	check(ret == 0, "stats", "stats are refused");
+#else
+	check(ret == -1, "stats", "stats are accepted without SD_STATS");
+#endif
+
+	/* the output is the same whether or not it is instrumented */
+	sd_markdown_render(ob, document->data, document->size, markdown);
+	check(same(ob, expected), "stats", "an instrumented render differs");
+
+#ifdef SD_STATS
+	check((stats.bytes_in == document->size) && (stats.bytes_out == ob->size), "stats", "unexpected byte counts");
+	check((stats.block_count[SD_STATS_HEADER] == 2) && (stats.block_count[SD_STATS_PARAGRAPH] == 1), "stats", "unexpected block counts");
+	check((stats.trigger_count[SD_STATS_EMPHASIS] == 1) && (stats.trigger_count[SD_STATS_LINK] == 1), "stats", "unexpected trigger counts");
+	check((stats.ref_count == 1) && (stats.footnote_count == 0), "stats", "unexpected reference counts");
+
+	/* cleared at the start of each render */
+	ob->size = 0;
+	sd_markdown_render(ob, document->data, document->size, markdown);
+	check((stats.bytes_in == document->size) && (stats.block_count[SD_STATS_HEADER] == 2), "stats", "stats add up over renders");
+#endif
+
+	check(sd_markdown_set_stats(markdown, NULL) == 0, "stats", "stats cannot be removed");
+
+	sd_markdown_free(markdown);
+	bufrelease(document);
+	bufrelease(expected);
+	bufrelease(ob);
+}
+
+/* excerpts */
+
+static void test_excerpt_prefix_htmlblock(void)
+{
+	struct buf* document = bufnew(1024);
+	struct buf* whole = bufnew(OUTPUT_UNIT);
+	struct buf* prefix = bufnew(OUTPUT_UNIT);
+
+	/* the unindented closing tag lies past the first prefix, an indented one before it */
+	bufputs(document, "<div>\n  </div>\n\nHello world\n\n");
+
+	for (int i = 0; i < 400; ++i) {
+		bufprintf(document, "filler paragraph %d\n\n", i);
+	}
+
+	bufputs(document, "</div>\n\nTail text\n");
+
+	render_excerpt(whole, document, 0, 20, 0, 0, NULL);
+	render_excerpt(prefix, document, 0, 20, 0, 1, NULL);
+
+	check((whole->size == prefix->size) && (memcmp(whole->data, prefix->data, whole->size) == 0), "excerpt_prefix_htmlblock", "prefix render differs from the whole document");
+	check((whole->size == 9) && (memcmp(whole->data, "Tail text", 9) == 0), "excerpt_prefix_htmlblock", "the HTML block does not end at its unindented closing tag");
+
+	bufrelease(document);
+	bufrelease(whole);
+	bufrelease(prefix);
+}
+
+static void test_excerpt_footnotes(void)
+{
+	struct buf* document = bufnew(OUTPUT_UNIT);
+	struct buf* ob = bufnew(OUTPUT_UNIT);
+
+	/* the excerpt renderer leaves the footnotes out, which must not count */
+	bufputs(document, "Hi[^1] there\n\n[^1]: a very long footnote text that goes on\n");
+
+	int truncated;
+	int ret = render_excerpt(ob, document, MKDEXT_FOOTNOTES, 20, 0, 0, &truncated);
+
+	check((ret == 0) && (truncated == 0), "excerpt_footnotes", "an excerpt with all its text is reported cut short");
+	check((ob->size == 8) && (memcmp(ob->data, "Hi there", 8) == 0), "excerpt_footnotes", "unexpected excerpt");
+
+	bufrelease(document);
+	bufrelease(ob);
+}
+
+/**
+ * characters of a UTF-8 string
+ */
+static size_t utf8_length(const uint8_t* data, size_t size)
+{
+	size_t chars = 0;
+
+	for (size_t i = 0; i < size; ++i) {
+		if ((data[i] & 0xC0) != 0x80) {
+			chars++;
+		}
+	}
+
+	return chars;
+}
+
+static void test_excerpt_separators(void)
+{
+	struct buf* document = bufnew(OUTPUT_UNIT);
+	struct buf* ob = bufnew(OUTPUT_UNIT);
+
+	bufputs(document, "a\n\nb\n\nc");
+	render_excerpt(ob, document, 0, 3, EXCERPT_BYTES, 0, NULL);
+	check((ob->size == 3) && (memcmp(ob->data, "a\nb", 3) == 0), "excerpt_separators", "the newlines between blocks are not counted");
+
+	/* blocks, code, quotes, lists and table cells, cut at every length */
+	document->size = 0;
+	bufputs(document, "# T\xc3\xaftle\n\npara one\n\n    code\n\n> quote\n\n- item\n- \xc3\xa9t\xc3\xa9\n\n| h1 | h2 |\n|----|----|\n| c1 | c2 |\n");
+
+	for (size_t max = 1; max < 40; ++max) {
+		for (unsigned int flags = 0; flags <= EXCERPT_BYTES; flags += EXCERPT_BYTES) {
+			ob->size = 0;
+			render_excerpt(ob, document, MKDEXT_TABLES, max, flags, 0, NULL);
+
+			size_t size = (flags & EXCERPT_BYTES) ? (ob->size) : (utf8_length(ob->data, ob->size));
+
+			check(size <= max, "excerpt_separators", "the excerpt is longer than its maximum");
+		}
+	}
+
+	bufrelease(document);
+	bufrelease(ob);
+}
+
+/* HTML renderer */
+
+/**
+ * renders document twice with the same HTML_TOC renderer, doc_header
+ * being left out unless reset is set; returns whether the second render
+ * wrote the same as the first
+ */
+static int render_toc_twice(const struct buf* document, int reset)
+{
+	struct buf* first = bufnew(OUTPUT_UNIT);
+	struct buf* second = bufnew(OUTPUT_UNIT);
+
+	struct sd_callbacks callbacks;
+	struct html_renderopt options;
+	sdhtml_renderer(&callbacks, &options, HTML_TOC);
+
+	if (reset == 0) {
+		callbacks.doc_header = NULL;
+	}
+
+	struct sd_markdown* markdown = sd_markdown_new(0, MAX_NESTING, &callbacks, &options);
+
+	sd_markdown_render(first, document->data, document->size, markdown);
+	sd_markdown_render(second, document->data, document->size, markdown);
+
+	int same = (first->size == second->size) && (memcmp(first->data, second->data, first->size) == 0);
+
+	sd_markdown_free(markdown);
+	bufrelease(first);
+	bufrelease(second);
+
+	return same;
+}
+
+static void test_html_toc_reset(void)
+{
+	struct buf* document = bufnew(OUTPUT_UNIT);
+
+	bufputs(document, "# One\n\n## Two\n\n# Three\n");
+
+	check(render_toc_twice(document, 1) != 0, "html_toc_reset", "the header numbering carries over to the next document");
+	check(render_toc_twice(document, 0) == 0, "html_toc_reset", "without doc_header, the header numbering does not carry over");
+
+	bufrelease(document);
+}
+
+/**
+ * renders document into ob with the callbacks set up by sdhtml_renderer or
+ * sdhtml_toc_renderer
+ */
+static void render_html(struct buf* ob, const struct buf* document, const struct sd_callbacks* callbacks, struct html_renderopt* options)
+{
+	struct sd_markdown* markdown = sd_markdown_new(CORPUS_EXTENSIONS, MAX_NESTING, callbacks, options);
+
+	sd_markdown_render(ob, document->data, document->size, markdown);
+	sd_markdown_free(markdown);
+}
+
+static void test_html_with_toc(void)
+{
+	struct buf* document = bufnew(1024);
+	struct buf* toc = bufnew(OUTPUT_UNIT);
+	struct buf* body = bufnew(OUTPUT_UNIT);
+	struct buf* expected_toc = bufnew(OUTPUT_UNIT);
+	struct buf* expected_body = bufnew(OUTPUT_UNIT);
+
+	struct sd_callbacks callbacks;
+	struct html_renderopt options;
+
+	/* the headers of the corpus are plain text, which both write alike */
+	put_corpus(document, 300);
+
+	sdhtml_toc_renderer(&callbacks, &options);
+	render_html(expected_toc, document, &callbacks, &options);
+
+	sdhtml_renderer(&callbacks, &options, HTML_TOC);
+	render_html(expected_body, document, &callbacks, &options);
+
+	sdhtml_renderer_with_toc(&callbacks, &options, 0, toc);
+	render_html(body, document, &callbacks, &options);
+
+	check(same(body, expected_body), "html_with_toc", "the body differs from an HTML_TOC render");
+	check(same(toc, expected_toc), "html_with_toc", "the table of contents differs from sdhtml_toc_renderer");
+
+	/* the entries hold the text of the headers, without their markup */
+	static const char TOC[] = "<ul>\n<li>\n<a href=\"#toc_0\">One em &amp; two</a>\n</li>\n</ul>\n";
+
+	document->size = 0;
+	toc->size = 0;
+	body->size = 0;
+	bufputs(document, "# One *em* & `two`\n");
+	render_html(body, document, &callbacks, &options);
+	check((toc->size == (sizeof(TOC) - 1)) && (memcmp(toc->data, TOC, toc->size) == 0), "html_with_toc", "unexpected table of contents of headers with markup");
+
+	bufrelease(document);
+	bufrelease(toc);
+	bufrelease(body);
+	bufrelease(expected_toc);
+	bufrelease(expected_body);
+}
+
+/* SmartyPants */
+
+/**
+ * returns whether sdhtml_smartypants turns html into expected
+ */
+static int smartypants_gives(const char* html, const char* expected)
+{
+	struct buf* ob = bufnew(OUTPUT_UNIT);
+
+	sdhtml_smartypants(ob, (const uint8_t*) html, strlen(html));
+
+	int equal = (ob->size == strlen(expected)) && (memcmp(ob->data, expected, ob->size) == 0);
+
+	bufrelease(ob);
+
+	return equal;
+}
+
+static void test_smartypants_pass(void)
+{
+	check(smartypants_gives("<p>a `b</p>", "<p>a `b</p>"), "smartypants_pass", "a lone backtick is dropped");
+	check(smartypants_gives("<p>``a''</p>", "<p>&ldquo;a&rdquo;</p>"), "smartypants_pass", "backtick quotes are left straight");
+	check(smartypants_gives("it's", "it&rsquo;s"), "smartypants_pass", "a contraction ending the text is left straight");
+	check(smartypants_gives("we're", "we&rsquo;re"), "smartypants_pass", "a contraction ending the text is left straight");
+	check(smartypants_gives("say \"hi\"", "say &ldquo;hi&rdquo;"), "smartypants_pass", "a quote ending the text is left straight");
+	check(smartypants_gives("<p>it&#39;s</p>", "<p>it&#39;s</p>"), "smartypants_pass", "an escaped apostrophe is curled");
+	check(smartypants_gives("a <code", "a <code"), "smartypants_pass", "an unterminated tag is not copied as is");
+}
+
+/**
+ * renders document with HTML_SMARTYPANTS, and without it followed by
+ * sdhtml_smartypants; returns whether both give the same output
+ */
+static int smartypants_render_same(const char* document)
+{
+	struct buf* plain = bufnew(OUTPUT_UNIT);
+	struct buf* expected = bufnew(OUTPUT_UNIT);
+	struct buf* ob = bufnew(OUTPUT_UNIT);
+
+	struct sd_callbacks callbacks;
+	struct html_renderopt options;
+	sdhtml_renderer(&callbacks, &options, 0);
+	struct sd_markdown* markdown = sd_markdown_new(CORPUS_EXTENSIONS, MAX_NESTING, &callbacks, &options);
+
+	sd_markdown_render(plain, (const uint8_t*) document, strlen(document), markdown);
+	sdhtml_smartypants(expected, plain->data, plain->size);
+	sd_markdown_free(markdown);
+
+	sdhtml_renderer(&callbacks, &options, HTML_SMARTYPANTS);
+	markdown = sd_markdown_new(CORPUS_EXTENSIONS, MAX_NESTING, &callbacks, &options);
+	sd_markdown_render(ob, (const uint8_t*) document, strlen(document), markdown);
+	sd_markdown_free(markdown);
+
+	int equal = same(ob, expected);
+
+	bufrelease(plain);
+	bufrelease(expected);
+	bufrelease(ob);
+
+	return equal;
+}
+
+static void test_smartypants_render(void)
+{
+	/* text without apostrophes or escaped characters renders as with the second pass */
+	check(smartypants_render_same("# \"Title\" -- one\n\nSome \"*quoted*\" text --- and more... 1/2 or 3/4th\n\n> \"nested\" (c) (r) (tm)\n\n- \"one\"\n- \"two\"\n\n    \"code\" -- kept\n\nwith `\"code\" --` and <span title=\"x\">\"html\"</span>\n"), "smartypants_render", "HTML_SMARTYPANTS differs from sdhtml_smartypants");
+
+	/* where they differ on purpose */
+	struct buf* ob = bufnew(OUTPUT_UNIT);
+	struct buf* text = bufnew(OUTPUT_UNIT);
+	struct smartypants_data smrt;
+
+	static const char RUN[] = "it's \"a\" <b> & c";
+	static const char EXPECTED[] = "it&rsquo;s &ldquo;a&rdquo; &lt;b&gt; &amp; c";
+
+	memset(&smrt, 0x00, sizeof(smrt));
+	sdhtml_smartypants_text(ob, &smrt, ' ', (const uint8_t*) RUN, sizeof(RUN) - 1);
+	check((ob->size == (sizeof(EXPECTED) - 1)) && (memcmp(ob->data, EXPECTED, ob->size) == 0), "smartypants_render", "unexpected text run");
+
+	/* quotes carry over from one run to the next */
+	ob->size = 0;
+	memset(&smrt, 0x00, sizeof(smrt));
+	sdhtml_smartypants_text(ob, &smrt, ' ', (const uint8_t*) "\"a", 2);
+	sdhtml_smartypants_text(ob, &smrt, 'a', (const uint8_t*) " b\"", 3);
+	bufputs(text, "&ldquo;a b&rdquo;");
+	check(same(ob, text), "smartypants_render", "the quotes do not carry over");
+
+	bufrelease(ob);
+	bufrelease(text);
+}
+
+/* render cache */
+
+static void test_cache_prefixed_output(void)
+{
+	static const char before[] = "<p>before</p>\n";
+
+	struct buf* document = bufnew(OUTPUT_UNIT);
+	struct buf* alone = bufnew(OUTPUT_UNIT);
+	struct buf* cached = bufnew(OUTPUT_UNIT);
+
+	struct sd_callbacks callbacks;
+	struct html_renderopt options;
+	sdhtml_renderer(&callbacks, &options, 0);
+	struct sd_markdown* markdown = sd_markdown_new(0, MAX_NESTING, &callbacks, &options);
+
+	bufputs(document, "# Title\n\nsome text\n");
+	sd_markdown_render(alone, document->data, document->size, markdown);
+
+	/* filled from an empty buffer then hit into a non-empty one, and the other way round */
+	for (int round = 0; round < 2; ++round) {
+		struct sd_render_cache* cache = sd_render_cache_new(1 << 20);
+
+		for (int pass = 0; pass < 2; ++pass) {
+			int prefixed = (pass != round);
+
+			cached->size = 0;
+			bufputs(cached, (prefixed != 0) ? (before) : (""));
+			sd_render_cache_render(cached, document->data, document->size, markdown, 0, NULL, cache);
+
+			size_t skip = (prefixed != 0) ? (sizeof(before) - 1) : (0);
+
+			check((cached->size == (skip + alone->size)) && (memcmp(cached->data + skip, alone->data, alone->size) == 0), "cache_prefixed_output", "the output depends on what the buffer held");
+		}
+
+		sd_render_cache_free(cache);
+	}
+
+	sd_markdown_free(markdown);
+	bufrelease(document);
+	bufrelease(alone);
+	bufrelease(cached);
+}
+
+static void test_cache_lru(void)
+{
+	static const uint8_t source[] = "document";
+	static const uint8_t output[] = "<p>document</p>\n";
+
+	struct sd_render_key keys[8];
+	struct sd_render_cache_stats stats;
+	struct buf* ob = bufnew(OUTPUT_UNIT);
+
+	memset(keys, 0x00, sizeof(keys));
+
+	/* keys spread over the shards */
+	for (size_t i = 0; i < 8; ++i) {
+		keys[i].doc_hash = (i + 1) * 0x9e3779b97f4a7c15ULL;
+		keys[i].doc_size = sizeof(source);
+	}
+
+	struct sd_render_cache* cache = sd_render_cache_new(1 << 20);
+
+	sd_render_cache_put(cache, &keys[0], source, output, sizeof(output));
+	sd_render_cache_stats(cache, &stats);
+	sd_render_cache_free(cache);
+
+	/* room for 4 entries, the first one being used again before each new one */
+	cache = sd_render_cache_new((stats.bytes * 4) + (stats.bytes / 2));
+
+	for (size_t i = 0; i < 8; ++i) {
+		sd_render_cache_put(cache, &keys[i], source, output, sizeof(output));
+		sd_render_cache_get(cache, &keys[0], source, ob);
+	}
+
+	check(sd_render_cache_get(cache, &keys[0], source, ob) == 1, "cache_lru", "the most used entry was evicted");
+
+	for (size_t i = 1; i < 5; ++i) {
+		check(sd_render_cache_get(cache, &keys[i], source, ob) == 0, "cache_lru", "an older entry was kept");
+	}
+
+	for (size_t i = 5; i < 8; ++i) {
+		check(sd_render_cache_get(cache, &keys[i], source, ob) == 1, "cache_lru", "a recent entry was evicted");
+	}
+
+	sd_render_cache_free(cache);
+	bufrelease(ob);
+}
+
+#if !defined(_WIN32)
+#define STRESS_THREADS 8
+#define STRESS_PUTS 20000
+
+static const uint8_t STRESS_SOURCE[] = "document";
+static const uint8_t STRESS_OUTPUT[] = "<p>document</p>\n";
+
+struct cache_stress
+{
+	struct sd_render_cache* cache;
+	unsigned int thread;
+};
+
+static void* cache_stress_main(void* arg)
+{
+	struct cache_stress* stress = arg;
+	struct buf* ob = bufnew(OUTPUT_UNIT);
+	struct sd_render_key key;
+
+	memset(&key, 0x00, sizeof(key));
+	key.doc_size = sizeof(STRESS_SOURCE);
+
+	for (unsigned int i = 0; i < STRESS_PUTS; ++i) {
+		key.doc_hash = (((uint64_t) stress->thread << 32) | i) * 0x9e3779b97f4a7c15ULL;
+		sd_render_cache_put(stress->cache, &key, STRESS_SOURCE, STRESS_OUTPUT, sizeof(STRESS_OUTPUT));
+
+		ob->size = 0;
+		sd_render_cache_get(stress->cache, &key, STRESS_SOURCE, ob);
+	}
+
+	bufrelease(ob);
+
+	return NULL;
+}
+
+static void test_cache_threads(void)
+{
+	struct sd_render_key key;
+	struct sd_render_cache_stats stats;
+
+	memset(&key, 0x00, sizeof(key));
+	key.doc_size = sizeof(STRESS_SOURCE);
+
+	struct sd_render_cache* cache = sd_render_cache_new(1 << 20);
+
+	sd_render_cache_put(cache, &key, STRESS_SOURCE, STRESS_OUTPUT, sizeof(STRESS_OUTPUT));
+	sd_render_cache_stats(cache, &stats);
+	sd_render_cache_free(cache);
+
+	/* a few entries at a time, evicted while the other threads put theirs */
+	size_t entry_bytes = stats.bytes;
+	size_t max_bytes = entry_bytes * 4;
+	struct cache_stress stress[STRESS_THREADS];
+	pthread_t threads[STRESS_THREADS];
+	size_t started = 0;
+
+	cache = sd_render_cache_new(max_bytes);
+
+	for (unsigned int t = 0; t < STRESS_THREADS; ++t) {
+		stress[t].cache = cache;
+		stress[t].thread = t;
+
+		if (pthread_create(&threads[t], NULL, cache_stress_main, &stress[t]) == 0) {
+			started++;
+		}
+	}
+
+	for (size_t t = 0; t < started; ++t) {
+		pthread_join(threads[t], NULL);
+	}
+
+	sd_render_cache_stats(cache, &stats);
+
+	check(stats.bytes <= max_bytes, "cache_threads", "the cache holds more than its maximum");
+	check(stats.bytes == (stats.entries * entry_bytes), "cache_threads", "the memory counted differs from that of the entries");
+	check(stats.entries != 0, "cache_threads", "the cache was emptied");
+
+	sd_render_cache_free(cache);
+}
+#endif
+
+int main(void)
+{
+	test_arena();
+	test_stream();
+	test_parallel();
+	test_session();
+	test_batch();
+	test_nodes();
+	test_scan();
+	test_render_out_of_room();
+	test_budget();
+	test_stats();
+	test_excerpt_prefix_htmlblock();
+	test_excerpt_footnotes();
+	test_excerpt_separators();
+	test_html_toc_reset();
+	test_html_with_toc();
+	test_smartypants_pass();
+	test_smartypants_render();
+	test_cache_prefixed_output();
+	test_cache_lru();
+#if !defined(_WIN32)
+	test_cache_threads();
+#endif
+
+	if (failures != 0) {
+		fprintf(stderr, "%d failed\n", failures);
+
+		return 1;
+	}
+
+	printf("all tests passed\n");
+
+	return 0;
+}
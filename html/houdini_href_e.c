@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "houdini.h"
+#include "scan.h"
 
 #define ESCAPE_GROW_FACTOR(x) (((x) * 12) / 10)
 
@@ -30,45 +31,41 @@
  *
  * All other characters will be escaped to %XX.
  *
+ * The bitmap is the one built by sd_charset_add_outside and sd_charset_add.
  */
-static const char HREF_SAFE[] =
+static const struct sd_charset HREF_UNSAFE_SET =
 {
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 1, 0, 1, 1, 1, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
-	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1,
-	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
-	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/*
+	 * every byte outside [0x21, 0x7A] is escaped, as the few chars in
+	 * there that are neither safe nor reserved
+	 */
+	{ '"', '&', '\'', '<', '>', '[', '\\', ']', '^', '`' }, 10, 1, 0x21, 0x7A, 0,
+	{
+		0xff, 0xff, 0xff, 0xff, 0xc5, 0x00, 0x00, 0x50, 0x00, 0x00, 0x00, 0x78, 0x01, 0x00, 0x00, 0xf8,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	},
 };
 
 void houdini_escape_href(struct buf* ob, const uint8_t* src, size_t size)
 {
-	if (bufgrow(ob, ESCAPE_GROW_FACTOR(size)) != BUF_OK) {
+	size_t i = sd_scan(&HREF_UNSAFE_SET, src, size);
+
+	/* nothing to escape, the common case */
+	if (i == size) {
+		bufput(ob, src, size);
+		return;
+	}
+
+	if (bufgrow(ob, ob->size + ESCAPE_GROW_FACTOR(size)) != BUF_OK) {
 		return;
 	}
 
 	static const char hex_chars[] = "0123456789ABCDEF";
 	char hex_str[3];
 	hex_str[0] = '%';
-	size_t i = 0;
-
-	while (i < size) {
-		size_t org = i;
-
-		while ((i < size) && (HREF_SAFE[src[i]] != 0)) {
-			i++;
-		}
+	size_t org = 0;
 
+	while (1) {
 		if (i > org) {
 			bufput(ob, src + org, i - org);
 		}
@@ -120,6 +117,7 @@ void houdini_escape_href(struct buf* ob, const uint8_t* src, size_t size)
 				break;
 		}
 
-		i++;
+		org = ++i;
+		i += sd_scan(&HREF_UNSAFE_SET, src + i, size - i);
 	}
 }
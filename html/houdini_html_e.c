@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "houdini.h"
+#include "scan.h"
 
 /* this is very scientific, yes */
 #define ESCAPE_GROW_FACTOR(x) (((x) * 12) / 10)
@@ -48,22 +49,50 @@ static const char* HTML_ESCAPES[] =
 	"&gt;",
 };
 
+static const size_t HTML_ESCAPES_LEN[] =
+{
+	0, 6, 5, 5, 5, 4, 4,
+};
+
+/* the non-zero entries of HTML_ESCAPE_TABLE, as built by sd_charset_add */
+static const struct sd_charset HTML_ESCAPE_SET =
+{
+	{ '"', '&', '\'', '/', '<', '>' }, 6, 0, 0, 0, 0,
+	{
+		0x00, 0x00, 0x00, 0x00, 0xc4, 0x80, 0x00, 0x50, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	},
+};
+
+/* the same without the forward slash */
+static const struct sd_charset HTML_ESCAPE_SET_NOSLASH =
+{
+	{ '"', '&', '\'', '<', '>' }, 5, 0, 0, 0, 0,
+	{
+		0x00, 0x00, 0x00, 0x00, 0xc4, 0x00, 0x00, 0x50, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	},
+};
+
 void houdini_escape_html0(struct buf* ob, const uint8_t* src, size_t size, int secure)
 {
-	if (bufgrow(ob, ESCAPE_GROW_FACTOR(size)) != BUF_OK) {
+	/* The forward slash is only escaped in secure mode */
+	const struct sd_charset* set = secure ? &HTML_ESCAPE_SET : &HTML_ESCAPE_SET_NOSLASH;
+	size_t i = sd_scan(set, src, size);
+
+	/* nothing to escape, the common case */
+	if (i == size) {
+		bufput(ob, src, size);
 		return;
 	}
 
-	size_t i = 0;
-	size_t esc = 0;
-
-	while (i < size) {
-		size_t org = i;
+	if (bufgrow(ob, ob->size + ESCAPE_GROW_FACTOR(size)) != BUF_OK) {
+		return;
+	}
 
-		while ((i < size) && ((esc = HTML_ESCAPE_TABLE[src[i]]) == 0)) {
-			i++;
-		}
+	size_t org = 0;
 
+	while (1) {
 		if (i > org) {
 			bufput(ob, src + org, i - org);
 		}
@@ -73,14 +102,11 @@ void houdini_escape_html0(struct buf* ob, const uint8_t* src, size_t size, int s
 			break;
 		}
 
-		/* The forward slash is only escaped in secure mode */
-		if ((src[i] == '/') && (secure == 0)) {
-			bufputc(ob, '/');
-		} else {
-			bufputs(ob, HTML_ESCAPES[esc]);
-		}
+		size_t esc = HTML_ESCAPE_TABLE[src[i]];
+		bufput(ob, HTML_ESCAPES[esc], HTML_ESCAPES_LEN[esc]);
 
-		i++;
+		org = ++i;
+		i += sd_scan(set, src + i, size - i);
 	}
 }
 
@@ -25,7 +25,20 @@
 
 #include "houdini.h"
 
-#define USE_XHTML(opt) (opt->flags & HTML_USE_XHTML)
+/* header tags by level, headers being one to six deep */
+static const char* const HEADER_OPEN[] = {"<h1", "<h2", "<h3", "<h4", "<h5", "<h6"};
+static const char* const HEADER_CLOSE[] = {"</h1>\n", "</h2>\n", "</h3>\n", "</h4>\n", "</h5>\n", "</h6>\n"};
+
+/**
+ * renderer state of a run of blocks rendered on another thread
+ */
+struct html_fork
+{
+	struct html_renderopt options;
+
+	/* state the run was rendered from */
+	struct html_renderopt origin;
+};
 
 int sdhtml_is_tag(const uint8_t* tag_data, size_t tag_size, const char* tagname)
 {
@@ -67,6 +80,32 @@ static inline void escape_html(struct buf* ob, const uint8_t* source, size_t len
 	houdini_escape_html0(ob, source, length_, 0);
 }
 
+/**
+ * writes a number in decimal, without going through printf
+ */
+static void html_putnum(struct buf* ob, unsigned int num)
+{
+	uint8_t digits[16];
+	size_t i = sizeof(digits);
+
+	do {
+		digits[--i] = '0' + (num % 10);
+		num /= 10;
+	} while (num != 0);
+
+	bufput(ob, digits + i, sizeof(digits) - i);
+}
+
+/**
+ * whether a block precedes in ob, not counting the container opened in place
+ */
+static inline int html_after_block(const struct buf* ob, void* opaque)
+{
+	struct html_renderopt* options = opaque;
+
+	return (ob->size != 0) && ((ob != options->open_data.ob) || (ob->size != options->open_data.size));
+}
+
 static inline void escape_href(struct buf* ob, const uint8_t* source, size_t length_)
 {
 	houdini_escape_href(ob, source, length_);
@@ -83,10 +122,6 @@ static int rndr_autolink(struct buf* ob, const struct buf* link, enum mkd_autoli
 		return 0;
 	}
 
-	if (((options->flags & HTML_SAFELINK) != 0) && (sd_autolink_issafe(link->data, link->size) == 0) && (type != MKDA_EMAIL)) {
-		return 0;
-	}
-
 	BUFPUTSL(ob, "<a href=\"");
 
 	if (type == MKDA_EMAIL) {
@@ -119,9 +154,67 @@ static int rndr_autolink(struct buf* ob, const struct buf* link, enum mkd_autoli
 	return 1;
 }
 
+static int rndr_autolink_safe(struct buf* ob, const struct buf* link, enum mkd_autolink type, void* opaque)
+{
+	if ((link != NULL) && (type != MKDA_EMAIL) && (sd_autolink_issafe(link->data, link->size) == 0)) {
+		return 0;
+	}
+
+	return rndr_autolink(ob, link, type, opaque);
+}
+
+/**
+ * writes the opening tag of a container, whose children then follow in ob
+ */
+static int rndr_open(struct buf* ob, enum mkd_node type, int flags, void* opaque)
+{
+	struct html_renderopt* options = opaque;
+
+	if (type == MKDN_LISTITEM) {
+		BUFPUTSL(ob, "<li>");
+	} else if ((type == MKDN_BLOCKQUOTE) || (type == MKDN_LIST)) {
+		if (html_after_block(ob, opaque) != 0) {
+			bufputc(ob, '\n');
+		}
+
+		if (type == MKDN_BLOCKQUOTE) {
+			BUFPUTSL(ob, "<blockquote>\n");
+		} else {
+			bufput(ob, (flags & MKD_LIST_ORDERED) ? ("<ol>\n") : ("<ul>\n"), 5);
+		}
+	} else {
+		return 0;
+	}
+
+	options->open_data.ob = ob;
+	options->open_data.size = ob->size;
+
+	return 1;
+}
+
+static void rndr_close(struct buf* ob, enum mkd_node type, int flags, void* opaque)
+{
+	struct html_renderopt* options = opaque;
+
+	if (type == MKDN_LISTITEM) {
+		/* the opening tag stops the trimming */
+		while ((ob->size != 0) && (ob->data[ob->size - 1] == '\n')) {
+			ob->size--;
+		}
+
+		BUFPUTSL(ob, "</li>\n");
+	} else if (type == MKDN_BLOCKQUOTE) {
+		BUFPUTSL(ob, "</blockquote>\n");
+	} else if (type == MKDN_LIST) {
+		bufput(ob, (flags & MKD_LIST_ORDERED) ? ("</ol>\n") : ("</ul>\n"), 6);
+	}
+
+	options->open_data.ob = NULL;
+}
+
 static void rndr_blockcode(struct buf* ob, const struct buf* text, const struct buf* lang, void* opaque)
 {
-	if (ob->size != 0) {
+	if (html_after_block(ob, opaque) != 0) {
 		bufputc(ob, '\n');
 	}
 
@@ -166,17 +259,13 @@ static void rndr_blockcode(struct buf* ob, const struct buf* text, const struct
 
 static void rndr_blockquote(struct buf* ob, const struct buf* text, void* opaque)
 {
-	if (ob->size != 0) {
-		bufputc(ob, '\n');
-	}
-
-	BUFPUTSL(ob, "<blockquote>\n");
+	rndr_open(ob, MKDN_BLOCKQUOTE, 0, opaque);
 
 	if (text != NULL) {
 		bufput(ob, text->data, text->size);
 	}
 
-	BUFPUTSL(ob, "</blockquote>\n");
+	rndr_close(ob, MKDN_BLOCKQUOTE, 0, opaque);
 }
 
 static int rndr_codespan(struct buf* ob, const struct buf* text, void* opaque)
@@ -250,17 +339,119 @@ static int rndr_emphasis(struct buf* ob, const struct buf* text, void* opaque)
 
 static int rndr_linebreak(struct buf* ob, void* opaque)
 {
-	struct html_renderopt* options = opaque;
-	bufputs(ob, (USE_XHTML(options)) ? ("<br/>\n") : ("<br>\n"));
+	BUFPUTSL(ob, "<br>\n");
 
 	return 1;
 }
 
+static int rndr_linebreak_xhtml(struct buf* ob, void* opaque)
+{
+	BUFPUTSL(ob, "<br/>\n");
+
+	return 1;
+}
+
+/**
+ * writes the h tag of a header, its level being in the tables unless
+ * the parser someday allows more than six
+ */
+static void html_header_open(struct buf* ob, int level)
+{
+	if ((level >= 1) && (level <= 6)) {
+		bufput(ob, HEADER_OPEN[level - 1], 3);
+	} else {
+		bufprintf(ob, "<h%d", level);
+	}
+}
+
+static void html_header_close(struct buf* ob, int level)
+{
+	if ((level >= 1) && (level <= 6)) {
+		bufput(ob, HEADER_CLOSE[level - 1], 6);
+	} else {
+		bufprintf(ob, "</h%d>\n", level);
+	}
+}
+
+/**
+ * opens the lists of the table of contents down to the level of a header
+ */
+static void toc_nest(struct buf* ob, struct html_renderopt* options, int level)
+{
+	/*
+	 * set the level offset if this is the first header
+	 * we're parsing for the document
+	 */
+	if (options->toc_data.current_level == 0) {
+		options->toc_data.level_offset = level - 1;
+	}
+
+	level -= options->toc_data.level_offset;
+
+	if (level > options->toc_data.current_level) {
+		while (level > options->toc_data.current_level) {
+			BUFPUTSL(ob, "<ul>\n<li>\n");
+			options->toc_data.current_level++;
+		}
+	} else if (level < options->toc_data.current_level) {
+		BUFPUTSL(ob, "</li>\n");
+
+		while (level < options->toc_data.current_level) {
+			BUFPUTSL(ob, "</ul>\n</li>\n");
+			options->toc_data.current_level--;
+		}
+
+		BUFPUTSL(ob, "<li>\n");
+	} else {
+		BUFPUTSL(ob, "</li>\n<li>\n");
+	}
+}
+
+/**
+ * copies the text of rendered HTML, without its tags
+ */
+static void html_strip_tags(struct buf* ob, const uint8_t* data, size_t size)
+{
+	size_t i = 0;
+
+	while (i < size) {
+		size_t org = i;
+
+		while ((i < size) && (data[i] != '<')) {
+			i++;
+		}
+
+		bufput(ob, data + org, i - org);
+
+		while ((i < size) && (data[i] != '>')) {
+			i++;
+		}
+
+		i++;
+	}
+}
+
+static void rndr_header_plain(struct buf* ob, const struct buf* text, int level, void* opaque)
+{
+	if (html_after_block(ob, opaque) != 0) {
+		bufputc(ob, '\n');
+	}
+
+	html_header_open(ob, level);
+	bufputc(ob, '>');
+
+	if (text != NULL) {
+		bufput(ob, text->data, text->size);
+	}
+
+	html_header_close(ob, level);
+}
+
 static void rndr_header(struct buf* ob, const struct buf* text, int level, void* opaque)
 {
 	struct html_renderopt* options = opaque;
 
-	if (ob->size != 0) {
+	if (html_after_block(ob, opaque) != 0) {
 		bufputc(ob, '\n');
 	}
 
@@ -270,32 +461,57 @@ static void rndr_header(struct buf* ob, const struct buf* text, int level, void*
 			options->outline_data.open_section_count--;
 		}
 
-		bufprintf(ob, "<section class=\"section%d\">\n", level);
+		BUFPUTSL(ob, "<section class=\"section");
+		html_putnum(ob, (unsigned int) level);
+		BUFPUTSL(ob, "\">\n");
 		options->outline_data.open_section_count++;
 		options->outline_data.current_level = level;
 	}
 
+	if (options->flags & (HTML_TOC | HTML_OUTLINE)) {
+		options->stateful = 1;
+	}
+
+	html_header_open(ob, level);
+
 	if (options->flags & HTML_TOC) {
-		bufprintf(ob, "<h%d id=\"toc_%d\">", level, options->toc_data.header_count++);
+		BUFPUTSL(ob, " id=\"toc_");
+		html_putnum(ob, (unsigned int) options->toc_data.header_count);
+		BUFPUTSL(ob, "\">");
 	} else {
-		bufprintf(ob, "<h%d>", level);
+		bufputc(ob, '>');
+	}
+
+	/* the entry of the table of contents written alongside, with the text of the header */
+	if (((options->flags & HTML_TOC) != 0) && (options->toc != NULL)) {
+		toc_nest(options->toc, options, level);
+
+		BUFPUTSL(options->toc, "<a href=\"#toc_");
+		html_putnum(options->toc, (unsigned int) options->toc_data.header_count);
+		BUFPUTSL(options->toc, "\">");
+
+		if (text != NULL) {
+			html_strip_tags(options->toc, text->data, text->size);
+		}
+
+		BUFPUTSL(options->toc, "</a>\n");
+	}
+
+	if (options->flags & HTML_TOC) {
+		options->toc_data.header_count++;
 	}
 
 	if (text != NULL) {
 		bufput(ob, text->data, text->size);
 	}
 
-	bufprintf(ob, "</h%d>\n", level);
+	html_header_close(ob, level);
 }
 
 static int rndr_link(struct buf* ob, const struct buf* link, const struct buf* title, const struct buf* content, void* opaque)
 {
 	struct html_renderopt* options = opaque;
 
-	if ((link != NULL) && ((options->flags & HTML_SAFELINK) != 0) && (sd_autolink_issafe(link->data, link->size) == 0)) {
-		return 0;
-	}
-
 	BUFPUTSL(ob, "<a href=\"");
 
 	if ((link != NULL) && (link->size != 0)) {
@@ -324,43 +540,42 @@ static int rndr_link(struct buf* ob, const struct buf* link, const struct buf* t
 	return 1;
 }
 
-static void rndr_list(struct buf* ob, const struct buf* text, int flags, void* opaque)
+static int rndr_link_safe(struct buf* ob, const struct buf* link, const struct buf* title, const struct buf* content, void* opaque)
 {
-	if (ob->size != 0) {
-		bufputc(ob, '\n');
+	if ((link != NULL) && (sd_autolink_issafe(link->data, link->size) == 0)) {
+		return 0;
 	}
 
-	bufput(ob, (flags & MKD_LIST_ORDERED) ? ("<ol>\n") : ("<ul>\n"), 5);
+	return rndr_link(ob, link, title, content, opaque);
+}
+
+static void rndr_list(struct buf* ob, const struct buf* text, int flags, void* opaque)
+{
+	rndr_open(ob, MKDN_LIST, flags, opaque);
 
 	if (text != NULL) {
 		bufput(ob, text->data, text->size);
 	}
 
-	bufput(ob, (flags & MKD_LIST_ORDERED) ? ("</ol>\n") : ("</ul>\n"), 6);
+	rndr_close(ob, MKDN_LIST, flags, opaque);
 }
 
 static void rndr_listitem(struct buf* ob, const struct buf* text, int flags, void* opaque)
 {
-	BUFPUTSL(ob, "<li>");
+	rndr_open(ob, MKDN_LISTITEM, flags, opaque);
 
 	if (text != NULL) {
-		size_t size = text->size;
-
-		while ((size != 0) && (text->data[size - 1] == '\n')) {
-			size--;
-		}
-
-		bufput(ob, text->data, size);
+		bufput(ob, text->data, text->size);
 	}
 
-	BUFPUTSL(ob, "</li>\n");
+	rndr_close(ob, MKDN_LISTITEM, flags, opaque);
 }
 
 static void rndr_paragraph(struct buf* ob, const struct buf* text, void* opaque)
 {
 	struct html_renderopt* options = opaque;
 
-	if (ob->size != 0) {
+	if (html_after_block(ob, opaque) != 0) {
 		bufputc(ob, '\n');
 	}
 
@@ -400,7 +615,12 @@ static void rndr_paragraph(struct buf* ob, const struct buf* text, void* opaque)
 				break;
 			}
 
-			rndr_linebreak(ob, opaque);
+			if (options->flags & HTML_USE_XHTML) {
+				BUFPUTSL(ob, "<br/>\n");
+			} else {
+				BUFPUTSL(ob, "<br>\n");
+			}
+
 			i++;
 		}
 	} else {
@@ -432,7 +652,7 @@ static void rndr_raw_block(struct buf* ob, const struct buf* text, void* opaque)
 		return;
 	}
 
-	if (ob->size != 0) {
+	if (html_after_block(ob, opaque) != 0) {
 		bufputc(ob, '\n');
 	}
 
@@ -455,19 +675,27 @@ static int rndr_triple_emphasis(struct buf* ob, const struct buf* text, void* op
 
 static void rndr_hrule(struct buf* ob, void* opaque)
 {
-	struct html_renderopt* options = opaque;
-
-	if (ob->size != 0) {
+	if (html_after_block(ob, opaque) != 0) {
 		bufputc(ob, '\n');
 	}
 
-	bufputs(ob, (USE_XHTML(options)) ? ("<hr/>\n") : ("<hr>\n"));
+	BUFPUTSL(ob, "<hr>\n");
 }
 
-static int rndr_image(struct buf* ob, const struct buf* link, const struct buf* title, const struct buf* alt, void* opaque)
+static void rndr_hrule_xhtml(struct buf* ob, void* opaque)
 {
-	struct html_renderopt* options = opaque;
+	if (html_after_block(ob, opaque) != 0) {
+		bufputc(ob, '\n');
+	}
+
+	BUFPUTSL(ob, "<hr/>\n");
+}
 
+/**
+ * writes an img tag but for its end, returns 0 when there is no image
+ */
+static int html_image(struct buf* ob, const struct buf* link, const struct buf* title, const struct buf* alt)
+{
 	if ((link == NULL) || (link->size == 0)) {
 		return 0;
 	}
@@ -485,7 +713,27 @@ static int rndr_image(struct buf* ob, const struct buf* link, const struct buf*
 		escape_html(ob, title->data, title->size);
 	}
 
-	bufputs(ob, USE_XHTML(options) ? ("\"/>") : ("\">"));
+	return 1;
+}
+
+static int rndr_image(struct buf* ob, const struct buf* link, const struct buf* title, const struct buf* alt, void* opaque)
+{
+	if (html_image(ob, link, title, alt) == 0) {
+		return 0;
+	}
+
+	BUFPUTSL(ob, "\">");
+
+	return 1;
+}
+
+static int rndr_image_xhtml(struct buf* ob, const struct buf* link, const struct buf* title, const struct buf* alt, void* opaque)
+{
+	if (html_image(ob, link, title, alt) == 0) {
+		return 0;
+	}
+
+	BUFPUTSL(ob, "\"/>");
 
 	return 1;
 }
@@ -525,9 +773,23 @@ static int rndr_raw_html(struct buf* ob, const struct buf* text, void* opaque)
 	return 1;
 }
 
+static int rndr_raw_html_plain(struct buf* ob, const struct buf* text, void* opaque)
+{
+	bufput(ob, text->data, text->size);
+
+	return 1;
+}
+
+static int rndr_raw_html_escape(struct buf* ob, const struct buf* text, void* opaque)
+{
+	escape_html(ob, text->data, text->size);
+
+	return 1;
+}
+
 static void rndr_table(struct buf* ob, const struct buf* header, const struct buf* body_, void* opaque)
 {
-	if (ob->size != 0) {
+	if (html_after_block(ob, opaque) != 0) {
 		bufputc(ob, '\n');
 	}
 
@@ -618,6 +880,99 @@ static void rndr_normal_text(struct buf* ob, const struct buf* text, void* opaqu
 	}
 }
 
+static void rndr_normal_text_smartypants(struct buf* ob, const struct buf* text, void* opaque)
+{
+	struct html_renderopt* options = opaque;
+
+	if (text == NULL) {
+		return;
+	}
+
+	/* quotes depend on those left open before */
+	for (size_t i = 0; (i < text->size) && (options->stateful == 0); ++i) {
+		if ((text->data[i] == '"') || (text->data[i] == '\'') || (text->data[i] == '`')) {
+			options->stateful = 1;
+		}
+	}
+
+	sdhtml_smartypants_text(ob, &options->smartypants_data, (ob->size != 0) ? (ob->data[ob->size - 1]) : ('\0'), text->data, text->size);
+}
+
+/**
+ * compares the parts of the state that headers and quotes depend on
+ */
+static int html_state_cmp(const struct html_renderopt* a, const struct html_renderopt* b)
+{
+	if (memcmp(&a->toc_data, &b->toc_data, sizeof(a->toc_data)) != 0) {
+		return 1;
+	}
+
+	if (memcmp(&a->smartypants_data, &b->smartypants_data, sizeof(a->smartypants_data)) != 0) {
+		return 1;
+	}
+
+	return memcmp(&a->outline_data, &b->outline_data, sizeof(a->outline_data)) != 0;
+}
+
+static void* rndr_fork(void* opaque)
+{
+	struct html_renderopt* options = opaque;
+
+	/* the state may be part of a larger structure, which is not copied, and the table of contents is written in order */
+	if ((options->link_attributes != NULL) || (options->toc != NULL)) {
+		return NULL;
+	}
+
+	struct html_fork* fork = malloc(sizeof(struct html_fork));
+
+	if (fork == NULL) {
+		return NULL;
+	}
+
+	memcpy(&fork->options, options, sizeof(struct html_renderopt));
+	memcpy(&fork->origin, options, sizeof(struct html_renderopt));
+	fork->options.stateful = 0;
+
+	return fork;
+}
+
+static int rndr_join(void* opaque, void* fork_opaque, int flags)
+{
+	struct html_renderopt* options = opaque;
+	struct html_fork* fork = fork_opaque;
+	int ret = 0;
+
+	/* only headers and quotes read the state, carrying on from where it was */
+	if (((flags & SD_JOIN_DISCARD) == 0) && (fork->options.stateful != 0)) {
+		if (html_state_cmp(options, &fork->origin) == 0) {
+			options->toc_data = fork->options.toc_data;
+			options->outline_data = fork->options.outline_data;
+			options->smartypants_data = fork->options.smartypants_data;
+			options->stateful = 1;
+		} else {
+			ret = -1;
+		}
+	}
+
+	if ((flags & SD_JOIN_KEEP) == 0) {
+		free(fork);
+	}
+
+	return ret;
+}
+
+/**
+ * starts every document from the same state, whatever the last one left
+ */
+static void rndr_doc_header(struct buf* ob, void* opaque)
+{
+	struct html_renderopt* options = opaque;
+
+	memset(&options->toc_data, 0x00, sizeof(options->toc_data));
+	memset(&options->outline_data, 0x00, sizeof(options->outline_data));
+	memset(&options->smartypants_data, 0x00, sizeof(options->smartypants_data));
+}
+
 static void rndr_finalize(struct buf* ob, void* opaque)
 {
 	struct html_renderopt* options = opaque;
@@ -671,11 +1026,15 @@ static void rndr_footnote_def(struct buf* ob, const struct buf* text, unsigned i
 		}
 	}
 
-	bufprintf(ob, "\n<li id=\"fn%d\">\n", num);
+	BUFPUTSL(ob, "\n<li id=\"fn");
+	html_putnum(ob, num);
+	BUFPUTSL(ob, "\">\n");
 
 	if (pfound != 0) {
 		bufput(ob, text->data, i);
-		bufprintf(ob, "&nbsp;<a href=\"#fnref%d\" rev=\"footnote\">&#8617;</a>", num);
+		BUFPUTSL(ob, "&nbsp;<a href=\"#fnref");
+		html_putnum(ob, num);
+		BUFPUTSL(ob, "\" rev=\"footnote\">&#8617;</a>");
 		bufput(ob, text->data + i, text->size - i);
 	} else if (text != NULL) {
 		bufput(ob, text->data, text->size);
@@ -686,7 +1045,13 @@ static void rndr_footnote_def(struct buf* ob, const struct buf* text, unsigned i
 
 static int rndr_footnote_ref(struct buf* ob, unsigned int num, void* opaque)
 {
-	bufprintf(ob, "<sup id=\"fnref%d\"><a href=\"#fn%d\" rel=\"footnote\">%d</a></sup>", num, num, num);
+	BUFPUTSL(ob, "<sup id=\"fnref");
+	html_putnum(ob, num);
+	BUFPUTSL(ob, "\"><a href=\"#fn");
+	html_putnum(ob, num);
+	BUFPUTSL(ob, "\" rel=\"footnote\">");
+	html_putnum(ob, num);
+	BUFPUTSL(ob, "</a></sup>");
 
 	return 1;
 }
@@ -695,35 +1060,12 @@ static void toc_header(struct buf* ob, const struct buf* text, int level, void*
 {
 	struct html_renderopt* options = opaque;
 
-	/*
-	 * set the level offset if this is the first header
-	 * we're parsing for the document
-	 */
-	if (options->toc_data.current_level == 0) {
-		options->toc_data.level_offset = level - 1;
-	}
+	toc_nest(ob, options, level);
+	options->stateful = 1;
 
-	level -= options->toc_data.level_offset;
-
-	if (level > options->toc_data.current_level) {
-		while (level > options->toc_data.current_level) {
-			BUFPUTSL(ob, "<ul>\n<li>\n");
-			options->toc_data.current_level++;
-		}
-	} else if (level < options->toc_data.current_level) {
-		BUFPUTSL(ob, "</li>\n");
-
-		while (level < options->toc_data.current_level) {
-			BUFPUTSL(ob, "</ul>\n</li>\n");
-			options->toc_data.current_level--;
-		}
-
-		BUFPUTSL(ob, "<li>\n");
-	} else {
-		BUFPUTSL(ob, "</li>\n<li>\n");
-	}
-
-	bufprintf(ob, "<a href=\"#toc_%d\">", options->toc_data.header_count++);
+	BUFPUTSL(ob, "<a href=\"#toc_");
+	html_putnum(ob, (unsigned int) options->toc_data.header_count++);
+	BUFPUTSL(ob, "\">");
 
 	if (text != NULL) {
 		escape_html(ob, text->data, text->size);
@@ -751,6 +1093,13 @@ static void toc_finalize(struct buf* ob, void* opaque)
 	}
 }
 
+static void rndr_toc_footer(struct buf* ob, void* opaque)
+{
+	struct html_renderopt* options = opaque;
+
+	toc_finalize(options->toc, opaque);
+}
+
 void sdhtml_toc_renderer(struct sd_callbacks* callbacks, struct html_renderopt* options)
 {
 	static const struct sd_callbacks cb_default =
@@ -786,10 +1135,13 @@ void sdhtml_toc_renderer(struct sd_callbacks* callbacks, struct html_renderopt*
 		NULL,
 		NULL,
 
-		NULL,
+		rndr_doc_header,
 		toc_finalize,
 
 		NULL,
+
+		rndr_fork,
+		rndr_join,
 	};
 
 	memset(options, 0x00, sizeof(struct html_renderopt));
@@ -833,20 +1185,51 @@ void sdhtml_renderer(struct sd_callbacks* callbacks, struct html_renderopt* opti
 		NULL,
 		rndr_normal_text,
 
-		NULL,
+		rndr_doc_header,
 		NULL,
 
 		/* rndr_finalize */
 		NULL,
+
+		rndr_fork,
+		rndr_join,
+
+		rndr_open,
+		rndr_close,
 	};
 
 	/* Prepare the options pointer */
 	memset(options, 0x00, sizeof(struct html_renderopt));
 	options->flags = render_flags;
 
-	/* Prepare the callbacks */
+	/* Prepare the callbacks, specialized for the flags */
 	memcpy(callbacks, &cb_default, sizeof(struct sd_callbacks));
 
+	if ((render_flags & (HTML_TOC | HTML_OUTLINE)) == 0) {
+		callbacks->header = rndr_header_plain;
+	}
+
+	if (render_flags & HTML_USE_XHTML) {
+		callbacks->hrule = rndr_hrule_xhtml;
+		callbacks->image = rndr_image_xhtml;
+		callbacks->linebreak = rndr_linebreak_xhtml;
+	}
+
+	if (render_flags & HTML_SAFELINK) {
+		callbacks->link = rndr_link_safe;
+		callbacks->autolink = rndr_autolink_safe;
+	}
+
+	if (render_flags & HTML_SMARTYPANTS) {
+		callbacks->normal_text = rndr_normal_text_smartypants;
+	}
+
+	if (render_flags & HTML_ESCAPE) {
+		callbacks->raw_html_tag = rndr_raw_html_escape;
+	} else if ((render_flags & (HTML_SKIP_HTML | HTML_SKIP_STYLE | HTML_SKIP_LINKS | HTML_SKIP_IMAGES)) == 0) {
+		callbacks->raw_html_tag = rndr_raw_html_plain;
+	}
+
 	if (render_flags & HTML_OUTLINE) {
 		callbacks->outline = rndr_finalize;
 
@@ -867,3 +1250,11 @@ void sdhtml_renderer(struct sd_callbacks* callbacks, struct html_renderopt* opti
 		callbacks->blockhtml = NULL;
 	}
 }
+
+void sdhtml_renderer_with_toc(struct sd_callbacks* callbacks, struct html_renderopt* options, unsigned int render_flags, struct buf* toc)
+{
+	sdhtml_renderer(callbacks, options, render_flags | HTML_TOC);
+
+	options->toc = toc;
+	callbacks->doc_footer = rndr_toc_footer;
+}
@@ -25,6 +25,15 @@
 extern "C" {
 #endif
 
+/**
+ * quote state of SmartyPants, carried over from one run of text to the next
+ */
+struct smartypants_data
+{
+	int in_squote;
+	int in_dquote;
+};
+
 struct html_renderopt
 {
 	struct
@@ -42,6 +51,22 @@ struct html_renderopt
 		int open_section_count;
 	} outline_data;
 
+	/* typography of HTML_SMARTYPANTS */
+	struct smartypants_data smartypants_data;
+
+	/* whether a header or a quote read the state above since the last fork, for joins */
+	int stateful;
+
+	/* end of the last container opened in place, where its first block starts */
+	struct
+	{
+		const struct buf* ob;
+		size_t size;
+	} open_data;
+
+	/* table of contents written by sdhtml_renderer_with_toc, NULL otherwise */
+	struct buf* toc;
+
 	/* extra callbacks */
 	void (*link_attributes)(struct buf* ob, const struct buf* url, void* self);
 };
@@ -59,8 +84,32 @@ typedef enum
 	HTML_USE_XHTML = (1 << 8),
 	HTML_ESCAPE = (1 << 9),
 	HTML_OUTLINE = (1 << 10),
+	HTML_SMARTYPANTS = (1 << 11),
 } html_render_mode;
 
+/**
+ * state of the excerpt renderer
+ */
+struct excerpt_renderopt
+{
+	/* length of the excerpt, in characters or with EXCERPT_BYTES in bytes */
+	size_t max_size;
+	unsigned int flags;
+
+	/* length of the text written, and whether some was left out */
+	size_t size;
+	int truncated;
+
+	/* buffer the text was last written into, and where it ended */
+	const struct buf* tail_ob;
+	size_t tail_size;
+};
+
+typedef enum
+{
+	EXCERPT_BYTES = (1 << 0),
+} excerpt_mode;
+
 typedef enum
 {
 	HTML_TAG_NONE = 0,
@@ -70,12 +119,59 @@ typedef enum
 
 int sdhtml_is_tag(const uint8_t* tag_data, size_t tag_size, const char* tagname);
 
+/**
+ * fills in the HTML callbacks, specialized for render_flags: options->flags
+ * is not to be changed afterwards. The doc_header callback, called at the
+ * start of every render, resets options->toc_data, outline_data and
+ * smartypants_data, so that every document renders the same with a used
+ * renderer as with a new one: the HTML_TOC anchors and the HTML_OUTLINE
+ * sections of every document are numbered from 0, and no quote is left
+ * open from the last one. Renders used to carry that state over from one
+ * document to the next, which setting callbacks->doc_header to NULL
+ * brings back
+ */
 extern void sdhtml_renderer(struct sd_callbacks* callbacks, struct html_renderopt* options_ptr, unsigned int render_flags);
 
+/**
+ * fills in the callbacks writing the table of contents, whose doc_header
+ * resets the state as for sdhtml_renderer
+ */
 extern void sdhtml_toc_renderer(struct sd_callbacks* callbacks, struct html_renderopt* options_ptr);
 
+/**
+ * fills in the callbacks like sdhtml_renderer with HTML_TOC, the headers
+ * also writing the table of contents into toc as the body is rendered; the
+ * entries hold the text of the headers, without their markup. The state is
+ * reset for every render as with sdhtml_renderer
+ */
+extern void sdhtml_renderer_with_toc(struct sd_callbacks* callbacks, struct html_renderopt* options_ptr, unsigned int render_flags, struct buf* toc);
+
+/**
+ * fills in callbacks rendering the beginning of the text of a document,
+ * up to max_size characters (bytes with EXCERPT_BYTES): without markup,
+ * with entities decoded and a newline between blocks. The render stops
+ * once the excerpt is full; whenever text was left out, it returns
+ * SD_BUDGET_EXCEEDED and options->truncated is set
+ */
+extern void sdhtml_excerpt_renderer(struct sd_callbacks* callbacks, struct excerpt_renderopt* options_ptr, size_t max_size, unsigned int flags);
+
+/**
+ * applies SmartyPants to rendered HTML, leaving tags and the contents of
+ * code, pre and similar elements alone. Apostrophes of the text, which the
+ * renderer writes as &#39;, stay straight. A lone backtick is kept and a
+ * tag left open at the end of the text is copied as is; both used to be
+ * dropped or read past the text
+ */
 extern void sdhtml_smartypants(struct buf* ob, const uint8_t* text, size_t size);
 
+/**
+ * escapes a run of text like the HTML renderer, applying SmartyPants to it;
+ * previous_char is the one preceding the run. Unlike sdhtml_smartypants
+ * over a render, apostrophes are curled, so HTML_SMARTYPANTS renders write
+ * &rsquo; in "it's" where the second pass left &#39;
+ */
+extern void sdhtml_smartypants_text(struct buf* ob, struct smartypants_data* smrt, uint8_t previous_char, const uint8_t* text, size_t size);
+
 #ifdef __cplusplus
 }
 #endif
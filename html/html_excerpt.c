@@ -0,0 +1,557 @@
+#include "markdown.h"
+#include "html.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+struct excerpt_fork
+{
+	struct excerpt_renderopt options;
+
+	/* state the run was rendered from */
+	struct excerpt_renderopt origin;
+};
+
+/**
+ * named entities decoded into the excerpt, the others being kept as they are
+ */
+static const struct
+{
+	const char* name;
+	uint32_t code;
+} EXCERPT_ENTITIES[] = {
+	{"amp", '&'},
+	{"lt", '<'},
+	{"gt", '>'},
+	{"quot", '"'},
+	{"apos", '\''},
+	{"nbsp", 0xA0},
+	{"copy", 0xA9},
+	{"reg", 0xAE},
+	{"deg", 0xB0},
+	{"middot", 0xB7},
+	{"laquo", 0xAB},
+	{"raquo", 0xBB},
+	{"times", 0xD7},
+	{"ndash", 0x2013},
+	{"mdash", 0x2014},
+	{"lsquo", 0x2018},
+	{"rsquo", 0x2019},
+	{"ldquo", 0x201C},
+	{"rdquo", 0x201D},
+	{"bull", 0x2022},
+	{"hellip", 0x2026},
+	{"euro", 0x20AC},
+	{"trade", 0x2122},
+};
+
+/**
+ * appends text as long as the excerpt has room, without cutting through a
+ * character; newlines are read as spaces
+ */
+static void excerpt_put(struct buf* ob, struct excerpt_renderopt* options, const uint8_t* text, size_t size)
+{
+	if (options->truncated != 0) {
+		return;
+	}
+
+	size_t len = size;
+
+	if (options->flags & EXCERPT_BYTES) {
+		size_t room = options->max_size - options->size;
+
+		if (len > room) {
+			len = room;
+
+			while ((len > 0) && ((text[len] & 0xC0) == 0x80)) {
+				len--;
+			}
+
+			options->truncated = 1;
+		}
+
+		options->size += len;
+	} else {
+		size_t chars = 0;
+
+		for (len = 0; len < size; ++len) {
+			if ((text[len] & 0xC0) == 0x80) {
+				continue;
+			}
+
+			if ((options->size + chars) >= options->max_size) {
+				options->truncated = 1;
+
+				break;
+			}
+
+			chars++;
+		}
+
+		options->size += chars;
+	}
+
+	size_t i = 0;
+
+	while (i < len) {
+		const uint8_t* eol = memchr(text + i, '\n', len - i);
+		size_t end = (eol != NULL) ? ((size_t) (eol - text)) : (len);
+
+		bufput(ob, text + i, end - i);
+
+		if (end < len) {
+			bufputc(ob, ' ');
+			end++;
+		}
+
+		i = end;
+	}
+
+	options->tail_ob = ob;
+	options->tail_size = ob->size;
+}
+
+/**
+ * takes back the count of the text the parser removed from the end of ob
+ * since it was written, such as the scheme of an autolink or the spaces
+ * before a line break; those callbacks come right after the text, whose
+ * bytes are still there past the end of ob
+ */
+static void excerpt_untail(struct buf* ob, struct excerpt_renderopt* options)
+{
+	if ((options->tail_ob != ob) || (ob->size >= options->tail_size)) {
+		return;
+	}
+
+	const uint8_t* tail = ob->data + ob->size;
+	size_t size = options->tail_size - ob->size;
+
+	if (options->flags & EXCERPT_BYTES) {
+		options->size -= size;
+	} else {
+		for (size_t i = 0; i < size; ++i) {
+			if ((tail[i] & 0xC0) != 0x80) {
+				options->size--;
+			}
+		}
+	}
+
+	options->tail_size = ob->size;
+}
+
+/**
+ * appends separator to ob when it is not empty, counted like text, before
+ * the size bytes of text already counted; when the excerpt is full, the
+ * last character of text makes room for it. returns how much of text is
+ * to be appended after it
+ */
+static size_t excerpt_separate(struct buf* ob, struct excerpt_renderopt* options, uint8_t separator, const uint8_t* text, size_t size)
+{
+	if ((ob->size == 0) || (size == 0)) {
+		return size;
+	}
+
+	if (options->size >= options->max_size) {
+		size_t len = size;
+
+		do {
+			len--;
+		} while ((len > 0) && ((text[len] & 0xC0) == 0x80));
+
+		options->size -= (options->flags & EXCERPT_BYTES) ? (size - len) : (1);
+		options->truncated = 1;
+		size = len;
+
+		/* no separator without text after it */
+		if (size == 0) {
+			return 0;
+		}
+	}
+
+	bufputc(ob, separator);
+	options->size++;
+
+	return size;
+}
+
+/**
+ * appends the excerpt of a block, on a line of its own
+ */
+static void excerpt_block(struct buf* ob, struct excerpt_renderopt* options, const struct buf* text)
+{
+	/* the buffers handed over are reused afterwards */
+	options->tail_ob = NULL;
+
+	if (text == NULL) {
+		return;
+	}
+
+	bufput(ob, text->data, excerpt_separate(ob, options, '\n', text->data, text->size));
+}
+
+static size_t utf8_encode(uint8_t* out, uint32_t code)
+{
+	if (code < 0x80) {
+		out[0] = (uint8_t) code;
+
+		return 1;
+	}
+
+	if (code < 0x800) {
+		out[0] = (uint8_t) (0xC0 | (code >> 6));
+		out[1] = (uint8_t) (0x80 | (code & 0x3F));
+
+		return 2;
+	}
+
+	if (code < 0x10000) {
+		out[0] = (uint8_t) (0xE0 | (code >> 12));
+		out[1] = (uint8_t) (0x80 | ((code >> 6) & 0x3F));
+		out[2] = (uint8_t) (0x80 | (code & 0x3F));
+
+		return 3;
+	}
+
+	out[0] = (uint8_t) (0xF0 | (code >> 18));
+	out[1] = (uint8_t) (0x80 | ((code >> 12) & 0x3F));
+	out[2] = (uint8_t) (0x80 | ((code >> 6) & 0x3F));
+	out[3] = (uint8_t) (0x80 | (code & 0x3F));
+
+	return 4;
+}
+
+/**
+ * code point of a numeric entity body such as #38 or #x26, 0 when it is not one
+ */
+static uint32_t entity_number(const uint8_t* name, size_t size)
+{
+	int hex = (size > 1) && ((name[1] == 'x') || (name[1] == 'X'));
+	size_t i = (hex != 0) ? (2) : (1);
+	uint32_t code = 0;
+
+	if (i >= size) {
+		return 0;
+	}
+
+	for (; i < size; ++i) {
+		uint8_t c = name[i];
+		uint32_t digit;
+
+		if ((c >= '0') && (c <= '9')) {
+			digit = c - '0';
+		} else if ((hex != 0) && (c >= 'a') && (c <= 'f')) {
+			digit = c - 'a' + 10;
+		} else if ((hex != 0) && (c >= 'A') && (c <= 'F')) {
+			digit = c - 'A' + 10;
+		} else {
+			return 0;
+		}
+
+		code = (code * ((hex != 0) ? (16) : (10))) + digit;
+
+		if (code > 0x10FFFF) {
+			return 0xFFFD;
+		}
+	}
+
+	/* the surrogates and NUL are not characters of their own */
+	if ((code == 0) || ((code >= 0xD800) && (code <= 0xDFFF))) {
+		return 0xFFFD;
+	}
+
+	return code;
+}
+
+static void excerpt_entity(struct buf* ob, const struct buf* entity, void* opaque)
+{
+	struct excerpt_renderopt* options = opaque;
+
+	/* the parser only hands &[#]name; entities over */
+	const uint8_t* name = entity->data + 1;
+	size_t size = entity->size - 2;
+	uint32_t code = 0;
+
+	if (name[0] == '#') {
+		code = entity_number(name, size);
+	} else {
+		for (size_t i = 0; i < (sizeof(EXCERPT_ENTITIES) / sizeof(EXCERPT_ENTITIES[0])); ++i) {
+			if ((strlen(EXCERPT_ENTITIES[i].name) == size) && (memcmp(EXCERPT_ENTITIES[i].name, name, size) == 0)) {
+				code = EXCERPT_ENTITIES[i].code;
+
+				break;
+			}
+		}
+	}
+
+	if (code == 0) {
+		excerpt_put(ob, options, entity->data, entity->size);
+
+		return;
+	}
+
+	uint8_t utf8[4];
+
+	excerpt_put(ob, options, utf8, utf8_encode(utf8, code));
+}
+
+static void excerpt_normal_text(struct buf* ob, const struct buf* text, void* opaque)
+{
+	excerpt_put(ob, opaque, text->data, text->size);
+}
+
+static void excerpt_blockcode(struct buf* ob, const struct buf* text, const struct buf* lang, void* opaque)
+{
+	if (text == NULL) {
+		return;
+	}
+
+	struct excerpt_renderopt* options = opaque;
+	size_t size = text->size;
+	size_t org_size = ob->size;
+
+	while ((size > 0) && (text->data[size - 1] == '\n')) {
+		size--;
+	}
+
+	if ((size == 0) || (options->truncated != 0)) {
+		return;
+	}
+
+	/* the separator takes the room of the first character */
+	if (org_size != 0) {
+		if (options->size >= options->max_size) {
+			options->truncated = 1;
+
+			return;
+		}
+
+		bufputc(ob, '\n');
+		options->size++;
+	}
+
+	excerpt_put(ob, options, text->data, size);
+
+	/* no separator without text after it */
+	if ((org_size != 0) && (ob->size == (org_size + 1))) {
+		ob->size = org_size;
+		options->size--;
+	}
+}
+
+/**
+ * blocks made of others, such as quotes and table rows
+ */
+static void excerpt_container(struct buf* ob, const struct buf* text, void* opaque)
+{
+	excerpt_block(ob, opaque, text);
+}
+
+static void excerpt_blockhtml(struct buf* ob, const struct buf* text, void* opaque)
+{
+}
+
+static void excerpt_header(struct buf* ob, const struct buf* text, int level, void* opaque)
+{
+	excerpt_block(ob, opaque, text);
+}
+
+static void excerpt_list(struct buf* ob, const struct buf* text, int flags, void* opaque)
+{
+	excerpt_block(ob, opaque, text);
+}
+
+static void excerpt_paragraph(struct buf* ob, const struct buf* text, void* opaque)
+{
+	excerpt_block(ob, opaque, text);
+}
+
+static void excerpt_table(struct buf* ob, const struct buf* header, const struct buf* body, void* opaque)
+{
+	excerpt_block(ob, opaque, header);
+	excerpt_block(ob, opaque, body);
+}
+
+static void excerpt_tablecell(struct buf* ob, const struct buf* text, int flags, void* opaque)
+{
+	struct excerpt_renderopt* options = opaque;
+
+	options->tail_ob = NULL;
+
+	if (text == NULL) {
+		return;
+	}
+
+	bufput(ob, text->data, excerpt_separate(ob, options, ' ', text->data, text->size));
+}
+
+static int excerpt_autolink(struct buf* ob, const struct buf* link, enum mkd_autolink type, void* opaque)
+{
+	excerpt_untail(ob, opaque);
+	excerpt_put(ob, opaque, link->data, link->size);
+
+	return 1;
+}
+
+static int excerpt_codespan(struct buf* ob, const struct buf* text, void* opaque)
+{
+	if (text != NULL) {
+		excerpt_put(ob, opaque, text->data, text->size);
+	}
+
+	return 1;
+}
+
+/**
+ * spans whose content is kept without their markup
+ */
+static int excerpt_span(struct buf* ob, const struct buf* text, void* opaque)
+{
+	struct excerpt_renderopt* options = opaque;
+
+	options->tail_ob = NULL;
+
+	if (text != NULL) {
+		bufput(ob, text->data, text->size);
+	}
+
+	return 1;
+}
+
+static int excerpt_image(struct buf* ob, const struct buf* link, const struct buf* title, const struct buf* alt, void* opaque)
+{
+	excerpt_untail(ob, opaque);
+
+	if (alt != NULL) {
+		excerpt_put(ob, opaque, alt->data, alt->size);
+	}
+
+	return 1;
+}
+
+static int excerpt_linebreak(struct buf* ob, void* opaque)
+{
+	excerpt_untail(ob, opaque);
+	excerpt_put(ob, opaque, (const uint8_t*) "\n", 1);
+
+	return 1;
+}
+
+static int excerpt_link(struct buf* ob, const struct buf* link, const struct buf* title, const struct buf* content, void* opaque)
+{
+	return excerpt_span(ob, content, opaque);
+}
+
+static int excerpt_raw_html(struct buf* ob, const struct buf* tag, void* opaque)
+{
+	return 1;
+}
+
+static int excerpt_footnote_ref(struct buf* ob, unsigned int num, void* opaque)
+{
+	return 1;
+}
+
+static int excerpt_state_cmp(const struct excerpt_renderopt* a, const struct excerpt_renderopt* b)
+{
+	return (a->size != b->size) || (a->truncated != b->truncated);
+}
+
+static void* excerpt_fork(void* opaque)
+{
+	struct excerpt_fork* fork = malloc(sizeof(struct excerpt_fork));
+
+	if (fork == NULL) {
+		return NULL;
+	}
+
+	memcpy(&fork->options, opaque, sizeof(struct excerpt_renderopt));
+	memcpy(&fork->origin, opaque, sizeof(struct excerpt_renderopt));
+
+	return fork;
+}
+
+static int excerpt_join(void* opaque, void* fork_opaque, int flags)
+{
+	struct excerpt_renderopt* options = opaque;
+	struct excerpt_fork* fork = fork_opaque;
+	int ret = 0;
+
+	/* a run writing text carries on from where it started, which must be where the state still is */
+	if (((flags & SD_JOIN_DISCARD) == 0) && (excerpt_state_cmp(&fork->options, &fork->origin) != 0)) {
+		if (excerpt_state_cmp(options, &fork->origin) == 0) {
+			options->size = fork->options.size;
+			options->truncated = fork->options.truncated;
+		} else {
+			ret = -1;
+		}
+	}
+
+	if ((flags & SD_JOIN_KEEP) == 0) {
+		free(fork);
+	}
+
+	return ret;
+}
+
+static int excerpt_done(void* opaque)
+{
+	struct excerpt_renderopt* options = opaque;
+
+	return options->truncated;
+}
+
+void sdhtml_excerpt_renderer(struct sd_callbacks* callbacks, struct excerpt_renderopt* options, size_t max_size, unsigned int flags)
+{
+	static const struct sd_callbacks cb_default =
+	{
+		excerpt_blockcode,
+		excerpt_container,
+		excerpt_blockhtml,
+		excerpt_header,
+		NULL,
+		excerpt_list,
+		excerpt_list,
+		excerpt_paragraph,
+		excerpt_table,
+		excerpt_container,
+		excerpt_tablecell,
+		NULL,
+		NULL,
+
+		excerpt_autolink,
+		excerpt_codespan,
+		excerpt_span,
+		excerpt_span,
+		excerpt_image,
+		excerpt_linebreak,
+		excerpt_link,
+		excerpt_raw_html,
+		excerpt_span,
+		excerpt_span,
+		excerpt_span,
+		excerpt_span,
+		excerpt_footnote_ref,
+
+		excerpt_entity,
+		excerpt_normal_text,
+
+		NULL,
+		NULL,
+
+		NULL,
+
+		excerpt_fork,
+		excerpt_join,
+
+		NULL,
+		NULL,
+
+		excerpt_done,
+	};
+
+	memset(options, 0x00, sizeof(struct excerpt_renderopt));
+	options->max_size = max_size;
+	options->flags = flags;
+
+	memcpy(callbacks, &cb_default, sizeof(struct sd_callbacks));
+}
@@ -16,6 +16,7 @@
 
 #include "buffer.h"
 #include "html.h"
+#include "houdini.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -26,12 +27,6 @@
 #define snprintf _snprintf
 #endif
 
-struct smartypants_data
-{
-	int in_squote;
-	int in_dquote;
-};
-
 static size_t smartypants_cb__ltag(struct buf* ob, struct smartypants_data* smrt, uint8_t previous_char, const uint8_t* text, size_t size);
 static size_t smartypants_cb__dquote(struct buf* ob, struct smartypants_data* smrt, uint8_t previous_char, const uint8_t* text, size_t size);
 static size_t smartypants_cb__amp(struct buf* ob, struct smartypants_data* smrt, uint8_t previous_char, const uint8_t* text, size_t size);
@@ -99,12 +94,33 @@ static const uint8_t smartypants_cb_chars[] =
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 };
 
+/* the same for text, in which ampersands, angle brackets and backslashes are only escaped */
+static const uint8_t smartypants_text_chars[] =
+{
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 4, 0, 0, 0, 0, 3, 2, 0, 0, 0, 0, 1, 6, 0,
+	0, 7, 0, 7, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	9, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
 static inline int word_boundary(uint8_t c)
 {
 	return (c == '\0') || (isspace(c) != 0) || (ispunct(c) != 0);
 }
 
-static int smartypants_quotes(struct buf* ob, uint8_t previous_char, uint8_t next_char, uint8_t quote, int* is_open)
+static int smartypants_quotes(struct buf* ob, struct smartypants_data* smrt, uint8_t previous_char, uint8_t next_char, uint8_t quote, int* is_open)
 {
 	if ((*is_open != 0) && (word_boundary(next_char) == 0)) {
 		return 0;
@@ -128,12 +144,12 @@ static size_t smartypants_cb__squote(struct buf* ob, struct smartypants_data* sm
 		uint8_t t1 = tolower(text[1]);
 
 		if (t1 == '\'') {
-			if (smartypants_quotes(ob, previous_char, (size >= 3) ? (text[2]) : ('\0'), 'd', &smrt->in_dquote) != 0) {
+			if (smartypants_quotes(ob, smrt, previous_char, (size >= 3) ? (text[2]) : ('\0'), 'd', &smrt->in_dquote) != 0) {
 				return 1;
 			}
 		}
 
-		if (((t1 == 's') || (t1 == 't') || (t1 == 'm') || (t1 == 'd')) && ((size == 3) || (word_boundary(text[2]) != 0))) {
+		if (((t1 == 's') || (t1 == 't') || (t1 == 'm') || (t1 == 'd')) && ((size == 2) || (word_boundary(text[2]) != 0))) {
 			BUFPUTSL(ob, "&rsquo;");
 
 			return 0;
@@ -142,7 +158,7 @@ static size_t smartypants_cb__squote(struct buf* ob, struct smartypants_data* sm
 		if (size >= 3) {
 			uint8_t t2 = tolower(text[2]);
 
-			if ((((t1 == 'r') && (t2 == 'e')) || ((t1 == 'l') && (t2 == 'l')) || ((t1 == 'v') && (t2 == 'e'))) && ((size == 4) || (word_boundary(text[3]) != 0))) {
+			if ((((t1 == 'r') && (t2 == 'e')) || ((t1 == 'l') && (t2 == 'l')) || ((t1 == 'v') && (t2 == 'e'))) && ((size == 3) || (word_boundary(text[3]) != 0))) {
 				BUFPUTSL(ob, "&rsquo;");
 
 				return 0;
@@ -150,7 +166,7 @@ static size_t smartypants_cb__squote(struct buf* ob, struct smartypants_data* sm
 		}
 	}
 
-	if (smartypants_quotes(ob, previous_char, (size > 0) ? (text[1]) : ('\0'), 's', &smrt->in_squote) != 0) {
+	if (smartypants_quotes(ob, smrt, previous_char, (size > 1) ? (text[1]) : ('\0'), 's', &smrt->in_squote) != 0) {
 		return 0;
 	}
 
@@ -211,7 +227,7 @@ static size_t smartypants_cb__dash(struct buf* ob, struct smartypants_data* smrt
 static size_t smartypants_cb__amp(struct buf* ob, struct smartypants_data* smrt, uint8_t previous_char, const uint8_t* text, size_t size)
 {
 	if ((size >= 6) && (memcmp(text, "&quot;", 6) == 0)) {
-		if (smartypants_quotes(ob, previous_char, (size >= 7) ? (text[6]) : ('\0'), 'd', &smrt->in_dquote) != 0) {
+		if (smartypants_quotes(ob, smrt, previous_char, (size >= 7) ? (text[6]) : ('\0'), 'd', &smrt->in_dquote) != 0) {
 			return 5;
 		}
 	}
@@ -247,11 +263,13 @@ static size_t smartypants_cb__period(struct buf* ob, struct smartypants_data* sm
 static size_t smartypants_cb__backtick(struct buf* ob, struct smartypants_data* smrt, uint8_t previous_char, const uint8_t* text, size_t size)
 {
 	if ((size >= 2) && (text[1] == '`')) {
-		if (smartypants_quotes(ob, previous_char, (size >= 3) ? (text[2]) : ('\0'), 'd', &smrt->in_dquote) != 0) {
+		if (smartypants_quotes(ob, smrt, previous_char, (size >= 3) ? (text[2]) : ('\0'), 'd', &smrt->in_dquote) != 0) {
 			return 1;
 		}
 	}
 
+	bufputc(ob, text[0]);
+
 	return 0;
 }
 
@@ -290,7 +308,7 @@ static size_t smartypants_cb__number(struct buf* ob, struct smartypants_data* sm
 
 static size_t smartypants_cb__dquote(struct buf* ob, struct smartypants_data* smrt, uint8_t previous_char, const uint8_t* text, size_t size)
 {
-	if (smartypants_quotes(ob, previous_char, (size > 0) ? (text[1]) : ('\0'), 'd', &smrt->in_dquote) == 0) {
+	if (smartypants_quotes(ob, smrt, previous_char, (size > 1) ? (text[1]) : ('\0'), 'd', &smrt->in_dquote) == 0) {
 		BUFPUTSL(ob, "&quot;");
 	}
 
@@ -342,6 +360,13 @@ static size_t smartypants_cb__ltag(struct buf* ob, struct smartypants_data* smrt
 		}
 	}
 
+	/* an unterminated tag ends with the text */
+	if (i == size) {
+		bufput(ob, text, size);
+
+		return size - 1;
+	}
+
 	bufput(ob, text, i + 1);
 
 	return i;
@@ -432,3 +457,23 @@ void sdhtml_smartypants(struct buf* ob, const uint8_t* text, size_t size)
 		}
 	}
 }
+
+void sdhtml_smartypants_text(struct buf* ob, struct smartypants_data* smrt, uint8_t previous_char, const uint8_t* text, size_t size)
+{
+	for (size_t i = 0; i < size; ++i) {
+		uint8_t action = 0;
+		size_t org = i;
+
+		while ((i < size) && ((action = smartypants_text_chars[text[i]]) == 0)) {
+			i++;
+		}
+
+		if (i > org) {
+			houdini_escape_html0(ob, text + org, i - org, 0);
+		}
+
+		if (i < size) {
+			i += smartypants_cb_ptrs[(int) action](ob, smrt, (i != 0) ? (text[i - 1]) : (previous_char), text + i, size - i);
+		}
+	}
+}
@@ -0,0 +1,116 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN (2 * sizeof(void*))
+#define ARENA_ROUND(x) (((x) + (ARENA_ALIGN - 1)) & ~(ARENA_ALIGN - 1))
+
+struct sd_arena_chunk
+{
+	struct sd_arena_chunk* next;
+	size_t size;
+	size_t used;
+};
+
+#define CHUNK_HEADER ARENA_ROUND(sizeof(struct sd_arena_chunk))
+#define CHUNK_DATA(chunk) ((unsigned char*) (chunk) + CHUNK_HEADER)
+
+static void* default_chunk_alloc(size_t size, void* opaque)
+{
+	return malloc(size);
+}
+
+static void default_chunk_free(void* chunk, void* opaque)
+{
+	free(chunk);
+}
+
+void sd_arena_init(struct sd_arena* arena, size_t chunk_size)
+{
+	arena->head = NULL;
+	arena->current = NULL;
+	arena->chunk_size = (chunk_size != 0) ? (chunk_size) : (4096);
+	arena->chunk_alloc = default_chunk_alloc;
+	arena->chunk_free = default_chunk_free;
+	arena->opaque = NULL;
+}
+
+void sd_arena_free(struct sd_arena* arena)
+{
+	if (arena == NULL) {
+		return;
+	}
+
+	struct sd_arena_chunk* chunk = arena->head;
+
+	while (chunk != NULL) {
+		struct sd_arena_chunk* next = chunk->next;
+		arena->chunk_free(chunk, arena->opaque);
+		chunk = next;
+	}
+
+	arena->head = NULL;
+	arena->current = NULL;
+}
+
+void* sd_arena_alloc(struct sd_arena* arena, size_t size)
+{
+	size = ARENA_ROUND(size);
+
+	struct sd_arena_chunk* chunk = arena->current;
+
+	if ((chunk != NULL) && ((chunk->size - chunk->used) >= size)) {
+		void* ptr = CHUNK_DATA(chunk) + chunk->used;
+		chunk->used += size;
+
+		return ptr;
+	}
+
+	/* chunks left over from before the last reset are reused in order */
+	if ((chunk != NULL) && (chunk->next != NULL) && (chunk->next->size >= size)) {
+		chunk = chunk->next;
+	} else if ((chunk == NULL) && (arena->head != NULL) && (arena->head->size >= size)) {
+		chunk = arena->head;
+	} else {
+		size_t chunk_size = (size > arena->chunk_size) ? (size) : (arena->chunk_size);
+		struct sd_arena_chunk* neochunk = arena->chunk_alloc(CHUNK_HEADER + chunk_size, arena->opaque);
+
+		if (neochunk == NULL) {
+			return NULL;
+		}
+
+		neochunk->size = chunk_size;
+
+		if (chunk != NULL) {
+			neochunk->next = chunk->next;
+			chunk->next = neochunk;
+		} else {
+			neochunk->next = arena->head;
+			arena->head = neochunk;
+		}
+
+		chunk = neochunk;
+	}
+
+	chunk->used = size;
+	arena->current = chunk;
+
+	return CHUNK_DATA(chunk);
+}
+
+void* sd_arena_calloc(struct sd_arena* arena, size_t size)
+{
+	void* ptr = sd_arena_alloc(arena, size);
+
+	if (ptr != NULL) {
+		memset(ptr, 0x00, size);
+	}
+
+	return ptr;
+}
+
+void sd_arena_reset(struct sd_arena* arena)
+{
+	arena->current = NULL;
+}
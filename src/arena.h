@@ -0,0 +1,48 @@
+#ifndef ARENA_H__
+#define ARENA_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct sd_arena_chunk;
+
+/**
+ * bump allocator for short-lived allocations, released all at once
+ */
+struct sd_arena
+{
+	struct sd_arena_chunk* head;
+	struct sd_arena_chunk* current;
+
+	/**
+	 * minimal size of a chunk
+	 */
+	size_t chunk_size;
+
+	/**
+	 * chunk allocator, malloc() and free() unless overridden
+	 */
+	void* (*chunk_alloc)(size_t size, void* opaque);
+	void (*chunk_free)(void* chunk, void* opaque);
+	void* opaque;
+};
+
+void sd_arena_init(struct sd_arena*, size_t chunk_size);
+void sd_arena_free(struct sd_arena*);
+
+void* sd_arena_alloc(struct sd_arena*, size_t size);
+void* sd_arena_calloc(struct sd_arena*, size_t size);
+
+/**
+ * discards every allocation, keeping the chunks for reuse
+ */
+void sd_arena_reset(struct sd_arena*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
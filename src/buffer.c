@@ -15,7 +15,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-/* 16MB */
+/* 16MB, default cap for buffers without their own max_size */
 #define BUFFER_MAX_ALLOC_SIZE (1024 * 1024 * 16)
 
 #include "buffer.h"
@@ -32,6 +32,37 @@
 #define _buf_vsnprintf vsnprintf
 #endif
 
+#if defined(_MSC_VER)
+#define BUF_THREAD_LOCAL __declspec(thread)
+#else
+#define BUF_THREAD_LOCAL __thread
+#endif
+
+/* allocations refused by bufgrow on this thread, for the parser to tell a failed render */
+static BUF_THREAD_LOCAL size_t fail_count = 0;
+
+size_t bufgrow_failures(void)
+{
+	return fail_count;
+}
+
+#ifdef SD_STATS
+static BUF_THREAD_LOCAL size_t grow_count = 0;
+
+size_t bufgrow_count(void)
+{
+	return grow_count;
+}
+#endif
+
+/**
+ * whether the data is still held in the storage following the buffer
+ */
+static inline int buf_is_inline(const struct buf* buf)
+{
+	return (buf->inline_size != 0) && (buf->data == (uint8_t*) (buf + 1));
+}
+
 int bufprefix(const struct buf* buf, const char* prefix)
 {
 	assert((buf != NULL) && (buf->unit != 0));
@@ -56,7 +87,11 @@ int bufgrow(struct buf* buf, size_t neosz)
 {
 	assert((buf != NULL) && (buf->unit != 0));
 
-	if (neosz > BUFFER_MAX_ALLOC_SIZE) {
+	size_t max_size = (buf->max_size != 0) ? (buf->max_size) : (BUFFER_MAX_ALLOC_SIZE);
+
+	if (neosz > max_size) {
+		fail_count++;
+
 		return BUF_ENOMEM;
 	}
 
@@ -66,19 +101,49 @@ int bufgrow(struct buf* buf, size_t neosz)
 
 	size_t neoasz = buf->asize + buf->unit;
 
-	while (neoasz < neosz) {
-		neoasz += buf->unit;
+	if (buf->growth != 0) {
+		size_t geoasz = ((buf->asize / 100) * buf->growth) + (((buf->asize % 100) * buf->growth) / 100);
+
+		if (geoasz > neoasz) {
+			neoasz = geoasz;
+		}
+	}
+
+	/* rounding the request up to a whole number of units */
+	if ((neoasz < neosz) || (neoasz < buf->asize)) {
+		neoasz = neosz + ((buf->unit - (neosz % buf->unit)) % buf->unit);
 	}
 
-	void* neodata = realloc(buf->data, neoasz);
+	if ((neoasz > max_size) || (neoasz < neosz)) {
+		neoasz = max_size;
+	}
+
+	void* neodata;
+
+	/* moving out of the inline storage, which cannot be reallocated */
+	if (buf_is_inline(buf)) {
+		neodata = malloc(neoasz);
+
+		if (neodata != NULL) {
+			memcpy(neodata, buf->data, buf->size);
+		}
+	} else {
+		neodata = realloc(buf->data, neoasz);
+	}
 
 	if (neodata == NULL) {
+		fail_count++;
+
 		return BUF_ENOMEM;
 	}
 
 	buf->data = neodata;
 	buf->asize = neoasz;
 
+#ifdef SD_STATS
+	grow_count++;
+#endif
+
 	return BUF_OK;
 }
 
@@ -94,11 +159,45 @@ struct buf* bufnew(size_t unit)
 		ret->asize = 0;
 		ret->size = 0;
 		ret->unit = unit;
+		ret->growth = 0;
+		ret->max_size = 0;
+		ret->inline_size = 0;
 	}
 
 	return ret;
 }
 
+/**
+ * allocation of a new buffer with inline storage
+ */
+struct buf* bufnew_inline(size_t unit, size_t inline_size)
+{
+	struct buf* ret = malloc(sizeof(struct buf) + inline_size);
+
+	if (ret != NULL) {
+		ret->data = (inline_size != 0) ? ((uint8_t*) (ret + 1)) : (NULL);
+		ret->asize = inline_size;
+		ret->size = 0;
+		ret->unit = unit;
+		ret->growth = 0;
+		ret->max_size = 0;
+		ret->inline_size = inline_size;
+	}
+
+	return ret;
+}
+
+/**
+ * sets the growth policy of a buffer
+ */
+void bufsetgrowth(struct buf* buf, unsigned int growth, size_t max_size)
+{
+	assert(buf != NULL);
+
+	buf->growth = growth;
+	buf->max_size = max_size;
+}
+
 /**
  * NULL-termination of the string array
  */
@@ -209,7 +308,10 @@ void bufrelease(struct buf* buf)
 		return;
 	}
 
-	free(buf->data);
+	if (buf_is_inline(buf) == 0) {
+		free(buf->data);
+	}
+
 	free(buf);
 }
 
@@ -222,9 +324,13 @@ void bufreset(struct buf* buf)
 		return;
 	}
 
-	free(buf->data);
-	buf->data = NULL;
-	buf->asize = 0;
+	if (buf_is_inline(buf) == 0) {
+		free(buf->data);
+	}
+
+	/* going back to the inline storage, if any */
+	buf->data = (buf->inline_size != 0) ? ((uint8_t*) (buf + 1)) : (NULL);
+	buf->asize = buf->inline_size;
 	buf->size = 0;
 }
 
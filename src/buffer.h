@@ -61,17 +61,34 @@ struct buf
 	 * reallocation unit size (0 = read-only buffer)
 	 */
 	size_t unit;
+
+	/**
+	 * geometric growth factor in percent of the allocated size
+	 * (0 = grow linearly by unit)
+	 */
+	unsigned int growth;
+
+	/**
+	 * maximal allocated size (0 = BUFFER_MAX_ALLOC_SIZE)
+	 */
+	size_t max_size;
+
+	/**
+	 * size of the storage allocated along with the buffer (0 = none),
+	 * holding the data until it outgrows it
+	 */
+	size_t inline_size;
 };
 
 /*
  * global buffer from a string litteral
  */
-#define BUF_STATIC(string_) { (uint8_t*) string_, sizeof string_ -1, sizeof string_, 0, 0 }
+#define BUF_STATIC(string_) { (uint8_t*) string_, sizeof string_ -1, sizeof string_, 0, 0, 0 }
 
 /*
  * macro for creating a volatile buffer on the stack
  */
-#define BUF_VOLATILE(strname) { (uint8_t*) strname, strlen(strname), 0, 0, 0 }
+#define BUF_VOLATILE(strname) { (uint8_t*) strname, strlen(strname), 0, 0, 0, 0 }
 
 /*
  * optimized bufputs of a string litteral
@@ -83,11 +100,40 @@ struct buf
  */
 int bufgrow(struct buf*, size_t);
 
+/**
+ * number of times bufgrow failed on the calling thread, the buffer being
+ * full or out of memory; the functions writing into a buffer drop what
+ * does not fit, which the difference of two counts tells
+ */
+size_t bufgrow_failures(void);
+
+#ifdef SD_STATS
+/**
+ * number of reallocations made by bufgrow on the calling thread
+ */
+size_t bufgrow_count(void);
+#endif
+
 /**
  * allocation of a new buffer
  */
 struct buf* bufnew(size_t) __attribute__((malloc));
 
+/**
+ * allocation of a new buffer holding its first inline_size bytes in the
+ * same allocation, so that small contents never touch the heap again
+ */
+struct buf* bufnew_inline(size_t unit, size_t inline_size) __attribute__((malloc));
+
+/**
+ * sets the growth policy of a buffer
+ *
+ * growth is a percentage of the allocated size (150 grows by half, 200
+ * doubles, 0 keeps growing linearly by unit) and max_size caps the
+ * allocation (0 falls back to the compile-time default).
+ */
+void bufsetgrowth(struct buf*, unsigned int growth, size_t max_size);
+
 /**
  * NUL-termination of the string array (making a C-string)
  */
@@ -0,0 +1,524 @@
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+/* shards of a cache, each with its own lock and recency list, the memory being shared */
+#define CACHE_SHARDS 16
+#define CACHE_MIN_BUCKETS 64
+
+/**
+ * cached render, followed by the source of the document and its output
+ */
+struct cache_entry
+{
+	struct sd_render_key key;
+	uint64_t hash;
+
+	/* chain of the bucket, the recency list, and the tick of the cache it was last used at */
+	struct cache_entry* next;
+	struct cache_entry* newer;
+	struct cache_entry* older;
+	uint64_t used;
+
+	size_t out_size;
+	size_t bytes;
+};
+
+#define ENTRY_SOURCE(entry) ((uint8_t*) ((entry) + 1))
+#define ENTRY_OUTPUT(entry) (ENTRY_SOURCE(entry) + (entry)->key.doc_size)
+
+#if defined(_WIN32)
+typedef CRITICAL_SECTION cache_lock;
+#else
+typedef pthread_mutex_t cache_lock;
+#endif
+
+struct cache_shard
+{
+	cache_lock lock;
+
+	/* power of two buckets, 0 until the first entry */
+	struct cache_entry** buckets;
+	size_t bucket_count;
+
+	struct cache_entry* newest;
+	struct cache_entry* oldest;
+
+	size_t entries;
+
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+};
+
+struct sd_render_cache
+{
+	struct cache_shard shards[CACHE_SHARDS];
+
+	/* memory held by all the shards */
+	cache_lock lock;
+	size_t bytes;
+	size_t max_bytes;
+
+	/* counts the uses of the entries, ordering them across the shards */
+	uint64_t tick;
+};
+
+static int lock_init(cache_lock* lock)
+{
+#if defined(_WIN32)
+	InitializeCriticalSection(lock);
+
+	return 0;
+#else
+	return pthread_mutex_init(lock, NULL);
+#endif
+}
+
+static void lock_destroy(cache_lock* lock)
+{
+#if defined(_WIN32)
+	DeleteCriticalSection(lock);
+#else
+	pthread_mutex_destroy(lock);
+#endif
+}
+
+static inline void lock_take(cache_lock* lock)
+{
+#if defined(_WIN32)
+	EnterCriticalSection(lock);
+#else
+	pthread_mutex_lock(lock);
+#endif
+}
+
+static inline void lock_give(cache_lock* lock)
+{
+#if defined(_WIN32)
+	LeaveCriticalSection(lock);
+#else
+	pthread_mutex_unlock(lock);
+#endif
+}
+
+/**
+ * the next tick of the cache, taken without its lock
+ */
+static inline uint64_t cache_tick(struct sd_render_cache* cache)
+{
+#if defined(_WIN32)
+	return (uint64_t) InterlockedIncrement64((volatile LONG64*) &cache->tick);
+#else
+	return __atomic_add_fetch(&cache->tick, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+static uint64_t key_hash(const struct sd_render_key* key)
+{
+	uint64_t hash = key->doc_hash ^ (key->callbacks * 0x9e3779b97f4a7c15ULL);
+
+	hash ^= ((uint64_t) key->ext_flags << 40) ^ ((uint64_t) key->max_nesting << 20) ^ key->render_flags;
+	hash ^= (uint64_t) (uintptr_t) key->render_hook;
+	hash *= 0xff51afd7ed558ccdULL;
+
+	return hash ^ (hash >> 33);
+}
+
+static int key_equal(const struct sd_render_key* a, const struct sd_render_key* b)
+{
+	return (a->doc_hash == b->doc_hash) && (a->doc_size == b->doc_size) && (a->callbacks == b->callbacks) && (a->ext_flags == b->ext_flags) && (a->max_nesting == b->max_nesting) && (a->render_flags == b->render_flags) && (a->render_hook == b->render_hook);
+}
+
+static inline struct cache_shard* cache_shard(struct sd_render_cache* cache, uint64_t hash)
+{
+	return &cache->shards[(hash >> 56) % CACHE_SHARDS];
+}
+
+/**
+ * finds the entry of the document, comparing the sources so that a collision never returns another output
+ */
+static struct cache_entry* shard_find(struct cache_shard* shard, const struct sd_render_key* key, uint64_t hash, const uint8_t* document)
+{
+	if (shard->bucket_count == 0) {
+		return NULL;
+	}
+
+	struct cache_entry* entry = shard->buckets[hash & (shard->bucket_count - 1)];
+
+	for (; entry != NULL; entry = entry->next) {
+		if ((entry->hash == hash) && (key_equal(&entry->key, key) != 0) && ((key->doc_size == 0) || (memcmp(ENTRY_SOURCE(entry), document, key->doc_size) == 0))) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+static void lru_unlink(struct cache_shard* shard, struct cache_entry* entry)
+{
+	if (entry->newer != NULL) {
+		entry->newer->older = entry->older;
+	} else {
+		shard->newest = entry->older;
+	}
+
+	if (entry->older != NULL) {
+		entry->older->newer = entry->newer;
+	} else {
+		shard->oldest = entry->newer;
+	}
+}
+
+static void lru_push(struct cache_shard* shard, struct cache_entry* entry)
+{
+	entry->newer = NULL;
+	entry->older = shard->newest;
+
+	if (shard->newest != NULL) {
+		shard->newest->newer = entry;
+	} else {
+		shard->oldest = entry;
+	}
+
+	shard->newest = entry;
+}
+
+/**
+ * unlinks and frees entry, returns the bytes it held
+ */
+static size_t shard_remove(struct cache_shard* shard, struct cache_entry* entry)
+{
+	size_t bytes = entry->bytes;
+
+	struct cache_entry** link = &shard->buckets[entry->hash & (shard->bucket_count - 1)];
+
+	while (*link != entry) {
+		link = &(*link)->next;
+	}
+
+	*link = entry->next;
+	lru_unlink(shard, entry);
+	shard->entries--;
+	free(entry);
+
+	return bytes;
+}
+
+/**
+ * doubles the buckets once there are as many entries, returns -1 when there are none to insert into
+ */
+static int shard_grow(struct cache_shard* shard)
+{
+	if (shard->entries < shard->bucket_count) {
+		return 0;
+	}
+
+	size_t count = (shard->bucket_count != 0) ? (shard->bucket_count * 2) : (CACHE_MIN_BUCKETS);
+	struct cache_entry** buckets = calloc(count, sizeof(struct cache_entry*));
+
+	if (buckets == NULL) {
+		return (shard->bucket_count != 0) ? (0) : (-1);
+	}
+
+	for (size_t i = 0; i < shard->bucket_count; ++i) {
+		struct cache_entry* entry = shard->buckets[i];
+
+		while (entry != NULL) {
+			struct cache_entry* next = entry->next;
+
+			entry->next = buckets[entry->hash & (count - 1)];
+			buckets[entry->hash & (count - 1)] = entry;
+			entry = next;
+		}
+	}
+
+	free(shard->buckets);
+	shard->buckets = buckets;
+	shard->bucket_count = count;
+
+	return 0;
+}
+
+struct sd_render_cache* sd_render_cache_new(size_t max_bytes)
+{
+	struct sd_render_cache* cache = calloc(1, sizeof(struct sd_render_cache));
+
+	if (cache == NULL) {
+		return NULL;
+	}
+
+	if (lock_init(&cache->lock) != 0) {
+		free(cache);
+
+		return NULL;
+	}
+
+	for (size_t i = 0; i < CACHE_SHARDS; ++i) {
+		if (lock_init(&cache->shards[i].lock) != 0) {
+			while (i-- > 0) {
+				lock_destroy(&cache->shards[i].lock);
+			}
+
+			lock_destroy(&cache->lock);
+			free(cache);
+
+			return NULL;
+		}
+	}
+
+	cache->max_bytes = max_bytes;
+
+	return cache;
+}
+
+void sd_render_cache_free(struct sd_render_cache* cache)
+{
+	if (cache == NULL) {
+		return;
+	}
+
+	for (size_t i = 0; i < CACHE_SHARDS; ++i) {
+		struct cache_shard* shard = &cache->shards[i];
+		struct cache_entry* entry = shard->newest;
+
+		while (entry != NULL) {
+			struct cache_entry* older = entry->older;
+
+			free(entry);
+			entry = older;
+		}
+
+		free(shard->buckets);
+		lock_destroy(&shard->lock);
+	}
+
+	lock_destroy(&cache->lock);
+	free(cache);
+}
+
+int sd_render_cache_get(struct sd_render_cache* cache, const struct sd_render_key* key, const uint8_t* document, struct buf* ob)
+{
+	uint64_t hash = key_hash(key);
+	struct cache_shard* shard = cache_shard(cache, hash);
+
+	lock_take(&shard->lock);
+
+	struct cache_entry* entry = shard_find(shard, key, hash, document);
+
+	if (entry != NULL) {
+		shard->hits++;
+		entry->used = cache_tick(cache);
+
+		if (shard->newest != entry) {
+			lru_unlink(shard, entry);
+			lru_push(shard, entry);
+		}
+
+		bufput(ob, ENTRY_OUTPUT(entry), entry->out_size);
+	} else {
+		shard->misses++;
+	}
+
+	lock_give(&shard->lock);
+
+	return (entry != NULL);
+}
+
+static void cache_release(struct sd_render_cache* cache, size_t bytes)
+{
+	lock_take(&cache->lock);
+	cache->bytes -= bytes;
+	lock_give(&cache->lock);
+}
+
+/**
+ * evicts the least recently used entries until the cache fits its memory,
+ * that of the whole cache being the oldest of one of the shards; no shard
+ * lock is held while the cache lock is, nor the other way round
+ */
+static void cache_evict(struct sd_render_cache* cache)
+{
+	while (1) {
+		lock_take(&cache->lock);
+
+		int over = (cache->bytes > cache->max_bytes);
+
+		lock_give(&cache->lock);
+
+		if (over == 0) {
+			return;
+		}
+
+		struct cache_shard* victim = NULL;
+		uint64_t used = 0;
+
+		for (size_t i = 0; i < CACHE_SHARDS; ++i) {
+			struct cache_shard* shard = &cache->shards[i];
+
+			lock_take(&shard->lock);
+
+			if ((shard->oldest != NULL) && ((victim == NULL) || (shard->oldest->used < used))) {
+				victim = shard;
+				used = shard->oldest->used;
+			}
+
+			lock_give(&shard->lock);
+		}
+
+		if (victim == NULL) {
+			return;
+		}
+
+		size_t freed = 0;
+
+		/* an entry used again in the meantime is left, the search starting over */
+		lock_take(&victim->lock);
+
+		if ((victim->oldest != NULL) && (victim->oldest->used == used)) {
+			freed = shard_remove(victim, victim->oldest);
+			victim->evictions++;
+		}
+
+		lock_give(&victim->lock);
+
+		if (freed != 0) {
+			cache_release(cache, freed);
+		}
+	}
+}
+
+int sd_render_cache_put(struct sd_render_cache* cache, const struct sd_render_key* key, const uint8_t* document, const uint8_t* output, size_t out_size)
+{
+	uint64_t hash = key_hash(key);
+	struct cache_shard* shard = cache_shard(cache, hash);
+
+	if ((key->doc_size > cache->max_bytes) || (out_size > cache->max_bytes)) {
+		return -1;
+	}
+
+	size_t bytes = sizeof(struct cache_entry) + key->doc_size + out_size;
+
+	if (bytes > cache->max_bytes) {
+		return -1;
+	}
+
+	/* copying outside of the lock */
+	struct cache_entry* entry = malloc(bytes);
+
+	if (entry == NULL) {
+		return -1;
+	}
+
+	entry->key = *key;
+	entry->hash = hash;
+	entry->out_size = out_size;
+	entry->bytes = bytes;
+	entry->used = cache_tick(cache);
+
+	if (key->doc_size != 0) {
+		memcpy(ENTRY_SOURCE(entry), document, key->doc_size);
+	}
+
+	if (out_size != 0) {
+		memcpy(ENTRY_OUTPUT(entry), output, out_size);
+	}
+
+	/* counted before it is in the shard, where it may be evicted right away */
+	lock_take(&cache->lock);
+	cache->bytes += bytes;
+	lock_give(&cache->lock);
+
+	lock_take(&shard->lock);
+
+	struct cache_entry* old = shard_find(shard, key, hash, document);
+	size_t freed = (old != NULL) ? (shard_remove(shard, old)) : (0);
+
+	if (shard_grow(shard) != 0) {
+		lock_give(&shard->lock);
+		free(entry);
+		cache_release(cache, bytes + freed);
+
+		return -1;
+	}
+
+	struct cache_entry** bucket = &shard->buckets[hash & (shard->bucket_count - 1)];
+
+	entry->next = *bucket;
+	*bucket = entry;
+	lru_push(shard, entry);
+	shard->entries++;
+
+	lock_give(&shard->lock);
+
+	if (freed != 0) {
+		cache_release(cache, freed);
+	}
+
+	cache_evict(cache);
+
+	return 0;
+}
+
+int sd_render_cache_render(struct buf* ob, const uint8_t* document, size_t doc_size, struct sd_markdown* md, unsigned int render_flags, sd_render_hook render_hook, struct sd_render_cache* cache)
+{
+	struct sd_render_key key;
+
+	if (sd_markdown_render_key(&key, document, doc_size, md, render_flags, render_hook) != 0) {
+		return sd_markdown_render(ob, document, doc_size, md);
+	}
+
+	if (sd_render_cache_get(cache, &key, document, ob) != 0) {
+		return 0;
+	}
+
+	/* renderers look at what precedes a block, the document is rendered on its own as on a hit */
+	struct buf* work = ob;
+
+	if ((ob->size != 0) && ((work = bufnew(256)) == NULL)) {
+		return sd_markdown_render(ob, document, doc_size, md);
+	}
+
+	bufsetgrowth(work, ob->growth, ob->max_size);
+
+	size_t start = ob->size;
+	int status = sd_markdown_render(work, document, doc_size, md);
+
+	if (work != ob) {
+		bufput(ob, work->data, work->size);
+		bufrelease(work);
+	}
+
+	if (status == 0) {
+		sd_render_cache_put(cache, &key, document, ob->data + start, ob->size - start);
+	}
+
+	return status;
+}
+
+void sd_render_cache_stats(struct sd_render_cache* cache, struct sd_render_cache_stats* stats)
+{
+	memset(stats, 0x00, sizeof(struct sd_render_cache_stats));
+
+	for (size_t i = 0; i < CACHE_SHARDS; ++i) {
+		struct cache_shard* shard = &cache->shards[i];
+
+		lock_take(&shard->lock);
+		stats->hits += shard->hits;
+		stats->misses += shard->misses;
+		stats->evictions += shard->evictions;
+		stats->entries += shard->entries;
+		lock_give(&shard->lock);
+	}
+
+	lock_take(&cache->lock);
+	stats->bytes = cache->bytes;
+	lock_give(&cache->lock);
+}
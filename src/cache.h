@@ -0,0 +1,66 @@
+#ifndef CACHE_H__
+#define CACHE_H__
+
+#include "markdown.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct sd_render_cache;
+
+/**
+ * counters of a cache, summed over its shards
+ */
+struct sd_render_cache_stats
+{
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+
+	/* what the cache holds, sources and outputs included */
+	size_t entries;
+	size_t bytes;
+};
+
+/**
+ * creates a cache of rendered documents holding up to max_bytes, sources
+ * and outputs included, evicting the least recently used ones first; any
+ * document fitting in max_bytes on its own may be cached. Any number of
+ * threads may share it
+ */
+struct sd_render_cache* sd_render_cache_new(size_t max_bytes);
+
+void sd_render_cache_free(struct sd_render_cache*);
+
+/**
+ * appends to ob the output cached for document under key, returns 1 when
+ * found and 0 otherwise
+ */
+int sd_render_cache_get(struct sd_render_cache*, const struct sd_render_key* key, const uint8_t* document, struct buf* ob);
+
+/**
+ * caches the output of document under key, replacing what it held;
+ * returns 0 on success, -1 when out of memory or when the source and
+ * output together do not fit in the max_bytes of the cache
+ */
+int sd_render_cache_put(struct sd_render_cache*, const struct sd_render_key* key, const uint8_t* document, const uint8_t* output, size_t out_size);
+
+/**
+ * renders like sd_markdown_render through the cache, render_flags and
+ * render_hook being those the renderer of md was set up with, as for
+ * sd_markdown_render_key. The document is rendered on its own and then
+ * appended to ob, as by sd_markdown_render_batch, so that a hit writes
+ * the same whatever ob already holds. Only the output is cached: on a
+ * hit, the callbacks are not called and the renderer state is left as
+ * it is
+ */
+int sd_render_cache_render(struct buf* ob, const uint8_t* document, size_t doc_size, struct sd_markdown* md, unsigned int render_flags, sd_render_hook render_hook, struct sd_render_cache*);
+
+void sd_render_cache_stats(struct sd_render_cache*, struct sd_render_cache_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -19,21 +19,63 @@
 
 #include "markdown.h"
 #include "stack.h"
+#include "scan.h"
 
 #include <assert.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <time.h>
 
 #if defined(_WIN32)
+#include <windows.h>
 #define strncasecmp _strnicmp
+#else
+#include <pthread.h>
 #endif
 
-#define REF_TABLE_SIZE 8
+/* inline triggers between two looks at the clock of a budget */
+#define BUDGET_CLOCK_STEP 64
+
+/* first prefix rendered for a renderer stopping early, and its growth between attempts */
+#define PREFIX_MIN 4096
+#define PREFIX_GROWTH 8
+
+#ifdef SD_STATS
+#define STATS_ADD(md, field, n) do { if ((md)->stats != NULL) { (md)->stats->field += (n); } } while (0)
+#define STATS_MAX(md, field, n) do { if (((md)->stats != NULL) && ((md)->stats->field < (n))) { (md)->stats->field = (n); } } while (0)
+#define STATS_BLOCK(md, type) ((md)->stats_block = (type))
+#else
+#define STATS_ADD(md, field, n) ((void) 0)
+#define STATS_MAX(md, field, n) ((void) 0)
+#define STATS_BLOCK(md, type) ((void) 0)
+#endif
+
+/* smallest size of the link reference table */
+#define REF_TABLE_MIN 8
 
 #define BUFFER_BLOCK 0
 #define BUFFER_SPAN 1
 
+/* scratch of the emphasis parsers, not counted in the nesting */
+#define BUFFER_MEMO 2
+
+/* output pre-grown for x bytes of markdown */
+#define MARKDOWN_GROW(x) ((x) + ((x) >> 1))
+
+/* columns of a table whose alignments are kept on the stack */
+#define TABLE_COLUMNS_INLINE 32
+
+/* hash values of find_block_tag, and the longest block tag name */
+#define BLOCK_TAG_KEYS 38
+#define BLOCK_TAG_MAX 10
+
+/* distance an HTML block scans for its closing tag before using the index */
+#define HTML_SCAN_MAX 1024
+
+/* smallest chunk of text worth rendering on its own thread */
+#define PARALLEL_CHUNK_MIN 16384
+
 /* internal list flag */
 #define MKD_LI_END 8
 
@@ -46,17 +88,46 @@
  * LOCAL TYPES *
  ***************/
 
+/**
+ * case-folded name of a link reference or footnote
+ */
+struct ref_key
+{
+	unsigned int id;
+
+	uint8_t* data;
+	size_t size;
+
+	/* references found by the first pass, latest first */
+	struct ref_key* next;
+};
+
+/**
+ * open-addressing index of the references of a kind
+ */
+struct ref_table
+{
+	/* mask + 1 slots, or NULL when there are no references */
+	struct ref_key** slots;
+	size_t mask;
+
+	struct ref_key* list;
+	size_t count;
+
+	/* storage of slots, kept across renders */
+	struct ref_key** storage;
+	size_t storage_size;
+};
+
 /**
  * reference to a link
  */
 struct link_ref
 {
-	unsigned int id;
+	struct ref_key key;
 
 	struct buf* link;
 	struct buf* title;
-
-	struct link_ref* next;
 };
 
 /**
@@ -64,7 +135,7 @@ struct link_ref
  */
 struct footnote_ref
 {
-	unsigned int id;
+	struct ref_key key;
 
 	int is_used;
 	unsigned int num;
@@ -73,22 +144,78 @@ struct footnote_ref
 };
 
 /**
- * an item in a footnote_list
+ * closer searches of the emphasis parsers in the span of a parse_inline:
+ * a search finding no closer marks the positions it went through, and
+ * a later search from another opener stops when reaching one of them
+ */
+struct emph_memo
+{
+	uint8_t* begin;
+	uint8_t* end;
+
+	/* bit per search kind and emphasis char at each position, or NULL */
+	uint16_t* failed;
+};
+
+/**
+ * a closer search of parse_emph1, 2 or 3
+ */
+struct emph_scan
+{
+	/* failed bits from the start of the search, NULL when not memoized */
+	uint16_t* failed;
+	uint16_t bit;
+
+	/* positions the search went through */
+	struct buf* trail;
+};
+
+/**
+ * closing block tag which can end an HTML block, the rest of its line being blank
+ */
+struct close_tag
+{
+	/* offsets in the indexed text of the tag and of the end of its block */
+	size_t pos;
+	size_t end;
+
+	/* first tag from this one with the same name which starts a line */
+	size_t sol_next;
+
+	unsigned int key;
+	int line_start;
+};
+
+/**
+ * closing block tags of the text being parsed, by name and position, built on first use
  */
-struct footnote_item
+struct close_index
 {
-	struct footnote_ref* ref_;
-	struct footnote_item* next;
+	/* text indexed, end being NULL when there is none */
+	const uint8_t* begin;
+	const uint8_t* end;
+	int built;
+
+	/* the tags grouped by name in text order, those of key k starting at first[k] */
+	struct close_tag* tags;
+	struct close_tag* scratch;
+	size_t asize;
+	size_t first[BLOCK_TAG_KEYS + 1];
 };
 
 /**
- * linked list of footnote_item
+ * a node being built by sd_markdown_render_nodes
  */
-struct footnote_list
+struct node_slot
 {
-	unsigned int count;
-	struct footnote_item* head;
-	struct footnote_item* tail;
+	/* buffer its container collects it from */
+	const struct buf* ob;
+
+	/* previous node still waiting for its container, one-based */
+	size_t prev;
+
+	/* index in document order, once all the nodes are built */
+	size_t order;
 };
 
 /**
@@ -145,21 +272,118 @@ static char_trigger markdown_char_ptrs[] =
 };
 
 /**
- * structure containing one particular render
+ * compiled parser configuration, shared read-only by renders
  */
-struct sd_markdown
+struct sd_markdown_config
 {
 	struct sd_callbacks cb;
-	void* opaque;
-
-	struct link_ref* refs[REF_TABLE_SIZE];
-	struct footnote_list footnotes_found;
-	struct footnote_list footnotes_used;
 	uint8_t active_char[256];
-	struct stack work_bufs[2];
 	unsigned int ext_flags;
 	size_t max_nesting;
+
+	/* active chars, and line ends and tabs for the first pass */
+	struct sd_charset active_set;
+	struct sd_charset line_set;
+
+	/* hash of the callback addresses, for struct sd_render_key */
+	uint64_t callbacks_hash;
+};
+
+/**
+ * structure containing one particular render
+ */
+struct sd_markdown
+{
+	const struct sd_markdown_config* cfg;
+	void* opaque;
+
+	struct ref_table refs;
+	struct ref_table footnotes_found;
+
+	/* footnotes in order of first use */
+	struct stack footnotes_used;
+	struct stack work_bufs[3];
 	int in_link_body;
+
+	/* memo of the innermost parse_inline */
+	struct emph_memo* emph_memo;
+
+	/* configuration allocated by sd_markdown_new */
+	struct sd_markdown_config* own_cfg;
+
+	/* growth policy of the work buffers, inherited from the output */
+	unsigned int buf_growth;
+	size_t buf_max_size;
+
+	/* storage of the references, released at the end of each render */
+	struct sd_arena arena;
+	struct sd_arena* ref_arena;
+
+	/* caller's document when parsed in place, never to be written to */
+	const uint8_t* ro_begin;
+	const uint8_t* ro_end;
+	struct buf* ro_copy;
+
+	/* closing tags for the HTML blocks running to the end of the text */
+	struct close_index close;
+
+	/* working copy of the documents which cannot be parsed in place, kept warm */
+	struct buf* text;
+
+	/* output of a document of sd_markdown_render_batch, before it joins the batch */
+	struct buf* batch_ob;
+
+	/* output sink of sd_markdown_render_stream, stream_ob is NULL otherwise */
+	struct buf* stream_ob;
+	sd_write_cb stream_write;
+	void* stream_opaque;
+	int stream_status;
+
+	/* incremental rendering: session cache and what its blocks depend on */
+	struct sd_markdown_session* session;
+	struct buf* ref_log;
+	int used_footnote;
+
+	/* node output: the nodes being built, and the last one waiting for its container */
+	struct sd_nodes* nodes;
+	struct node_slot* node_slots;
+	size_t node_slots_size;
+	size_t node_top;
+	int node_status;
+
+	/* parallel rendering: contexts of the worker threads, and the threads kept between renders */
+	unsigned int threads;
+	struct sd_markdown** workers;
+	size_t worker_count;
+	struct render_pool* pool;
+
+	/* state of a worker context */
+	int is_worker;
+	int fork_conflict;
+	int scan_only;
+
+	/* bufgrow failures of the render that were made up for, and are no error */
+	size_t spared_failures;
+
+	/* work budget: limits, what is left of them in this render, and whether they ran out */
+	struct sd_budget budget;
+	int has_budget;
+	const struct buf* budget_ob;
+	size_t budget_base;
+	size_t budget_flushed;
+	size_t budget_triggers;
+	uint64_t deadline;
+	int budget_out;
+
+	/* rendering from a prefix of the document, and whether its output may differ from the whole one's */
+	int prefix_cut;
+	int prefix_unsafe;
+
+#ifdef SD_STATS
+	/* instrumentation, and the type of the block being parsed */
+	struct sd_stats* stats;
+	int stats_block;
+#endif
 };
 
 /* **************************
@@ -168,7 +392,7 @@ struct sd_markdown
 
 static inline struct buf* rndr_newbuf(struct sd_markdown* rndr, int type)
 {
-	static const size_t buf_size[2] = {256, 64};
+	static const size_t buf_size[3] = {256, 64, 256};
 	struct buf* work = NULL;
 	struct stack* pool = &rndr->work_bufs[type];
 
@@ -176,7 +400,8 @@ static inline struct buf* rndr_newbuf(struct sd_markdown* rndr, int type)
 		work = pool->item[pool->size++];
 		work->size = 0;
 	} else {
-		work = bufnew(buf_size[type]);
+		/* a first unit inline, most spans and blocks fitting in it */
+		work = bufnew_inline(buf_size[type], buf_size[type]);
 
 		if (work == NULL) {
 			return NULL;
@@ -189,6 +414,14 @@ static inline struct buf* rndr_newbuf(struct sd_markdown* rndr, int type)
 		}
 	}
 
+	if (type == BUFFER_BLOCK) {
+		STATS_MAX(rndr, block_bufs_max, pool->size);
+	} else if (type == BUFFER_SPAN) {
+		STATS_MAX(rndr, span_bufs_max, pool->size);
+	}
+
+	bufsetgrowth(work, rndr->buf_growth, rndr->buf_max_size);
+
 	return work;
 }
 
@@ -197,6 +430,117 @@ static inline void rndr_popbuf(struct sd_markdown* rndr, int type)
 	rndr->work_bufs[type].size--;
 }
 
+/**
+ * monotonic wall clock in nanoseconds
+ */
+static uint64_t rndr_clock(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER count;
+	LARGE_INTEGER frequency;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+
+	/* whole seconds apart, so that the product does not overflow */
+	uint64_t ticks = (uint64_t) count.QuadPart;
+	uint64_t hz = (uint64_t) frequency.QuadPart;
+
+	return ((ticks / hz) * 1000000000) + (((ticks % hz) * 1000000000) / hz);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000000) + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+/**
+ * checks the output written so far into ob, and the clock when asked to,
+ * against the budget; returns non-zero once it has run out
+ */
+static int rndr_overbudget(struct sd_markdown* rndr, const struct buf* ob, int check_clock)
+{
+	size_t out = ob->size;
+
+	/* the output of the render itself starts after what ob held, and includes what was streamed */
+	if (ob == rndr->budget_ob) {
+		out = out + rndr->budget_flushed - rndr->budget_base;
+	}
+
+	if ((rndr->budget.max_output != 0) && (out > rndr->budget.max_output)) {
+		rndr->budget_out = 1;
+	}
+
+	if ((check_clock != 0) && (rndr->budget.max_time != 0) && (rndr_clock() > rndr->deadline)) {
+		rndr->budget_out = 1;
+	}
+
+	if ((rndr->cfg->cb.done != NULL) && (rndr->cfg->cb.done(rndr->opaque) != 0)) {
+		rndr->budget_out = 1;
+	}
+
+	return rndr->budget_out;
+}
+
+/**
+ * charges one call of an inline parser to the budget, returns non-zero once it has run out
+ */
+static int rndr_spend(struct sd_markdown* rndr, const struct buf* ob)
+{
+	rndr->budget_triggers++;
+
+	if ((rndr->budget.max_triggers != 0) && (rndr->budget_triggers > rndr->budget.max_triggers)) {
+		rndr->budget_out = 1;
+	}
+
+	return rndr_overbudget(rndr, ob, (rndr->budget_triggers % BUDGET_CLOCK_STEP) == 0);
+}
+
+/**
+ * writes out all but the last byte of the streamed output, which is kept
+ * so that renderers still see a non-empty buffer when separating blocks
+ */
+static int rndr_flush(struct sd_markdown* rndr, struct buf* ob)
+{
+	if (ob->size <= 1) {
+		return 0;
+	}
+
+	size_t size = ob->size - 1;
+
+	if (rndr->stream_write(ob->data, size, rndr->stream_opaque) != 0) {
+		rndr->stream_status = -1;
+
+		return -1;
+	}
+
+	rndr->budget_flushed += size;
+	STATS_ADD(rndr, bytes_out, size);
+
+	ob->data[0] = ob->data[size];
+	ob->size = 1;
+
+	return 0;
+}
+
+/**
+ * opens a container in place when the renderer can, returns whether it did
+ */
+static inline int rndr_open(struct sd_markdown* rndr, struct buf* ob, enum mkd_node type, int flags)
+{
+	return (rndr->cfg->cb.open != NULL) && (rndr->cfg->cb.open(ob, type, flags, rndr->opaque) != 0);
+}
+
+/**
+ * returns whether data lies in the read-only caller's document
+ */
+static inline int rndr_readonly(struct sd_markdown* rndr, const uint8_t* data)
+{
+	return (rndr->ro_begin != NULL) && (data >= rndr->ro_begin) && (data < rndr->ro_end);
+}
+
 static void unscape_text(struct buf* ob, struct buf* src)
 {
 	size_t i = 0;
@@ -221,136 +565,202 @@ static void unscape_text(struct buf* ob, struct buf* src)
 	}
 }
 
+static inline uint8_t fold_case(uint8_t c)
+{
+	return ((unsigned int) (c - 'A') < 26) ? (c | 0x20) : (c);
+}
+
 static unsigned int hash_link_ref(const uint8_t* link_ref, size_t length_)
 {
-	unsigned int hash = 0;
+	unsigned int hash = 2166136261U;
 
 	for (size_t i = 0; i < length_; ++i) {
-		hash = tolower(link_ref[i]) + (hash << 6) + (hash << 16) - hash;
+		hash = (hash ^ fold_case(link_ref[i])) * 16777619U;
 	}
 
 	return hash;
 }
 
-static struct link_ref* add_link_ref(struct link_ref** references, const uint8_t* name, size_t name_size)
+/**
+ * copies data into a read-only buffer living in the arena
+ */
+static struct buf* arena_bufdup(struct sd_arena* arena, const uint8_t* data, size_t size)
 {
-	struct link_ref* ref_ = calloc(1, sizeof(struct link_ref));
+	struct buf* buf = sd_arena_alloc(arena, sizeof(struct buf) + size);
 
-	if (ref_ == NULL) {
+	if (buf == NULL) {
 		return NULL;
 	}
 
-	ref_->id = hash_link_ref(name, name_size);
-	ref_->next = references[ref_->id % REF_TABLE_SIZE];
+	memset(buf, 0x00, sizeof(struct buf));
+	buf->data = (uint8_t*) (buf + 1);
+	buf->size = size;
+	buf->asize = size;
 
-	references[ref_->id % REF_TABLE_SIZE] = ref_;
+	if (size != 0) {
+		memcpy(buf->data, data, size);
+	}
 
-	return ref_;
+	return buf;
 }
 
-static struct link_ref* find_link_ref(struct link_ref** references, uint8_t* name, size_t length_)
+/**
+ * allocates a reference of ref_size bytes starting with its key, and
+ * records it for ref_table_build
+ */
+static void* ref_table_add(struct ref_table* table, struct sd_arena* arena, size_t ref_size, const uint8_t* name, size_t name_size)
 {
-	unsigned int hash = hash_link_ref(name, length_);
-	struct link_ref* ref_ = references[hash % REF_TABLE_SIZE];
+	struct ref_key* key = sd_arena_calloc(arena, ref_size + name_size);
 
-	while (ref_ != NULL) {
-		if (ref_->id == hash) {
-			return ref_;
-		}
+	if (key == NULL) {
+		return NULL;
+	}
+
+	key->id = hash_link_ref(name, name_size);
+	key->data = (uint8_t*) key + ref_size;
+	key->size = name_size;
 
-		ref_ = ref_->next;
+	for (size_t i = 0; i < name_size; ++i) {
+		key->data[i] = fold_case(name[i]);
 	}
 
-	return NULL;
+	key->next = table->list;
+	table->list = key;
+	table->count++;
+
+	return key;
 }
 
-static void free_link_refs(struct link_ref** references)
+static void ref_table_reset(struct ref_table* table)
 {
-	for (size_t i = 0; i < REF_TABLE_SIZE; ++i) {
-		struct link_ref* r = references[i];
+	table->slots = NULL;
+	table->mask = 0;
+	table->list = NULL;
+	table->count = 0;
+}
+
+static int ref_key_is(const struct ref_key* key, unsigned int hash, const uint8_t* name, size_t length_)
+{
+	if ((key->id != hash) || (key->size != length_)) {
+		return 0;
+	}
 
-		while (r != NULL) {
-			struct link_ref* next = r->next;
-			bufrelease(r->link);
-			bufrelease(r->title);
-			free(r);
-			r = next;
+	for (size_t i = 0; i < length_; ++i) {
+		if (key->data[i] != fold_case(name[i])) {
+			return 0;
 		}
 	}
+
+	return 1;
 }
 
-static struct footnote_ref* create_footnote_ref(struct footnote_list* list, const uint8_t* name, size_t name_size)
+/**
+ * indexes the references of the first pass, keeping the latest or the
+ * first definition of a name; returns 0 when out of memory
+ */
+static int ref_table_build(struct ref_table* table, int first_wins)
 {
-	struct footnote_ref* ref_ = calloc(1, sizeof(struct footnote_ref));
+	size_t size = REF_TABLE_MIN;
 
-	if (ref_ == NULL) {
-		return NULL;
+	if (table->count == 0) {
+		return 1;
 	}
 
-	ref_->id = hash_link_ref(name, name_size);
+	/* at most half full */
+	while (size < (table->count * 2)) {
+		size <<= 1;
+	}
 
-	return ref_;
-}
+	if (table->storage_size < size) {
+		struct ref_key** storage = realloc(table->storage, size * sizeof(void*));
 
-static int add_footnote_ref(struct footnote_list* list, struct footnote_ref* ref_)
-{
-	struct footnote_item* item = calloc(1, sizeof(struct footnote_item));
+		if (storage == NULL) {
+			return 0;
+		}
 
-	if (item == NULL) {
-		return 0;
+		table->storage = storage;
+		table->storage_size = size;
 	}
 
-	item->ref_ = ref_;
+	memset(table->storage, 0x00, size * sizeof(void*));
+	table->slots = table->storage;
+	table->mask = size - 1;
 
-	if (list->head == NULL) {
-		list->tail = item;
-		list->head = item;
-	} else {
-		list->tail->next = item;
-		list->tail = item;
-	}
+	/* the list is latest first: an earlier definition replaces a later one */
+	for (struct ref_key* key = table->list; key != NULL; key = key->next) {
+		size_t i = key->id & table->mask;
 
-	list->count++;
+		while ((table->slots[i] != NULL) && (ref_key_is(table->slots[i], key->id, key->data, key->size) == 0)) {
+			i = (i + 1) & table->mask;
+		}
+
+		if ((table->slots[i] == NULL) || (first_wins != 0)) {
+			table->slots[i] = key;
+		}
+	}
 
 	return 1;
 }
 
-static struct footnote_ref* find_footnote_ref(struct footnote_list* list, uint8_t* name, size_t length_)
+static void* ref_table_find(const struct ref_table* table, const uint8_t* name, size_t length_)
 {
+	if (table->slots == NULL) {
+		return NULL;
+	}
+
 	unsigned int hash = hash_link_ref(name, length_);
-	struct footnote_item* item = list->head;
+	size_t i = hash & table->mask;
 
-	while (item != NULL) {
-		if (item->ref_->id == hash) {
-			return item->ref_;
+	while (table->slots[i] != NULL) {
+		if (ref_key_is(table->slots[i], hash, name, length_) != 0) {
+			return table->slots[i];
 		}
 
-		item = item->next;
+		i = (i + 1) & table->mask;
 	}
 
 	return NULL;
 }
 
-static void free_footnote_ref(struct footnote_ref* ref_)
+/**
+ * appends a length-prefixed string to a reference log
+ */
+static void ref_log_put(struct buf* log, const uint8_t* data, size_t size)
 {
-	bufrelease(ref_->contents);
-	free(ref_);
+	bufput(log, &size, sizeof(size_t));
+
+	if (size != 0) {
+		bufput(log, data, size);
+	}
 }
 
-static void free_footnote_list(struct footnote_list* list, int free_refs)
+/**
+ * looks up a link reference, logging its resolution when rendering the
+ * block of a session
+ */
+static struct link_ref* rndr_findref(struct sd_markdown* rndr, const uint8_t* name, size_t size)
 {
-	struct footnote_item* item = list->head;
+	struct link_ref* lr = ref_table_find(&rndr->refs, name, size);
 
-	while (item != NULL) {
-		struct footnote_item* next = item->next;
+	/* a reference may be defined past the prefix */
+	rndr->prefix_unsafe = 1;
 
-		if (free_refs != 0) {
-			free_footnote_ref(item->ref_);
-		}
+	if (rndr->ref_log != NULL) {
+		ref_log_put(rndr->ref_log, name, size);
+		bufputc(rndr->ref_log, (lr != NULL));
 
-		free(item);
-		item = next;
+		if (lr != NULL) {
+			ref_log_put(rndr->ref_log, lr->link->data, lr->link->size);
+
+			if (lr->title != NULL) {
+				ref_log_put(rndr->ref_log, lr->title->data, lr->title->size);
+			} else {
+				ref_log_put(rndr->ref_log, NULL, 0);
+			}
+		}
 	}
+
+	return lr;
 }
 
 /**
@@ -369,454 +779,490 @@ static inline int _isspace(int c)
 	return (c == ' ') || (c == '\n');
 }
 
-/* ***************************
- * INLINE PARSING FUNCTIONS *
- ****************************/
+/* **************
+ * NODE OUTPUT *
+ ***************/
+
+/* where the attributes of a node wait for it */
+static const struct buf node_attrs = {NULL, 0, 0, 0, 0, 0};
 
 /**
- * looks for the address part of a mail autolink and '>'
+ * appends a node waiting for its container, covering the text from offset
  */
-/* this is less strict than the original markdown e-mail address matching */
-static size_t is_mail_autolink(uint8_t* data, size_t size)
+static void node_push(struct sd_markdown* md, const struct buf* ob, enum mkd_node type, unsigned int flags, size_t offset)
 {
-	/* address is assumed to be: [-@._a-zA-Z0-9]+ with exactly one '@' */
-	for (size_t i = 0, nb = 0; i < size; ++i) {
-		if (isalnum(data[i]) != 0) {
-			continue;
-		}
+	struct sd_nodes* nodes = md->nodes;
 
-		switch (data[i]) {
-			case '@':
-				nb++;
+	if (nodes->count == nodes->asize) {
+		size_t asize = (nodes->asize != 0) ? (nodes->asize * 2) : (256);
+		struct sd_node* grown = realloc(nodes->nodes, asize * sizeof(struct sd_node));
 
-				/* ToDo: FALLTHROUGH? */
+		if (grown == NULL) {
+			md->node_status = -1;
 
-			case '-':
-			case '.':
-			case '_':
-				break;
+			return;
+		}
 
-			case '>':
-				return (nb == 1) ? (i + 1) : (0);
+		nodes->nodes = grown;
+		nodes->asize = asize;
+	}
 
-			default:
-				return 0;
+	if (md->node_slots_size < nodes->asize) {
+		struct node_slot* slots = realloc(md->node_slots, nodes->asize * sizeof(struct node_slot));
+
+		if (slots == NULL) {
+			md->node_status = -1;
+
+			return;
 		}
+
+		md->node_slots = slots;
+		md->node_slots_size = nodes->asize;
 	}
 
-	return 0;
+	size_t n = nodes->count++;
+	struct sd_node* node = &nodes->nodes[n];
+
+	node->type = type;
+	node->flags = flags;
+	node->parent = SD_NODE_ROOT;
+	node->offset = offset;
+	node->size = nodes->text->size - offset;
+
+	md->node_slots[n].ob = ob;
+	md->node_slots[n].prev = md->node_top;
+	md->node_top = n + 1;
 }
 
 /**
- * returns the length of the given tag, or 0 is it's not valid
+ * appends a leaf, extending the previous one for runs of text
  */
-static size_t tag_length(uint8_t* data, size_t size, enum mkd_autolink* autolink)
+static void node_leaf(struct sd_markdown* md, const struct buf* ob, enum mkd_node type, unsigned int flags, const struct buf* text)
 {
-	/* a valid tag can't be shorter than 3 chars */
-	if (size < 3) {
-		return 0;
-	}
+	struct sd_nodes* nodes = md->nodes;
+	size_t offset = nodes->text->size;
+	size_t size = (text != NULL) ? (text->size) : (0);
 
-	/* begins with a '<' optionally followed by '/', followed by letter or number */
-	if (data[0] != '<') {
-		return 0;
-	}
+	if (size != 0) {
+		bufput(nodes->text, text->data, size);
 
-	size_t i = (data[1] == '/') ? (2) : (1);
+		if (nodes->text->size != (offset + size)) {
+			md->node_status = -1;
 
-	if (isalnum(data[i]) == 0) {
-		return 0;
+			return;
+		}
 	}
 
-	/* scheme test */
-	*autolink = MKDA_NOT_AUTOLINK;
+	size_t top = md->node_top;
 
-	/* try to find the beginning of an URI */
-	while ((i < size) && (isalnum(data[i] != 0) || (data[i] == '.') || (data[i] == '+') || (data[i] == '-'))) {
-		i++;
+	if ((type == MKDN_TEXT) && (top != 0) && (md->node_slots[top - 1].ob == ob) && (nodes->nodes[top - 1].type == MKDN_TEXT)) {
+		nodes->nodes[top - 1].size += size;
+
+		return;
 	}
 
-	if ((i > 1) && (data[i] == '@')) {
-		size_t j = is_mail_autolink(data + i, size - i);
+	node_push(md, ob, type, flags, offset);
+}
 
-		if (j != 0) {
-			*autolink = MKDA_EMAIL;
+static void node_attr(struct sd_markdown* md, enum mkd_node type, const struct buf* text)
+{
+	if (text != NULL) {
+		node_leaf(md, &node_attrs, type, 0, text);
+	}
+}
 
-			return i + j;
-		}
+/**
+ * makes the nodes waiting in from children of node n, returns the start of their text
+ */
+static size_t node_adopt(struct sd_markdown* md, const struct buf* from, size_t n, size_t offset)
+{
+	while ((from != NULL) && (md->node_top != 0) && (md->node_slots[md->node_top - 1].ob == from)) {
+		struct sd_node* child = &md->nodes->nodes[md->node_top - 1];
+
+		child->parent = n;
+		offset = child->offset;
+		md->node_top = md->node_slots[md->node_top - 1].prev;
 	}
 
-	if ((i > 2) && (data[i] == ':')) {
-		*autolink = MKDA_NORMAL;
-		i++;
-	}
-
-	/* completing autolink test: no whitespace or ' or " */
-	if (i >= size) {
-		*autolink = MKDA_NOT_AUTOLINK;
-	} else if (*autolink != MKDA_NOT_AUTOLINK) {
-		size_t j = i;
-
-		while (i < size) {
-			if (data[i] == '\\') {
-				i += 2;
-			} else if ((data[i] == '>') || (data[i] == '\'') || (data[i] == '"') || (data[i] == ' ') || (data[i] == '\n')) {
-				break;
-			} else {
-				i++;
-			}
-		}
-
-		if (i >= size) {
-			return 0;
-		}
-
-		if ((i > j) && (data[i] == '>')) {
-			return i + 1;
-		}
-
-		/* one of the forbidden chars has been found */
-		*autolink = MKDA_NOT_AUTOLINK;
-	}
+	return offset;
+}
 
-	/* looking for sometinhg looking like a tag end */
-	while ((i < size) && (data[i] != '>')) {
-		i++;
-	}
+/**
+ * appends a container, with the attributes and the nodes rendered into
+ * children and, for tables, more as children
+ */
+static void node_close(struct sd_markdown* md, const struct buf* ob, enum mkd_node type, unsigned int flags, const struct buf* children, const struct buf* more)
+{
+	size_t n = md->nodes->count;
+	size_t offset = md->nodes->text->size;
 
-	if (i >= size) {
-		return 0;
-	}
+	/* from the last rendered */
+	offset = node_adopt(md, &node_attrs, n, offset);
+	offset = node_adopt(md, more, n, offset);
+	offset = node_adopt(md, children, n, offset);
 
-	return i + 1;
+	node_push(md, ob, type, flags, offset);
 }
 
 /**
- * parses inline markdown elements
+ * moves the nodes, built children first, into document order
  */
-static void parse_inline(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
+static void node_reorder(struct sd_markdown* md)
 {
-	if ((rndr->work_bufs[BUFFER_SPAN].size + rndr->work_bufs[BUFFER_BLOCK].size) > rndr->max_nesting) {
-		return;
-	}
+	struct sd_node* nodes = md->nodes->nodes;
+	struct node_slot* slots = md->node_slots;
+	size_t count = md->nodes->count;
 
-	size_t i = 0;
-	size_t end = 0;
-	uint8_t action = 0;
-	struct buf work = {NULL, 0, 0, 0};
+	/* sizes of the subtrees, in prev */
+	for (size_t i = 0; i < count; ++i) {
+		slots[i].prev = 1;
+	}
 
-	while (i < size) {
-		/* copying inactive chars into the output */
-		while ((end < size) && ((action = rndr->active_char[data[end]]) == 0)) {
-			end++;
+	for (size_t i = 0; i < count; ++i) {
+		if (nodes[i].parent != SD_NODE_ROOT) {
+			slots[nodes[i].parent].prev += slots[i].prev;
 		}
+	}
 
-		if (rndr->cb.normal_text != NULL) {
-			work.data = data + i;
-			work.size = end - i;
-			rndr->cb.normal_text(ob, &work, rndr->opaque);
-		} else {
-			bufput(ob, data + i, end - i);
-		}
+	/* placing the last child at the end of its parent's subtree, prev becoming where the previous one ends */
+	size_t end = count;
 
-		if (end >= size) {
-			break;
-		}
+	for (size_t i = count; i > 0; --i) {
+		size_t parent = nodes[i - 1].parent;
+		size_t* parent_end = (parent != SD_NODE_ROOT) ? (&slots[parent].prev) : (&end);
 
-		i = end;
+		slots[i - 1].order = *parent_end - slots[i - 1].prev;
+		*parent_end = slots[i - 1].order;
+		slots[i - 1].prev = slots[i - 1].order + slots[i - 1].prev;
+	}
 
-		end = markdown_char_ptrs[(int) action](ob, rndr, data + i, i, size - i);
+	for (size_t i = 0; i < count; ++i) {
+		if (nodes[i].parent != SD_NODE_ROOT) {
+			nodes[i].parent = slots[nodes[i].parent].order;
+		}
+	}
 
-		if (end == 0) { /* no action from the callback */
-			end = i + 1;
-		} else {
-			i += end;
-			end = i;
+	/* permuting along the cycles */
+	for (size_t i = 0; i < count; ++i) {
+		while (slots[i].order != i) {
+			size_t j = slots[i].order;
+			struct sd_node node = nodes[j];
+
+			nodes[j] = nodes[i];
+			nodes[i] = node;
+			slots[i].order = slots[j].order;
+			slots[j].order = j;
 		}
 	}
 }
 
 /**
- * looks for the next emph uint8_t, skipping other constructs
+ * the plain text ending ob, of which the inline parser may take back a few bytes
  */
-static size_t find_emph_char(uint8_t* data, size_t size, uint8_t c)
+static size_t rndr_tail(struct sd_markdown* rndr, struct buf* ob, const uint8_t** tail)
 {
-	size_t i = 1;
+	if (rndr->nodes == NULL) {
+		*tail = ob->data;
 
-	while (i < size) {
-		while ((i < size) && (data[i] != c) && (data[i] != '`') && (data[i] != '[')) {
-			i++;
-		}
+		return ob->size;
+	}
 
-		if (i == size) {
-			return 0;
-		}
+	size_t top = rndr->node_top;
 
-		if (data[i] == c) {
-			return i;
-		}
+	if ((top == 0) || (rndr->node_slots[top - 1].ob != ob) || (rndr->nodes->nodes[top - 1].type != MKDN_TEXT)) {
+		*tail = NULL;
 
-		/* not counting escaped chars */
-		if ((i != 0) && (data[i - 1] == '\\')) {
-			i++;
+		return 0;
+	}
 
-			continue;
-		}
+	*tail = rndr->nodes->text->data + rndr->nodes->nodes[top - 1].offset;
 
-		if (data[i] == '`') {
-			size_t span_nb = 0;
+	return rndr->nodes->nodes[top - 1].size;
+}
 
-			/* counting the number of opening backticks */
-			while ((i < size) && (data[i] == '`')) {
-				i++;
-				span_nb++;
-			}
+static void rndr_untail(struct sd_markdown* rndr, struct buf* ob, size_t size)
+{
+	if (rndr->nodes == NULL) {
+		ob->size -= size;
 
-			if (i >= size) {
-				return 0;
-			}
+		return;
+	}
 
-			/* finding the matching closing sequence */
-			size_t bt = 0;
-			size_t tmp_i = 0;
+	const uint8_t* tail;
+	size_t tail_size = rndr_tail(rndr, ob, &tail);
 
-			while ((i < size) && (bt < span_nb)) {
-				if ((tmp_i == 0) && (data[i] == c)) {
-					tmp_i = i;
-				}
+	if (size > tail_size) {
+		size = tail_size;
+	}
 
-				if (data[i] == '`') {
-					bt++;
-				} else {
-					bt = 0;
-				}
+	if (size == 0) {
+		return;
+	}
 
-				i++;
-			}
+	/* the last node, ending the text */
+	struct sd_node* node = &rndr->nodes->nodes[rndr->node_top - 1];
 
-			if (i >= size) {
-				return tmp_i;
-			}
-		} else if (data[i] == '[') {
-			/* skipping a link */
+	node->size -= size;
+	rndr->nodes->text->size -= size;
 
-			size_t tmp_i = 0;
+	if (node->size == 0) {
+		rndr->nodes->count--;
+		rndr->node_top = rndr->node_slots[rndr->node_top - 1].prev;
+	}
+}
 
-			i++;
+/*
+ * callbacks recording the nodes, with the parser as opaque
+ */
 
-			while ((i < size) && (data[i] != ']')) {
-				if ((tmp_i == 0) && (data[i] == c)) {
-					tmp_i = i;
-				}
+static void node_blockcode(struct buf* ob, const struct buf* text, const struct buf* lang, void* opaque)
+{
+	node_attr(opaque, MKDN_LANG, lang);
+	node_attr(opaque, MKDN_TEXT, text);
+	node_close(opaque, ob, MKDN_BLOCKCODE, 0, NULL, NULL);
+}
 
-				i++;
-			}
+static void node_blockquote(struct buf* ob, const struct buf* text, void* opaque)
+{
+	node_close(opaque, ob, MKDN_BLOCKQUOTE, 0, text, NULL);
+}
 
-			i++;
+static void node_blockhtml(struct buf* ob, const struct buf* text, void* opaque)
+{
+	node_leaf(opaque, ob, MKDN_BLOCKHTML, 0, text);
+}
 
-			while ((i < size) && ((data[i] == ' ') || (data[i] == '\n'))) {
-				i++;
-			}
+static void node_header(struct buf* ob, const struct buf* text, int level, void* opaque)
+{
+	node_close(opaque, ob, MKDN_HEADER, (unsigned int) level, text, NULL);
+}
 
-			if (i >= size) {
-				return tmp_i;
-			}
+static void node_hrule(struct buf* ob, void* opaque)
+{
+	node_leaf(opaque, ob, MKDN_HRULE, 0, NULL);
+}
 
-			uint8_t cc;
+static void node_list(struct buf* ob, const struct buf* text, int flags, void* opaque)
+{
+	node_close(opaque, ob, MKDN_LIST, (unsigned int) flags, text, NULL);
+}
 
-			switch (data[i]) {
-				case '[':
-					cc = ']';
+static void node_listitem(struct buf* ob, const struct buf* text, int flags, void* opaque)
+{
+	node_close(opaque, ob, MKDN_LISTITEM, (unsigned int) flags, text, NULL);
+}
 
-					break;
+static void node_paragraph(struct buf* ob, const struct buf* text, void* opaque)
+{
+	node_close(opaque, ob, MKDN_PARAGRAPH, 0, text, NULL);
+}
 
-				case '(':
-					cc = ')';
+static void node_table(struct buf* ob, const struct buf* header, const struct buf* body, void* opaque)
+{
+	node_close(opaque, ob, MKDN_TABLE, 0, header, body);
+}
 
-					break;
+static void node_table_row(struct buf* ob, const struct buf* text, void* opaque)
+{
+	node_close(opaque, ob, MKDN_TABLE_ROW, 0, text, NULL);
+}
 
-				default:
-					if (tmp_i != 0) {
-						return tmp_i;
-					} else {
-						continue;
-					}
-			}
+static void node_table_cell(struct buf* ob, const struct buf* text, int flags, void* opaque)
+{
+	node_close(opaque, ob, MKDN_TABLE_CELL, (unsigned int) flags, text, NULL);
+}
 
-			i++;
+static void node_footnotes(struct buf* ob, const struct buf* text, void* opaque)
+{
+	node_close(opaque, ob, MKDN_FOOTNOTES, 0, text, NULL);
+}
 
-			while ((i < size) && (data[i] != cc)) {
-				if ((tmp_i == 0) && (data[i] == c)) {
-					tmp_i = i;
-				}
+static void node_footnote_def(struct buf* ob, const struct buf* text, unsigned int num, void* opaque)
+{
+	node_close(opaque, ob, MKDN_FOOTNOTE_DEF, num, text, NULL);
+}
 
-				i++;
-			}
+static int node_autolink(struct buf* ob, const struct buf* link, enum mkd_autolink type, void* opaque)
+{
+	node_attr(opaque, MKDN_URL, link);
+	node_close(opaque, ob, MKDN_AUTOLINK, (unsigned int) type, NULL, NULL);
 
-			if (i >= size) {
-				return tmp_i;
-			}
+	return 1;
+}
 
-			i++;
-		}
-	}
+static int node_codespan(struct buf* ob, const struct buf* text, void* opaque)
+{
+	node_leaf(opaque, ob, MKDN_CODESPAN, 0, text);
 
-	return 0;
+	return 1;
 }
 
-/**
- * parsing single emphase
- */
-/* closed by a symbol not preceded by whitespace and not followed by symbol */
-static size_t parse_emph1(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size, uint8_t c)
+static int node_double_emphasis(struct buf* ob, const struct buf* text, void* opaque)
 {
-	if (rndr->cb.emphasis == NULL) {
-		return 0;
-	}
+	node_close(opaque, ob, MKDN_DOUBLE_EMPHASIS, 0, text, NULL);
 
-	size_t i = 0;
+	return 1;
+}
 
-	/* skipping one symbol if coming from emph3 */
-	if ((size > 1) && (data[0] == c) && (data[1] == c)) {
-		i = 1;
-	}
+static int node_emphasis(struct buf* ob, const struct buf* text, void* opaque)
+{
+	node_close(opaque, ob, MKDN_EMPHASIS, 0, text, NULL);
 
-	while (i < size) {
-		size_t len = find_emph_char(data + i, size - i, c);
+	return 1;
+}
 
-		if (len == 0) {
-			return 0;
-		}
+static int node_image(struct buf* ob, const struct buf* link, const struct buf* title, const struct buf* alt, void* opaque)
+{
+	node_attr(opaque, MKDN_URL, link);
+	node_attr(opaque, MKDN_TITLE, title);
+	node_attr(opaque, MKDN_TEXT, alt);
+	node_close(opaque, ob, MKDN_IMAGE, 0, NULL, NULL);
 
-		i += len;
+	return 1;
+}
 
-		if (i >= size) {
-			return 0;
-		}
+static int node_linebreak(struct buf* ob, void* opaque)
+{
+	node_leaf(opaque, ob, MKDN_LINEBREAK, 0, NULL);
 
-		if ((data[i] == c) && (_isspace(data[i - 1]) == 0)) {
-			if (rndr->ext_flags & MKDEXT_NO_INTRA_EMPHASIS) {
-				if (((i + 1) < size) && (isalnum(data[i + 1]) != 0)) {
-					continue;
-				}
-			}
+	return 1;
+}
 
-			struct buf* work = rndr_newbuf(rndr, BUFFER_SPAN);
+static int node_link(struct buf* ob, const struct buf* link, const struct buf* title, const struct buf* content, void* opaque)
+{
+	node_attr(opaque, MKDN_URL, link);
+	node_attr(opaque, MKDN_TITLE, title);
+	node_close(opaque, ob, MKDN_LINK, 0, content, NULL);
 
-			if (work == NULL) {
-				return 0;
-			}
+	return 1;
+}
 
-			parse_inline(work, rndr, data, i);
-			int r = rndr->cb.emphasis(ob, work, rndr->opaque);
-			rndr_popbuf(rndr, BUFFER_SPAN);
+static int node_raw_html_tag(struct buf* ob, const struct buf* tag, void* opaque)
+{
+	node_leaf(opaque, ob, MKDN_RAW_HTML_TAG, 0, tag);
 
-			return (r != 0) ? (i + 1) : (0);
-		}
-	}
-
-	return 0;
+	return 1;
 }
 
-/**
- * parsing single emphase
- */
-static size_t parse_emph2(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size, uint8_t c)
+static int node_triple_emphasis(struct buf* ob, const struct buf* text, void* opaque)
 {
-	int (*render_method)(struct buf * ob, const struct buf * text, void* opaque);
-
-	render_method = (c == '~') ? (rndr->cb.strikethrough) : (rndr->cb.double_emphasis);
-	render_method = (c == '+') ? (rndr->cb.ins) : (render_method);
+	node_close(opaque, ob, MKDN_TRIPLE_EMPHASIS, 0, text, NULL);
 
-	if (render_method == NULL) {
-		return 0;
-	}
+	return 1;
+}
 
-	size_t i = 0;
+static int node_ins(struct buf* ob, const struct buf* text, void* opaque)
+{
+	node_close(opaque, ob, MKDN_INS, 0, text, NULL);
 
-	while (i < size) {
-		size_t len = find_emph_char(data + i, size - i, c);
+	return 1;
+}
 
-		if (len == 0) {
-			return 0;
-		}
+static int node_strikethrough(struct buf* ob, const struct buf* text, void* opaque)
+{
+	node_close(opaque, ob, MKDN_STRIKETHROUGH, 0, text, NULL);
 
-		i += len;
+	return 1;
+}
 
-		if (((i + 1) < size) && (data[i] == c) && (data[i + 1] == c) && (i != 0) && (_isspace(data[i - 1]) == 0)) {
-			struct buf* work = rndr_newbuf(rndr, BUFFER_SPAN);
+static int node_superscript(struct buf* ob, const struct buf* text, void* opaque)
+{
+	node_close(opaque, ob, MKDN_SUPERSCRIPT, 0, text, NULL);
 
-			if (work == NULL) {
-				return 0;
-			}
+	return 1;
+}
 
-			parse_inline(work, rndr, data, i);
-			int r = render_method(ob, work, rndr->opaque);
-			rndr_popbuf(rndr, BUFFER_SPAN);
+static int node_footnote_ref(struct buf* ob, unsigned int num, void* opaque)
+{
+	node_leaf(opaque, ob, MKDN_FOOTNOTE_REF, num, NULL);
 
-			return (r != 0) ? (i + 2) : (0);
-		}
+	return 1;
+}
 
-		i++;
-	}
+static void node_entity(struct buf* ob, const struct buf* entity, void* opaque)
+{
+	node_leaf(opaque, ob, MKDN_ENTITY, 0, entity);
+}
 
-	return 0;
+static void node_normal_text(struct buf* ob, const struct buf* text, void* opaque)
+{
+	node_leaf(opaque, ob, MKDN_TEXT, 0, text);
 }
 
 /**
- * parsing single emphase
+ * fills cb with the node callbacks: all the blocks, as blocks whose callback
+ * is NULL are still parsed, but only the spans and HTML blocks of org whose
+ * parsing depends on their callback
  */
-/* finds the first closing tag, and delegates to the other emph */
-static size_t parse_emph3(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size, uint8_t c)
+static void node_callbacks(struct sd_callbacks* cb, const struct sd_callbacks* org)
 {
-	size_t i = 0;
-
-	while (i < size) {
-		size_t len = find_emph_char(data + i, size - i, c);
-
-		if (len == 0) {
-			return 0;
-		}
+	memset(cb, 0x00, sizeof(struct sd_callbacks));
+
+	cb->blockcode = node_blockcode;
+	cb->blockquote = node_blockquote;
+	cb->blockhtml = (org->blockhtml != NULL) ? (node_blockhtml) : (NULL);
+	cb->header = node_header;
+	cb->hrule = node_hrule;
+	cb->list = node_list;
+	cb->listitem = node_listitem;
+	cb->paragraph = node_paragraph;
+	cb->table = node_table;
+	cb->table_row = node_table_row;
+	cb->table_cell = node_table_cell;
+	cb->footnotes = node_footnotes;
+	cb->footnote_def = node_footnote_def;
+
+	cb->autolink = (org->autolink != NULL) ? (node_autolink) : (NULL);
+	cb->codespan = (org->codespan != NULL) ? (node_codespan) : (NULL);
+	cb->double_emphasis = (org->double_emphasis != NULL) ? (node_double_emphasis) : (NULL);
+	cb->emphasis = (org->emphasis != NULL) ? (node_emphasis) : (NULL);
+	cb->image = (org->image != NULL) ? (node_image) : (NULL);
+	cb->linebreak = (org->linebreak != NULL) ? (node_linebreak) : (NULL);
+	cb->link = (org->link != NULL) ? (node_link) : (NULL);
+	cb->raw_html_tag = (org->raw_html_tag != NULL) ? (node_raw_html_tag) : (NULL);
+	cb->triple_emphasis = (org->triple_emphasis != NULL) ? (node_triple_emphasis) : (NULL);
+	cb->ins = (org->ins != NULL) ? (node_ins) : (NULL);
+	cb->strikethrough = (org->strikethrough != NULL) ? (node_strikethrough) : (NULL);
+	cb->superscript = (org->superscript != NULL) ? (node_superscript) : (NULL);
+	cb->footnote_ref = (org->footnote_ref != NULL) ? (node_footnote_ref) : (NULL);
+
+	/* the text is otherwise copied into the output */
+	cb->entity = node_entity;
+	cb->normal_text = node_normal_text;
+}
 
-		i += len;
+/* ***************************
+ * INLINE PARSING FUNCTIONS *
+ ****************************/
 
-		/* skip whitespace preceded symbols */
-		if ((data[i] != c) || (_isspace(data[i - 1]) != 0)) {
+/**
+ * looks for the address part of a mail autolink and '>'
+ */
+/* this is less strict than the original markdown e-mail address matching */
+static size_t is_mail_autolink(uint8_t* data, size_t size)
+{
+	/* address is assumed to be: [-@._a-zA-Z0-9]+ with exactly one '@' */
+	for (size_t i = 0, nb = 0; i < size; ++i) {
+		if (isalnum(data[i]) != 0) {
 			continue;
 		}
 
-		if (((i + 2) < size) && (data[i + 1] == c) && (data[i + 2] == c) && (rndr->cb.triple_emphasis != NULL)) {
-			/* triple symbol found */
-			struct buf* work = rndr_newbuf(rndr, BUFFER_SPAN);
-
-			if (work == NULL) {
-				return 0;
-			}
-
-			parse_inline(work, rndr, data, i);
-			int r = rndr->cb.triple_emphasis(ob, work, rndr->opaque);
-			rndr_popbuf(rndr, BUFFER_SPAN);
+		switch (data[i]) {
+			case '@':
+				nb++;
 
-			return (r != 0) ? (i + 3) : (0);
-		} else if (((i + 1) < size) && (data[i + 1] == c)) {
-			/* double symbol found, handing over to emph1 */
-			len = parse_emph1(ob, rndr, data - 2, size + 2, c);
+				/* ToDo: FALLTHROUGH? */
 
-			if (len == 0) {
-				return 0;
-			} else {
-				return len - 2;
-			}
+			case '-':
+			case '.':
+			case '_':
+				break;
 
-		} else {
-			/* single symbol found, handing over to emph2 */
-			len = parse_emph2(ob, rndr, data - 1, size + 1, c);
+			case '>':
+				return (nb == 1) ? (i + 1) : (0);
 
-			if (len == 0) {
+			default:
 				return 0;
-			} else {
-				return len - 1;
-			}
 		}
 	}
 
@@ -824,2780 +1270,5368 @@ static size_t parse_emph3(struct buf* ob, struct sd_markdown* rndr, uint8_t* dat
 }
 
 /**
- * single and double emphasis parsing
+ * returns the length of the given tag, or 0 is it's not valid
  */
-static size_t char_emphasis(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+static size_t tag_length(uint8_t* data, size_t size, enum mkd_autolink* autolink)
 {
-	if (rndr->ext_flags & MKDEXT_NO_INTRA_EMPHASIS) {
-		if ((offset > 0) && (_isspace(data[-1]) == 0) && (data[-1] != '>')) {
-			return 0;
-		}
+	/* a valid tag can't be shorter than 3 chars */
+	if (size < 3) {
+		return 0;
 	}
 
-	uint8_t c = data[0];
-	size_t ret;
+	/* begins with a '<' optionally followed by '/', followed by letter or number */
+	if (data[0] != '<') {
+		return 0;
+	}
 
-	if ((size > 2) && (data[1] != c)) {
-		/*
-		 * whitespace cannot follow an opening emphasis;
-		 * ins only takes two characters '++'
-		 * strikethrough only takes two characters '~~'
-		 */
-		if ((c == '+') || (c == '~') || (_isspace(data[1]) != 0)) {
-			return 0;
-		}
+	size_t i = (data[1] == '/') ? (2) : (1);
 
-		ret = parse_emph1(ob, rndr, data + 1, size - 1, c);
+	if (isalnum(data[i]) == 0) {
+		return 0;
+	}
 
-		if (ret == 0) {
-			return 0;
-		}
+	/* scheme test */
+	*autolink = MKDA_NOT_AUTOLINK;
 
-		return ret + 1;
+	/* try to find the beginning of an URI */
+	while ((i < size) && (isalnum(data[i] != 0) || (data[i] == '.') || (data[i] == '+') || (data[i] == '-'))) {
+		i++;
 	}
 
-	if ((size > 3) && (data[1] == c) && (data[2] != c)) {
-		if (_isspace(data[2]) != 0) {
-			return 0;
-		}
+	if ((i > 1) && (data[i] == '@')) {
+		size_t j = is_mail_autolink(data + i, size - i);
 
-		ret = parse_emph2(ob, rndr, data + 2, size - 2, c);
+		if (j != 0) {
+			*autolink = MKDA_EMAIL;
 
-		if (ret == 0) {
-			return 0;
+			return i + j;
 		}
+	}
 
-		return ret + 2;
+	if ((i > 2) && (data[i] == ':')) {
+		*autolink = MKDA_NORMAL;
+		i++;
 	}
 
-	if ((size > 4) && (data[1] == c) && (data[2] == c) && (data[3] != c)) {
-		if ((c == '+') || (c == '~') || (_isspace(data[3]) != 0)) {
-			return 0;
-		}
+	/* completing autolink test: no whitespace or ' or " */
+	if (i >= size) {
+		*autolink = MKDA_NOT_AUTOLINK;
+	} else if (*autolink != MKDA_NOT_AUTOLINK) {
+		size_t j = i;
 
-		ret = parse_emph3(ob, rndr, data + 3, size - 3, c);
+		while (i < size) {
+			if (data[i] == '\\') {
+				i += 2;
+			} else if ((data[i] == '>') || (data[i] == '\'') || (data[i] == '"') || (data[i] == ' ') || (data[i] == '\n')) {
+				break;
+			} else {
+				i++;
+			}
+		}
 
-		if (ret == 0) {
+		if (i >= size) {
 			return 0;
 		}
 
-		return ret + 3;
+		if ((i > j) && (data[i] == '>')) {
+			return i + 1;
+		}
+
+		/* one of the forbidden chars has been found */
+		*autolink = MKDA_NOT_AUTOLINK;
 	}
 
-	return 0;
+	/* looking for sometinhg looking like a tag end */
+	while ((i < size) && (data[i] != '>')) {
+		i++;
+	}
+
+	if (i >= size) {
+		return 0;
+	}
+
+	return i + 1;
 }
 
 /**
- * '\n' preceded by two spaces (assuming linebreak != 0)
+ * whether the autolink trigger at data[offset] is certain not to start a link,
+ * checking what the sd_autolink functions first reject on
  */
-static size_t char_linebreak(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+static inline int autolink_unlikely(uint8_t action, uint8_t* data, size_t offset, size_t size)
 {
-	if ((offset < 2) || (data[-1] != ' ') || (data[-2] != ' ')) {
-		return 0;
-	}
+	uint8_t* c = data + offset;
+	size_t left = size - offset;
 
-	/* removing the last space from ob and rendering */
-	while ((ob->size != 0) && (ob->data[ob->size - 1] == ' ')) {
-		ob->size--;
-	}
+	switch (action) {
+		case MD_CHAR_AUTOLINK_WWW:
+			return (left < 4) || (c[1] != 'w') || (c[2] != 'w') || (c[3] != '.') || ((offset > 0) && (ispunct(c[-1]) == 0) && (isspace(c[-1]) == 0));
+
+		case MD_CHAR_AUTOLINK_URL:
+			return (left < 4) || (c[1] != '/') || (c[2] != '/') || (offset == 0) || (isalpha(c[-1]) == 0);
 
-	return (rndr->cb.linebreak(ob, rndr->opaque)) ? (1) : (0);
+		case MD_CHAR_AUTOLINK_EMAIL:
+			return (offset == 0) || ((isalnum(c[-1]) == 0) && (strchr(".+-_", c[-1]) == NULL));
+
+		default:
+			return 0;
+	}
 }
 
 /**
- * '`' parsing a code span (assuming codespan != 0)
+ * returns the offset of the next "www." in data from offset, or size
  */
-static size_t char_codespan(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+static inline size_t find_www(uint8_t* data, size_t offset, size_t size)
 {
-	size_t nb = 0;
+	size_t i = offset + 3;
 
-	/* counting the number of backticks in the delimiter */
-	while ((nb < size) && (data[nb] == '`')) {
-		nb++;
-	}
-
-	/* finding the next delimiter */
-	size_t i = 0;
-	size_t end;
+	while (i < size) {
+		uint8_t* dot = memchr(data + i, '.', size - i);
 
-	for (end = nb; (end < size) && (i < nb); end++) {
-		if (data[end] == '`') {
-			i++;
-		} else {
-			i = 0;
+		if (dot == NULL) {
+			break;
 		}
-	}
 
-	if ((i < nb) && (end >= size)) {
-		/* no matching delimiter */
-		return 0;
-	}
+		i = dot - data;
 
-	/* trimming outside whitespaces */
-	size_t f_begin = nb;
+		if ((data[i - 1] == 'w') && (data[i - 2] == 'w') && (data[i - 3] == 'w')) {
+			return i - 3;
+		}
 
-	while ((f_begin < end) && (data[f_begin] == ' ')) {
-		f_begin++;
+		i++;
 	}
 
-	size_t f_end = end - nb;
-
-	while ((f_end > nb) && (data[f_end - 1] == ' ')) {
-		f_end--;
-	}
+	return size;
+}
+
+/**
+ * whether inline parsing renders nothing: scanning, out of budget or too deeply nested
+ */
+static inline int inline_blocked(struct sd_markdown* rndr)
+{
+	return ((rndr->scan_only != 0) || (rndr->budget_out != 0) || ((rndr->work_bufs[BUFFER_SPAN].size + rndr->work_bufs[BUFFER_BLOCK].size) > rndr->cfg->max_nesting));
+}
+
+/**
+ * parses inline markdown elements
+ */
+static void parse_inline(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
+{
+	if (inline_blocked(rndr) != 0) {
+		return;
+	}
+
+	size_t i = 0;
+	size_t end = 0;
+	uint8_t action = 0;
+	struct buf work = {NULL, 0, 0, 0};
+	struct emph_memo memo = {data, data + size, NULL};
+	struct emph_memo* outer_memo = rndr->emph_memo;
+
+	/* 'w' is left out of the active set, the text runs stopping at the next "www." instead */
+	size_t www = (rndr->cfg->ext_flags & MKDEXT_AUTOLINK) ? (find_www(data, 0, size)) : (size);
+
+	rndr->emph_memo = &memo;
+
+	while (i < size) {
+		/* copying inactive chars into the output, and the autolink triggers which cannot start one */
+		while (1) {
+			if (www < end) {
+				www = find_www(data, end, size);
+			}
+
+			end += sd_scan(&rndr->cfg->active_set, data + end, www - end);
+
+			if ((end >= size) || (autolink_unlikely(rndr->cfg->active_char[data[end]], data, end, size) == 0)) {
+				break;
+			}
+
+			end++;
+		}
+
+		if (end < size) {
+			action = rndr->cfg->active_char[data[end]];
+		}
+
+		if (rndr->cfg->cb.normal_text != NULL) {
+			work.data = data + i;
+			work.size = end - i;
+			rndr->cfg->cb.normal_text(ob, &work, rndr->opaque);
+		} else {
+			bufput(ob, data + i, end - i);
+		}
+
+		if (end >= size) {
+			break;
+		}
+
+		i = end;
+
+		if ((rndr->has_budget != 0) && (rndr_spend(rndr, ob) != 0)) {
+			break;
+		}
+
+		STATS_ADD(rndr, trigger_count[action - 1], 1);
+		end = markdown_char_ptrs[(int) action](ob, rndr, data + i, i, size - i);
+
+		if (end == 0) { /* no action from the callback */
+			end = i + 1;
+		} else {
+			i += end;
+			end = i;
+		}
+	}
+
+	if (memo.failed != NULL) {
+		rndr_popbuf(rndr, BUFFER_MEMO);
+	}
+
+	rndr->emph_memo = outer_memo;
+}
+
+/**
+ * looks for the next emph uint8_t, skipping other constructs
+ */
+static size_t find_emph_char(uint8_t* data, size_t size, uint8_t c)
+{
+	struct sd_charset set;
+
+	sd_charset_init(&set);
+	sd_charset_add(&set, c);
+	sd_charset_add(&set, '`');
+	sd_charset_add(&set, '[');
+
+	size_t i = 1;
+
+	while (i < size) {
+		i += sd_scan(&set, data + i, size - i);
+
+		if (i == size) {
+			return 0;
+		}
+
+		if (data[i] == c) {
+			return i;
+		}
+
+		/* not counting escaped chars */
+		if ((i != 0) && (data[i - 1] == '\\')) {
+			i++;
+
+			continue;
+		}
+
+		if (data[i] == '`') {
+			size_t span_nb = 0;
+
+			/* counting the number of opening backticks */
+			while ((i < size) && (data[i] == '`')) {
+				i++;
+				span_nb++;
+			}
+
+			if (i >= size) {
+				return 0;
+			}
+
+			/* finding the matching closing sequence */
+			size_t bt = 0;
+			size_t tmp_i = 0;
+
+			while ((i < size) && (bt < span_nb)) {
+				if ((tmp_i == 0) && (data[i] == c)) {
+					tmp_i = i;
+				}
+
+				if (data[i] == '`') {
+					bt++;
+				} else {
+					bt = 0;
+				}
+
+				i++;
+			}
+
+			if (i >= size) {
+				return tmp_i;
+			}
+		} else if (data[i] == '[') {
+			/* skipping a link */
+
+			size_t tmp_i = 0;
+
+			i++;
+
+			while ((i < size) && (data[i] != ']')) {
+				if ((tmp_i == 0) && (data[i] == c)) {
+					tmp_i = i;
+				}
+
+				i++;
+			}
+
+			i++;
+
+			while ((i < size) && ((data[i] == ' ') || (data[i] == '\n'))) {
+				i++;
+			}
+
+			if (i >= size) {
+				return tmp_i;
+			}
+
+			uint8_t cc;
+
+			switch (data[i]) {
+				case '[':
+					cc = ']';
+
+					break;
+
+				case '(':
+					cc = ')';
+
+					break;
+
+				default:
+					if (tmp_i != 0) {
+						return tmp_i;
+					} else {
+						continue;
+					}
+			}
+
+			i++;
+
+			while ((i < size) && (data[i] != cc)) {
+				if ((tmp_i == 0) && (data[i] == c)) {
+					tmp_i = i;
+				}
+
+				i++;
+			}
+
+			if (i >= size) {
+				return tmp_i;
+			}
+
+			i++;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * starts a closer search of parse_emph<kind> over data, which ends the
+ * span of the current parse_inline
+ */
+static void emph_scan_begin(struct emph_scan* scan, struct sd_markdown* rndr, uint8_t* data, size_t size, uint8_t c, int kind)
+{
+	struct emph_memo* memo = rndr->emph_memo;
+	size_t c_bit = (c == '*') ? (0) : ((c == '_') ? (1) : ((c == '~') ? (2) : (3)));
+
+	scan->failed = NULL;
+	scan->bit = (uint16_t) (1 << ((kind - 1) * 4 + c_bit));
+	scan->trail = NULL;
+
+	if ((memo == NULL) || (data < memo->begin) || ((data + size) != memo->end)) {
+		return;
+	}
+
+	if (memo->failed == NULL) {
+		size_t memo_size = (memo->end - memo->begin) * sizeof(uint16_t);
+		struct buf* failed = rndr_newbuf(rndr, BUFFER_MEMO);
+
+		if (failed == NULL) {
+			memo->end = NULL;
+
+			return;
+		}
+
+		/* the spans are then matched without the memo */
+		if (bufgrow(failed, memo_size) != BUF_OK) {
+			rndr->spared_failures++;
+			rndr_popbuf(rndr, BUFFER_MEMO);
+			memo->end = NULL;
+
+			return;
+		}
+
+		memset(failed->data, 0x00, memo_size);
+		memo->failed = (uint16_t*) failed->data;
+	}
+
+	if ((scan->trail = rndr_newbuf(rndr, BUFFER_MEMO)) == NULL) {
+		return;
+	}
+
+	scan->failed = memo->failed + (data - memo->begin);
+}
+
+/**
+ * whether a search reaching position i is known to find no closer
+ */
+static inline int emph_scan_failed(struct emph_scan* scan, size_t i)
+{
+	return (scan->failed != NULL) && ((scan->failed[i] & scan->bit) != 0);
+}
+
+static inline void emph_scan_visit(struct emph_scan* scan, size_t i)
+{
+	if (scan->failed != NULL) {
+		bufput(scan->trail, &i, sizeof(size_t));
+	}
+}
+
+/**
+ * ends a search, marking its positions when it failed for reasons that
+ * hold whatever the opener; a refused closer marks nothing
+ */
+static void emph_scan_end(struct sd_markdown* rndr, struct emph_scan* scan, int failed)
+{
+	if (scan->failed == NULL) {
+		return;
+	}
+
+	if (failed != 0) {
+		size_t count = scan->trail->size / sizeof(size_t);
+		const size_t* trail = (const size_t*) scan->trail->data;
+
+		for (size_t k = 0; k < count; ++k) {
+			scan->failed[trail[k]] |= scan->bit;
+		}
+	}
+
+	rndr_popbuf(rndr, BUFFER_MEMO);
+	scan->failed = NULL;
+}
+
+/**
+ * parsing single emphase
+ */
+/* closed by a symbol not preceded by whitespace and not followed by symbol */
+static size_t parse_emph1(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size, uint8_t c)
+{
+	if (rndr->cfg->cb.emphasis == NULL) {
+		return 0;
+	}
+
+	size_t i = 0;
+	struct emph_scan scan;
+
+	/* skipping one symbol if coming from emph3 */
+	if ((size > 1) && (data[0] == c) && (data[1] == c)) {
+		i = 1;
+	}
+
+	emph_scan_begin(&scan, rndr, data, size, c, 1);
+
+	while (i < size) {
+		size_t len = find_emph_char(data + i, size - i, c);
+
+		if (len == 0) {
+			break;
+		}
+
+		i += len;
+
+		if ((i >= size) || (emph_scan_failed(&scan, i) != 0)) {
+			break;
+		}
+
+		emph_scan_visit(&scan, i);
+
+		if ((data[i] == c) && (_isspace(data[i - 1]) == 0)) {
+			if (rndr->cfg->ext_flags & MKDEXT_NO_INTRA_EMPHASIS) {
+				if (((i + 1) < size) && (isalnum(data[i + 1]) != 0)) {
+					continue;
+				}
+			}
+
+			emph_scan_end(rndr, &scan, 0);
+
+			struct buf* work = rndr_newbuf(rndr, BUFFER_SPAN);
+
+			if (work == NULL) {
+				return 0;
+			}
+
+			parse_inline(work, rndr, data, i);
+			int r = rndr->cfg->cb.emphasis(ob, work, rndr->opaque);
+			rndr_popbuf(rndr, BUFFER_SPAN);
+
+			return (r != 0) ? (i + 1) : (0);
+		}
+	}
+
+	emph_scan_end(rndr, &scan, 1);
+
+	return 0;
+}
+
+/**
+ * parsing single emphase
+ */
+static size_t parse_emph2(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size, uint8_t c)
+{
+	int (*render_method)(struct buf * ob, const struct buf * text, void* opaque);
+
+	render_method = (c == '~') ? (rndr->cfg->cb.strikethrough) : (rndr->cfg->cb.double_emphasis);
+	render_method = (c == '+') ? (rndr->cfg->cb.ins) : (render_method);
+
+	if (render_method == NULL) {
+		return 0;
+	}
+
+	size_t i = 0;
+	struct emph_scan scan;
+
+	emph_scan_begin(&scan, rndr, data, size, c, 2);
+
+	while (i < size) {
+		size_t len = find_emph_char(data + i, size - i, c);
+
+		if (len == 0) {
+			break;
+		}
+
+		i += len;
+
+		if (emph_scan_failed(&scan, i) != 0) {
+			break;
+		}
+
+		emph_scan_visit(&scan, i);
+
+		if (((i + 1) < size) && (data[i] == c) && (data[i + 1] == c) && (i != 0) && (_isspace(data[i - 1]) == 0)) {
+			emph_scan_end(rndr, &scan, 0);
+
+			struct buf* work = rndr_newbuf(rndr, BUFFER_SPAN);
+
+			if (work == NULL) {
+				return 0;
+			}
+
+			parse_inline(work, rndr, data, i);
+			int r = render_method(ob, work, rndr->opaque);
+			rndr_popbuf(rndr, BUFFER_SPAN);
+
+			return (r != 0) ? (i + 2) : (0);
+		}
+
+		i++;
+	}
+
+	emph_scan_end(rndr, &scan, 1);
+
+	return 0;
+}
+
+/**
+ * parsing single emphase
+ */
+/* finds the first closing tag, and delegates to the other emph */
+static size_t parse_emph3(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size, uint8_t c)
+{
+	size_t i = 0;
+	struct emph_scan scan;
+
+	emph_scan_begin(&scan, rndr, data, size, c, 3);
+
+	while (i < size) {
+		size_t len = find_emph_char(data + i, size - i, c);
+
+		if (len == 0) {
+			break;
+		}
+
+		i += len;
+
+		if (emph_scan_failed(&scan, i) != 0) {
+			break;
+		}
+
+		emph_scan_visit(&scan, i);
+
+		/* skip whitespace preceded symbols */
+		if ((data[i] != c) || (_isspace(data[i - 1]) != 0)) {
+			continue;
+		}
+
+		/* the outcome now depends on the opener */
+		emph_scan_end(rndr, &scan, 0);
+
+		if (((i + 2) < size) && (data[i + 1] == c) && (data[i + 2] == c) && (rndr->cfg->cb.triple_emphasis != NULL)) {
+			/* triple symbol found */
+			struct buf* work = rndr_newbuf(rndr, BUFFER_SPAN);
+
+			if (work == NULL) {
+				return 0;
+			}
+
+			parse_inline(work, rndr, data, i);
+			int r = rndr->cfg->cb.triple_emphasis(ob, work, rndr->opaque);
+			rndr_popbuf(rndr, BUFFER_SPAN);
+
+			return (r != 0) ? (i + 3) : (0);
+		} else if (((i + 1) < size) && (data[i + 1] == c)) {
+			/* double symbol found, handing over to emph1 */
+			len = parse_emph1(ob, rndr, data - 2, size + 2, c);
+
+			if (len == 0) {
+				return 0;
+			} else {
+				return len - 2;
+			}
+
+		} else {
+			/* single symbol found, handing over to emph2 */
+			len = parse_emph2(ob, rndr, data - 1, size + 1, c);
+
+			if (len == 0) {
+				return 0;
+			} else {
+				return len - 1;
+			}
+		}
+	}
+
+	emph_scan_end(rndr, &scan, 1);
+
+	return 0;
+}
+
+/**
+ * single and double emphasis parsing
+ */
+static size_t char_emphasis(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+{
+	if (rndr->cfg->ext_flags & MKDEXT_NO_INTRA_EMPHASIS) {
+		if ((offset > 0) && (_isspace(data[-1]) == 0) && (data[-1] != '>')) {
+			return 0;
+		}
+	}
+
+	uint8_t c = data[0];
+	size_t ret;
+
+	if ((size > 2) && (data[1] != c)) {
+		/*
+		 * whitespace cannot follow an opening emphasis;
+		 * ins only takes two characters '++'
+		 * strikethrough only takes two characters '~~'
+		 */
+		if ((c == '+') || (c == '~') || (_isspace(data[1]) != 0)) {
+			return 0;
+		}
+
+		ret = parse_emph1(ob, rndr, data + 1, size - 1, c);
+
+		if (ret == 0) {
+			return 0;
+		}
+
+		return ret + 1;
+	}
+
+	if ((size > 3) && (data[1] == c) && (data[2] != c)) {
+		if (_isspace(data[2]) != 0) {
+			return 0;
+		}
+
+		ret = parse_emph2(ob, rndr, data + 2, size - 2, c);
+
+		if (ret == 0) {
+			return 0;
+		}
+
+		return ret + 2;
+	}
+
+	if ((size > 4) && (data[1] == c) && (data[2] == c) && (data[3] != c)) {
+		if ((c == '+') || (c == '~') || (_isspace(data[3]) != 0)) {
+			return 0;
+		}
+
+		ret = parse_emph3(ob, rndr, data + 3, size - 3, c);
+
+		if (ret == 0) {
+			return 0;
+		}
+
+		return ret + 3;
+	}
+
+	return 0;
+}
+
+/**
+ * '\n' preceded by two spaces (assuming linebreak != 0)
+ */
+static size_t char_linebreak(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+{
+	if ((offset < 2) || (data[-1] != ' ') || (data[-2] != ' ')) {
+		return 0;
+	}
+
+	/* removing the last space from ob and rendering */
+	const uint8_t* tail;
+	size_t tail_size = rndr_tail(rndr, ob, &tail);
+	size_t spaces = 0;
+
+	while ((spaces < tail_size) && (tail[tail_size - spaces - 1] == ' ')) {
+		spaces++;
+	}
+
+	rndr_untail(rndr, ob, spaces);
+
+	return (rndr->cfg->cb.linebreak(ob, rndr->opaque)) ? (1) : (0);
+}
+
+/**
+ * '`' parsing a code span (assuming codespan != 0)
+ */
+static size_t char_codespan(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+{
+	size_t nb = 0;
+
+	/* counting the number of backticks in the delimiter */
+	while ((nb < size) && (data[nb] == '`')) {
+		nb++;
+	}
+
+	/* finding the next delimiter */
+	size_t i = 0;
+	size_t end;
+
+	for (end = nb; (end < size) && (i < nb); end++) {
+		if (data[end] == '`') {
+			i++;
+		} else {
+			i = 0;
+		}
+	}
+
+	if ((i < nb) && (end >= size)) {
+		/* no matching delimiter */
+		return 0;
+	}
+
+	/* trimming outside whitespaces */
+	size_t f_begin = nb;
+
+	while ((f_begin < end) && (data[f_begin] == ' ')) {
+		f_begin++;
+	}
+
+	size_t f_end = end - nb;
+
+	while ((f_end > nb) && (data[f_end - 1] == ' ')) {
+		f_end--;
+	}
 
 	/* real code span */
 	if (f_begin < f_end) {
 		struct buf work = {data + f_begin, f_end - f_begin, 0, 0};
 
-		if (rndr->cb.codespan(ob, &work, rndr->opaque) == 0) {
-			end = 0;
+		if (rndr->cfg->cb.codespan(ob, &work, rndr->opaque) == 0) {
+			end = 0;
+		}
+	} else {
+		if (rndr->cfg->cb.codespan(ob, 0, rndr->opaque) == 0) {
+			end = 0;
+		}
+	}
+
+	return end;
+}
+
+/**
+ * '\\' backslash escape
+ */
+static size_t char_escape(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+{
+	static const char* escape_chars = "\\`*_{}[]()#+-.!:|&<>^~$";
+	struct buf work = {NULL, 0, 0, 0};
+
+	if (size > 1) {
+		if (strchr(escape_chars, data[1]) == NULL) {
+			return 0;
+		}
+
+		if (rndr->cfg->cb.normal_text != NULL) {
+			work.data = data + 1;
+			work.size = 1;
+			rndr->cfg->cb.normal_text(ob, &work, rndr->opaque);
+		} else {
+			bufputc(ob, data[1]);
+		}
+	} else if (size == 1) {
+		/* the backslash ending the span is text as well */
+		if (rndr->cfg->cb.normal_text != NULL) {
+			work.data = data;
+			work.size = 1;
+			rndr->cfg->cb.normal_text(ob, &work, rndr->opaque);
+		} else {
+			bufputc(ob, data[0]);
+		}
+	}
+
+	return 2;
+}
+
+/**
+ * '&' escaped when it doesn't belong to an entity
+ */
+/* valid entities are assumed to be anything matching &#?[A-Za-z0-9]+; */
+static size_t char_entity(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+{
+	size_t end = 1;
+	struct buf work = {NULL, 0, 0, 0};
+
+	if ((end < size) && (data[end] == '#')) {
+		end++;
+	}
+
+	while ((end < size) && (isalnum(data[end]) != 0)) {
+		end++;
+	}
+
+	if ((end < size) && (data[end] == ';')) {
+		/* real entity */
+		end++;
+	} else {
+		/* lone '&' */
+		return 0;
+	}
+
+	if (rndr->cfg->cb.entity != NULL) {
+		work.data = data;
+		work.size = end;
+		rndr->cfg->cb.entity(ob, &work, rndr->opaque);
+	} else {
+		bufput(ob, data, end);
+	}
+
+	return end;
+}
+
+/**
+ * '<' when tags or autolinks are allowed
+ */
+static size_t char_langle_tag(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+{
+	enum mkd_autolink altype = MKDA_NOT_AUTOLINK;
+	size_t end = tag_length(data, size, &altype);
+	struct buf work = {data, end, 0, 0};
+	int ret = 0;
+
+	if (end > 2) {
+		if ((rndr->cfg->cb.autolink != NULL) && (altype != MKDA_NOT_AUTOLINK)) {
+			struct buf* u_link = rndr_newbuf(rndr, BUFFER_SPAN);
+
+			if (u_link == NULL) {
+				return 0;
+			}
+
+			work.data = data + 1;
+			work.size = end - 2;
+			unscape_text(u_link, &work);
+			ret = rndr->cfg->cb.autolink(ob, u_link, altype, rndr->opaque);
+			rndr_popbuf(rndr, BUFFER_SPAN);
+		} else if (rndr->cfg->cb.raw_html_tag != NULL) {
+			ret = rndr->cfg->cb.raw_html_tag(ob, &work, rndr->opaque);
+		}
+	}
+
+	if (ret == 0) {
+		return 0;
+	} else {
+		return end;
+	}
+}
+
+static size_t char_autolink_www(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+{
+	if ((rndr->cfg->cb.link == NULL) || (rndr->in_link_body != 0)) {
+		return 0;
+	}
+
+	struct buf* link = rndr_newbuf(rndr, BUFFER_SPAN);
+
+	if (link == NULL) {
+		return 0;
+	}
+
+	size_t rewind;
+	size_t link_len = sd_autolink__www(&rewind, link, data, offset, size, 0);
+
+	if (link_len > 0) {
+		struct buf* link_url = rndr_newbuf(rndr, BUFFER_SPAN);
+
+		if (link_url == NULL) {
+			return 0;
+		}
+
+		BUFPUTSL(link_url, "http://");
+		bufput(link_url, link->data, link->size);
+
+		rndr_untail(rndr, ob, rewind);
+
+		if (rndr->cfg->cb.normal_text != NULL) {
+			struct buf* link_text = rndr_newbuf(rndr, BUFFER_SPAN);
+
+			if (link_text == NULL) {
+				return 0;
+			}
+
+			rndr->cfg->cb.normal_text(link_text, link, rndr->opaque);
+			rndr->cfg->cb.link(ob, link_url, NULL, link_text, rndr->opaque);
+			rndr_popbuf(rndr, BUFFER_SPAN);
+		} else {
+			rndr->cfg->cb.link(ob, link_url, NULL, link, rndr->opaque);
+		}
+
+		rndr_popbuf(rndr, BUFFER_SPAN);
+	}
+
+	rndr_popbuf(rndr, BUFFER_SPAN);
+
+	return link_len;
+}
+
+static size_t char_autolink_email(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+{
+	if ((rndr->cfg->cb.autolink == NULL) || (rndr->in_link_body != 0)) {
+		return 0;
+	}
+
+	struct buf* link = rndr_newbuf(rndr, BUFFER_SPAN);
+
+	if (link == NULL) {
+		return 0;
+	}
+
+	size_t rewind;
+	size_t link_len = sd_autolink__email(&rewind, link, data, offset, size, 0);
+
+	if (link_len > 0) {
+		rndr_untail(rndr, ob, rewind);
+		rndr->cfg->cb.autolink(ob, link, MKDA_EMAIL, rndr->opaque);
+	}
+
+	rndr_popbuf(rndr, BUFFER_SPAN);
+
+	return link_len;
+}
+
+static size_t char_autolink_url(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+{
+	if ((rndr->cfg->cb.autolink == NULL) || (rndr->in_link_body != 0)) {
+		return 0;
+	}
+
+	struct buf* link = rndr_newbuf(rndr, BUFFER_SPAN);
+
+	if (link == NULL) {
+		return 0;
+	}
+
+	size_t rewind;
+	size_t link_len = sd_autolink__url(&rewind, link, data, offset, size, 0);
+
+	if (link_len > 0) {
+		rndr_untail(rndr, ob, rewind);
+		rndr->cfg->cb.autolink(ob, link, MKDA_NORMAL, rndr->opaque);
+	}
+
+	rndr_popbuf(rndr, BUFFER_SPAN);
+
+	return link_len;
+}
+
+/**
+ * '[': parsing a link or an image
+ */
+static size_t char_link(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+{
+	int is_img = (offset != 0) && (data[-1] == '!');
+	size_t i = 1;
+	size_t org_work_size = rndr->work_bufs[BUFFER_SPAN].size;
+	int ret = 0;
+
+	/* checking whether the correct renderer exists */
+	if (((is_img != 0) && (rndr->cfg->cb.image == NULL)) || ((is_img == 0) && (rndr->cfg->cb.link == NULL))) {
+		goto cleanup;
+	}
+
+	int text_has_nl = 0;
+
+	/* looking for the matching closing bracket */
+	for (int level = 1; i < size; i++) {
+		if (data[i] == '\n') {
+			text_has_nl = 1;
+		} else if (data[i - 1] == '\\') {
+			continue;
+		} else if (data[i] == '[') {
+			level++;
+		} else if (data[i] == ']') {
+			level--;
+
+			if (level <= 0) {
+				break;
+			}
+		}
+	}
+
+	if (i >= size) {
+		goto cleanup;
+	}
+
+	size_t txt_e = i;
+	i++;
+
+	/* footnote link */
+	if ((rndr->cfg->ext_flags & MKDEXT_FOOTNOTES) && (data[1] == '^')) {
+		if (txt_e < 3) {
+			goto cleanup;
+		}
+
+		struct buf id = {NULL, 0, 0, 0};
+
+		id.data = data + 2;
+
+		id.size = txt_e - 2;
+
+		struct footnote_ref* fr = ref_table_find(&rndr->footnotes_found, id.data, id.size);
+
+		rndr->used_footnote = 1;
+		rndr->prefix_unsafe = 1;
+
+		/* numbering is sequential, the chunk is rendered again in order */
+		if ((fr != NULL) && (rndr->is_worker != 0)) {
+			rndr->fork_conflict = 1;
+
+			goto cleanup;
+		}
+
+		/* mark footnote used */
+		if ((fr != NULL) && (fr->is_used == 0)) {
+			if (stack_push(&rndr->footnotes_used, fr) < 0) {
+				goto cleanup;
+			}
+
+			fr->is_used = 1;
+			fr->num = rndr->footnotes_used.size;
+		}
+
+		/* render */
+		if ((fr != NULL) && (rndr->cfg->cb.footnote_ref != NULL)) {
+			ret = rndr->cfg->cb.footnote_ref(ob, fr->num, rndr->opaque);
+		}
+
+		goto cleanup;
+	}
+
+	/* skip any amount of whitespace or newline */
+	/* (this is much more laxist than original markdown syntax) */
+	while ((i < size) && (_isspace(data[i]) != 0)) {
+		i++;
+	}
+
+	size_t title_b = 0;
+	size_t title_e = 0;
+	struct buf* link = NULL;
+	struct buf* title = NULL;
+
+	/* inline style link */
+	if ((i < size) && (data[i] == '(')) {
+		/* skipping initial whitespace */
+		i++;
+
+		while ((i < size) && (_isspace(data[i]) != 0)) {
+			i++;
+		}
+
+		size_t link_b = i;
+
+		/* looking for link end: ' " ) */
+		while (i < size) {
+			if (data[i] == '\\') {
+				i += 2;
+			} else if (data[i] == ')') {
+				break;
+			} else if ((i >= 1) && (_isspace(data[i - 1]) != 0) && ((data[i] == '\'') || (data[i] == '"'))) {
+				break;
+			} else {
+				i++;
+			}
+		}
+
+		if (i >= size) {
+			goto cleanup;
+		}
+
+		size_t link_e = i;
+
+		/* looking for title end if present */
+		if ((data[i] == '\'') || (data[i] == '"')) {
+			int qtype = data[i];
+			int in_title = 1;
+			i++;
+			title_b = i;
+
+			while (i < size) {
+				if (data[i] == '\\') {
+					i += 2;
+				} else if (data[i] == qtype) {
+					in_title = 0;
+					i++;
+				} else if ((data[i] == ')') && (in_title == 0)) {
+					break;
+				} else {
+					i++;
+				}
+			}
+
+			if (i >= size) {
+				goto cleanup;
+			}
+
+			/* skipping whitespaces after title */
+			title_e = i - 1;
+
+			while ((title_e > title_b) && (_isspace(data[title_e]) != 0)) {
+				title_e--;
+			}
+
+			/* checking for closing quote presence */
+			if ((data[title_e] != '\'') && (data[title_e] != '"')) {
+				title_e = 0;
+				title_b = 0;
+				link_e = i;
+			}
+		}
+
+		/* remove whitespace at the end of the link */
+		while ((link_e > link_b) && (_isspace(data[link_e - 1]) != 0)) {
+			link_e--;
+		}
+
+		/* remove optional angle brackets around the link */
+		if (data[link_b] == '<') {
+			link_b++;
+		}
+
+		if (data[link_e - 1] == '>') {
+			link_e--;
+		}
+
+		/* building escaped link and title */
+		if (link_e > link_b) {
+			link = rndr_newbuf(rndr, BUFFER_SPAN);
+
+			if (link == NULL) {
+				goto cleanup;
+			}
+
+			bufput(link, data + link_b, link_e - link_b);
+		}
+
+		if (title_e > title_b) {
+			title = rndr_newbuf(rndr, BUFFER_SPAN);
+
+			if (link == NULL) {
+				goto cleanup;
+			}
+
+			bufput(title, data + title_b, title_e - title_b);
+		}
+
+		i++;
+	} else if ((i < size) && (data[i] == '[')) {
+		/* reference style link */
+
+		/* looking for the id */
+		i++;
+		size_t link_b = i;
+
+		while ((i < size) && (data[i] != ']')) {
+			i++;
+		}
+
+		if (i >= size) {
+			goto cleanup;
+		}
+
+		struct buf id = {NULL, 0, 0, 0};
+
+		size_t link_e = i;
+
+		/* finding the link_ref */
+		if (link_b == link_e) {
+			if (text_has_nl != 0) {
+				struct buf* b = rndr_newbuf(rndr, BUFFER_SPAN);
+
+				if (b == NULL) {
+					goto cleanup;
+				}
+
+				for (size_t j = 1; j < txt_e; j++) {
+					if (data[j] != '\n') {
+						bufputc(b, data[j]);
+					} else if (data[j - 1] != ' ') {
+						bufputc(b, ' ');
+					}
+				}
+
+				id.data = b->data;
+				id.size = b->size;
+			} else {
+				id.data = data + 1;
+				id.size = txt_e - 1;
+			}
+		} else {
+			id.data = data + link_b;
+			id.size = link_e - link_b;
+		}
+
+		struct link_ref* lr = rndr_findref(rndr, id.data, id.size);
+
+		if (lr == NULL) {
+			goto cleanup;
+		}
+
+		/* keeping link and title from link_ref */
+		link = lr->link;
+		title = lr->title;
+		i++;
+	} else {
+		/* shortcut reference style link */
+
+		struct buf id = {NULL, 0, 0, 0};
+
+		/* crafting the id */
+		if (text_has_nl != 0) {
+			struct buf* b = rndr_newbuf(rndr, BUFFER_SPAN);
+
+			if (b == NULL) {
+				goto cleanup;
+			}
+
+			for (size_t j = 1; j < txt_e; j++) {
+				if (data[j] != '\n') {
+					bufputc(b, data[j]);
+				} else if (data[j - 1] != ' ') {
+					bufputc(b, ' ');
+				}
+			}
+
+			id.data = b->data;
+			id.size = b->size;
+		} else {
+			id.data = data + 1;
+			id.size = txt_e - 1;
+		}
+
+		/* finding the link_ref */
+		struct link_ref* lr = rndr_findref(rndr, id.data, id.size);
+
+		if (lr == NULL) {
+			goto cleanup;
+		}
+
+		/* keeping link and title from link_ref */
+		link = lr->link;
+		title = lr->title;
+
+		/* rewinding the whitespace */
+		i = txt_e + 1;
+	}
+
+	struct buf* content = NULL;
+
+	/* building content: img alt is escaped, link content is parsed */
+	if (txt_e > 1) {
+		content = rndr_newbuf(rndr, BUFFER_SPAN);
+
+		if (content == NULL) {
+			goto cleanup;
+		}
+
+		if (is_img != 0) {
+			bufput(content, data + 1, txt_e - 1);
+		} else {
+			/*
+			 * disable autolinking when parsing inline the
+			 * content of a link
+			 */
+			rndr->in_link_body = 1;
+			parse_inline(content, rndr, data + 1, txt_e - 1);
+			rndr->in_link_body = 0;
+		}
+	}
+
+	struct buf* u_link = NULL;
+
+	if (link != NULL) {
+		u_link = rndr_newbuf(rndr, BUFFER_SPAN);
+
+		if (u_link == NULL) {
+			goto cleanup;
+		}
+
+		unscape_text(u_link, link);
+	}
+
+	/* calling the relevant rendering function */
+	if (is_img != 0) {
+		const uint8_t* tail;
+		size_t tail_size = rndr_tail(rndr, ob, &tail);
+
+		if ((tail_size != 0) && (tail[tail_size - 1] == '!')) {
+			rndr_untail(rndr, ob, 1);
+		}
+
+		ret = rndr->cfg->cb.image(ob, u_link, title, content, rndr->opaque);
+	} else {
+		ret = rndr->cfg->cb.link(ob, u_link, title, content, rndr->opaque);
+	}
+
+	/* cleanup */
+cleanup:
+	rndr->work_bufs[BUFFER_SPAN].size = (int) org_work_size;
+
+	return (ret != 0) ? (i) : (0);
+}
+
+static size_t char_superscript(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+{
+	if (rndr->cfg->cb.superscript == NULL) {
+		return 0;
+	}
+
+	if (size < 2) {
+		return 0;
+	}
+
+	size_t sup_start;
+	size_t sup_len;
+
+	if (data[1] == '(') {
+		sup_len = 2;
+		sup_start = 2;
+
+		while ((sup_len < size) && (data[sup_len] != ')') && (data[sup_len - 1] != '\\')) {
+			sup_len++;
+		}
+
+		if (sup_len == size) {
+			return 0;
+		}
+	} else {
+		sup_len = 1;
+		sup_start = 1;
+
+		while ((sup_len < size) && (_isspace(data[sup_len]) == 0)) {
+			sup_len++;
+		}
+	}
+
+	if ((sup_len - sup_start) == 0) {
+		return (sup_start == 2) ? (3) : (0);
+	}
+
+	struct buf* sup = rndr_newbuf(rndr, BUFFER_SPAN);
+
+	if (sup == NULL) {
+		return 0;
+	}
+
+	parse_inline(sup, rndr, data + sup_start, sup_len - sup_start);
+	rndr->cfg->cb.superscript(ob, sup, rndr->opaque);
+	rndr_popbuf(rndr, BUFFER_SPAN);
+
+	return (sup_start == 2) ? (sup_len + 1) : (sup_len);
+}
+
+/* ********************************
+ * BLOCK-LEVEL PARSING FUNCTIONS *
+ *********************************/
+
+/**
+ * returns the line length when it is empty, 0 otherwise
+ */
+static size_t is_empty(const uint8_t* data, size_t size)
+{
+	size_t i;
+
+	for (i = 0; (i < size) && (data[i] != '\n'); i++) {
+		if (data[i] != ' ') {
+			return 0;
+		}
+	}
+
+	return i + 1;
+}
+
+/**
+ * returns whether a line is a horizontal rule
+ */
+static int is_hrule(uint8_t* data, size_t size)
+{
+	/* skipping initial spaces */
+	if (size < 3) {
+		return 0;
+	}
+
+	size_t i = 0;
+
+	if (data[0] == ' ') {
+		i++;
+
+		if (data[1] == ' ') {
+			i++;
+
+			if (data[2] == ' ') {
+				i++;
+			}
+		}
+	}
+
+	/* looking at the hrule uint8_t */
+	if (((i + 2) >= size) || ((data[i] != '*') && (data[i] != '-') && (data[i] != '_'))) {
+		return 0;
+	}
+
+	uint8_t c = data[i];
+
+	size_t n = 0;
+
+	/* the whole line must be the char or whitespace */
+	while ((i < size) && (data[i] != '\n')) {
+		if (data[i] == c) {
+			n++;
+		} else if (data[i] != ' ') {
+			return 0;
+		}
+
+		i++;
+	}
+
+	return n >= 3;
+}
+
+/**
+ * check if a line begins with a code fence; return the
+ * width of the code fence
+ */
+static size_t prefix_codefence(uint8_t* data, size_t size)
+{
+	/* skipping initial spaces */
+	if (size < 3) {
+		return 0;
+	}
+
+	size_t i = 0;
+
+	if (data[0] == ' ') {
+		i++;
+
+		if (data[1] == ' ') {
+			i++;
+
+			if (data[2] == ' ') {
+				i++;
+			}
+		}
+	}
+
+	/* looking at the hrule uint8_t */
+	if (((i + 2) >= size) || (!((data[i] == '~') || (data[i] == '`')))) {
+		return 0;
+	}
+
+	uint8_t c = data[i];
+
+	size_t n = 0;
+
+	/* the whole line must be the uint8_t or whitespace */
+	while ((i < size) && (data[i] == c)) {
+		n++;
+		i++;
+	}
+
+	if (n < 3) {
+		return 0;
+	}
+
+	return i;
+}
+
+/**
+ * check if a line is a code fence; return its size if it is
+ */
+static size_t is_codefence(uint8_t* data, size_t size, struct buf* syntax)
+{
+	size_t i = prefix_codefence(data, size);
+
+	if (i == 0) {
+		return 0;
+	}
+
+	while ((i < size) && (data[i] == ' ')) {
+		i++;
+	}
+
+	uint8_t* syn_start = data + i;
+
+	size_t syn_len = 0;
+
+	if ((i < size) && (data[i] == '{')) {
+		i++;
+		syn_start++;
+
+		while ((i < size) && (data[i] != '}') && (data[i] != '\n')) {
+			syn_len++;
+			i++;
+		}
+
+		if ((i == size) || (data[i] != '}')) {
+			return 0;
+		}
+
+		/*
+		 * strip all whitespace at the beginning and the end
+		 * of the {} block
+		 */
+		while ((syn_len > 0) && (_isspace(syn_start[0]) != 0)) {
+			syn_start++;
+			syn_len--;
+		}
+
+		while ((syn_len > 0) && (_isspace(syn_start[syn_len - 1]) != 0)) {
+			syn_len--;
+		}
+
+		i++;
+	} else {
+		while ((i < size) && (_isspace(data[i]) == 0)) {
+			syn_len++;
+			i++;
+		}
+	}
+
+	if (syntax != NULL) {
+		syntax->data = syn_start;
+		syntax->size = syn_len;
+	}
+
+	while ((i < size) && (data[i] != '\n')) {
+		if (_isspace(data[i]) == 0) {
+			return 0;
+		}
+
+		i++;
+	}
+
+	return i + 1;
+}
+
+/**
+ * returns whether the line is a hash-prefixed header
+ */
+static int is_atxheader(struct sd_markdown* rndr, uint8_t* data, size_t size)
+{
+	if (data[0] != '#') {
+		return 0;
+	}
+
+	if (rndr->cfg->ext_flags & MKDEXT_SPACE_HEADERS) {
+		size_t level = 0;
+
+		while ((level < size) && (level < 6) && (data[level] == '#')) {
+			level++;
+		}
+
+		if ((level < size) && (data[level] != ' ')) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * returns whether the line is a setext-style hdr underline
+ */
+static int is_headerline(uint8_t* data, size_t size)
+{
+	size_t i = 0;
+
+	/* test of level 1 header */
+	if (data[i] == '=') {
+		for (i = 1; (i < size) && (data[i] == '='); i++) {
+			;
+		}
+
+		while ((i < size) && (data[i] == ' ')) {
+			i++;
+		}
+
+		return ((i >= size) || (data[i] == '\n')) ? (1) : (0);
+	}
+
+	/* test of level 2 header */
+	if (data[i] == '-') {
+		for (i = 1; (i < size) && (data[i] == '-'); i++) {
+			;
+		}
+
+		while ((i < size) && (data[i] == ' ')) {
+			i++;
+		}
+
+		return ((i >= size) || (data[i] == '\n')) ? (2) : (0);
+	}
+
+	return 0;
+}
+
+static int is_next_headerline(uint8_t* data, size_t size)
+{
+	size_t i = 0;
+
+	while ((i < size) && (data[i] != '\n')) {
+		i++;
+	}
+
+	if (++i >= size) {
+		return 0;
+	}
+
+	return is_headerline(data + i, size - i);
+}
+
+/**
+ * returns blockquote prefix length
+ */
+static size_t prefix_quote(uint8_t* data, size_t size)
+{
+	size_t i = 0;
+
+	if ((i < size) && (data[i] == ' ')) {
+		i++;
+	}
+
+	if ((i < size) && (data[i] == ' ')) {
+		i++;
+	}
+
+	if ((i < size) && (data[i] == ' ')) {
+		i++;
+	}
+
+	if ((i < size) && (data[i] == '>')) {
+		if (((i + 1) < size) && (data[i + 1] == ' ')) {
+			return i + 2;
+		}
+
+		return i + 1;
+	}
+
+	return 0;
+}
+
+/**
+ * returns prefix length for block code
+ */
+static size_t prefix_code(uint8_t* data, size_t size)
+{
+	if ((size > 3) && (data[0] == ' ') && (data[1] == ' ') && (data[2] == ' ') && (data[3] == ' ')) {
+		return 4;
+	}
+
+	return 0;
+}
+
+/**
+ * returns ordered list item prefix
+ */
+static size_t prefix_oli(uint8_t* data, size_t size)
+{
+	size_t i = 0;
+
+	if ((i < size) && (data[i] == ' ')) {
+		i++;
+	}
+
+	if ((i < size) && (data[i] == ' ')) {
+		i++;
+	}
+
+	if ((i < size) && (data[i] == ' ')) {
+		i++;
+	}
+
+	if ((i >= size) || (data[i] < '0') || (data[i] > '9')) {
+		return 0;
+	}
+
+	while ((i < size) && (data[i] >= '0') && (data[i] <= '9')) {
+		i++;
+	}
+
+	if (((i + 1) >= size) || (data[i] != '.') || (data[i + 1] != ' ')) {
+		return 0;
+	}
+
+	if (is_next_headerline(data + i, size - i)) {
+		return 0;
+	}
+
+	return i + 2;
+}
+
+/**
+ * returns ordered list item prefix
+ */
+static size_t prefix_uli(uint8_t* data, size_t size)
+{
+	size_t i = 0;
+
+	if ((i < size) && (data[i] == ' ')) {
+		i++;
+	}
+
+	if ((i < size) && (data[i] == ' ')) {
+		i++;
+	}
+
+	if ((i < size) && (data[i] == ' ')) {
+		i++;
+	}
+
+	if (((i + 1) >= size) || ((data[i] != '*') && (data[i] != '+') && (data[i] != '-')) || (data[i + 1] != ' ')) {
+		return 0;
+	}
+
+	if (is_next_headerline(data + i, size - i)) {
+		return 0;
+	}
+
+	return i + 2;
+}
+
+/**
+ * parsing of one block, returning next uint8_t to parse
+ */
+static size_t parse_block(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size);
+
+/**
+ * handles parsing of a blockquote fragment
+ */
+static size_t parse_blockquote(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
+{
+	struct buf* out_ = rndr_newbuf(rndr, BUFFER_BLOCK);
+
+	if (out_ == NULL) {
+		return 0;
+	}
+
+	size_t beg = 0;
+	size_t end = 0;
+	size_t work_size = 0;
+	uint8_t* work_data = NULL;
+
+	/*
+	 * the caller's document is compacted into a single copy instead;
+	 * nested blocks then work on that copy, so it is never used twice
+	 */
+	struct buf* work = NULL;
+	int readonly = rndr_readonly(rndr, data);
+
+	while (beg < size) {
+		for (end = beg + 1; (end < size) && (data[end - 1] != '\n'); end++) {
+			;
+		}
+
+		size_t pre = prefix_quote(data + beg, end - beg);
+
+		if (pre != 0) {
+			/* skipping prefix */
+			beg += pre;
+		} else if ((is_empty(data + beg, end - beg) != 0) && ((end >= size) || ((prefix_quote(data + end, size - end) == 0) && (is_empty(data + end, size - end) == 0)))) {
+			/* empty line followed by non-quote line */
+			break;
+		}
+
+		if (beg < end) { /* copy into the in-place working buffer */
+			/* bufput(work, data + beg, end - beg); */
+			if (work_data == NULL) {
+				work_data = data + beg;
+			} else if (work != NULL) {
+				bufput(work, data + beg, end - beg);
+			} else if ((data + beg) != (work_data + work_size)) {
+				if (readonly != 0) {
+					work = rndr->ro_copy;
+					work->size = 0;
+					bufput(work, work_data, work_size);
+					bufput(work, data + beg, end - beg);
+				} else {
+					memmove(work_data + work_size, data + beg, end - beg);
+				}
+			}
+
+			work_size += end - beg;
+		}
+
+		beg = end;
+	}
+
+	if (work != NULL) {
+		work_data = work->data;
+	}
+
+	/* out_ still counts in the nesting level when rendering in place */
+	if ((rndr->cfg->cb.blockquote != NULL) && (rndr_open(rndr, ob, MKDN_BLOCKQUOTE, 0) != 0)) {
+		parse_block(ob, rndr, work_data, work_size);
+		rndr->cfg->cb.close(ob, MKDN_BLOCKQUOTE, 0, rndr->opaque);
+	} else {
+		parse_block(out_, rndr, work_data, work_size);
+
+		if (rndr->cfg->cb.blockquote != NULL) {
+			rndr->cfg->cb.blockquote(ob, out_, rndr->opaque);
+		}
+	}
+
+	rndr_popbuf(rndr, BUFFER_BLOCK);
+
+	return end;
+}
+
+static size_t parse_htmlblock(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size, int do_render);
+
+/**
+ * handles parsing of a regular paragraph
+ */
+static size_t parse_paragraph(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
+{
+	size_t i = 0;
+	size_t end = 0;
+	int level = 0;
+
+	while (i < size) {
+		for (end = i + 1; (end < size) && (data[end - 1] != '\n'); end++) {
+			/* empty */
+			;
+		}
+
+		if (is_empty(data + i, size - i) != 0) {
+			break;
+		}
+
+		level = is_headerline(data + i, size - i);
+
+		if (level != 0) {
+			break;
+		}
+
+		if ((is_atxheader(rndr, data + i, size - i) != 0) || (is_hrule(data + i, size - i) != 0) || (prefix_quote(data + i, size - i) != 0)) {
+			end = i;
+
+			break;
+		}
+
+		/*
+		 * Early termination of a paragraph with the same logic
+		 * as Markdown 1.0.0. If this logic is applied, the
+		 * Markdown 1.0.3 test suite won't pass cleanly
+		 *
+		 * :: If the first character in a new line is not a letter,
+		 * let's check to see if there's some kind of block starting
+		 * here
+		 */
+		if ((rndr->cfg->ext_flags & MKDEXT_LAX_SPACING) && (isalnum(data[i]) == 0)) {
+			if ((prefix_oli(data + i, size - i) != 0) || (prefix_uli(data + i, size - i) != 0)) {
+				end = i;
+
+				break;
+			}
+
+			/* see if an html block starts here */
+			if ((data[i] == '<') && (rndr->cfg->cb.blockhtml != NULL) && (parse_htmlblock(ob, rndr, data + i, size - i, 0) != 0)) {
+				end = i;
+
+				break;
+			}
+
+			/* see if a code fence starts here */
+			if (((rndr->cfg->ext_flags & MKDEXT_FENCED_CODE) != 0) && (is_codefence(data + i, size - i, NULL) != 0)) {
+				end = i;
+
+				break;
+			}
+		}
+
+		i = end;
+	}
+
+	struct buf work = {data, 0, 0, 0};
+
+	work.size = i;
+
+	while ((work.size != 0) && (data[work.size - 1] == '\n')) {
+		work.size--;
+	}
+
+	if (level == 0) {
+		struct buf* tmp = rndr_newbuf(rndr, BUFFER_BLOCK);
+
+		if (tmp == NULL) {
+			return 0;
+		}
+
+		parse_inline(tmp, rndr, work.data, work.size);
+
+		if (rndr->cfg->cb.paragraph != NULL) {
+			rndr->cfg->cb.paragraph(ob, tmp, rndr->opaque);
+		}
+
+		rndr_popbuf(rndr, BUFFER_BLOCK);
+	} else {
+		if (work.size != 0) {
+			i = work.size;
+			work.size -= 1;
+
+			while ((work.size != 0) && (data[work.size] != '\n')) {
+				work.size -= 1;
+			}
+
+			size_t beg = work.size + 1;
+
+			while ((work.size != 0) && (data[work.size - 1] == '\n')) {
+				work.size -= 1;
+			}
+
+			if (work.size > 0) {
+				struct buf* tmp = rndr_newbuf(rndr, BUFFER_BLOCK);
+
+				if (tmp == NULL) {
+					return 0;
+				}
+
+				parse_inline(tmp, rndr, work.data, work.size);
+
+				if (rndr->cfg->cb.paragraph != NULL) {
+					rndr->cfg->cb.paragraph(ob, tmp, rndr->opaque);
+				}
+
+				rndr_popbuf(rndr, BUFFER_BLOCK);
+				work.data += beg;
+				work.size = i - beg;
+			} else {
+				work.size = i;
+			}
+		}
+
+		struct buf* header_work = rndr_newbuf(rndr, BUFFER_SPAN);
+
+		if (header_work == NULL) {
+			return 0;
+		}
+
+		parse_inline(header_work, rndr, work.data, work.size);
+
+		if (rndr->cfg->cb.header != NULL) {
+			rndr->cfg->cb.header(ob, header_work, (int) level, rndr->opaque);
+		}
+
+		rndr_popbuf(rndr, BUFFER_SPAN);
+	}
+
+	return end;
+}
+
+/**
+ * handles parsing of a block-level code fragment
+ */
+static size_t parse_fencedcode(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
+{
+	struct buf lang = {NULL, 0, 0, 0};
+	size_t beg = is_codefence(data, size, &lang);
+
+	if (beg == 0) {
+		return 0;
+	}
+
+	struct buf* work = rndr_newbuf(rndr, BUFFER_BLOCK);
+
+	if (work == NULL) {
+		return 0;
+	}
+
+	size_t end;
+
+	while (beg < size) {
+		struct buf fence_trail = {NULL, 0, 0, 0};
+
+		size_t fence_end = is_codefence(data + beg, size - beg, &fence_trail);
+
+		if ((fence_end != 0) && (fence_trail.size == 0)) {
+			beg += fence_end;
+
+			break;
+		}
+
+		for (end = beg + 1; (end < size) && (data[end - 1] != '\n'); end++) {
+			;
+		}
+
+		if (beg < end) {
+			/*
+			 * verbatim copy to the working buffer,
+			 * escaping entities
+			 */
+			if (is_empty(data + beg, end - beg) != 0) {
+				bufputc(work, '\n');
+			} else {
+				bufput(work, data + beg, end - beg);
+			}
+		}
+
+		beg = end;
+	}
+
+	if ((work->size != 0) && (work->data[work->size - 1] != '\n')) {
+		bufputc(work, '\n');
+	}
+
+	if (rndr->cfg->cb.blockcode != NULL) {
+		rndr->cfg->cb.blockcode(ob, work, (lang.size != 0) ? (&lang) : (NULL), rndr->opaque);
+	}
+
+	rndr_popbuf(rndr, BUFFER_BLOCK);
+
+	return beg;
+}
+
+static size_t parse_blockcode(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
+{
+	struct buf* work = rndr_newbuf(rndr, BUFFER_BLOCK);
+
+	if (work == NULL) {
+		return 0;
+	}
+
+	size_t beg = 0;
+	size_t end;
+	size_t work_size = 0;
+	uint8_t* work_data = NULL;
+
+	/* like blockquotes, only the caller's document is copied, the rest is compacted in place */
+	int readonly = rndr_readonly(rndr, data);
+
+	while (beg < size) {
+		for (end = beg + 1; (end < size) && (data[end - 1] != '\n'); end++) {
+		}
+
+		size_t pre = prefix_code(data + beg, end - beg);
+
+		if (pre != 0) {
+			/* skipping prefix */
+			beg += pre;
+		} else if (is_empty(data + beg, end - beg) == 0) {
+			/* non-empty non-prefixed line breaks the pre */
+			break;
+		}
+
+		if (beg < end) {
+			/*
+			 * verbatim copy to the working buffer,
+			 * escaping entities
+			 */
+			if (readonly != 0) {
+				if (is_empty(data + beg, end - beg) != 0) {
+					bufputc(work, '\n');
+				} else {
+					bufput(work, data + beg, end - beg);
+				}
+			} else {
+				if (work_data == NULL) {
+					work_data = data + beg;
+				}
+
+				if (is_empty(data + beg, end - beg) != 0) {
+					work_data[work_size++] = '\n';
+				} else {
+					memmove(work_data + work_size, data + beg, end - beg);
+					work_size += end - beg;
+				}
+			}
+		}
+
+		beg = end;
+	}
+
+	struct buf code = {NULL, 0, 0, 0};
+
+	if (readonly == 0) {
+		while ((work_size != 0) && (work_data[work_size - 1] == '\n')) {
+			work_size--;
+		}
+
+		/* the newline closing the code is one of those trimmed, unless the code ends the text */
+		if ((work_data != NULL) && ((work_data + work_size) < (data + beg)) && (work_data[work_size] == '\n')) {
+			code.data = work_data;
+			code.size = work_size + 1;
+		} else {
+			bufput(work, work_data, work_size);
+			bufputc(work, '\n');
 		}
 	} else {
-		if (rndr->cb.codespan(ob, 0, rndr->opaque) == 0) {
-			end = 0;
+		while ((work->size != 0) && (work->data[work->size - 1] == '\n')) {
+			work->size -= 1;
+		}
+
+		bufputc(work, '\n');
+	}
+
+	if (rndr->cfg->cb.blockcode != NULL) {
+		rndr->cfg->cb.blockcode(ob, (code.data != NULL) ? (&code) : (work), NULL, rndr->opaque);
+	}
+
+	rndr_popbuf(rndr, BUFFER_BLOCK);
+
+	return beg;
+}
+
+/**
+ * parsing of a single list item
+ */
+/* assuming initial prefix is already removed */
+static size_t parse_listitem(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size, int* flags)
+{
+	size_t orgpre = 0;
+
+	/* keeping track of the first indentation prefix */
+	while ((orgpre < 3) && (orgpre < size) && (data[orgpre] == ' ')) {
+		orgpre++;
+	}
+
+	size_t beg = prefix_uli(data, size);
+
+	if (beg == 0) {
+		beg = prefix_oli(data, size);
+	}
+
+	if (beg == 0) {
+		return 0;
+	}
+
+	/* skipping to the beginning of the following line */
+	size_t end = beg;
+
+	while ((end < size) && (data[end - 1] != '\n')) {
+		end++;
+	}
+
+	/* getting working buffers */
+	struct buf* work = rndr_newbuf(rndr, BUFFER_SPAN);
+
+	if (work == NULL) {
+		return 0;
+	}
+
+	struct buf* inter = rndr_newbuf(rndr, BUFFER_SPAN);
+
+	if (inter == NULL) {
+		return 0;
+	}
+
+	/* putting the first line into the working buffer */
+	bufput(work, data + beg, end - beg);
+	beg = end;
+
+	size_t sublist = 0;
+	int in_empty = 0;
+	int has_inside_empty = 0;
+	int in_fence = 0;
+
+	/* process the following lines */
+	while (beg < size) {
+		uint8_t* eol = memchr(data + beg, '\n', size - beg);
+
+		end = (eol != NULL) ? ((size_t) (eol - data) + 1) : (size);
+
+		/* the leading spaces, telling empty lines at once */
+		size_t lead = 0;
+
+		while (((beg + lead) < end) && (data[beg + lead] == ' ')) {
+			lead++;
+		}
+
+		/* process an empty line */
+		if (((beg + lead) == end) || (data[beg + lead] == '\n')) {
+			in_empty = 1;
+			beg = end;
+
+			continue;
+		}
+
+		/* calculating the indentation */
+		size_t i = (lead < 4) ? (lead) : (4);
+		size_t pre = i;
+
+		/* the only byte a fence or an item marker may start at, past up to 3 more spaces */
+		uint8_t mark = ((lead - i) <= 3) ? (data[beg + lead]) : (' ');
+
+		if ((rndr->cfg->ext_flags & MKDEXT_FENCED_CODE) && ((mark == '`') || (mark == '~'))) {
+			if (is_codefence(data + beg + i, end - beg - i, NULL) != 0) {
+				in_fence = in_fence == 0;
+			}
+		}
+
+		size_t has_next_uli = 0;
+		size_t has_next_oli = 0;
+
+		/*
+		 * Only check for new list items if we are **not** inside
+		 * a fenced code block
+		 */
+		if (in_fence == 0) {
+			if ((mark == '*') || (mark == '+') || (mark == '-')) {
+				has_next_uli = prefix_uli(data + beg + i, end - beg - i);
+			} else if ((mark >= '0') && (mark <= '9')) {
+				has_next_oli = prefix_oli(data + beg + i, end - beg - i);
+			}
+		}
+
+		/* checking for ul/ol switch */
+		if ((in_empty != 0) && (((*flags & MKD_LIST_ORDERED) && (has_next_uli != 0)) || ((!(*flags & MKD_LIST_ORDERED)) && (has_next_oli != 0)))) {
+			*flags |= MKD_LI_END;
+
+			/* the following item must have same list type */
+			break;
+		}
+
+		/* checking for a new item */
+		if (((has_next_uli != 0) && (is_hrule(data + beg + i, end - beg - i) == 0)) || (has_next_oli != 0)) {
+			if (in_empty != 0) {
+				has_inside_empty = 1;
+			}
+
+			if (pre == orgpre) { /* the following item must have */
+				/* the same indentation */
+				break;
+			}
+
+			if (sublist == 0) {
+				sublist = work->size;
+			}
+		} else if ((in_empty != 0) && (pre == 0)) {
+			/*
+			 * joining only indented stuff after empty lines;
+			 * note that now we only require 1 space of indentation
+			 * to continue a list
+			 */
+			*flags |= MKD_LI_END;
+
+			break;
+		} else if (in_empty != 0) {
+			bufputc(work, '\n');
+			has_inside_empty = 1;
 		}
+
+		in_empty = 0;
+
+		/* adding the line without prefix into the working buffer */
+		bufput(work, data + beg + i, end - beg - i);
+		beg = end;
 	}
 
-	return end;
-}
+	/* render of li contents */
+	if (has_inside_empty != 0) {
+		*flags |= MKD_LI_BLOCK;
+	}
 
-/**
- * '\\' backslash escape
- */
-static size_t char_escape(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
-{
-	static const char* escape_chars = "\\`*_{}[]()#+-.!:|&<>^~$";
-	struct buf work = {NULL, 0, 0, 0};
+	int in_place = (rndr->cfg->cb.listitem != NULL) && (rndr_open(rndr, ob, MKDN_LISTITEM, *flags) != 0);
+	struct buf* target = (in_place != 0) ? (ob) : (inter);
 
-	if (size > 1) {
-		if (strchr(escape_chars, data[1]) == NULL) {
-			return 0;
+	if (*flags & MKD_LI_BLOCK) {
+		/* intermediate render of block li */
+		if ((sublist != 0) && (sublist < work->size)) {
+			parse_block(target, rndr, work->data, sublist);
+			parse_block(target, rndr, work->data + sublist, work->size - sublist);
+		} else {
+			parse_block(target, rndr, work->data, work->size);
 		}
-
-		if (rndr->cb.normal_text != NULL) {
-			work.data = data + 1;
-			work.size = 1;
-			rndr->cb.normal_text(ob, &work, rndr->opaque);
+	} else {
+		/* intermediate render of inline li */
+		if ((sublist != 0) && (sublist < work->size)) {
+			parse_inline(target, rndr, work->data, sublist);
+			parse_block(target, rndr, work->data + sublist, work->size - sublist);
 		} else {
-			bufputc(ob, data[1]);
+			parse_inline(target, rndr, work->data, work->size);
 		}
-	} else if (size == 1) {
-		bufputc(ob, data[0]);
 	}
 
-	return 2;
+	/* render of li itself */
+	if (in_place != 0) {
+		rndr->cfg->cb.close(ob, MKDN_LISTITEM, *flags, rndr->opaque);
+	} else if (rndr->cfg->cb.listitem != NULL) {
+		rndr->cfg->cb.listitem(ob, inter, *flags, rndr->opaque);
+	}
+
+	rndr_popbuf(rndr, BUFFER_SPAN);
+	rndr_popbuf(rndr, BUFFER_SPAN);
+
+	return beg;
 }
 
 /**
- * '&' escaped when it doesn't belong to an entity
+ * parsing ordered or unordered list block
  */
-/* valid entities are assumed to be anything matching &#?[A-Za-z0-9]+; */
-static size_t char_entity(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+static size_t parse_list(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size, int flags)
 {
-	size_t end = 1;
-	struct buf work = {NULL, 0, 0, 0};
+	struct buf* work = rndr_newbuf(rndr, BUFFER_BLOCK);
 
-	if ((end < size) && (data[end] == '#')) {
-		end++;
+	if (work == NULL) {
+		return 0;
 	}
 
-	while ((end < size) && (isalnum(data[end]) != 0)) {
-		end++;
-	}
+	size_t i = 0;
+	int in_place = (rndr->cfg->cb.list != NULL) && (rndr_open(rndr, ob, MKDN_LIST, flags) != 0);
 
-	if ((end < size) && (data[end] == ';')) {
-		/* real entity */
-		end++;
-	} else {
-		/* lone '&' */
-		return 0;
+	while (i < size) {
+		size_t j = parse_listitem((in_place != 0) ? (ob) : (work), rndr, data + i, size - i, &flags);
+		i += j;
+
+		if ((j == 0) || (flags & MKD_LI_END) || (rndr->budget_out != 0)) {
+			break;
+		}
 	}
 
-	if (rndr->cb.entity != NULL) {
-		work.data = data;
-		work.size = end;
-		rndr->cb.entity(ob, &work, rndr->opaque);
-	} else {
-		bufput(ob, data, end);
+	if (in_place != 0) {
+		rndr->cfg->cb.close(ob, MKDN_LIST, flags, rndr->opaque);
+	} else if (rndr->cfg->cb.list != NULL) {
+		rndr->cfg->cb.list(ob, work, flags, rndr->opaque);
 	}
 
-	return end;
+	rndr_popbuf(rndr, BUFFER_BLOCK);
+
+	return i;
 }
 
 /**
- * '<' when tags or autolinks are allowed
+ * parsing of atx-style headers
  */
-static size_t char_langle_tag(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+static size_t parse_atxheader(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
 {
-	enum mkd_autolink altype = MKDA_NOT_AUTOLINK;
-	size_t end = tag_length(data, size, &altype);
-	struct buf work = {data, end, 0, 0};
-	int ret = 0;
+	size_t level = 0;
 
-	if (end > 2) {
-		if ((rndr->cb.autolink != NULL) && (altype != MKDA_NOT_AUTOLINK)) {
-			struct buf* u_link = rndr_newbuf(rndr, BUFFER_SPAN);
+	while ((level < size) && (level < 6) && (data[level] == '#')) {
+		level++;
+	}
 
-			if (u_link == NULL) {
-				return 0;
-			}
+	size_t i;
 
-			work.data = data + 1;
-			work.size = end - 2;
-			unscape_text(u_link, &work);
-			ret = rndr->cb.autolink(ob, u_link, altype, rndr->opaque);
-			rndr_popbuf(rndr, BUFFER_SPAN);
-		} else if (rndr->cb.raw_html_tag != NULL) {
-			ret = rndr->cb.raw_html_tag(ob, &work, rndr->opaque);
-		}
+	for (i = level; (i < size) && (data[i] == ' '); i++) {
+		;
 	}
 
-	if (ret == 0) {
-		return 0;
-	} else {
-		return end;
-	}
-}
+	size_t end;
 
-static size_t char_autolink_www(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
-{
-	if ((rndr->cb.link == NULL) || (rndr->in_link_body != 0)) {
-		return 0;
+	for (end = i; (end < size) && (data[end] != '\n'); end++) {
+		;
 	}
 
-	struct buf* link = rndr_newbuf(rndr, BUFFER_SPAN);
+	size_t skip = end;
 
-	if (link == NULL) {
-		return 0;
+	while ((end != 0) && (data[end - 1] == '#')) {
+		end--;
 	}
 
-	size_t rewind;
-	size_t link_len = sd_autolink__www(&rewind, link, data, offset, size, 0);
+	while ((end != 0) && (data[end - 1] == ' ')) {
+		end--;
+	}
 
-	if (link_len > 0) {
-		struct buf* link_url = rndr_newbuf(rndr, BUFFER_SPAN);
+	if (end > i) {
+		struct buf* work = rndr_newbuf(rndr, BUFFER_SPAN);
 
-		if (link_url == NULL) {
+		if (work == NULL) {
 			return 0;
 		}
 
-		BUFPUTSL(link_url, "http://");
-		bufput(link_url, link->data, link->size);
-
-		ob->size -= rewind;
-
-		if (rndr->cb.normal_text != NULL) {
-			struct buf* link_text = rndr_newbuf(rndr, BUFFER_SPAN);
-
-			if (link_text == NULL) {
-				return 0;
-			}
+		parse_inline(work, rndr, data + i, end - i);
 
-			rndr->cb.normal_text(link_text, link, rndr->opaque);
-			rndr->cb.link(ob, link_url, NULL, link_text, rndr->opaque);
-			rndr_popbuf(rndr, BUFFER_SPAN);
-		} else {
-			rndr->cb.link(ob, link_url, NULL, link, rndr->opaque);
+		if (rndr->cfg->cb.header != NULL) {
+			rndr->cfg->cb.header(ob, work, (int) level, rndr->opaque);
 		}
 
 		rndr_popbuf(rndr, BUFFER_SPAN);
 	}
 
-	rndr_popbuf(rndr, BUFFER_SPAN);
-
-	return link_len;
+	return skip;
 }
 
-static size_t char_autolink_email(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+/**
+ * parse a single footnote definition
+ */
+static void parse_footnote_def(struct buf* ob, struct sd_markdown* rndr, unsigned int num, uint8_t* data, size_t size)
 {
-	if ((rndr->cb.autolink == NULL) || (rndr->in_link_body != 0)) {
-		return 0;
-	}
-
-	struct buf* link = rndr_newbuf(rndr, BUFFER_SPAN);
+	struct buf* work = rndr_newbuf(rndr, BUFFER_SPAN);
 
-	if (link == NULL) {
-		return 0;
+	if (work == NULL) {
+		return;
 	}
 
-	size_t rewind;
-	size_t link_len = sd_autolink__email(&rewind, link, data, offset, size, 0);
+	parse_block(work, rndr, data, size);
 
-	if (link_len > 0) {
-		ob->size -= rewind;
-		rndr->cb.autolink(ob, link, MKDA_EMAIL, rndr->opaque);
+	if (rndr->cfg->cb.footnote_def != NULL) {
+		rndr->cfg->cb.footnote_def(ob, work, num, rndr->opaque);
 	}
 
 	rndr_popbuf(rndr, BUFFER_SPAN);
-
-	return link_len;
 }
 
-static size_t char_autolink_url(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+/**
+ * render the contents of the footnotes
+ */
+static void parse_footnote_list(struct buf* ob, struct sd_markdown* rndr, struct stack* footnotes)
 {
-	if ((rndr->cb.autolink == NULL) || (rndr->in_link_body != 0)) {
-		return 0;
+	if (footnotes->size == 0) {
+		return;
 	}
 
-	struct buf* link = rndr_newbuf(rndr, BUFFER_SPAN);
+	struct buf* work = rndr_newbuf(rndr, BUFFER_BLOCK);
 
-	if (link == NULL) {
-		return 0;
+	if (work == NULL) {
+		return;
 	}
 
-	size_t rewind;
-	size_t link_len = sd_autolink__url(&rewind, link, data, offset, size, 0);
-
-	if (link_len > 0) {
-		ob->size -= rewind;
-		rndr->cb.autolink(ob, link, MKDA_NORMAL, rndr->opaque);
+	for (size_t i = 0; i < footnotes->size; ++i) {
+		struct footnote_ref* ref_ = footnotes->item[i];
+		parse_footnote_def(work, rndr, ref_->num, ref_->contents->data, ref_->contents->size);
 	}
 
-	rndr_popbuf(rndr, BUFFER_SPAN);
+	if (rndr->cfg->cb.footnotes != NULL) {
+		rndr->cfg->cb.footnotes(ob, work, rndr->opaque);
+	}
 
-	return link_len;
+	rndr_popbuf(rndr, BUFFER_BLOCK);
 }
 
 /**
- * '[': parsing a link or an image
+ * checking end of HTML block : </tag>[ \t]*\n[ \t*]\n
  */
-static size_t char_link(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+/* returns the length on match, 0 otherwise */
+static size_t htmlblock_end_tag(const char* tag, size_t tag_len, struct sd_markdown* rndr, uint8_t* data, size_t size)
 {
-	int is_img = (offset != 0) && (data[-1] == '!');
-	size_t i = 1;
-	size_t org_work_size = rndr->work_bufs[BUFFER_SPAN].size;
-	int ret = 0;
-
-	/* checking whether the correct renderer exists */
-	if (((is_img != 0) && (rndr->cb.image == NULL)) || ((is_img == 0) && (rndr->cb.link == NULL))) {
-		goto cleanup;
-	}
-
-	int text_has_nl = 0;
-
-	/* looking for the matching closing bracket */
-	for (int level = 1; i < size; i++) {
-		if (data[i] == '\n') {
-			text_has_nl = 1;
-		} else if (data[i - 1] == '\\') {
-			continue;
-		} else if (data[i] == '[') {
-			level++;
-		} else if (data[i] == ']') {
-			level--;
-
-			if (level <= 0) {
-				break;
-			}
-		}
-	}
-
-	if (i >= size) {
-		goto cleanup;
+	/* checking if tag is a match */
+	if (((tag_len + 3) >= size) || (strncasecmp((char*) data + 2, tag, tag_len) != 0) || (data[tag_len + 2] != '>')) {
+		return 0;
 	}
 
-	size_t txt_e = i;
-	i++;
-
-	/* footnote link */
-	if ((rndr->ext_flags & MKDEXT_FOOTNOTES) && (data[1] == '^')) {
-		if (txt_e < 3) {
-			goto cleanup;
-		}
-
-		struct buf id = {NULL, 0, 0, 0};
-
-		id.data = data + 2;
-
-		id.size = txt_e - 2;
-
-		struct footnote_ref* fr = find_footnote_ref(&rndr->footnotes_found, id.data, id.size);
-
-		/* mark footnote used */
-		if ((fr != NULL) && (fr->is_used == 0)) {
-			if (add_footnote_ref(&rndr->footnotes_used, fr) == 0) {
-				goto cleanup;
-			}
+	/* checking white lines */
+	size_t i = tag_len + 3;
+	size_t w = 0;
 
-			fr->is_used = 1;
-			fr->num = rndr->footnotes_used.count;
-		}
+	if (i < size) {
+		w = is_empty(data + i, size - i);
 
-		/* render */
-		if ((fr != NULL) && (rndr->cb.footnote_ref != NULL)) {
-			ret = rndr->cb.footnote_ref(ob, fr->num, rndr->opaque);
+		if (w == 0) {
+			/* non-blank after tag */
+			return 0;
 		}
-
-		goto cleanup;
 	}
 
-	/* skip any amount of whitespace or newline */
-	/* (this is much more laxist than original markdown syntax) */
-	while ((i < size) && (_isspace(data[i]) != 0)) {
-		i++;
+	i += w;
+	w = 0;
+
+	if (i < size) {
+		w = is_empty(data + i, size - i);
 	}
 
-	size_t title_b = 0;
-	size_t title_e = 0;
-	struct buf* link = NULL;
-	struct buf* title = NULL;
+	return i + w;
+}
 
-	/* inline style link */
-	if ((i < size) && (data[i] == '(')) {
-		/* skipping initial whitespace */
-		i++;
+/**
+ * indexes the closing block tags of the text once per render, returns 0 when it cannot
+ */
+static int close_index_build(struct close_index* index, struct sd_markdown* rndr)
+{
+	if (index->built != 0) {
+		return 1;
+	}
 
-		while ((i < size) && (_isspace(data[i]) != 0)) {
-			i++;
-		}
+	uint8_t* data = (uint8_t*) index->begin;
+	size_t size = index->end - index->begin;
+	size_t count = 0;
+	size_t i = 0;
 
-		size_t link_b = i;
+	memset(index->first, 0x00, sizeof(index->first));
 
-		/* looking for link end: ' " ) */
-		while (i < size) {
-			if (data[i] == '\\') {
-				i += 2;
-			} else if (data[i] == ')') {
-				break;
-			} else if ((i >= 1) && (_isspace(data[i - 1]) != 0) && ((data[i] == '\'') || (data[i] == '"'))) {
-				break;
-			} else {
-				i++;
-			}
-		}
+	while ((i + 1) < size) {
+		uint8_t* lt = memchr(data + i, '<', size - i - 1);
 
-		if (i >= size) {
-			goto cleanup;
+		if (lt == NULL) {
+			break;
 		}
 
-		size_t link_e = i;
+		size_t pos = lt - data;
+		i = pos + 1;
 
-		/* looking for title end if present */
-		if ((data[i] == '\'') || (data[i] == '"')) {
-			int qtype = data[i];
-			int in_title = 1;
-			i++;
-			title_b = i;
+		if (data[pos + 1] != '/') {
+			continue;
+		}
 
-			while (i < size) {
-				if (data[i] == '\\') {
-					i += 2;
-				} else if (data[i] == qtype) {
-					in_title = 0;
-					i++;
-				} else if ((data[i] == ')') && (in_title == 0)) {
-					break;
-				} else {
-					i++;
-				}
-			}
+		size_t name_end = pos + 2;
 
-			if (i >= size) {
-				goto cleanup;
-			}
+		while ((name_end < size) && (data[name_end] != '>') && ((name_end - pos - 2) < BLOCK_TAG_MAX)) {
+			name_end++;
+		}
 
-			/* skipping whitespaces after title */
-			title_e = i - 1;
+		if ((name_end >= size) || (data[name_end] != '>')) {
+			continue;
+		}
 
-			while ((title_e > title_b) && (_isspace(data[title_e]) != 0)) {
-				title_e--;
-			}
+		size_t tag_len = name_end - pos - 2;
+		const char* tag = find_block_tag((char*) data + pos + 2, (unsigned int) tag_len);
 
-			/* checking for closing quote presence */
-			if ((data[title_e] != '\'') && (data[title_e] != '"')) {
-				title_e = 0;
-				title_b = 0;
-				link_e = i;
-			}
+		if (tag == NULL) {
+			continue;
 		}
 
-		/* remove whitespace at the end of the link */
-		while ((link_e > link_b) && (_isspace(data[link_e - 1]) != 0)) {
-			link_e--;
-		}
+		size_t end = htmlblock_end_tag(tag, tag_len, rndr, data + pos, size - pos);
 
-		/* remove optional angle brackets around the link */
-		if (data[link_b] == '<') {
-			link_b++;
+		if (end == 0) {
+			continue;
 		}
 
-		if (data[link_e - 1] == '>') {
-			link_e--;
-		}
+		if (count == index->asize) {
+			size_t asize = (index->asize != 0) ? (index->asize * 2) : (64);
+			struct close_tag* tags = realloc(index->tags, asize * sizeof(struct close_tag));
 
-		/* building escaped link and title */
-		if (link_e > link_b) {
-			link = rndr_newbuf(rndr, BUFFER_SPAN);
+			if (tags == NULL) {
+				index->end = NULL;
 
-			if (link == NULL) {
-				goto cleanup;
+				return 0;
 			}
 
-			bufput(link, data + link_b, link_e - link_b);
-		}
+			index->tags = tags;
+			tags = realloc(index->scratch, asize * sizeof(struct close_tag));
 
-		if (title_e > title_b) {
-			title = rndr_newbuf(rndr, BUFFER_SPAN);
+			if (tags == NULL) {
+				index->end = NULL;
 
-			if (link == NULL) {
-				goto cleanup;
+				return 0;
 			}
 
-			bufput(title, data + title_b, title_e - title_b);
+			index->scratch = tags;
+			index->asize = asize;
 		}
 
-		i++;
-	} else if ((i < size) && (data[i] == '[')) {
-		/* reference style link */
+		struct close_tag* close = &index->scratch[count++];
 
-		/* looking for the id */
-		i++;
-		size_t link_b = i;
+		close->pos = pos;
+		close->end = pos + end;
+		close->key = hash_block_tag(tag, (unsigned int) tag_len);
+		close->line_start = (pos > 0) && (data[pos - 1] == '\n');
+		index->first[close->key + 1]++;
+	}
 
-		while ((i < size) && (data[i] != ']')) {
-			i++;
-		}
+	/* grouping by name, keeping the text order */
+	size_t next[BLOCK_TAG_KEYS];
 
-		if (i >= size) {
-			goto cleanup;
-		}
+	for (size_t k = 0; k < BLOCK_TAG_KEYS; ++k) {
+		index->first[k + 1] += index->first[k];
+		next[k] = index->first[k];
+	}
 
-		struct buf id = {NULL, 0, 0, 0};
+	for (size_t j = 0; j < count; ++j) {
+		index->tags[next[index->scratch[j].key]++] = index->scratch[j];
+	}
 
-		size_t link_e = i;
+	for (size_t k = 0; k < BLOCK_TAG_KEYS; ++k) {
+		size_t sol = index->first[k + 1];
 
-		/* finding the link_ref */
-		if (link_b == link_e) {
-			if (text_has_nl != 0) {
-				struct buf* b = rndr_newbuf(rndr, BUFFER_SPAN);
+		for (size_t j = index->first[k + 1]; j > index->first[k]; --j) {
+			if (index->tags[j - 1].line_start != 0) {
+				sol = j - 1;
+			}
 
-				if (b == NULL) {
-					goto cleanup;
-				}
+			index->tags[j - 1].sol_next = sol;
+		}
+	}
 
-				for (size_t j = 1; j < txt_e; j++) {
-					if (data[j] != '\n') {
-						bufputc(b, data[j]);
-					} else if (data[j - 1] != ' ') {
-						bufputc(b, ' ');
-					}
-				}
+	index->built = 1;
 
-				id.data = b->data;
-				id.size = b->size;
-			} else {
-				id.data = data + 1;
-				id.size = txt_e - 1;
-			}
+	return 1;
+}
+
+/**
+ * looks up in the index what htmlblock_end would find scanning data
+ */
+static size_t close_index_find(struct close_index* index, const char* curtag, size_t tag_size, uint8_t* data, size_t size, int start_of_line)
+{
+	unsigned int key = hash_block_tag(curtag, (unsigned int) tag_size);
+	size_t start = data - index->begin;
+	size_t lo = index->first[key];
+	size_t hi = index->first[key + 1];
+
+	/* the first tag past the opening one */
+	while (lo < hi) {
+		size_t mid = lo + ((hi - lo) / 2);
+
+		if (index->tags[mid].pos <= start) {
+			lo = mid + 1;
 		} else {
-			id.data = data + link_b;
-			id.size = link_e - link_b;
+			hi = mid;
 		}
+	}
 
-		struct link_ref* lr = find_link_ref(rndr->refs, id.data, id.size);
+	/* past the initial line, only the tags starting a line count */
+	if ((start_of_line != 0) && (lo < index->first[key + 1])) {
+		uint8_t* eol = memchr(data, '\n', size);
+		size_t line_end = (eol != NULL) ? ((size_t) (eol - index->begin)) : ((size_t) (index->end - index->begin));
 
-		if (lr == NULL) {
-			goto cleanup;
+		if (index->tags[lo].pos > line_end) {
+			lo = index->tags[lo].sol_next;
 		}
+	}
 
-		/* keeping link and title from link_ref */
-		link = lr->link;
-		title = lr->title;
-		i++;
-	} else {
-		/* shortcut reference style link */
+	if (lo == index->first[key + 1]) {
+		return 0;
+	}
 
-		struct buf id = {NULL, 0, 0, 0};
+	return index->tags[lo].end - start;
+}
 
-		/* crafting the id */
-		if (text_has_nl != 0) {
-			struct buf* b = rndr_newbuf(rndr, BUFFER_SPAN);
+/**
+ * scans data for the closing tag, giving up with SIZE_MAX past scan_max
+ */
+static size_t htmlblock_scan(const char* curtag, size_t tag_size, struct sd_markdown* rndr, uint8_t* data, size_t size, int start_of_line, size_t scan_max)
+{
+	size_t i = 1;
+	int block_lines = 0;
 
-			if (b == NULL) {
-				goto cleanup;
+	while (i < size) {
+		i++;
+
+		while ((i < size) && (!((data[i - 1] == '<') && (data[i] == '/')))) {
+			if (i >= scan_max) {
+				return SIZE_MAX;
 			}
 
-			for (size_t j = 1; j < txt_e; j++) {
-				if (data[j] != '\n') {
-					bufputc(b, data[j]);
-				} else if (data[j - 1] != ' ') {
-					bufputc(b, ' ');
-				}
+			if (data[i] == '\n') {
+				block_lines++;
 			}
 
-			id.data = b->data;
-			id.size = b->size;
-		} else {
-			id.data = data + 1;
-			id.size = txt_e - 1;
+			i++;
 		}
 
-		/* finding the link_ref */
-		struct link_ref* lr = find_link_ref(rndr->refs, id.data, id.size);
-
-		if (lr == NULL) {
-			goto cleanup;
+		/*
+		 * If we are only looking for unindented tags, skip the tag
+		 * if it doesn't follow a newline.
+		 *
+		 * The only exception to this is if the tag is still on the
+		 * initial line; in that case it still counts as a closing
+		 * tag
+		 */
+		if ((start_of_line != 0) && (block_lines > 0) && (data[i - 2] != '\n')) {
+			continue;
 		}
 
-		/* keeping link and title from link_ref */
-		link = lr->link;
-		title = lr->title;
-
-		/* rewinding the whitespace */
-		i = txt_e + 1;
-	}
-
-	struct buf* content = NULL;
-
-	/* building content: img alt is escaped, link content is parsed */
-	if (txt_e > 1) {
-		content = rndr_newbuf(rndr, BUFFER_SPAN);
-
-		if (content == NULL) {
-			goto cleanup;
+		if ((i + 2 + tag_size) >= size) {
+			break;
 		}
 
-		if (is_img != 0) {
-			bufput(content, data + 1, txt_e - 1);
-		} else {
-			/*
-			 * disable autolinking when parsing inline the
-			 * content of a link
-			 */
-			rndr->in_link_body = 1;
-			parse_inline(content, rndr, data + 1, txt_e - 1);
-			rndr->in_link_body = 0;
-		}
-	}
+		size_t end_tag = htmlblock_end_tag(curtag, tag_size, rndr, data + i - 1, size - i + 1);
 
-	struct buf* u_link = NULL;
+		if (end_tag != 0) {
+			return i + end_tag - 1;
+		}
+	}
 
-	if (link != NULL) {
-		u_link = rndr_newbuf(rndr, BUFFER_SPAN);
+	return 0;
+}
 
-		if (u_link == NULL) {
-			goto cleanup;
-		}
+static size_t htmlblock_end(const char* curtag, struct sd_markdown* rndr, uint8_t* data, size_t size, int start_of_line)
+{
+	size_t tag_size = strlen(curtag);
 
-		unscape_text(u_link, link);
-	}
+	/*
+	 * the blocks running to the end of the text, as the top-level ones do,
+	 * look their tag up in the index once a scan has gone far without one
+	 */
+	if ((rndr->close.end != NULL) && ((data + size) == rndr->close.end) && (size > HTML_SCAN_MAX)) {
+		if (rndr->close.built == 0) {
+			size_t end = htmlblock_scan(curtag, tag_size, rndr, data, size, start_of_line, HTML_SCAN_MAX);
 
-	/* calling the relevant rendering function */
-	if (is_img != 0) {
-		if ((ob->size != 0) && (ob->data[ob->size - 1] == '!')) {
-			ob->size -= 1;
+			if (end != SIZE_MAX) {
+				return end;
+			}
 		}
 
-		ret = rndr->cb.image(ob, u_link, title, content, rndr->opaque);
-	} else {
-		ret = rndr->cb.link(ob, u_link, title, content, rndr->opaque);
+		if (close_index_build(&rndr->close, rndr) != 0) {
+			return close_index_find(&rndr->close, curtag, tag_size, data, size, start_of_line);
+		}
 	}
 
-	/* cleanup */
-cleanup:
-	rndr->work_bufs[BUFFER_SPAN].size = (int) org_work_size;
-
-	return (ret != 0) ? (i) : (0);
+	return htmlblock_scan(curtag, tag_size, rndr, data, size, start_of_line, SIZE_MAX);
 }
 
-static size_t char_superscript(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t offset, size_t size)
+/**
+ * parsing of inline HTML block
+ */
+static size_t parse_htmlblock(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size, int do_render)
 {
-	if (rndr->cb.superscript == NULL) {
+	/* identification of the opening tag */
+	if ((size < 2) || (data[0] != '<')) {
 		return 0;
 	}
 
-	if (size < 2) {
-		return 0;
+	size_t i = 1;
+
+	while ((i < size) && (data[i] != '>') && (data[i] != ' ')) {
+		i++;
 	}
 
-	size_t sup_start;
-	size_t sup_len;
+	const char* curtag = NULL;
 
-	if (data[1] == '(') {
-		sup_len = 2;
-		sup_start = 2;
+	if (i < size) {
+		curtag = find_block_tag((char*) data + 1, (int) i - 1);
+	}
 
-		while ((sup_len < size) && (data[sup_len] != ')') && (data[sup_len - 1] != '\\')) {
-			sup_len++;
-		}
+	struct buf work = {data, 0, 0, 0};
 
-		if (sup_len == size) {
-			return 0;
+	/* handling of special cases */
+	if (curtag == NULL) {
+		size_t j = 0;
+
+		/* HTML comment, laxist form */
+		if ((size > 5) && (data[1] == '!') && (data[2] == '-') && (data[3] == '-')) {
+			i = 5;
+
+			while ((i < size) && (!((data[i - 2] == '-') && (data[i - 1] == '-') && (data[i] == '>')))) {
+				i++;
+			}
+
+			i++;
+
+			if (i < size) {
+				j = is_empty(data + i, size - i);
+			}
+
+			if (j != 0) {
+				work.size = i + j;
+
+				if ((do_render != 0) && (rndr->cfg->cb.blockhtml != NULL)) {
+					rndr->cfg->cb.blockhtml(ob, &work, rndr->opaque);
+				}
+
+				return work.size;
+			}
+
+			/* the end of the comment may lie past the prefix */
+			rndr->prefix_unsafe = 1;
 		}
-	} else {
-		sup_len = 1;
-		sup_start = 1;
 
-		while ((sup_len < size) && (_isspace(data[sup_len]) == 0)) {
-			sup_len++;
+		/* HR, which is the only self-closing block tag considered */
+		if ((size > 4) && ((data[1] == 'h') || (data[1] == 'H')) && ((data[2] == 'r') || (data[2] == 'R'))) {
+			i = 3;
+
+			while ((i < size) && (data[i] != '>')) {
+				i++;
+			}
+
+			if ((i + 1) < size) {
+				i++;
+				j = is_empty(data + i, size - i);
+
+				if (j != 0) {
+					work.size = i + j;
+
+					if ((do_render != 0) && (rndr->cfg->cb.blockhtml != NULL)) {
+						rndr->cfg->cb.blockhtml(ob, &work, rndr->opaque);
+					}
+
+					return work.size;
+				}
+			}
 		}
+
+		/* no special case recognised */
+		return 0;
 	}
 
-	if ((sup_len - sup_start) == 0) {
-		return (sup_start == 2) ? (3) : (0);
+	/* looking for an unindented matching closing tag */
+	/* followed by a blank line */
+	size_t tag_end = htmlblock_end(curtag, rndr, data, size, 1);
+
+	/* the unindented closing tag may lie past the prefix, an indented one then ending the block early */
+	if (tag_end == 0) {
+		rndr->prefix_unsafe = 1;
 	}
 
-	struct buf* sup = rndr_newbuf(rndr, BUFFER_SPAN);
+	/* if not found, trying a second pass looking for indented match */
+	/* but not if tag is "ins" or "del" (following original Markdown.pl) */
+	if ((tag_end == 0) && (strcmp(curtag, "ins") != 0) && (strcmp(curtag, "del") != 0)) {
+		tag_end = htmlblock_end(curtag, rndr, data, size, 0);
+	}
 
-	if (sup == NULL) {
+	if (tag_end == 0) {
 		return 0;
 	}
 
-	parse_inline(sup, rndr, data + sup_start, sup_len - sup_start);
-	rndr->cb.superscript(ob, sup, rndr->opaque);
-	rndr_popbuf(rndr, BUFFER_SPAN);
+	/* the end of the block has been found */
+	work.size = tag_end;
 
-	return (sup_start == 2) ? (sup_len + 1) : (sup_len);
-}
+	if ((do_render != 0) && (rndr->cfg->cb.blockhtml != NULL)) {
+		rndr->cfg->cb.blockhtml(ob, &work, rndr->opaque);
+	}
 
-/* ********************************
- * BLOCK-LEVEL PARSING FUNCTIONS *
- *********************************/
+	return tag_end;
+}
 
 /**
- * returns the line length when it is empty, 0 otherwise
+ * parses the text of a table cell, plain cells going straight to normal_text
  */
-static size_t is_empty(const uint8_t* data, size_t size)
+static void parse_table_cell(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
 {
-	size_t i;
+	if ((sd_scan(&rndr->cfg->active_set, data, size) < size) || ((rndr->cfg->ext_flags & MKDEXT_AUTOLINK) && (find_www(data, 0, size) < size))) {
+		parse_inline(ob, rndr, data, size);
 
-	for (i = 0; (i < size) && (data[i] != '\n'); i++) {
-		if (data[i] != ' ') {
-			return 0;
-		}
+		return;
 	}
 
-	return i + 1;
+	if (inline_blocked(rndr) != 0) {
+		return;
+	}
+
+	if (rndr->cfg->cb.normal_text != NULL) {
+		struct buf work = {data, size, 0, 0};
+		rndr->cfg->cb.normal_text(ob, &work, rndr->opaque);
+	} else {
+		bufput(ob, data, size);
+	}
 }
 
 /**
- * returns whether a line is a horizontal rule
+ * renders a row into ob, row_work and cell_work being scratch shared by the rows of the table
  */
-static int is_hrule(uint8_t* data, size_t size)
+static void parse_table_row(struct buf* ob, struct sd_markdown* rndr, struct buf* row_work, struct buf* cell_work, uint8_t* data, size_t size, size_t columns, int* col_data, int header_flag)
 {
-	/* skipping initial spaces */
-	if (size < 3) {
-		return 0;
+	if ((rndr->cfg->cb.table_cell == NULL) || (rndr->cfg->cb.table_row == NULL)) {
+		return;
 	}
 
 	size_t i = 0;
 
-	if (data[0] == ' ') {
+	if ((i < size) && (data[i] == '|')) {
 		i++;
+	}
 
-		if (data[1] == ' ') {
-			i++;
+	row_work->size = 0;
 
-			if (data[2] == ' ') {
-				i++;
-			}
+	size_t col;
+
+	for (col = 0; (col < columns) && (i < size); ++col) {
+		while ((i < size) && (_isspace(data[i]) != 0)) {
+			i++;
 		}
-	}
 
-	/* looking at the hrule uint8_t */
-	if (((i + 2) >= size) || ((data[i] != '*') && (data[i] != '-') && (data[i] != '_'))) {
-		return 0;
-	}
+		size_t cell_start = i;
 
-	uint8_t c = data[i];
+		while ((i < size) && ((data[i] != '|') || ((i > 0) && (data[i - 1] == '\\')))) {
+			i++;
+		}
 
-	size_t n = 0;
+		size_t cell_end = i - 1;
 
-	/* the whole line must be the char or whitespace */
-	while ((i < size) && (data[i] != '\n')) {
-		if (data[i] == c) {
-			n++;
-		} else if (data[i] != ' ') {
-			return 0;
+		while ((cell_end > cell_start) && (_isspace(data[cell_end]) != 0)) {
+			cell_end--;
 		}
 
+		cell_work->size = 0;
+		parse_table_cell(cell_work, rndr, data + cell_start, 1 + cell_end - cell_start);
+		rndr->cfg->cb.table_cell(row_work, cell_work, col_data[col] | header_flag, rndr->opaque);
+
 		i++;
 	}
 
-	return n >= 3;
+	for (; col < columns; ++col) {
+		struct buf empty_cell = {NULL, 0, 0, 0};
+		rndr->cfg->cb.table_cell(row_work, &empty_cell, col_data[col] | header_flag, rndr->opaque);
+	}
+
+	rndr->cfg->cb.table_row(ob, row_work, rndr->opaque);
 }
 
 /**
- * check if a line begins with a code fence; return the
- * width of the code fence
+ * parses the header and its underline, returning 0 when data does not start a table
  */
-static size_t prefix_codefence(uint8_t* data, size_t size)
+static size_t parse_table_header(uint8_t* data, size_t size, size_t* columns, size_t* header_end, int** column_data, int* col_inline)
 {
-	/* skipping initial spaces */
-	if (size < 3) {
+	uint8_t* eol = memchr(data, '\n', size);
+
+	if (eol == NULL) {
 		return 0;
 	}
 
-	size_t i = 0;
-
-	if (data[0] == ' ') {
-		i++;
-
-		if (data[1] == ' ') {
-			i++;
+	size_t i = eol - data;
+	int pipes = 0;
+	size_t j;
 
-			if (data[2] == ' ') {
-				i++;
-			}
+	for (j = 0; j < i; j++) {
+		if (data[j] == '|') {
+			pipes++;
 		}
 	}
 
-	/* looking at the hrule uint8_t */
-	if (((i + 2) >= size) || (!((data[i] == '~') || (data[i] == '`')))) {
+	if (pipes == 0) {
 		return 0;
 	}
 
-	uint8_t c = data[i];
+	*header_end = i;
 
-	size_t n = 0;
+	while ((*header_end > 0) && (_isspace(data[*header_end - 1]) != 0)) {
+		(*header_end)--;
+	}
 
-	/* the whole line must be the uint8_t or whitespace */
-	while ((i < size) && (data[i] == c)) {
-		n++;
-		i++;
+	if (data[0] == '|') {
+		pipes--;
 	}
 
-	if (n < 3) {
-		return 0;
+	if ((*header_end != 0) && (data[*header_end - 1] == '|')) {
+		pipes--;
 	}
 
-	return i;
-}
+	*columns = pipes + 1;
 
-/**
- * check if a line is a code fence; return its size if it is
- */
-static size_t is_codefence(uint8_t* data, size_t size, struct buf* syntax)
-{
-	size_t i = prefix_codefence(data, size);
+	if (*columns > TABLE_COLUMNS_INLINE) {
+		*column_data = calloc(*columns, sizeof(int));
 
-	if (i == 0) {
-		return 0;
+		if (*column_data == NULL) {
+			return 0;
+		}
+	} else {
+		*column_data = col_inline;
+		memset(col_inline, 0, *columns * sizeof(int));
 	}
 
-	while ((i < size) && (data[i] == ' ')) {
+	/* Parse the header underline */
+	i++;
+
+	if ((i < size) && (data[i] == '|')) {
 		i++;
 	}
 
-	uint8_t* syn_start = data + i;
+	size_t under_end = i;
 
-	size_t syn_len = 0;
+	while ((under_end < size) && (data[under_end] != '\n')) {
+		under_end++;
+	}
 
-	if ((i < size) && (data[i] == '{')) {
-		i++;
-		syn_start++;
+	size_t col;
 
-		while ((i < size) && (data[i] != '}') && (data[i] != '\n')) {
-			syn_len++;
+	for (col = 0; (col < *columns) && (i < under_end); ++col) {
+		while ((i < under_end) && (data[i] == ' ')) {
 			i++;
 		}
 
-		if ((i == size) || (data[i] != '}')) {
-			return 0;
+		size_t dashes = 0;
+
+		if (data[i] == ':') {
+			i++;
+			(*column_data)[col] |= MKD_TABLE_ALIGN_L;
+			dashes++;
 		}
 
-		/*
-		 * strip all whitespace at the beginning and the end
-		 * of the {} block
-		 */
-		while ((syn_len > 0) && (_isspace(syn_start[0]) != 0)) {
-			syn_start++;
-			syn_len--;
+		while ((i < under_end) && (data[i] == '-')) {
+			i++;
+			dashes++;
 		}
 
-		while ((syn_len > 0) && (_isspace(syn_start[syn_len - 1]) != 0)) {
-			syn_len--;
+		if ((i < under_end) && (data[i] == ':')) {
+			i++;
+			(*column_data)[col] |= MKD_TABLE_ALIGN_R;
+			dashes++;
 		}
 
-		i++;
-	} else {
-		while ((i < size) && (_isspace(data[i]) == 0)) {
-			syn_len++;
+		while ((i < under_end) && (data[i] == ' ')) {
 			i++;
 		}
-	}
 
-	if (syntax != NULL) {
-		syntax->data = syn_start;
-		syntax->size = syn_len;
-	}
+		if ((i < under_end) && (data[i] != '|')) {
+			break;
+		}
 
-	while ((i < size) && (data[i] != '\n')) {
-		if (_isspace(data[i]) == 0) {
-			return 0;
+		if (dashes < 3) {
+			break;
 		}
 
 		i++;
 	}
 
-	return i + 1;
+	if (col < *columns) {
+		return 0;
+	}
+
+	return under_end + 1;
 }
 
-/**
- * returns whether the line is a hash-prefixed header
- */
-static int is_atxheader(struct sd_markdown* rndr, uint8_t* data, size_t size)
+static size_t parse_table(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
 {
-	if (data[0] != '#') {
+	size_t columns;
+	size_t header_end;
+	int col_inline[TABLE_COLUMNS_INLINE];
+	int* col_data = NULL;
+	size_t i = parse_table_header(data, size, &columns, &header_end, &col_data, col_inline);
+
+	if (i == 0) {
+		if (col_data != col_inline) {
+			free(col_data);
+		}
+
 		return 0;
 	}
 
-	if (rndr->ext_flags & MKDEXT_SPACE_HEADERS) {
-		size_t level = 0;
+	struct buf* header_work = rndr_newbuf(rndr, BUFFER_SPAN);
+	struct buf* body_work = rndr_newbuf(rndr, BUFFER_BLOCK);
+	struct buf* row_work = rndr_newbuf(rndr, BUFFER_SPAN);
+	struct buf* cell_work = rndr_newbuf(rndr, BUFFER_SPAN);
 
-		while ((level < size) && (level < 6) && (data[level] == '#')) {
-			level++;
+	if ((header_work == NULL) || (body_work == NULL) || (row_work == NULL) || (cell_work == NULL)) {
+		if (col_data != col_inline) {
+			free(col_data);
 		}
 
-		if ((level < size) && (data[level] != ' ')) {
-			return 0;
-		}
+		return 0;
 	}
 
-	return 1;
-}
-
-/**
- * returns whether the line is a setext-style hdr underline
- */
-static int is_headerline(uint8_t* data, size_t size)
-{
-	size_t i = 0;
+	parse_table_row(header_work, rndr, row_work, cell_work, data, header_end, columns, col_data, MKD_TABLE_HEADER);
 
-	/* test of level 1 header */
-	if (data[i] == '=') {
-		for (i = 1; (i < size) && (data[i] == '='); i++) {
-			;
-		}
+	while (i < size) {
+		uint8_t* eol = memchr(data + i, '\n', size - i);
 
-		while ((i < size) && (data[i] == ' ')) {
-			i++;
+		/* the last line, like the rows without pipes, is left to the following block */
+		if ((eol == NULL) || (memchr(data + i, '|', eol - (data + i)) == NULL)) {
+			break;
 		}
 
-		return ((i >= size) || (data[i] == '\n')) ? (1) : (0);
-	}
-
-	/* test of level 2 header */
-	if (data[i] == '-') {
-		for (i = 1; (i < size) && (data[i] == '-'); i++) {
-			;
-		}
+		size_t row_end = eol - data;
 
-		while ((i < size) && (data[i] == ' ')) {
-			i++;
+		if (rndr->budget_out == 0) {
+			parse_table_row(body_work, rndr, row_work, cell_work, data + i, row_end - i, columns, col_data, MKD_TABLE_NONE);
 		}
 
-		return ((i >= size) || (data[i] == '\n')) ? (2) : (0);
+		i = row_end + 1;
 	}
 
-	return 0;
-}
-
-static int is_next_headerline(uint8_t* data, size_t size)
-{
-	size_t i = 0;
-
-	while ((i < size) && (data[i] != '\n')) {
-		i++;
+	if (rndr->cfg->cb.table != NULL) {
+		rndr->cfg->cb.table(ob, header_work, body_work, rndr->opaque);
 	}
 
-	if (++i >= size) {
-		return 0;
+	if (col_data != col_inline) {
+		free(col_data);
 	}
 
-	return is_headerline(data + i, size - i);
+	rndr_popbuf(rndr, BUFFER_SPAN);
+	rndr_popbuf(rndr, BUFFER_SPAN);
+	rndr_popbuf(rndr, BUFFER_BLOCK);
+	rndr_popbuf(rndr, BUFFER_SPAN);
+
+	return i;
 }
 
 /**
- * returns blockquote prefix length
+ * parsing of one block, returning next uint8_t to parse
  */
-static size_t prefix_quote(uint8_t* data, size_t size)
+static size_t dispatch_block(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
 {
-	size_t i = 0;
+	size_t i;
 
-	if ((i < size) && (data[i] == ' ')) {
-		i++;
-	}
+	if (is_atxheader(rndr, data, size) != 0) {
+		STATS_BLOCK(rndr, SD_STATS_HEADER);
 
-	if ((i < size) && (data[i] == ' ')) {
-		i++;
-	}
+		return parse_atxheader(ob, rndr, data, size);
+	} else if ((data[0] == '<') && (rndr->cfg->cb.blockhtml != NULL) && ((i = parse_htmlblock(ob, rndr, data, size, 1)) != 0)) {
+		STATS_BLOCK(rndr, SD_STATS_BLOCKHTML);
 
-	if ((i < size) && (data[i] == ' ')) {
-		i++;
-	}
+		return i;
+	} else if ((i = is_empty(data, size)) != 0) {
+		return i;
+	} else if (is_hrule(data, size) != 0) {
+		STATS_BLOCK(rndr, SD_STATS_HRULE);
 
-	if ((i < size) && (data[i] == '>')) {
-		if (((i + 1) < size) && (data[i + 1] == ' ')) {
-			return i + 2;
+		if (rndr->cfg->cb.hrule != NULL) {
+			rndr->cfg->cb.hrule(ob, rndr->opaque);
+		}
+
+		for (i = 0; (i < size) && (data[i] != '\n'); i++) {
+			;
 		}
 
 		return i + 1;
-	}
+	} else if (((rndr->cfg->ext_flags & MKDEXT_FENCED_CODE) != 0) && ((i = parse_fencedcode(ob, rndr, data, size)) != 0)) {
+		STATS_BLOCK(rndr, SD_STATS_FENCEDCODE);
 
-	return 0;
-}
+		return i;
+	} else if (((rndr->cfg->ext_flags & MKDEXT_TABLES) != 0) && ((i = parse_table(ob, rndr, data, size)) != 0)) {
+		STATS_BLOCK(rndr, SD_STATS_TABLE);
 
-/**
- * returns prefix length for block code
- */
-static size_t prefix_code(uint8_t* data, size_t size)
-{
-	if ((size > 3) && (data[0] == ' ') && (data[1] == ' ') && (data[2] == ' ') && (data[3] == ' ')) {
-		return 4;
-	}
+		return i;
+	} else if (prefix_quote(data, size) != 0) {
+		STATS_BLOCK(rndr, SD_STATS_BLOCKQUOTE);
 
-	return 0;
+		return parse_blockquote(ob, rndr, data, size);
+	} else if (prefix_code(data, size) != 0) {
+		STATS_BLOCK(rndr, SD_STATS_BLOCKCODE);
+
+		return parse_blockcode(ob, rndr, data, size);
+	} else if (prefix_uli(data, size) != 0) {
+		STATS_BLOCK(rndr, SD_STATS_LIST);
+
+		return parse_list(ob, rndr, data, size, 0);
+	} else if (prefix_oli(data, size) != 0) {
+		STATS_BLOCK(rndr, SD_STATS_LIST);
+
+		return parse_list(ob, rndr, data, size, MKD_LIST_ORDERED);
+	} else {
+		STATS_BLOCK(rndr, SD_STATS_PARAGRAPH);
+
+		return parse_paragraph(ob, rndr, data, size);
+	}
 }
 
+#ifdef SD_STATS
 /**
- * returns ordered list item prefix
+ * parsing of one block, timed by the type it turns out to be
  */
-static size_t prefix_oli(uint8_t* data, size_t size)
+static size_t parse_block_at(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
 {
-	size_t i = 0;
-
-	if ((i < size) && (data[i] == ' ')) {
-		i++;
-	}
-
-	if ((i < size) && (data[i] == ' ')) {
-		i++;
+	if (rndr->stats == NULL) {
+		return dispatch_block(ob, rndr, data, size);
 	}
 
-	if ((i < size) && (data[i] == ' ')) {
-		i++;
-	}
+	int outer = rndr->stats_block;
+	uint64_t start = rndr_clock();
 
-	if ((i >= size) || (data[i] < '0') || (data[i] > '9')) {
-		return 0;
-	}
+	rndr->stats_block = SD_STATS_BLOCK_COUNT;
 
-	while ((i < size) && (data[i] >= '0') && (data[i] <= '9')) {
-		i++;
-	}
+	size_t ret = dispatch_block(ob, rndr, data, size);
 
-	if (((i + 1) >= size) || (data[i] != '.') || (data[i + 1] != ' ')) {
-		return 0;
+	if (rndr->stats_block != SD_STATS_BLOCK_COUNT) {
+		rndr->stats->block_count[rndr->stats_block]++;
+		rndr->stats->block_time[rndr->stats_block] += rndr_clock() - start;
 	}
 
-	if (is_next_headerline(data + i, size - i)) {
-		return 0;
-	}
+	rndr->stats_block = outer;
 
-	return i + 2;
+	return ret;
+}
+#else
+static inline size_t parse_block_at(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
+{
+	return dispatch_block(ob, rndr, data, size);
 }
+#endif
 
 /**
- * returns ordered list item prefix
+ * parsing of a sequence of blocks, returns the size of those parsed
  */
-static size_t prefix_uli(uint8_t* data, size_t size)
+static size_t parse_block(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
 {
-	size_t i = 0;
-
-	if ((i < size) && (data[i] == ' ')) {
-		i++;
-	}
-
-	if ((i < size) && (data[i] == ' ')) {
-		i++;
+	if ((rndr->scan_only != 0) || (rndr->budget_out != 0) || ((rndr->work_bufs[BUFFER_SPAN].size + rndr->work_bufs[BUFFER_BLOCK].size) > rndr->cfg->max_nesting)) {
+		return 0;
 	}
 
-	if ((i < size) && (data[i] == ' ')) {
-		i++;
-	}
+	size_t beg = 0;
 
-	if (((i + 1) >= size) || ((data[i] != '*') && (data[i] != '+') && (data[i] != '-')) || (data[i + 1] != ' ')) {
-		return 0;
-	}
+	while ((beg < size) && ((rndr->has_budget == 0) || (rndr_overbudget(rndr, ob, 1) == 0))) {
+		beg += parse_block_at(ob, rndr, data + beg, size - beg);
 
-	if (is_next_headerline(data + i, size - i)) {
-		return 0;
+		/* streaming out every finished top-level block, not those of containers rendered in place */
+		if ((ob == rndr->stream_ob) && ((rndr->work_bufs[BUFFER_SPAN].size + rndr->work_bufs[BUFFER_BLOCK].size) == 0) && (rndr_flush(rndr, ob) != 0)) {
+			break;
+		}
 	}
 
-	return i + 2;
+	return beg;
 }
 
+/* ********************
+ * PARALLEL RENDERING *
+ **********************/
+
 /**
- * parsing of one block, returning next uint8_t to parse
+ * a run of top-level blocks rendered by a worker
  */
-static void parse_block(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size);
+struct render_chunk
+{
+	size_t beg;
+	size_t end;
+	struct buf* ob;
+	void* opaque;
+
+	/* the output starts with a placeholder byte */
+	int seeded;
+
+	/* the chunk has to be rendered again in sequence */
+	int conflict;
+};
 
 /**
- * handles parsing of a blockquote fragment
+ * chunks shared by all the workers of a render
  */
-static size_t parse_blockquote(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
+struct render_job
 {
-	struct buf* out_ = rndr_newbuf(rndr, BUFFER_BLOCK);
-
-	if (out_ == NULL) {
-		return 0;
-	}
+	uint8_t* data;
+	size_t size;
+	struct render_chunk* chunks;
+	size_t chunk_count;
+	size_t next;
 
-	size_t beg = 0;
-	size_t end = 0;
-	size_t work_size = 0;
-	uint8_t* work_data = NULL;
+	/* context of each worker, the calling thread being the first one */
+	struct sd_markdown** contexts;
 
-	while (beg < size) {
-		for (end = beg + 1; (end < size) && (data[end - 1] != '\n'); end++) {
-			;
-		}
+#if !defined(_WIN32)
+	pthread_mutex_t lock;
+#endif
+};
 
-		size_t pre = prefix_quote(data + beg, end - beg);
+#if !defined(_WIN32)
+struct render_thread
+{
+	struct render_pool* pool;
 
-		if (pre != 0) {
-			/* skipping prefix */
-			beg += pre;
-		} else if ((is_empty(data + beg, end - beg) != 0) && ((end >= size) || ((prefix_quote(data + end, size - end) == 0) && (is_empty(data + end, size - end) == 0)))) {
-			/* empty line followed by non-quote line */
-			break;
-		}
+	/* worker context of the thread, from 1, and the last job it saw */
+	size_t index;
+	unsigned long generation;
+	pthread_t thread;
+};
 
-		if (beg < end) { /* copy into the in-place working buffer */
-			/* bufput(work, data + beg, end - beg); */
-			if (work_data == NULL) {
-				work_data = data + beg;
-			} else if ((data + beg) != (work_data + work_size)) {
-				memmove(work_data + work_size, data + beg, end - beg);
-			}
+/**
+ * threads of the parallel renders of a parser, waiting between them for a job
+ */
+struct render_pool
+{
+	pthread_mutex_t lock;
+	pthread_cond_t posted;
+	pthread_cond_t finished;
+
+	struct render_thread** threads;
+	size_t thread_count;
+
+	/* job of the current render, counted so that each thread takes it once */
+	struct render_job* job;
+	size_t active;
+	unsigned long generation;
+	size_t busy;
+	int stop;
+};
+#endif
 
-			work_size += end - beg;
-		}
+/**
+ * allocates the private parts of a worker context
+ */
+static struct sd_markdown* rndr_newworker(void)
+{
+	struct sd_markdown* ctx = calloc(1, sizeof(struct sd_markdown));
 
-		beg = end;
+	if (ctx == NULL) {
+		return NULL;
 	}
 
-	parse_block(out_, rndr, work_data, work_size);
+	if ((stack_init(&ctx->work_bufs[BUFFER_BLOCK], 4) < 0) || (stack_init(&ctx->work_bufs[BUFFER_SPAN], 8) < 0) || (stack_init(&ctx->work_bufs[BUFFER_MEMO], 4) < 0) || ((ctx->ro_copy = bufnew(256)) == NULL)) {
+		stack_free(&ctx->work_bufs[BUFFER_BLOCK]);
+		stack_free(&ctx->work_bufs[BUFFER_SPAN]);
+		stack_free(&ctx->work_bufs[BUFFER_MEMO]);
+		free(ctx);
 
-	if (rndr->cb.blockquote != NULL) {
-		rndr->cb.blockquote(ob, out_, rndr->opaque);
+		return NULL;
 	}
 
-	rndr_popbuf(rndr, BUFFER_BLOCK);
+	sd_arena_init(&ctx->arena, 0);
 
-	return end;
+	return ctx;
 }
 
-static size_t parse_htmlblock(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size, int do_render);
-
 /**
- * handles parsing of a regular paragraph
+ * makes a worker context render like md, keeping its own pools
  */
-static size_t parse_paragraph(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
+static void rndr_syncworker(struct sd_markdown* ctx, struct sd_markdown* md)
 {
-	size_t i = 0;
-	size_t end = 0;
-	int level = 0;
+	struct stack work_bufs[3];
+	struct buf* ro_copy = ctx->ro_copy;
+	struct close_index close = ctx->close;
+	struct sd_arena arena = ctx->arena;
+
+	memcpy(work_bufs, ctx->work_bufs, sizeof(work_bufs));
+	memcpy(ctx, md, sizeof(struct sd_markdown));
+	memcpy(ctx->work_bufs, work_bufs, sizeof(work_bufs));
+
+	ctx->own_cfg = NULL;
+	ctx->refs.storage = NULL;
+	ctx->refs.storage_size = 0;
+	ctx->footnotes_found.storage = NULL;
+	ctx->footnotes_found.storage_size = 0;
+	memset(&ctx->footnotes_used, 0x00, sizeof(ctx->footnotes_used));
+	ctx->ro_copy = ro_copy;
+	ctx->close = close;
+	ctx->close.end = NULL;
+	ctx->text = NULL;
+	ctx->batch_ob = NULL;
+	ctx->arena = arena;
+	ctx->ref_arena = &ctx->arena;
+	ctx->stream_ob = NULL;
+	ctx->workers = NULL;
+	ctx->worker_count = 0;
+	ctx->pool = NULL;
+	ctx->in_link_body = 0;
+	ctx->emph_memo = NULL;
+	ctx->session = NULL;
+	ctx->ref_log = NULL;
+	ctx->nodes = NULL;
+	ctx->node_slots = NULL;
+	ctx->node_slots_size = 0;
+	ctx->is_worker = 1;
+	ctx->fork_conflict = 0;
+	ctx->spared_failures = 0;
+	ctx->scan_only = 0;
+	ctx->has_budget = 0;
+	ctx->budget_out = 0;
+
+#ifdef SD_STATS
+	ctx->stats = NULL;
+#endif
 
-	while (i < size) {
-		for (end = i + 1; (end < size) && (data[end - 1] != '\n'); end++) {
-			/* empty */
-			;
-		}
+	bufsetgrowth(ctx->ro_copy, ctx->buf_growth, ctx->buf_max_size);
+}
 
-		if (is_empty(data + i, size - i) != 0) {
-			break;
+static void render_worker_main(struct render_job* job, struct sd_markdown* ctx)
+{
+	while (1) {
+#if !defined(_WIN32)
+		pthread_mutex_lock(&job->lock);
+#endif
+
+		size_t n = job->next;
+
+		if (n < job->chunk_count) {
+			job->next++;
 		}
 
-		level = is_headerline(data + i, size - i);
+#if !defined(_WIN32)
+		pthread_mutex_unlock(&job->lock);
+#endif
 
-		if (level != 0) {
+		if (n >= job->chunk_count) {
 			break;
 		}
 
-		if ((is_atxheader(rndr, data + i, size - i) != 0) || (is_hrule(data + i, size - i) != 0) || (prefix_quote(data + i, size - i) != 0)) {
-			end = i;
+		struct render_chunk* chunk = &job->chunks[n];
 
-			break;
+		ctx->opaque = chunk->opaque;
+		ctx->fork_conflict = 0;
+
+		size_t failures = bufgrow_failures();
+		size_t spared = ctx->spared_failures;
+
+		/* the blocks look ahead into the whole text, as in a serial render */
+		for (size_t beg = chunk->beg; beg < chunk->end;) {
+			beg += parse_block_at(chunk->ob, ctx, job->data + beg, job->size - beg);
 		}
 
-		/*
-		 * Early termination of a paragraph with the same logic
-		 * as Markdown 1.0.0. If this logic is applied, the
-		 * Markdown 1.0.3 test suite won't pass cleanly
-		 *
-		 * :: If the first character in a new line is not a letter,
-		 * let's check to see if there's some kind of block starting
-		 * here
-		 */
-		if ((rndr->ext_flags & MKDEXT_LAX_SPACING) && (isalnum(data[i]) == 0)) {
-			if ((prefix_oli(data + i, size - i) != 0) || (prefix_uli(data + i, size - i) != 0)) {
-				end = i;
+		chunk->conflict = ctx->fork_conflict;
 
-				break;
-			}
+		/* a chunk short of memory is rendered again in sequence, where a failure counts */
+		if (bufgrow_failures() != failures) {
+			chunk->conflict = 1;
+			ctx->spared_failures = spared + (bufgrow_failures() - failures);
+		}
+	}
+}
 
-			/* see if an html block starts here */
-			if ((data[i] == '<') && (rndr->cb.blockhtml != NULL) && (parse_htmlblock(ob, rndr, data + i, size - i, 0) != 0)) {
-				end = i;
+#if !defined(_WIN32)
+static void* render_thread_main(void* arg)
+{
+	struct render_thread* thread = arg;
+	struct render_pool* pool = thread->pool;
 
-				break;
-			}
+	pthread_mutex_lock(&pool->lock);
 
-			/* see if a code fence starts here */
-			if (((rndr->ext_flags & MKDEXT_FENCED_CODE) != 0) && (is_codefence(data + i, size - i, NULL) != 0)) {
-				end = i;
+	while (1) {
+		while ((pool->stop == 0) && (pool->generation == thread->generation)) {
+			pthread_cond_wait(&pool->posted, &pool->lock);
+		}
 
-				break;
-			}
+		if (pool->stop != 0) {
+			break;
 		}
 
-		i = end;
-	}
+		thread->generation = pool->generation;
 
-	struct buf work = {data, 0, 0, 0};
+		struct render_job* job = pool->job;
+		int active = (thread->index < pool->active);
 
-	work.size = i;
+		pthread_mutex_unlock(&pool->lock);
 
-	while ((work.size != 0) && (data[work.size - 1] == '\n')) {
-		work.size--;
+		if (active != 0) {
+			render_worker_main(job, job->contexts[thread->index]);
+		}
+
+		pthread_mutex_lock(&pool->lock);
+
+		if (--pool->busy == 0) {
+			pthread_cond_signal(&pool->finished);
+		}
 	}
 
-	if (level == 0) {
-		struct buf* tmp = rndr_newbuf(rndr, BUFFER_BLOCK);
+	pthread_mutex_unlock(&pool->lock);
 
-		if (tmp == NULL) {
+	return NULL;
+}
+
+/**
+ * makes sure the pool of md has count threads, starting it if needed; returns
+ * how many it has, which may be fewer
+ */
+static size_t render_pool_grow(struct sd_markdown* md, size_t count)
+{
+	struct render_pool* pool = md->pool;
+
+	if (pool == NULL) {
+		if ((pool = calloc(1, sizeof(struct render_pool))) == NULL) {
 			return 0;
 		}
 
-		parse_inline(tmp, rndr, work.data, work.size);
+		if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+			free(pool);
 
-		if (rndr->cb.paragraph != NULL) {
-			rndr->cb.paragraph(ob, tmp, rndr->opaque);
+			return 0;
 		}
 
-		rndr_popbuf(rndr, BUFFER_BLOCK);
-	} else {
-		if (work.size != 0) {
-			i = work.size;
-			work.size -= 1;
+		if (pthread_cond_init(&pool->posted, NULL) != 0) {
+			pthread_mutex_destroy(&pool->lock);
+			free(pool);
 
-			while ((work.size != 0) && (data[work.size] != '\n')) {
-				work.size -= 1;
-			}
+			return 0;
+		}
 
-			size_t beg = work.size + 1;
+		if (pthread_cond_init(&pool->finished, NULL) != 0) {
+			pthread_cond_destroy(&pool->posted);
+			pthread_mutex_destroy(&pool->lock);
+			free(pool);
 
-			while ((work.size != 0) && (data[work.size - 1] == '\n')) {
-				work.size -= 1;
-			}
+			return 0;
+		}
 
-			if (work.size > 0) {
-				struct buf* tmp = rndr_newbuf(rndr, BUFFER_BLOCK);
+		md->pool = pool;
+	}
 
-				if (tmp == NULL) {
-					return 0;
-				}
+	if (pool->thread_count >= count) {
+		return pool->thread_count;
+	}
 
-				parse_inline(tmp, rndr, work.data, work.size);
+	struct render_thread** threads = realloc(pool->threads, count * sizeof(struct render_thread*));
 
-				if (rndr->cb.paragraph != NULL) {
-					rndr->cb.paragraph(ob, tmp, rndr->opaque);
-				}
+	if (threads == NULL) {
+		return pool->thread_count;
+	}
 
-				rndr_popbuf(rndr, BUFFER_BLOCK);
-				work.data += beg;
-				work.size = i - beg;
-			} else {
-				work.size = i;
-			}
-		}
+	pool->threads = threads;
 
-		struct buf* header_work = rndr_newbuf(rndr, BUFFER_SPAN);
+	/* no job is posted while the main thread is here, the new threads wait for the next one */
+	while (pool->thread_count < count) {
+		struct render_thread* thread = malloc(sizeof(struct render_thread));
 
-		if (header_work == NULL) {
-			return 0;
+		if (thread == NULL) {
+			break;
 		}
 
-		parse_inline(header_work, rndr, work.data, work.size);
+		thread->pool = pool;
+		thread->index = pool->thread_count + 1;
+		thread->generation = pool->generation;
 
-		if (rndr->cb.header != NULL) {
-			rndr->cb.header(ob, header_work, (int) level, rndr->opaque);
+		if (pthread_create(&thread->thread, NULL, render_thread_main, thread) != 0) {
+			free(thread);
+
+			break;
 		}
 
-		rndr_popbuf(rndr, BUFFER_SPAN);
+		pool->threads[pool->thread_count++] = thread;
 	}
 
-	return end;
+	return pool->thread_count;
 }
 
 /**
- * handles parsing of a block-level code fragment
+ * renders job with the first active workers, the calling thread being the first
  */
-static size_t parse_fencedcode(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
+static void render_pool_run(struct render_pool* pool, struct render_job* job, size_t active)
 {
-	struct buf lang = {NULL, 0, 0, 0};
-	size_t beg = is_codefence(data, size, &lang);
+	pthread_mutex_lock(&pool->lock);
+	pool->job = job;
+	pool->active = active;
+	pool->busy = pool->thread_count;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->posted);
+	pthread_mutex_unlock(&pool->lock);
 
-	if (beg == 0) {
-		return 0;
+	render_worker_main(job, job->contexts[0]);
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (pool->busy != 0) {
+		pthread_cond_wait(&pool->finished, &pool->lock);
 	}
 
-	struct buf* work = rndr_newbuf(rndr, BUFFER_BLOCK);
+	pool->job = NULL;
+	pthread_mutex_unlock(&pool->lock);
+}
 
-	if (work == NULL) {
-		return 0;
+static void render_pool_free(struct render_pool* pool)
+{
+	if (pool == NULL) {
+		return;
 	}
 
-	size_t end;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->posted);
+	pthread_mutex_unlock(&pool->lock);
 
-	while (beg < size) {
-		struct buf fence_trail = {NULL, 0, 0, 0};
+	for (size_t i = 0; i < pool->thread_count; ++i) {
+		pthread_join(pool->threads[i]->thread, NULL);
+		free(pool->threads[i]);
+	}
 
-		size_t fence_end = is_codefence(data + beg, size - beg, &fence_trail);
+	free(pool->threads);
+	pthread_cond_destroy(&pool->finished);
+	pthread_cond_destroy(&pool->posted);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+#endif
 
-		if ((fence_end != 0) && (fence_trail.size == 0)) {
-			beg += fence_end;
+static void scan_blockhtml(struct buf* ob, const struct buf* text, void* opaque)
+{
+}
 
-			break;
-		}
+/**
+ * makes sure md has at least count worker contexts, returns 0 on success
+ */
+static int rndr_getworkers(struct sd_markdown* md, size_t count)
+{
+	if (md->worker_count >= count) {
+		return 0;
+	}
 
-		for (end = beg + 1; (end < size) && (data[end - 1] != '\n'); end++) {
-			;
-		}
+	struct sd_markdown** workers = realloc(md->workers, count * sizeof(struct sd_markdown*));
 
-		if (beg < end) {
-			/*
-			 * verbatim copy to the working buffer,
-			 * escaping entities
-			 */
-			if (is_empty(data + beg, end - beg) != 0) {
-				bufputc(work, '\n');
-			} else {
-				bufput(work, data + beg, end - beg);
-			}
+	if (workers == NULL) {
+		return -1;
+	}
+
+	md->workers = workers;
+
+	while (md->worker_count < count) {
+		if ((md->workers[md->worker_count] = rndr_newworker()) == NULL) {
+			return -1;
 		}
 
-		beg = end;
+		md->worker_count++;
 	}
 
-	if ((work->size != 0) && (work->data[work->size - 1] != '\n')) {
-		bufputc(work, '\n');
+	return 0;
+}
+
+/**
+ * sets up the first worker context to measure the top-level blocks of md
+ * with parse_block_at without rendering them; scan_cfg is its configuration
+ */
+static struct sd_markdown* rndr_getscanner(struct sd_markdown* md, struct sd_markdown_config* scan_cfg)
+{
+	if (rndr_getworkers(md, 1) != 0) {
+		return NULL;
 	}
 
-	if (rndr->cb.blockcode != NULL) {
-		rndr->cb.blockcode(ob, work, (lang.size != 0) ? (&lang) : (NULL), rndr->opaque);
+	struct sd_markdown* scan = md->workers[0];
+
+	memcpy(scan_cfg, md->cfg, sizeof(struct sd_markdown_config));
+	memset(&scan_cfg->cb, 0x00, sizeof(struct sd_callbacks));
+
+	if (md->cfg->cb.blockhtml != NULL) {
+		scan_cfg->cb.blockhtml = scan_blockhtml;
 	}
 
-	rndr_popbuf(rndr, BUFFER_BLOCK);
+	rndr_syncworker(scan, md);
+	scan->cfg = scan_cfg;
+	scan->opaque = NULL;
+	scan->scan_only = 1;
 
-	return beg;
+	return scan;
 }
 
-static size_t parse_blockcode(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
+/**
+ * renders the top-level blocks on several threads; returns non-zero
+ * without rendering anything when the text cannot be split
+ */
+static int parse_block_parallel(struct buf* ob, struct sd_markdown* md, uint8_t* data, size_t size)
 {
-	struct buf* work = rndr_newbuf(rndr, BUFFER_BLOCK);
+#if defined(_WIN32)
+	return -1;
+#else
+	if ((md->cfg->cb.fork == NULL) || (md->cfg->cb.join == NULL) || (size < (2 * PARALLEL_CHUNK_MIN))) {
+		return -1;
+	}
 
-	if (work == NULL) {
-		return 0;
+	/* getting the worker contexts */
+	if (rndr_getworkers(md, md->threads) != 0) {
+		return -1;
 	}
 
-	size_t beg = 0;
-	size_t end;
+	if ((md->ro_copy == NULL) && ((md->ro_copy = bufnew(256)) == NULL)) {
+		return -1;
+	}
 
-	while (beg < size) {
-		for (end = beg + 1; (end < size) && (data[end - 1] != '\n'); end++) {
+	/* the text is shared by the workers, none may compact it in place */
+	const uint8_t* ro_begin = md->ro_begin;
+	const uint8_t* ro_end = md->ro_end;
+
+	md->ro_begin = data;
+	md->ro_end = data + size;
+
+	/* first pass on the extent of the top-level blocks, to split the text */
+	size_t target = size / (md->threads * 4);
+
+	if (target < PARALLEL_CHUNK_MIN) {
+		target = PARALLEL_CHUNK_MIN;
+	}
+
+	struct render_job job;
+
+	job.data = data;
+	job.size = size;
+	job.chunk_count = 0;
+	job.next = 0;
+	job.chunks = malloc(((size / target) + 1) * sizeof(struct render_chunk));
+
+	if (job.chunks == NULL) {
+		md->ro_begin = ro_begin;
+		md->ro_end = ro_end;
+
+		return -1;
+	}
+
+	struct sd_markdown_config scan_cfg;
+	struct sd_markdown* scan = rndr_getscanner(md, &scan_cfg);
+	struct buf* scratch = rndr_newbuf(scan, BUFFER_BLOCK);
+
+	if (scratch != NULL) {
+		size_t beg = 0;
+
+		while (beg < size) {
+			if ((job.chunk_count == 0) || ((beg - job.chunks[job.chunk_count - 1].beg) >= target)) {
+				job.chunks[job.chunk_count++].beg = beg;
+			}
+
+			beg += parse_block_at(scratch, scan, data + beg, size - beg);
 		}
 
-		size_t pre = prefix_code(data + beg, end - beg);
+		rndr_popbuf(scan, BUFFER_BLOCK);
+	}
 
-		if (pre != 0) {
-			/* skipping prefix */
-			beg += pre;
-		} else if (is_empty(data + beg, end - beg) == 0) {
-			/* non-empty non-prefixed line breaks the pre */
-			break;
+	int ret = -1;
+	size_t forked = 0;
+
+	if (job.chunk_count < 2) {
+		goto cleanup;
+	}
+
+	/* the chunks speculate on the renderer state and on a non-empty output */
+	for (forked = 0; forked < job.chunk_count; forked++) {
+		struct render_chunk* chunk = &job.chunks[forked];
+
+		chunk->end = ((forked + 1) < job.chunk_count) ? (job.chunks[forked + 1].beg) : (size);
+		chunk->seeded = (forked != 0) || (ob->size != 0);
+		chunk->conflict = 0;
+		chunk->ob = bufnew(64);
+
+		if (chunk->ob == NULL) {
+			goto cleanup;
 		}
 
-		if (beg < end) {
-			/*
-			 * verbatim copy to the working buffer,
-			 * escaping entities
-			 */
-			if (is_empty(data + beg, end - beg) != 0) {
-				bufputc(work, '\n');
-			} else {
-				bufput(work, data + beg, end - beg);
-			}
+		bufsetgrowth(chunk->ob, md->buf_growth, md->buf_max_size);
+
+		if (chunk->seeded != 0) {
+			bufputc(chunk->ob, '\0');
+		}
+
+		chunk->opaque = md->cfg->cb.fork(md->opaque);
+
+		if (chunk->opaque == NULL) {
+			bufrelease(chunk->ob);
+
+			goto cleanup;
 		}
+	}
+
+	/* no more workers than chunks, the threads being kept for the next renders */
+	size_t active = (job.chunk_count < md->threads) ? (job.chunk_count) : (md->threads);
+	size_t ready = render_pool_grow(md, active - 1);
+
+	if ((ready + 1) < active) {
+		active = ready + 1;
+	}
+
+	/* without another thread, the blocks are better rendered in sequence */
+	if ((active < 2) || (active > md->worker_count) || (pthread_mutex_init(&job.lock, NULL) != 0)) {
+		goto cleanup;
+	}
 
-		beg = end;
+	job.contexts = md->workers;
+
+	for (size_t w = 0; w < active; w++) {
+		rndr_syncworker(md->workers[w], md);
 	}
 
-	while ((work->size != 0) && (work->data[work->size - 1] == '\n')) {
-		work->size -= 1;
+	render_pool_run(md->pool, &job, active);
+	pthread_mutex_destroy(&job.lock);
+
+	/* the calling thread rendered with the first worker */
+	md->spared_failures += md->workers[0]->spared_failures;
+
+	/* merging in order, rendering again whatever was mispredicted */
+	for (size_t n = 0; n < job.chunk_count; n++) {
+		struct render_chunk* chunk = &job.chunks[n];
+		int discard = (chunk->conflict != 0) || ((chunk->seeded != 0) != (ob->size != 0));
+
+		if ((md->cfg->cb.join(md->opaque, chunk->opaque, (discard != 0) ? (SD_JOIN_DISCARD) : (0)) == 0) && (discard == 0)) {
+			bufput(ob, chunk->ob->data + chunk->seeded, chunk->ob->size - chunk->seeded);
+		} else {
+			for (size_t beg = chunk->beg; beg < chunk->end;) {
+				beg += parse_block_at(ob, md, data + beg, size - beg);
+			}
+		}
+
+		bufrelease(chunk->ob);
 	}
 
-	bufputc(work, '\n');
+	forked = 0;
+	ret = 0;
 
-	if (rndr->cb.blockcode != NULL) {
-		rndr->cb.blockcode(ob, work, NULL, rndr->opaque);
+cleanup:
+	while (forked > 0) {
+		forked--;
+		md->cfg->cb.join(md->opaque, job.chunks[forked].opaque, SD_JOIN_DISCARD);
+		bufrelease(job.chunks[forked].ob);
 	}
 
-	rndr_popbuf(rndr, BUFFER_BLOCK);
+	free(job.chunks);
+	md->ro_begin = ro_begin;
+	md->ro_end = ro_end;
 
-	return beg;
+	return ret;
+#endif
 }
 
+/* ***********************
+ * INCREMENTAL RENDERING *
+ *************************/
+
 /**
- * parsing of a single list item
+ * a top-level block rendered by a session, kept for the next render
  */
-/* assuming initial prefix is already removed */
-static size_t parse_listitem(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size, int* flags)
+struct session_block
 {
-	size_t orgpre = 0;
+	unsigned int hash;
 
-	/* keeping track of the first indentation prefix */
-	while ((orgpre < 3) && (orgpre < size) && (data[orgpre] == ' ')) {
-		orgpre++;
-	}
+	/* next block of the index with the same hash, one-based */
+	size_t same;
 
-	size_t beg = prefix_uli(data, size);
+	/* source, output and references used, offsets in the generation buffers */
+	size_t src;
+	size_t src_size;
+	size_t out;
+	size_t out_size;
+	size_t refs;
+	size_t refs_size;
 
-	if (beg == 0) {
-		beg = prefix_oli(data, size);
-	}
+	/* whether the output was not empty before the block */
+	int seeded;
 
-	if (beg == 0) {
-		return 0;
-	}
+	/* renderer state from cb.fork, the block rendered from and left, or NULL once taken */
+	void* state;
+};
 
-	/* skipping to the beginning of the following line */
-	size_t end = beg;
+/**
+ * the blocks of one render
+ */
+struct session_gen
+{
+	struct buf* src;
+	struct buf* out;
+	struct buf* refs;
 
-	while ((end < size) && (data[end - 1] != '\n')) {
-		end++;
+	struct session_block* blocks;
+	size_t count;
+	size_t asize;
+};
+
+struct sd_markdown_session
+{
+	struct sd_markdown* md;
+
+	/* blocks of the last render, and of the current one */
+	struct session_gen gen[2];
+	int last;
+
+	/* open-addressing index of the last blocks by hash, one-based */
+	size_t* index;
+	size_t index_size;
+
+	/* output of a block being rendered, and its references */
+	struct buf* stage;
+	struct buf* ref_log;
+};
+
+static unsigned int hash_block(const uint8_t* data, size_t size)
+{
+	unsigned int hash = 2166136261U;
+
+	for (size_t i = 0; i < size; ++i) {
+		hash = (hash ^ data[i]) * 16777619U;
 	}
 
-	/* getting working buffers */
-	struct buf* work = rndr_newbuf(rndr, BUFFER_SPAN);
+	return hash;
+}
 
-	if (work == NULL) {
+static int ref_log_get(const uint8_t** log, const uint8_t* end, const uint8_t** data, size_t* size)
+{
+	if ((size_t) (end - *log) < sizeof(size_t)) {
 		return 0;
 	}
 
-	struct buf* inter = rndr_newbuf(rndr, BUFFER_SPAN);
+	memcpy(size, *log, sizeof(size_t));
+	*log += sizeof(size_t);
 
-	if (inter == NULL) {
+	if ((size_t) (end - *log) < *size) {
 		return 0;
 	}
 
-	/* putting the first line into the working buffer */
-	bufput(work, data + beg, end - beg);
-	beg = end;
+	*data = *log;
+	*log += *size;
 
-	size_t sublist = 0;
-	int in_empty = 0;
-	int has_inside_empty = 0;
-	int in_fence = 0;
+	return 1;
+}
 
-	/* process the following lines */
-	while (beg < size) {
-		end++;
+/**
+ * whether the references logged by a block still resolve the same
+ */
+static int ref_log_valid(struct sd_markdown* md, const uint8_t* log, size_t size)
+{
+	const uint8_t* end = log + size;
 
-		while ((end < size) && (data[end - 1] != '\n')) {
-			end++;
+	while (log < end) {
+		const uint8_t* name;
+		const uint8_t* link;
+		const uint8_t* title;
+		size_t name_size, link_size, title_size;
+
+		if ((ref_log_get(&log, end, &name, &name_size) == 0) || (log >= end)) {
+			return 0;
 		}
 
-		/* process an empty line */
-		if (is_empty(data + beg, end - beg) != 0) {
-			in_empty = 1;
-			beg = end;
+		struct link_ref* lr = ref_table_find(&md->refs, name, name_size);
+		uint8_t found = *log++;
 
-			continue;
+		if (found != (lr != NULL)) {
+			return 0;
 		}
 
-		/* calculating the indentation */
-		size_t i = 0;
+		if (lr == NULL) {
+			continue;
+		}
 
-		while ((i < 4) && ((beg + i) < end) && (data[beg + i] == ' ')) {
-			i++;
+		if ((ref_log_get(&log, end, &link, &link_size) == 0) || (ref_log_get(&log, end, &title, &title_size) == 0)) {
+			return 0;
 		}
 
-		size_t pre = i;
+		if ((lr->link->size != link_size) || (memcmp(lr->link->data, link, link_size) != 0)) {
+			return 0;
+		}
 
-		if (rndr->ext_flags & MKDEXT_FENCED_CODE) {
-			if (is_codefence(data + beg + i, end - beg - i, NULL) != 0) {
-				in_fence = in_fence == 0;
+		if (lr->title == NULL) {
+			if (title_size != 0) {
+				return 0;
 			}
+		} else if ((lr->title->size != title_size) || (memcmp(lr->title->data, title, title_size) != 0)) {
+			return 0;
 		}
+	}
 
-		size_t has_next_uli = 0;
-		size_t has_next_oli = 0;
+	return 1;
+}
 
-		/*
-		 * Only check for new list items if we are **not** inside
-		 * a fenced code block
-		 */
-		if (in_fence == 0) {
-			has_next_uli = prefix_uli(data + beg + i, end - beg - i);
-			has_next_oli = prefix_oli(data + beg + i, end - beg - i);
+static void session_gen_reset(struct sd_markdown* md, struct session_gen* gen)
+{
+	for (size_t i = 0; i < gen->count; ++i) {
+		if (gen->blocks[i].state != NULL) {
+			md->cfg->cb.join(md->opaque, gen->blocks[i].state, SD_JOIN_DISCARD);
 		}
+	}
 
-		/* checking for ul/ol switch */
-		if ((in_empty != 0) && (((*flags & MKD_LIST_ORDERED) && (has_next_uli != 0)) || ((!(*flags & MKD_LIST_ORDERED)) && (has_next_oli != 0)))) {
-			*flags |= MKD_LI_END;
+	gen->count = 0;
+	gen->src->size = 0;
+	gen->out->size = 0;
+	gen->refs->size = 0;
+}
 
-			/* the following item must have same list type */
-			break;
+/**
+ * appends a block to a generation, its source being already in gen->src
+ * at offset src; takes over its renderer state, returns 0 when out of memory
+ */
+static int session_gen_add(struct session_gen* gen, unsigned int hash, size_t src, size_t src_size, const uint8_t* out, size_t out_size, const uint8_t* refs, size_t refs_size, int seeded, void* state)
+{
+	if (gen->src->size != (src + src_size)) {
+		return 0;
+	}
+
+	if (gen->count == gen->asize) {
+		size_t asize = (gen->asize != 0) ? (gen->asize * 2) : (64);
+		struct session_block* blocks = realloc(gen->blocks, asize * sizeof(struct session_block));
+
+		if (blocks == NULL) {
+			return 0;
 		}
 
-		/* checking for a new item */
-		if (((has_next_uli != 0) && (is_hrule(data + beg + i, end - beg - i) == 0)) || (has_next_oli != 0)) {
-			if (in_empty != 0) {
-				has_inside_empty = 1;
-			}
+		gen->blocks = blocks;
+		gen->asize = asize;
+	}
 
-			if (pre == orgpre) { /* the following item must have */
-				/* the same indentation */
-				break;
-			}
+	struct session_block* block = &gen->blocks[gen->count];
 
-			if (sublist == 0) {
-				sublist = work->size;
-			}
-		} else if ((in_empty != 0) && (pre == 0)) {
-			/*
-			 * joining only indented stuff after empty lines;
-			 * note that now we only require 1 space of indentation
-			 * to continue a list
-			 */
-			*flags |= MKD_LI_END;
+	block->hash = hash;
+	block->src = src;
+	block->src_size = src_size;
+	block->out = gen->out->size;
+	block->out_size = out_size;
+	block->refs = gen->refs->size;
+	block->refs_size = refs_size;
+	block->seeded = seeded;
+	block->state = state;
 
-			break;
-		} else if (in_empty != 0) {
-			bufputc(work, '\n');
-			has_inside_empty = 1;
-		}
+	bufput(gen->out, out, out_size);
+	bufput(gen->refs, refs, refs_size);
 
-		in_empty = 0;
+	/* a buffer which could not grow */
+	if ((gen->out->size != (block->out + out_size)) || (gen->refs->size != (block->refs + refs_size))) {
+		gen->out->size = block->out;
+		gen->refs->size = block->refs;
 
-		/* adding the line without prefix into the working buffer */
-		bufput(work, data + beg + i, end - beg - i);
-		beg = end;
+		return 0;
 	}
 
-	/* render of li contents */
-	if (has_inside_empty != 0) {
-		*flags |= MKD_LI_BLOCK;
+	gen->count++;
+
+	return 1;
+}
+
+/**
+ * indexes the blocks of the last render by hash, chaining those which share
+ * one in document order; returns 0 when out of memory
+ */
+static int session_index(struct sd_markdown_session* session)
+{
+	struct session_gen* last = &session->gen[session->last];
+	size_t size = 64;
+
+	while (size < (last->count * 2)) {
+		size <<= 1;
 	}
 
-	if (*flags & MKD_LI_BLOCK) {
-		/* intermediate render of block li */
-		if ((sublist != 0) && (sublist < work->size)) {
-			parse_block(inter, rndr, work->data, sublist);
-			parse_block(inter, rndr, work->data + sublist, work->size - sublist);
-		} else {
-			parse_block(inter, rndr, work->data, work->size);
-		}
-	} else {
-		/* intermediate render of inline li */
-		if ((sublist != 0) && (sublist < work->size)) {
-			parse_inline(inter, rndr, work->data, sublist);
-			parse_block(inter, rndr, work->data + sublist, work->size - sublist);
-		} else {
-			parse_inline(inter, rndr, work->data, work->size);
+	if (session->index_size < size) {
+		size_t* index = realloc(session->index, size * sizeof(size_t));
+
+		if (index == NULL) {
+			return 0;
 		}
+
+		session->index = index;
+		session->index_size = size;
 	}
 
-	/* render of li itself */
-	if (rndr->cb.listitem != NULL) {
-		rndr->cb.listitem(ob, inter, *flags, rndr->opaque);
+	memset(session->index, 0x00, session->index_size * sizeof(size_t));
+
+	for (size_t n = last->count; n > 0; --n) {
+		struct session_block* block = &last->blocks[n - 1];
+		size_t i = block->hash & (session->index_size - 1);
+
+		while ((session->index[i] != 0) && (last->blocks[session->index[i] - 1].hash != block->hash)) {
+			i = (i + 1) & (session->index_size - 1);
+		}
+
+		block->same = session->index[i];
+		session->index[i] = n;
 	}
 
-	rndr_popbuf(rndr, BUFFER_SPAN);
-	rndr_popbuf(rndr, BUFFER_SPAN);
+	return 1;
+}
 
-	return beg;
+static int session_block_is(struct sd_markdown_session* session, const struct session_block* block, const uint8_t* data, size_t size, int seeded)
+{
+	const struct session_gen* last = &session->gen[session->last];
+
+	return (block->state != NULL) && (block->seeded == seeded) && (block->src_size == size) && (memcmp(last->src->data + block->src, data, size) == 0) && (ref_log_valid(session->md, last->refs->data + block->refs, block->refs_size) != 0);
 }
 
 /**
- * parsing ordered or unordered list block
+ * finds a block of the last render with the same source and surroundings,
+ * trying the one after the previous match before hashing the source
  */
-static size_t parse_list(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size, int flags)
+static struct session_block* session_find(struct sd_markdown_session* session, const uint8_t* data, size_t size, int seeded, size_t* next, unsigned int* hash)
 {
-	struct buf* work = rndr_newbuf(rndr, BUFFER_BLOCK);
+	struct session_gen* last = &session->gen[session->last];
 
-	if (work == NULL) {
-		return 0;
+	if ((*next < last->count) && (session_block_is(session, &last->blocks[*next], data, size, seeded) != 0)) {
+		*hash = last->blocks[*next].hash;
+
+		return &last->blocks[(*next)++];
 	}
 
-	size_t i = 0;
+	*hash = hash_block(data, size);
 
-	while (i < size) {
-		size_t j = parse_listitem(work, rndr, data + i, size - i, &flags);
-		i += j;
+	size_t i = *hash & (session->index_size - 1);
 
-		if ((j == 0) || (flags & MKD_LI_END)) {
-			break;
-		}
+	while ((session->index[i] != 0) && (last->blocks[session->index[i] - 1].hash != *hash)) {
+		i = (i + 1) & (session->index_size - 1);
 	}
 
-	if (rndr->cb.list != NULL) {
-		rndr->cb.list(ob, work, flags, rndr->opaque);
-	}
+	for (size_t n = session->index[i]; n != 0; n = last->blocks[n - 1].same) {
+		if (session_block_is(session, &last->blocks[n - 1], data, size, seeded) != 0) {
+			*next = n;
 
-	rndr_popbuf(rndr, BUFFER_BLOCK);
+			return &last->blocks[n - 1];
+		}
+	}
 
-	return i;
+	return NULL;
 }
 
 /**
- * parsing of atx-style headers
+ * renders the top-level blocks, splicing the output the last render had
+ * for those with the same source; returns non-zero without rendering
+ * anything when the renderer cannot fork its state
  */
-static size_t parse_atxheader(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
+static int parse_block_session(struct buf* ob, struct sd_markdown* md, uint8_t* data, size_t size)
 {
-	size_t level = 0;
+	struct sd_markdown_session* session = md->session;
+	struct session_gen* last = &session->gen[session->last];
+	struct session_gen* gen = &session->gen[session->last ^ 1];
 
-	while ((level < size) && (level < 6) && (data[level] == '#')) {
-		level++;
+	if ((md->cfg->cb.fork == NULL) || (md->cfg->cb.join == NULL) || (session_index(session) == 0)) {
+		return -1;
 	}
 
-	size_t i;
+	/* the scanner reads ahead of the blocks, which may not be compacted in place */
+	const uint8_t* ro_begin = md->ro_begin;
+	const uint8_t* ro_end = md->ro_end;
+	struct sd_markdown_config scan_cfg;
 
-	for (i = level; (i < size) && (data[i] == ' '); i++) {
-		;
-	}
+	md->ro_begin = data;
+	md->ro_end = data + size;
 
-	size_t end;
+	struct sd_markdown* scan = rndr_getscanner(md, &scan_cfg);
+	struct buf* scratch = (scan != NULL) ? (rndr_newbuf(scan, BUFFER_BLOCK)) : (NULL);
 
-	for (end = i; (end < size) && (data[end] != '\n'); end++) {
-		;
+	md->ro_begin = ro_begin;
+	md->ro_end = ro_end;
+
+	if (scratch == NULL) {
+		return -1;
 	}
 
-	size_t skip = end;
+	size_t next = 0;
 
-	while ((end != 0) && (data[end - 1] == '#')) {
-		end--;
-	}
+	for (size_t beg = 0; (beg < size) && ((md->has_budget == 0) || (rndr_overbudget(md, ob, 1) == 0));) {
+		size_t block_size = parse_block_at(scratch, scan, data + beg, size - beg);
+		unsigned int hash;
+		int seeded = (ob->size != 0);
+		struct session_block* block = session_find(session, data + beg, block_size, seeded, &next, &hash);
 
-	while ((end != 0) && (data[end - 1] == ' ')) {
-		end--;
-	}
+		/* same source, references and surroundings, and the renderer state still fits */
+		if ((block != NULL) && (md->cfg->cb.join(md->opaque, block->state, SD_JOIN_KEEP) == 0)) {
+			size_t src = gen->src->size;
 
-	if (end > i) {
-		struct buf* work = rndr_newbuf(rndr, BUFFER_SPAN);
+			bufput(ob, last->out->data + block->out, block->out_size);
+			bufput(gen->src, data + beg, block_size);
 
-		if (work == NULL) {
-			return 0;
-		}
+			if (session_gen_add(gen, hash, src, block_size, last->out->data + block->out, block->out_size, last->refs->data + block->refs, block->refs_size, seeded, block->state) != 0) {
+				block->state = NULL;
+			} else {
+				gen->src->size = src;
+			}
 
-		parse_inline(work, rndr, data + i, end - i);
+			beg += block_size;
 
-		if (rndr->cb.header != NULL) {
-			rndr->cb.header(ob, work, (int) level, rndr->opaque);
+			continue;
 		}
 
-		rndr_popbuf(rndr, BUFFER_SPAN);
-	}
-
-	return skip;
-}
+		void* state = md->cfg->cb.fork(md->opaque);
 
-/**
- * parse a single footnote definition
- */
-static void parse_footnote_def(struct buf* ob, struct sd_markdown* rndr, unsigned int num, uint8_t* data, size_t size)
-{
-	struct buf* work = rndr_newbuf(rndr, BUFFER_SPAN);
+		if (state == NULL) {
+			beg += parse_block_at(ob, md, data + beg, size - beg);
 
-	if (work == NULL) {
-		return;
-	}
+			continue;
+		}
 
-	parse_block(work, rndr, data, size);
+		/* keeping the source, as blockquotes compact theirs in place */
+		size_t src = gen->src->size;
+		bufput(gen->src, data + beg, block_size);
 
-	if (rndr->cb.footnote_def != NULL) {
-		rndr->cb.footnote_def(ob, work, num, rndr->opaque);
-	}
+		void* opaque = md->opaque;
 
-	rndr_popbuf(rndr, BUFFER_SPAN);
-}
+		session->stage->size = 0;
+		session->ref_log->size = 0;
 
-/**
- * render the contents of the footnotes
- */
-static void parse_footnote_list(struct buf* ob, struct sd_markdown* rndr, struct footnote_list* footnotes)
-{
-	if (footnotes->count == 0) {
-		return;
-	}
+		if (seeded != 0) {
+			bufputc(session->stage, '\0');
+		}
 
-	struct buf* work = rndr_newbuf(rndr, BUFFER_BLOCK);
+		md->opaque = state;
+		md->ref_log = session->ref_log;
+		md->used_footnote = 0;
 
-	if (work == NULL) {
-		return;
-	}
+		parse_block_at(session->stage, md, data + beg, size - beg);
 
-	struct footnote_item* item = footnotes->head;
+		md->opaque = opaque;
+		md->ref_log = NULL;
 
-	while (item != NULL) {
-		struct footnote_ref* ref_ = item->ref_;
-		parse_footnote_def(work, rndr, ref_->num, ref_->contents->data, ref_->contents->size);
-		item = item->next;
-	}
+		md->cfg->cb.join(md->opaque, state, SD_JOIN_KEEP);
+		bufput(ob, session->stage->data + seeded, session->stage->size - seeded);
+
+		/* footnote numbers depend on the whole document, and a block cut short is not the block */
+		if ((md->used_footnote != 0) || (md->budget_out != 0) || (session_gen_add(gen, hash, src, block_size, session->stage->data + seeded, session->stage->size - seeded, session->ref_log->data, session->ref_log->size, seeded, state) == 0)) {
+			md->cfg->cb.join(md->opaque, state, SD_JOIN_DISCARD);
+			gen->src->size = src;
+		}
 
-	if (rndr->cb.footnotes != NULL) {
-		rndr->cb.footnotes(ob, work, rndr->opaque);
+		beg += block_size;
 	}
 
-	rndr_popbuf(rndr, BUFFER_BLOCK);
+	rndr_popbuf(scan, BUFFER_BLOCK);
+
+	/* the blocks which were not reused are dropped */
+	session_gen_reset(md, last);
+	session->last ^= 1;
+
+	return 0;
 }
 
+/* ********************
+ * REFERENCE PARSING *
+ *********************/
+
 /**
- * checking end of HTML block : </tag>[ \t]*\n[ \t*]\n
+ * returns whether a line is a footnote definition or not
  */
-/* returns the length on match, 0 otherwise */
-static size_t htmlblock_end_tag(const char* tag, size_t tag_len, struct sd_markdown* rndr, uint8_t* data, size_t size)
+static int is_footnote(const uint8_t* data, size_t beg, size_t end, size_t* last, struct sd_markdown* rndr)
 {
-	/* checking if tag is a match */
-	if (((tag_len + 3) >= size) || (strncasecmp((char*) data + 2, tag, tag_len) != 0) || (data[tag_len + 2] != '>')) {
+	/* up to 3 optional leading spaces */
+	if ((beg + 3) >= end) {
 		return 0;
 	}
 
-	/* checking white lines */
-	size_t i = tag_len + 3;
-	size_t w = 0;
+	size_t i = 0;
 
-	if (i < size) {
-		w = is_empty(data + i, size - i);
+	if (data[beg] == ' ') {
+		i = 1;
 
-		if (w == 0) {
-			/* non-blank after tag */
-			return 0;
+		if (data[beg + 1] == ' ') {
+			i = 2;
+
+			if (data[beg + 2] == ' ') {
+				i = 3;
+
+				if (data[beg + 3] == ' ') {
+					return 0;
+				}
+			}
 		}
 	}
 
-	i += w;
-	w = 0;
+	i += beg;
 
-	if (i < size) {
-		w = is_empty(data + i, size - i);
+	/* id part: caret followed by anything between brackets */
+	if (data[i] != '[') {
+		return 0;
 	}
 
-	return i + w;
-}
+	i++;
 
-static size_t htmlblock_end(const char* curtag, struct sd_markdown* rndr, uint8_t* data, size_t size, int start_of_line)
-{
-	size_t tag_size = strlen(curtag);
-	size_t i = 1;
-	int block_lines = 0;
+	if ((i >= end) || (data[i] != '^')) {
+		return 0;
+	}
 
-	while (i < size) {
+	i++;
+	size_t id_offset = i;
+
+	while ((i < end) && (data[i] != '\n') && (data[i] != '\r') && (data[i] != ']')) {
 		i++;
+	}
 
-		while ((i < size) && (!((data[i - 1] == '<') && (data[i] == '/')))) {
-			if (data[i] == '\n') {
-				block_lines++;
-			}
+	if ((i >= end) || (data[i] != ']')) {
+		return 0;
+	}
 
-			i++;
-		}
+	size_t id_end = i;
 
-		/*
-		 * If we are only looking for unindented tags, skip the tag
-		 * if it doesn't follow a newline.
-		 *
-		 * The only exception to this is if the tag is still on the
-		 * initial line; in that case it still counts as a closing
-		 * tag
-		 */
-		if ((start_of_line != 0) && (block_lines > 0) && (data[i - 2] != '\n')) {
-			continue;
-		}
+	/* spacer: colon (space | tab)* newline? (space | tab)* */
+	i++;
 
-		if ((i + 2 + tag_size) >= size) {
-			break;
-		}
+	if ((i >= end) || (data[i] != ':')) {
+		return 0;
+	}
 
-		size_t end_tag = htmlblock_end_tag(curtag, tag_size, rndr, data + i - 1, size - i + 1);
+	i++;
 
-		if (end_tag != 0) {
-			return i + end_tag - 1;
-		}
+	while ((i < end) && (data[i] == ' ')) {
+		i++;
 	}
 
-	return 0;
-}
+	if ((i < end) && ((data[i] == '\n') || (data[i] == '\r'))) {
+		i++;
 
-/**
- * parsing of inline HTML block
- */
-static size_t parse_htmlblock(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size, int do_render)
-{
-	/* identification of the opening tag */
-	if ((size < 2) || (data[0] != '<')) {
-		return 0;
+		if ((i < end) && (data[i] == '\n') && (data[i - 1] == '\r')) {
+			i++;
+		}
 	}
 
-	size_t i = 1;
-
-	while ((i < size) && (data[i] != '>') && (data[i] != ' ')) {
+	while ((i < end) && (data[i] == ' ')) {
 		i++;
 	}
 
-	const char* curtag = NULL;
-
-	if (i < size) {
-		curtag = find_block_tag((char*) data + 1, (int) i - 1);
+	if ((i >= end) || (data[i] == '\n') || (data[i] == '\r')) {
+		return 0;
 	}
 
-	struct buf work = {data, 0, 0, 0};
+	/* getting content buffer, copied into the arena once complete */
+	struct buf* contents = rndr_newbuf(rndr, BUFFER_BLOCK);
 
-	/* handling of special cases */
-	if (curtag == NULL) {
-		size_t j = 0;
+	if (contents == NULL) {
+		return 0;
+	}
 
-		/* HTML comment, laxist form */
-		if ((size > 5) && (data[1] == '!') && (data[2] == '-') && (data[3] == '-')) {
-			i = 5;
+	size_t start = i;
 
-			while ((i < size) && (!((data[i - 2] == '-') && (data[i - 1] == '-') && (data[i] == '>')))) {
-				i++;
-			}
+	int in_empty = 0;
 
+	/* process lines similiar to a list item */
+	while (i < end) {
+		while ((i < end) && (data[i] != '\n') && (data[i] != '\r')) {
 			i++;
+		}
 
-			if (i < size) {
-				j = is_empty(data + i, size - i);
-			}
+		/* process an empty line */
+		if (is_empty(data + start, i - start) != 0) {
+			in_empty = 1;
 
-			if (j != 0) {
-				work.size = i + j;
+			if ((i < end) && ((data[i] == '\n') || (data[i] == '\r'))) {
+				i++;
 
-				if ((do_render != 0) && (rndr->cb.blockhtml != NULL)) {
-					rndr->cb.blockhtml(ob, &work, rndr->opaque);
+				if ((i < end) && (data[i] == '\n') && (data[i - 1] == '\r')) {
+					i++;
 				}
-
-				return work.size;
 			}
+
+			start = i;
+
+			continue;
 		}
 
-		/* HR, which is the only self-closing block tag considered */
-		if ((size > 4) && ((data[1] == 'h') || (data[1] == 'H')) && ((data[2] == 'r') || (data[2] == 'R'))) {
-			i = 3;
+		/* calculating the indentation */
+		size_t ind = 0;
 
-			while ((i < size) && (data[i] != '>')) {
-				i++;
-			}
+		while ((ind < 4) && ((start + ind) < end) && (data[start + ind] == ' ')) {
+			ind++;
+		}
 
-			if ((i + 1) < size) {
-				i++;
-				j = is_empty(data + i, size - i);
+		/*
+		 * joining only indented stuff after empty lines;
+		 * note that now we only require 1 space of indentation
+		 * to continue, just like lists
+		 */
+		if ((in_empty != 0) && (ind == 0)) {
+			break;
+		} else if (in_empty != 0) {
+			bufputc(contents, '\n');
+		}
 
-				if (j != 0) {
-					work.size = i + j;
+		in_empty = 0;
 
-					if ((do_render != 0) && (rndr->cb.blockhtml != NULL)) {
-						rndr->cb.blockhtml(ob, &work, rndr->opaque);
-					}
+		/* adding the line into the content buffer */
+		bufput(contents, data + start + ind, i - start - ind);
 
-					return work.size;
+		/* add carriage return */
+		if (i < end) {
+			bufput(contents, "\n", 1);
+
+			if ((i < end) && ((data[i] == '\n') || (data[i] == '\r'))) {
+				i++;
+
+				if ((i < end) && (data[i] == '\n') && (data[i - 1] == '\r')) {
+					i++;
 				}
 			}
 		}
 
-		/* no special case recognised */
+		start = i;
+	}
+
+	if (last != NULL) {
+		*last = start;
+	}
+
+	struct footnote_ref* ref_ = ref_table_add(&rndr->footnotes_found, rndr->ref_arena, sizeof(struct footnote_ref), data + id_offset, id_end - id_offset);
+
+	if (ref_ != NULL) {
+		ref_->contents = arena_bufdup(rndr->ref_arena, contents->data, contents->size);
+	}
+
+	rndr_popbuf(rndr, BUFFER_BLOCK);
+
+	if ((ref_ == NULL) || (ref_->contents == NULL)) {
 		return 0;
 	}
 
-	/* looking for an unindented matching closing tag */
-	/* followed by a blank line */
-	size_t tag_end = htmlblock_end(curtag, rndr, data, size, 1);
+	return 1;
+}
 
-	/* if not found, trying a second pass looking for indented match */
-	/* but not if tag is "ins" or "del" (following original Markdown.pl) */
-	if ((tag_end == 0) && (strcmp(curtag, "ins") != 0) && (strcmp(curtag, "del") != 0)) {
-		tag_end = htmlblock_end(curtag, rndr, data, size, 0);
+/**
+ * returns whether a line is a reference or not
+ */
+static int is_ref(const uint8_t* data, size_t beg, size_t end, size_t* last, struct sd_markdown* rndr)
+{
+	/* int n; */
+
+	/* up to 3 optional leading spaces */
+	if ((beg + 3) >= end) {
+		return 0;
+	}
+
+	size_t i = 0;
+
+	if (data[beg] == ' ') {
+		i = 1;
+
+		if (data[beg + 1] == ' ') {
+			i = 2;
+
+			if (data[beg + 2] == ' ') {
+				i = 3;
+
+				if (data[beg + 3] == ' ') {
+					return 0;
+				}
+			}
+		}
 	}
 
-	if (tag_end == 0) {
+	i += beg;
+
+	/* id part: anything but a newline between brackets */
+	if (data[i] != '[') {
 		return 0;
 	}
 
-	/* the end of the block has been found */
-	work.size = tag_end;
+	i++;
+	size_t id_offset = i;
 
-	if ((do_render != 0) && (rndr->cb.blockhtml != NULL)) {
-		rndr->cb.blockhtml(ob, &work, rndr->opaque);
+	while ((i < end) && (data[i] != '\n') && (data[i] != '\r') && (data[i] != ']')) {
+		i++;
 	}
 
-	return tag_end;
-}
-
-static void parse_table_row(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size, size_t columns, int* col_data, int header_flag)
-{
-	if ((rndr->cb.table_cell == NULL) || (rndr->cb.table_row == NULL)) {
-		return;
+	if ((i >= end) || (data[i] != ']')) {
+		return 0;
 	}
 
-	struct buf* row_work = rndr_newbuf(rndr, BUFFER_SPAN);
+	size_t id_end = i;
 
-	if (row_work == NULL) {
-		return;
+	/* spacer: colon (space | tab)* newline? (space | tab)* */
+	i++;
+
+	if ((i >= end) || (data[i] != ':')) {
+		return 0;
 	}
 
-	size_t i = 0;
+	i++;
 
-	if ((i < size) && (data[i] == '|')) {
+	while ((i < end) && (data[i] == ' ')) {
 		i++;
 	}
 
-	size_t col;
-
-	for (col = 0; (col < columns) && (i < size); ++col) {
-		struct buf* cell_work = rndr_newbuf(rndr, BUFFER_SPAN);
-
-		if (cell_work == NULL) {
-			return;
-		}
-
-		while ((i < size) && (_isspace(data[i]) != 0)) {
-			i++;
-		}
-
-		size_t cell_start = i;
+	if ((i < end) && ((data[i] == '\n') || (data[i] == '\r'))) {
+		i++;
 
-		while ((i < size) && ((data[i] != '|') || ((i > 0) && (data[i - 1] == '\\')))) {
+		if ((i < end) && (data[i] == '\r') && (data[i - 1] == '\n')) {
 			i++;
 		}
+	}
 
-		size_t cell_end = i - 1;
-
-		while ((cell_end > cell_start) && (_isspace(data[cell_end]) != 0)) {
-			cell_end--;
-		}
-
-		parse_inline(cell_work, rndr, data + cell_start, 1 + cell_end - cell_start);
-		rndr->cb.table_cell(row_work, cell_work, col_data[col] | header_flag, rndr->opaque);
-
-		rndr_popbuf(rndr, BUFFER_SPAN);
+	while ((i < end) && (data[i] == ' ')) {
 		i++;
 	}
 
-	for (; col < columns; ++col) {
-		struct buf empty_cell = {NULL, 0, 0, 0};
-		rndr->cb.table_cell(row_work, &empty_cell, col_data[col] | header_flag, rndr->opaque);
+	if (i >= end) {
+		return 0;
 	}
 
-	rndr->cb.table_row(ob, row_work, rndr->opaque);
-
-	rndr_popbuf(rndr, BUFFER_SPAN);
-}
-
-static size_t parse_table_header(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size, size_t* columns, int** column_data)
-{
-	int pipes = 0;
-	size_t i = 0;
-
-	while ((i < size) && (data[i] != '\n')) {
-		if (data[i++] == '|') {
-			pipes++;
-		}
+	/* link: whitespace-free sequence, optionally between angle brackets */
+	if (data[i] == '<') {
+		i++;
 	}
 
-	if ((i == size) || (pipes == 0)) {
-		return 0;
+	size_t link_offset = i;
+
+	while ((i < end) && (data[i] != ' ') && (data[i] != '\n') && (data[i] != '\r')) {
+		i++;
 	}
 
-	size_t header_end = i;
+	size_t link_end;
 
-	while ((header_end > 0) && (_isspace(data[header_end - 1]) != 0)) {
-		header_end--;
+	if (data[i - 1] == '>') {
+		link_end = i - 1;
+	} else {
+		link_end = i;
 	}
 
-	if (data[0] == '|') {
-		pipes--;
+	/* optional spacer: (space | tab)* (newline | '\'' | '"' | '(' ) */
+	while ((i < end) && (data[i] == ' ')) {
+		i++;
 	}
 
-	if ((header_end != 0) && (data[header_end - 1] == '|')) {
-		pipes--;
+	if ((i < end) && (data[i] != '\n') && (data[i] != '\r') && (data[i] != '\'') && (data[i] != '"') && (data[i] != '(')) {
+		return 0;
 	}
 
-	*columns = pipes + 1;
-	*column_data = calloc(*columns, sizeof(int));
-
-	/* Parse the header underline */
-	i++;
+	size_t line_end = 0;
 
-	if ((i < size) && (data[i] == '|')) {
-		i++;
+	/* computing end-of-line */
+	if ((i >= end) || (data[i] == '\r') || (data[i] == '\n')) {
+		line_end = i;
 	}
 
-	size_t under_end = i;
-
-	while ((under_end < size) && (data[under_end] != '\n')) {
-		under_end++;
+	if (((i + 1) < end) && (data[i] == '\n') && (data[i + 1] == '\r')) {
+		line_end = i + 1;
 	}
 
-	size_t col;
+	/* optional (space|tab)* spacer after a newline */
+	if (line_end != 0) {
+		i = line_end + 1;
 
-	for (col = 0; (col < *columns) && (i < under_end); ++col) {
-		while ((i < under_end) && (data[i] == ' ')) {
+		while ((i < end) && (data[i] == ' ')) {
 			i++;
 		}
+	}
 
-		size_t dashes = 0;
+	/*
+	 * optional title: any non-newline sequence enclosed in '"()
+	 * alone on its line
+	 */
+	size_t title_end = 0;
+	size_t title_offset = 0;
 
-		if (data[i] == ':') {
-			i++;
-			(*column_data)[col] |= MKD_TABLE_ALIGN_L;
-			dashes++;
-		}
+	if (((i + 1) < end) && ((data[i] == '\'') || (data[i] == '"') || (data[i] == '('))) {
+		i++;
+		title_offset = i;
 
-		while ((i < under_end) && (data[i] == '-')) {
+		/* looking for EOL */
+		while ((i < end) && (data[i] != '\n') && (data[i] != '\r')) {
 			i++;
-			dashes++;
 		}
 
-		if ((i < under_end) && (data[i] == ':')) {
-			i++;
-			(*column_data)[col] |= MKD_TABLE_ALIGN_R;
-			dashes++;
+		if (((i + 1) < end) && (data[i] == '\n') && (data[i + 1] == '\r')) {
+			title_end = i + 1;
+		} else {
+			title_end = i;
 		}
 
-		while ((i < under_end) && (data[i] == ' ')) {
-			i++;
-		}
+		/* stepping back */
+		i -= 1;
 
-		if ((i < under_end) && (data[i] != '|')) {
-			break;
+		while ((i > title_offset) && (data[i] == ' ')) {
+			i -= 1;
 		}
 
-		if (dashes < 3) {
-			break;
+		if ((i > title_offset) && ((data[i] == '\'') || (data[i] == '"') || (data[i] == ')'))) {
+			line_end = title_end;
+			title_end = i;
 		}
-
-		i++;
 	}
 
-	if (col < *columns) {
+	if ((line_end == 0) || (link_end == link_offset)) {
+		/* garbage after the link empty link */
 		return 0;
 	}
 
-	parse_table_row(ob, rndr, data, header_end, *columns, *column_data, MKD_TABLE_HEADER);
-
-	return under_end + 1;
-}
-
-static size_t parse_table(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
-{
-	struct buf* header_work = rndr_newbuf(rndr, BUFFER_SPAN);
-
-	if (header_work == NULL) {
-		return 0;
+	/* a valid ref has been found, filling-in return structures */
+	if (last != NULL) {
+		*last = line_end;
 	}
 
-	struct buf* body_work = rndr_newbuf(rndr, BUFFER_BLOCK);
+	if (rndr != NULL) {
+		struct link_ref* ref_ = ref_table_add(&rndr->refs, rndr->ref_arena, sizeof(struct link_ref), data + id_offset, id_end - id_offset);
 
-	if (body_work == NULL) {
-		return 0;
-	}
+		if (ref_ == NULL) {
+			return 0;
+		}
 
-	size_t columns;
-	int* col_data = NULL;
-	size_t i = parse_table_header(header_work, rndr, data, size, &columns, &col_data);
+		ref_->link = arena_bufdup(rndr->ref_arena, data + link_offset, link_end - link_offset);
 
-	if (i > 0) {
-		while (i < size) {
-			int pipes = 0;
-			size_t row_start = i;
+		if (ref_->link == NULL) {
+			return 0;
+		}
 
-			while ((i < size) && (data[i] != '\n')) {
-				if (data[i++] == '|') {
-					pipes++;
-				}
+		if (title_end > title_offset) {
+			ref_->title = arena_bufdup(rndr->ref_arena, data + title_offset, title_end - title_offset);
+
+			if (ref_->title == NULL) {
+				return 0;
 			}
+		}
+	}
 
-			if ((pipes == 0) || (i == size)) {
-				i = row_start;
+	return 1;
+}
 
-				break;
-			}
+static void expand_tabs(struct buf* ob, const struct sd_charset* tabs, const uint8_t* line, size_t size)
+{
+	size_t i = 0;
+	size_t tab = 0;
 
-			parse_table_row(body_work, rndr, data + row_start, i - row_start, columns, col_data, MKD_TABLE_NONE);
+	while (i < size) {
+		size_t org = i;
 
-			i++;
+		i += sd_scan(tabs, line + i, size - i);
+		tab += i - org;
+
+		if (i > org) {
+			bufput(ob, line + org, i - org);
 		}
 
-		if (rndr->cb.table != NULL) {
-			rndr->cb.table(ob, header_work, body_work, rndr->opaque);
+		if (i >= size) {
+			break;
 		}
-	}
 
-	free(col_data);
-	rndr_popbuf(rndr, BUFFER_SPAN);
-	rndr_popbuf(rndr, BUFFER_BLOCK);
+		do {
+			bufputc(ob, ' ');
+			tab++;
+		} while (tab % 4);
 
-	return i;
+		i++;
+	}
 }
 
 /**
- * parsing of one block, returning next uint8_t to parse
+ * allocates the working copy of the document
  */
-static void parse_block(struct buf* ob, struct sd_markdown* rndr, uint8_t* data, size_t size)
+static struct buf* rndr_newtext(struct sd_markdown* rndr, size_t doc_size)
 {
-	if ((rndr->work_bufs[BUFFER_SPAN].size + rndr->work_bufs[BUFFER_BLOCK].size) > rndr->max_nesting) {
-		return;
+	if ((rndr->text == NULL) && ((rndr->text = bufnew(64)) == NULL)) {
+		return NULL;
 	}
 
-	size_t i;
-	size_t beg = 0;
+	struct buf* text = rndr->text;
 
-	while (beg < size) {
-		uint8_t* txt_data = data + beg;
-		size_t end = size - beg;
-
-		if (is_atxheader(rndr, txt_data, end) != 0) {
-			beg += parse_atxheader(ob, rndr, txt_data, end);
-		} else if ((data[beg] == '<') && (rndr->cb.blockhtml != NULL) && ((i = parse_htmlblock(ob, rndr, txt_data, end, 1)) != 0)) {
-			beg += i;
-		} else if ((i = is_empty(txt_data, end)) != 0) {
-			beg += i;
-		} else if (is_hrule(txt_data, end) != 0) {
-			if (rndr->cb.hrule != NULL) {
-				rndr->cb.hrule(ob, rndr->opaque);
-			}
-
-			while ((beg < size) && (data[beg] != '\n')) {
-				beg++;
-			}
-
-			beg++;
-		} else if (((rndr->ext_flags & MKDEXT_FENCED_CODE) != 0) && ((i = parse_fencedcode(ob, rndr, txt_data, end)) != 0)) {
-			beg += i;
-		} else if (((rndr->ext_flags & MKDEXT_TABLES) != 0) && ((i = parse_table(ob, rndr, txt_data, end)) != 0)) {
-			beg += i;
-		} else if (prefix_quote(txt_data, end) != 0) {
-			beg += parse_blockquote(ob, rndr, txt_data, end);
-		} else if (prefix_code(txt_data, end) != 0) {
-			beg += parse_blockcode(ob, rndr, txt_data, end);
-		} else if (prefix_uli(txt_data, end) != 0) {
-			beg += parse_list(ob, rndr, txt_data, end, 0);
-		} else if (prefix_oli(txt_data, end) != 0) {
-			beg += parse_list(ob, rndr, txt_data, end, MKD_LIST_ORDERED);
-		} else {
-			beg += parse_paragraph(ob, rndr, txt_data, end);
-		}
+	text->size = 0;
+	bufsetgrowth(text, rndr->buf_growth, rndr->buf_max_size);
+
+	/* Preallocate enough space for our buffer to avoid expanding while copying */
+	if (bufgrow(text, doc_size) != BUF_OK) {
+		return NULL;
 	}
-}
 
-/* ********************
- * REFERENCE PARSING *
- *********************/
+	return text;
+}
 
 /**
- * returns whether a line is a footnote definition or not
+ * copies document[beg, end) into the working copy, expanding tabs and
+ * converting newlines when normalize is set
  */
-static int is_footnote(const uint8_t* data, size_t beg, size_t end, size_t* last, struct footnote_list* list)
+static void copy_text(struct sd_markdown* rndr, struct buf* text, const uint8_t* document, size_t beg, size_t end, size_t doc_size, int normalize)
 {
-	/* up to 3 optional leading spaces */
-	if ((beg + 3) >= end) {
-		return 0;
-	}
-
-	size_t i = 0;
-
-	if (data[beg] == ' ') {
-		i = 1;
+	if (normalize == 0) {
+		bufput(text, document + beg, end - beg);
 
-		if (data[beg + 1] == ' ') {
-			i = 2;
+		return;
+	}
 
-			if (data[beg + 2] == ' ') {
-				i = 3;
+	while (beg < end) {
+		size_t i = beg;
 
-				if (data[beg + 3] == ' ') {
-					return 0;
-				}
-			}
+		while ((i < end) && (document[i] != '\n') && (document[i] != '\r')) {
+			i++;
 		}
-	}
 
-	i += beg;
+		/* adding the line body if present */
+		if (i > beg) {
+			expand_tabs(text, &rndr->cfg->line_set, document + beg, i - beg);
+		}
 
-	/* id part: caret followed by anything between brackets */
-	if (data[i] != '[') {
-		return 0;
-	}
+		while ((i < end) && ((document[i] == '\n') || (document[i] == '\r'))) {
+			/* add one \n per newline */
+			if ((document[i] == '\n') || (((i + 1) < doc_size) && (document[i + 1] != '\n'))) {
+				bufputc(text, '\n');
+			}
 
-	i++;
+			i++;
+		}
 
-	if ((i >= end) || (data[i] != '^')) {
-		return 0;
+		beg = i;
 	}
+}
 
-	i++;
-	size_t id_offset = i;
+/**
+ * 64-bit hash of a whole document, mixing it in a word at a time
+ */
+static uint64_t hash_document(const uint8_t* data, size_t size)
+{
+	const uint64_t mul = 0x9e3779b97f4a7c15ULL;
+	uint64_t hash = 0xcbf29ce484222325ULL ^ ((uint64_t) size * mul);
+	uint64_t word;
+	size_t i = 0;
 
-	while ((i < end) && (data[i] != '\n') && (data[i] != '\r') && (data[i] != ']')) {
-		i++;
+	for (; (i + sizeof(word)) <= size; i += sizeof(word)) {
+		memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * mul;
+		hash ^= (hash >> 29);
 	}
 
-	if ((i >= end) || (data[i] != ']')) {
-		return 0;
+	if (i < size) {
+		word = 0;
+		memcpy(&word, data + i, size - i);
+		hash = (hash ^ word) * mul;
+		hash ^= (hash >> 29);
 	}
 
-	size_t id_end = i;
+	return hash ^ (hash >> 32);
+}
 
-	/* spacer: colon (space | tab)* newline? (space | tab)* */
-	i++;
+/* *********************
+ * EXPORTED FUNCTIONS *
+ **********************/
 
-	if ((i >= end) || (data[i] != ':')) {
-		return 0;
-	}
+struct sd_markdown_config* sd_markdown_config_new(unsigned int extensions, size_t max_nesting, const struct sd_callbacks* callbacks)
+{
+	assert((max_nesting > 0) && (callbacks != NULL));
 
-	i++;
+	struct sd_markdown_config* cfg = malloc(sizeof(struct sd_markdown_config));
 
-	while ((i < end) && (data[i] == ' ')) {
-		i++;
+	if (cfg == NULL) {
+		return NULL;
 	}
 
-	if ((i < end) && ((data[i] == '\n') || (data[i] == '\r'))) {
-		i++;
+	memcpy(&cfg->cb, callbacks, sizeof(struct sd_callbacks));
+	memset(cfg->active_char, 0x00, 256);
 
-		if ((i < end) && (data[i] == '\n') && (data[i - 1] == '\r')) {
-			i++;
+	if ((cfg->cb.emphasis != NULL) || (cfg->cb.double_emphasis != NULL) || (cfg->cb.triple_emphasis != NULL)) {
+		cfg->active_char['*'] = MD_CHAR_EMPHASIS;
+		cfg->active_char['_'] = MD_CHAR_EMPHASIS;
+
+		if (extensions & MKDEXT_STRIKETHROUGH) {
+			cfg->active_char['~'] = MD_CHAR_EMPHASIS;
 		}
-	}
 
-	while ((i < end) && (data[i] == ' ')) {
-		i++;
+		if (extensions & MKDEXT_INS) {
+			cfg->active_char['+'] = MD_CHAR_EMPHASIS;
+		}
 	}
 
-	if ((i >= end) || (data[i] == '\n') || (data[i] == '\r')) {
-		return 0;
+	if (cfg->cb.codespan != NULL) {
+		cfg->active_char['`'] = MD_CHAR_CODESPAN;
 	}
 
-	/* getting content buffer */
-	struct buf* contents = bufnew(64);
+	if (cfg->cb.linebreak != NULL) {
+		cfg->active_char['\n'] = MD_CHAR_LINEBREAK;
+	}
 
-	if (contents == NULL) {
-		return 0;
+	if ((cfg->cb.image != NULL) || (cfg->cb.link != NULL)) {
+		cfg->active_char['['] = MD_CHAR_LINK;
 	}
 
-	size_t start = i;
+	cfg->active_char['<'] = MD_CHAR_LANGLE;
+	cfg->active_char['\\'] = MD_CHAR_ESCAPE;
+	cfg->active_char['&'] = MD_CHAR_ENTITITY;
 
-	int in_empty = 0;
+	if (extensions & MKDEXT_AUTOLINK) {
+		cfg->active_char[':'] = MD_CHAR_AUTOLINK_URL;
+		cfg->active_char['@'] = MD_CHAR_AUTOLINK_EMAIL;
+		cfg->active_char['w'] = MD_CHAR_AUTOLINK_WWW;
+	}
 
-	/* process lines similiar to a list item */
-	while (i < end) {
-		while ((i < end) && (data[i] != '\n') && (data[i] != '\r')) {
-			i++;
-		}
+	if (extensions & MKDEXT_SUPERSCRIPT) {
+		cfg->active_char['^'] = MD_CHAR_SUPERSCRIPT;
+	}
 
-		/* process an empty line */
-		if (is_empty(data + start, i - start) != 0) {
-			in_empty = 1;
+	/* the "www." autolinks are looked for by parse_inline, as 'w' is too common to end the text runs */
+	uint8_t scan_table[256];
 
-			if ((i < end) && ((data[i] == '\n') || (data[i] == '\r'))) {
-				i++;
+	memcpy(scan_table, cfg->active_char, sizeof(scan_table));
+	scan_table['w'] = MD_CHAR_NONE;
+	sd_charset_from_table(&cfg->active_set, scan_table);
 
-				if ((i < end) && (data[i] == '\n') && (data[i - 1] == '\r')) {
-					i++;
-				}
-			}
+	sd_charset_init(&cfg->line_set);
+	sd_charset_add(&cfg->line_set, '\n');
+	sd_charset_add(&cfg->line_set, '\r');
+	sd_charset_add(&cfg->line_set, '\t');
 
-			start = i;
+	/* Extension data */
+	cfg->ext_flags = extensions;
+	cfg->max_nesting = max_nesting;
+	cfg->callbacks_hash = hash_document((const uint8_t*) &cfg->cb, sizeof(struct sd_callbacks));
 
-			continue;
-		}
+	return cfg;
+}
 
-		/* calculating the indentation */
-		size_t ind = 0;
+void sd_markdown_config_free(struct sd_markdown_config* cfg)
+{
+	free(cfg);
+}
 
-		while ((ind < 4) && ((start + ind) < end) && (data[start + ind] == ' ')) {
-			ind++;
-		}
+struct sd_markdown* sd_markdown_new_with_config(const struct sd_markdown_config* cfg, void* opaque)
+{
+	assert(cfg != NULL);
 
-		/*
-		 * joining only indented stuff after empty lines;
-		 * note that now we only require 1 space of indentation
-		 * to continue, just like lists
-		 */
-		if ((in_empty != 0) && (ind == 0)) {
-			break;
-		} else if (in_empty != 0) {
-			bufputc(contents, '\n');
-		}
+	struct sd_markdown* md = malloc(sizeof(struct sd_markdown));
 
-		in_empty = 0;
+	if (md == NULL) {
+		return NULL;
+	}
 
-		/* adding the line into the content buffer */
-		bufput(contents, data + start + ind, i - start - ind);
+	if (stack_init(&md->work_bufs[BUFFER_BLOCK], 4) < 0) {
+		stack_free(&md->work_bufs[BUFFER_BLOCK]);
+		free(md);
 
-		/* add carriage return */
-		if (i < end) {
-			bufput(contents, "\n", 1);
+		return NULL;
+	}
 
-			if ((i < end) && ((data[i] == '\n') || (data[i] == '\r'))) {
-				i++;
+	if (stack_init(&md->work_bufs[BUFFER_SPAN], 8) < 0) {
+		stack_free(&md->work_bufs[BUFFER_BLOCK]);
+		stack_free(&md->work_bufs[BUFFER_SPAN]);
+		free(md);
 
-				if ((i < end) && (data[i] == '\n') && (data[i - 1] == '\r')) {
-					i++;
-				}
-			}
-		}
+		return NULL;
+	}
 
-		start = i;
+	if (stack_init(&md->work_bufs[BUFFER_MEMO], 4) < 0) {
+		stack_free(&md->work_bufs[BUFFER_BLOCK]);
+		stack_free(&md->work_bufs[BUFFER_SPAN]);
+		stack_free(&md->work_bufs[BUFFER_MEMO]);
+		free(md);
+
+		return NULL;
 	}
 
-	if (last != NULL) {
-		*last = start;
+	if (stack_init(&md->footnotes_used, 8) < 0) {
+		stack_free(&md->work_bufs[BUFFER_BLOCK]);
+		stack_free(&md->work_bufs[BUFFER_SPAN]);
+		stack_free(&md->work_bufs[BUFFER_MEMO]);
+		stack_free(&md->footnotes_used);
+		free(md);
+
+		return NULL;
 	}
 
-	if (list != NULL) {
-		struct footnote_ref* ref_ = create_footnote_ref(list, data + id_offset, id_end - id_offset);
+	md->cfg = cfg;
+	md->own_cfg = NULL;
+	md->opaque = opaque;
+	md->in_link_body = 0;
+	md->emph_memo = NULL;
+	md->buf_growth = 0;
+	md->buf_max_size = 0;
+
+	memset(&md->refs, 0x00, sizeof(md->refs));
+	memset(&md->footnotes_found, 0x00, sizeof(md->footnotes_found));
+
+	sd_arena_init(&md->arena, 0);
+	md->ref_arena = &md->arena;
+	md->ro_begin = NULL;
+	md->ro_end = NULL;
+	md->ro_copy = NULL;
+	memset(&md->close, 0x00, sizeof(md->close));
+	md->text = NULL;
+	md->batch_ob = NULL;
+	md->stream_ob = NULL;
+	md->session = NULL;
+	md->ref_log = NULL;
+	md->used_footnote = 0;
+	md->nodes = NULL;
+	md->node_slots = NULL;
+	md->node_slots_size = 0;
+	md->node_top = 0;
+	md->node_status = 0;
+	md->threads = 1;
+	md->workers = NULL;
+	md->worker_count = 0;
+	md->pool = NULL;
+	md->is_worker = 0;
+	md->fork_conflict = 0;
+	md->spared_failures = 0;
+	md->scan_only = 0;
+
+	memset(&md->budget, 0x00, sizeof(md->budget));
+	md->has_budget = (cfg->cb.done != NULL);
+	md->prefix_cut = 0;
+	md->prefix_unsafe = 0;
+	md->budget_ob = NULL;
+	md->budget_out = 0;
+
+#ifdef SD_STATS
+	md->stats = NULL;
+	md->stats_block = SD_STATS_BLOCK_COUNT;
+#endif
+
+	return md;
+}
 
-		if (ref_ == NULL) {
-			return 0;
-		}
+struct sd_markdown* sd_markdown_new(unsigned int extensions, size_t max_nesting, const struct sd_callbacks* callbacks, void* opaque)
+{
+	struct sd_markdown_config* cfg = sd_markdown_config_new(extensions, max_nesting, callbacks);
 
-		if (add_footnote_ref(list, ref_) == 0) {
-			free_footnote_ref(ref_);
+	if (cfg == NULL) {
+		return NULL;
+	}
 
-			return 0;
-		}
+	struct sd_markdown* md = sd_markdown_new_with_config(cfg, opaque);
+
+	if (md == NULL) {
+		sd_markdown_config_free(cfg);
 
-		ref_->contents = contents;
+		return NULL;
 	}
 
-	return 1;
+	md->own_cfg = cfg;
+
+	return md;
 }
 
+static int render_prefix(struct buf* ob, const uint8_t* document, size_t doc_size, struct sd_markdown* md);
+
 /**
- * returns whether a line is a reference or not
+ * renders a whole document into ob, flushing it when streaming; returns
+ * 0 or SD_BUDGET_EXCEEDED
  */
-static int is_ref(const uint8_t* data, size_t beg, size_t end, size_t* last, struct link_ref** refs)
+static int render_document(struct buf* ob, const uint8_t* document, size_t doc_size, struct sd_markdown* md)
 {
-	/* int n; */
+	static const char UTF8_BOM[] = {0xEF, 0xBB, 0xBF};
 
-	/* up to 3 optional leading spaces */
-	if ((beg + 3) >= end) {
-		return 0;
+	struct buf* text = NULL;
+	int ret = -1;
+
+	/* renderers stopping early may not need the rest of a long document */
+	if ((md->cfg->cb.done != NULL) && (md->prefix_cut == 0) && (doc_size > PREFIX_MIN) && (render_prefix(ob, document, doc_size, md) == 0)) {
+		return SD_BUDGET_EXCEEDED;
 	}
 
-	size_t i = 0;
+	/* the working copy and buffers follow the policy of the output buffer */
+	md->buf_growth = ob->growth;
+	md->buf_max_size = ob->max_size;
 
-	if (data[beg] == ' ') {
-		i = 1;
+	/* whatever bufgrow refuses from here on is missing from the output */
+	size_t org_failures = bufgrow_failures();
 
-		if (data[beg + 1] == ' ') {
-			i = 2;
+	md->spared_failures = 0;
 
-			if (data[beg + 2] == ' ') {
-				i = 3;
+#ifdef SD_STATS
+	/* streamed output is counted as it is written, including what ob held */
+	size_t org_size = (md->stream_ob != NULL) ? (0) : (ob->size);
+	size_t org_grow_count = bufgrow_count();
 
-				if (data[beg + 3] == ' ') {
-					return 0;
-				}
-			}
-		}
+	if (md->stats != NULL) {
+		memset(md->stats, 0x00, sizeof(struct sd_stats));
+		md->stats->bytes_in = doc_size;
 	}
+#endif
 
-	i += beg;
+	/* starting the budget over */
+	md->budget_ob = ob;
+	md->budget_base = ob->size;
+	md->budget_flushed = 0;
+	md->budget_triggers = 0;
+	md->budget_out = 0;
 
-	/* id part: anything but a newline between brackets */
-	if (data[i] != '[') {
-		return 0;
+	if (md->budget.max_time != 0) {
+		md->deadline = rndr_clock() + md->budget.max_time;
 	}
 
-	i++;
-	size_t id_offset = i;
+	/* reset the references and footnotes */
+	ref_table_reset(&md->refs);
+	ref_table_reset(&md->footnotes_found);
+	md->footnotes_used.size = 0;
 
-	while ((i < end) && (data[i] != '\n') && (data[i] != '\r') && (data[i] != ']')) {
-		i++;
-	}
+	int footnotes_enabled = md->cfg->ext_flags & MKDEXT_FOOTNOTES;
 
-	if ((i >= end) || (data[i] != ']')) {
-		return 0;
+	/*
+	 * first pass: looking for references; the text between them is only
+	 * copied once a reference is found or normalization is needed,
+	 * otherwise the document is parsed in place
+	 */
+	size_t beg = 0;
+
+	/*
+	 * Skip a possible UTF-8 BOM, even though the Unicode standard
+	 * discourages having these in UTF-8 documents
+	 */
+	if ((doc_size >= 3) && (memcmp(document, UTF8_BOM, 3) == 0)) {
+		beg += 3;
 	}
 
-	size_t id_end = i;
+	size_t gap = beg;
+	int normalize = 0;
+	size_t end;
 
-	/* spacer: colon (space | tab)* newline? (space | tab)* */
-	i++;
+	while (beg < doc_size) { /* iterating over lines */
+		size_t ref_beg = beg;
 
-	if ((i >= end) || (data[i] != ':')) {
-		return 0;
-	}
+		if ((footnotes_enabled != 0) && (is_footnote(document, beg, doc_size, &end, md) != 0)) {
+			beg = end;
+		} else if (is_ref(document, beg, doc_size, &end, md) != 0) {
+			beg = end;
+		} else { /* skipping to the next line */
+			end = beg + sd_scan(&md->cfg->line_set, document + beg, doc_size - beg);
 
-	i++;
+			while ((end < doc_size) && (document[end] == '\t')) {
+				normalize = 1;
+				end++;
+				end += sd_scan(&md->cfg->line_set, document + end, doc_size - end);
+			}
 
-	while ((i < end) && (data[i] == ' ')) {
-		i++;
-	}
+			while ((end < doc_size) && ((document[end] == '\n') || (document[end] == '\r'))) {
+				if (document[end] == '\r') {
+					normalize = 1;
+				}
 
-	if ((i < end) && ((data[i] == '\n') || (data[i] == '\r'))) {
-		i++;
+				end++;
+			}
 
-		if ((i < end) && (data[i] == '\r') && (data[i - 1] == '\n')) {
-			i++;
+			beg = end;
+
+			continue;
 		}
-	}
 
-	while ((i < end) && (data[i] == ' ')) {
-		i++;
-	}
+		/* flushing the text preceding the reference */
+		if ((text == NULL) && ((text = rndr_newtext(md, doc_size)) == NULL)) {
+			goto cleanup;
+		}
 
-	if (i >= end) {
-		return 0;
+		copy_text(md, text, document, gap, ref_beg, doc_size, normalize);
+		gap = beg;
+		normalize = 0;
 	}
 
-	/* link: whitespace-free sequence, optionally between angle brackets */
-	if (data[i] == '<') {
-		i++;
+	/* the latest definition of a link wins, the first one of a footnote */
+	if ((ref_table_build(&md->refs, 0) == 0) || (ref_table_build(&md->footnotes_found, 1) == 0)) {
+		goto cleanup;
 	}
 
-	size_t link_offset = i;
+	STATS_ADD(md, ref_count, md->refs.count);
+	STATS_ADD(md, footnote_count, md->footnotes_found.count);
 
-	while ((i < end) && (data[i] != ' ') && (data[i] != '\n') && (data[i] != '\r')) {
-		i++;
-	}
+	const uint8_t* data = document + gap;
+	size_t size = doc_size - gap;
 
-	size_t link_end;
+	if ((text != NULL) || (normalize != 0) || ((size != 0) && (data[size - 1] != '\n'))) {
+		if ((text == NULL) && ((text = rndr_newtext(md, doc_size)) == NULL)) {
+			goto cleanup;
+		}
+
+		copy_text(md, text, document, gap, doc_size, doc_size, normalize);
+
+		/* adding a final newline if not already present */
+		if ((text->size != 0) && (text->data[text->size - 1] != '\n') && (text->data[text->size - 1] != '\r')) {
+			bufputc(text, '\n');
+		}
 
-	if (data[i - 1] == '>') {
-		link_end = i - 1;
+		data = text->data;
+		size = text->size;
 	} else {
-		link_end = i;
+		if ((md->ro_copy == NULL) && ((md->ro_copy = bufnew(256)) == NULL)) {
+			goto cleanup;
+		}
+
+		bufsetgrowth(md->ro_copy, md->buf_growth, md->buf_max_size);
+		md->ro_begin = data;
+		md->ro_end = data + size;
 	}
 
-	/* optional spacer: (space | tab)* (newline | '\'' | '"' | '(' ) */
-	while ((i < end) && (data[i] == ' ')) {
-		i++;
+	/* pre-grow the output buffer to minimize allocations */
+	if ((md->stream_ob == NULL) && (md->nodes == NULL) && (bufgrow(ob, MARKDOWN_GROW(size)) != BUF_OK)) {
+		goto cleanup;
 	}
 
-	if ((i < end) && (data[i] != '\n') && (data[i] != '\r') && (data[i] != '\'') && (data[i] != '"') && (data[i] != '(')) {
-		return 0;
+	/* the closing tags are indexed when the first HTML block needs them */
+	md->close.begin = data;
+	md->close.end = data + size;
+	md->close.built = 0;
+
+	/* second pass: actual rendering */
+	if (md->cfg->cb.doc_header != NULL) {
+		md->cfg->cb.doc_header(ob, md->opaque);
 	}
 
-	size_t line_end = 0;
+	if ((size != 0) && ((md->session == NULL) || (parse_block_session(ob, md, (uint8_t*) data, size) != 0))) {
+		if ((md->threads < 2) || (md->has_budget != 0) || (parse_block_parallel(ob, md, (uint8_t*) data, size) != 0)) {
+			/* the last block of a prefix may end at the cut rather than where it does in the document */
+			if (parse_block(ob, md, (uint8_t*) data, size) == size) {
+				md->prefix_unsafe = 1;
+			}
+		}
+	}
 
-	/* computing end-of-line */
-	if ((i >= end) || (data[i] == '\r') || (data[i] == '\n')) {
-		line_end = i;
+	/* a renderer done within the last block cuts the render short as well */
+	if ((md->cfg->cb.done != NULL) && (md->budget_out == 0) && (md->cfg->cb.done(md->opaque) != 0)) {
+		md->budget_out = 1;
 	}
 
-	if (((i + 1) < end) && (data[i] == '\n') && (data[i + 1] == '\r')) {
-		line_end = i + 1;
+	/* footnotes, dropped from a render cut short or by a renderer without them */
+	if ((footnotes_enabled != 0) && (md->budget_out == 0) && ((md->cfg->cb.footnotes != NULL) || (md->cfg->cb.footnote_def != NULL))) {
+		parse_footnote_list(ob, md, &md->footnotes_used);
 	}
 
-	/* optional (space|tab)* spacer after a newline */
-	if (line_end != 0) {
-		i = line_end + 1;
+	if (md->cfg->cb.doc_footer != NULL) {
+		md->cfg->cb.doc_footer(ob, md->opaque);
+	}
 
-		while ((i < end) && (data[i] == ' ')) {
-			i++;
-		}
+	if (md->cfg->cb.outline != NULL) {
+		md->cfg->cb.outline(ob, md->opaque);
 	}
 
-	/*
-	 * optional title: any non-newline sequence enclosed in '"()
-	 * alone on its line
-	 */
-	size_t title_end = 0;
-	size_t title_offset = 0;
+	ret = ((bufgrow_failures() - org_failures) > md->spared_failures) ? (-1) : (0);
 
-	if (((i + 1) < end) && ((data[i] == '\'') || (data[i] == '"') || (data[i] == '('))) {
-		i++;
-		title_offset = i;
+cleanup:
+	md->ro_begin = NULL;
+	md->ro_end = NULL;
+	md->close.end = NULL;
 
-		/* looking for EOL */
-		while ((i < end) && (data[i] != '\n') && (data[i] != '\r')) {
-			i++;
-		}
+	/* a caller-provided arena is released by its owner */
+	if (md->ref_arena == &md->arena) {
+		sd_arena_reset(&md->arena);
+	}
 
-		if (((i + 1) < end) && (data[i] == '\n') && (data[i + 1] == '\r')) {
-			title_end = i + 1;
-		} else {
-			title_end = i;
-		}
+#ifdef SD_STATS
+	if (md->stats != NULL) {
+		md->stats->bytes_out += ob->size - org_size;
+		md->stats->grow_count = bufgrow_count() - org_grow_count;
+	}
+#endif
 
-		/* stepping back */
-		i -= 1;
+	assert(md->work_bufs[BUFFER_SPAN].size == 0);
+	assert(md->work_bufs[BUFFER_BLOCK].size == 0);
+	assert(md->work_bufs[BUFFER_MEMO].size == 0);
 
-		while ((i > title_offset) && (data[i] == ' ')) {
-			i -= 1;
-		}
+	md->budget_ob = NULL;
 
-		if ((i > title_offset) && ((data[i] == '\'') || (data[i] == '"') || (data[i] == ')'))) {
-			line_end = title_end;
-			title_end = i;
-		}
+	if (ret != 0) {
+		return -1;
 	}
 
-	if ((line_end == 0) || (link_end == link_offset)) {
-		/* garbage after the link empty link */
-		return 0;
-	}
+	return (md->budget_out != 0) ? (SD_BUDGET_EXCEEDED) : (0);
+}
 
-	/* a valid ref has been found, filling-in return structures */
-	if (last != NULL) {
-		*last = line_end;
+/**
+ * renders from growing prefixes of the document, each with a copy of the
+ * renderer state, until one ends the render before its end without looking
+ * a reference up; returns 0 when one did, its output then being the one of
+ * the whole document, and -1 otherwise with nothing rendered
+ */
+static int render_prefix(struct buf* ob, const uint8_t* document, size_t doc_size, struct sd_markdown* md)
+{
+	const struct sd_callbacks* cb = &md->cfg->cb;
+
+	if ((cb->fork == NULL) || (cb->join == NULL) || (md->stream_ob != NULL) || (md->nodes != NULL) || (md->session != NULL)) {
+		return -1;
 	}
 
-	if (refs != NULL) {
-		struct link_ref* ref_ = add_link_ref(refs, data + id_offset, id_end - id_offset);
+	void* opaque = md->opaque;
+	size_t org_size = ob->size;
 
-		if (ref_ == NULL) {
-			return 0;
+	for (size_t prefix = PREFIX_MIN; prefix < doc_size; prefix *= PREFIX_GROWTH) {
+		const uint8_t* eol = memchr(document + prefix, '\n', doc_size - prefix);
+
+		if ((eol == NULL) || ((size_t) (eol + 1 - document) >= doc_size)) {
+			break;
 		}
 
-		ref_->link = bufnew(link_end - link_offset);
+		void* fork = cb->fork(opaque);
 
-		if (ref_->link == NULL) {
-			return 0;
+		if (fork == NULL) {
+			break;
 		}
 
-		bufput(ref_->link, data + link_offset, link_end - link_offset);
+		md->opaque = fork;
+		md->prefix_cut = 1;
+		md->prefix_unsafe = 0;
 
-		if (title_end > title_offset) {
-			ref_->title = bufnew(title_end - title_offset);
+		int status = render_document(ob, document, (size_t) (eol + 1 - document), md);
 
-			if (ref_->title == NULL) {
+		md->prefix_cut = 0;
+		md->opaque = opaque;
+
+		if ((status == SD_BUDGET_EXCEEDED) && (md->prefix_unsafe == 0)) {
+			if (cb->join(opaque, fork, 0) == 0) {
 				return 0;
 			}
-
-			bufput(ref_->title, data + title_offset, title_end - title_offset);
+		} else {
+			cb->join(opaque, fork, SD_JOIN_DISCARD);
 		}
+
+		ob->size = org_size;
 	}
 
-	return 1;
+	return -1;
 }
 
-static void expand_tabs(struct buf* ob, const uint8_t* line, size_t size)
+int sd_markdown_render(struct buf* ob, const uint8_t* document, size_t doc_size, struct sd_markdown* md)
 {
-	size_t i = 0;
-	size_t tab = 0;
-
-	while (i < size) {
-		size_t org = i;
+	md->stream_ob = NULL;
 
-		while ((i < size) && (line[i] != '\t')) {
-			i++;
-			tab++;
-		}
+	return render_document(ob, document, doc_size, md);
+}
 
-		if (i > org) {
-			bufput(ob, line + org, i - org);
-		}
+int sd_markdown_render_stream(struct buf* ob, const uint8_t* document, size_t doc_size, struct sd_markdown* md, sd_write_cb write, void* opaque)
+{
+	assert((ob != NULL) && (write != NULL));
 
-		if (i >= size) {
-			break;
-		}
+	md->stream_ob = ob;
+	md->stream_write = write;
+	md->stream_opaque = opaque;
+	md->stream_status = 0;
 
-		do {
-			bufputc(ob, ' ');
-			tab++;
-		} while (tab % 4);
+	int status = render_document(ob, document, doc_size, md);
 
-		i++;
+	if ((md->stream_status == 0) && (ob->size != 0) && (write(ob->data, ob->size, opaque) != 0)) {
+		md->stream_status = -1;
 	}
-}
 
-/* *********************
- * EXPORTED FUNCTIONS *
- **********************/
+	ob->size = 0;
+	md->stream_ob = NULL;
 
-struct sd_markdown* sd_markdown_new(unsigned int extensions, size_t max_nesting, const struct sd_callbacks* callbacks, void* opaque)
+	return (md->stream_status != 0) ? (md->stream_status) : (status);
+}
+
+int sd_markdown_render_parallel(struct buf* ob, const uint8_t* document, size_t doc_size, struct sd_markdown* md, unsigned int threads)
 {
-	assert((max_nesting > 0) && (callbacks != NULL));
+	md->stream_ob = NULL;
+	md->threads = threads;
 
-	struct sd_markdown* md = malloc(sizeof(struct sd_markdown));
+	int status = render_document(ob, document, doc_size, md);
 
-	if (md == NULL) {
-		return NULL;
-	}
+	md->threads = 1;
 
-	memcpy(&md->cb, callbacks, sizeof(struct sd_callbacks));
+	return status;
+}
 
-	if (stack_init(&md->work_bufs[BUFFER_BLOCK], 4) < 0) {
-		stack_free(&md->work_bufs[BUFFER_BLOCK]);
-		free(md);
+int sd_markdown_render_batch(struct buf* ob, size_t* offsets, const uint8_t* const* documents, const size_t* sizes, size_t count, struct sd_markdown* md)
+{
+	size_t left = 0;
+	int status = 0;
 
-		return NULL;
+	for (size_t i = 0; i < count; ++i) {
+		left += sizes[i];
 	}
 
-	if (stack_init(&md->work_bufs[BUFFER_SPAN], 8) < 0) {
-		stack_free(&md->work_bufs[BUFFER_BLOCK]);
-		stack_free(&md->work_bufs[BUFFER_SPAN]);
-		free(md);
-
-		return NULL;
+	/* each document is rendered on its own, as renderers look at what precedes a block */
+	if ((md->batch_ob == NULL) && ((md->batch_ob = bufnew(256)) == NULL)) {
+		return -1;
 	}
 
-	memset(md->active_char, 0x00, 256);
+	md->stream_ob = NULL;
 
-	if ((md->cb.emphasis != NULL) || (md->cb.double_emphasis != NULL) || (md->cb.triple_emphasis != NULL)) {
-		md->active_char['*'] = MD_CHAR_EMPHASIS;
-		md->active_char['_'] = MD_CHAR_EMPHASIS;
+	for (size_t i = 0; i < count; ++i) {
+		struct buf* work = md->batch_ob;
 
-		if (extensions & MKDEXT_STRIKETHROUGH) {
-			md->active_char['~'] = MD_CHAR_EMPHASIS;
+		offsets[i] = ob->size;
+		work->size = 0;
+		bufsetgrowth(work, ob->growth, ob->max_size);
+
+		int ret = render_document(work, documents[i], sizes[i], md);
+
+		if (ret == SD_BUDGET_EXCEEDED) {
+			status = SD_BUDGET_EXCEEDED;
+		} else if (ret != 0) {
+			status = -1;
 		}
 
-		if (extensions & MKDEXT_INS) {
-			md->active_char['+'] = MD_CHAR_EMPHASIS;
+		/* growing the output for all the documents left whenever it runs short, or to the exact size near the maximal one */
+		if ((status != -1) && ((ob->size + work->size) > ob->asize) && (bufgrow(ob, ob->size + work->size + MARKDOWN_GROW(left)) != BUF_OK) && (bufgrow(ob, ob->size + work->size) != BUF_OK)) {
+			status = -1;
 		}
-	}
 
-	if (md->cb.codespan != NULL) {
-		md->active_char['`'] = MD_CHAR_CODESPAN;
-	}
+		/* the documents from the one that failed on are left empty */
+		if (status == -1) {
+			for (size_t j = i + 1; j < count; ++j) {
+				offsets[j] = ob->size;
+			}
 
-	if (md->cb.linebreak != NULL) {
-		md->active_char['\n'] = MD_CHAR_LINEBREAK;
-	}
+			break;
+		}
 
-	if ((md->cb.image != NULL) || (md->cb.link != NULL)) {
-		md->active_char['['] = MD_CHAR_LINK;
+		bufput(ob, work->data, work->size);
+		left -= sizes[i];
 	}
 
-	md->active_char['<'] = MD_CHAR_LANGLE;
-	md->active_char['\\'] = MD_CHAR_ESCAPE;
-	md->active_char['&'] = MD_CHAR_ENTITITY;
+	offsets[count] = ob->size;
 
-	if (extensions & MKDEXT_AUTOLINK) {
-		md->active_char[':'] = MD_CHAR_AUTOLINK_URL;
-		md->active_char['@'] = MD_CHAR_AUTOLINK_EMAIL;
-		md->active_char['w'] = MD_CHAR_AUTOLINK_WWW;
-	}
+	return status;
+}
 
-	if (extensions & MKDEXT_SUPERSCRIPT) {
-		md->active_char['^'] = MD_CHAR_SUPERSCRIPT;
+struct sd_nodes* sd_nodes_new(void)
+{
+	struct sd_nodes* nodes = calloc(1, sizeof(struct sd_nodes));
+
+	if (nodes == NULL) {
+		return NULL;
 	}
 
-	/* Extension data */
-	md->ext_flags = extensions;
-	md->opaque = opaque;
-	md->max_nesting = max_nesting;
-	md->in_link_body = 0;
+	if ((nodes->text = bufnew(1024)) == NULL) {
+		free(nodes);
 
-	return md;
+		return NULL;
+	}
+
+	return nodes;
 }
 
-void sd_markdown_render(struct buf* ob, const uint8_t* document, size_t doc_size, struct sd_markdown* md)
+void sd_nodes_free(struct sd_nodes* nodes)
 {
-#define MARKDOWN_GROW(x) ((x) + ((x) >> 1))
-	static const char UTF8_BOM[] = {0xEF, 0xBB, 0xBF};
-
-	struct buf* text = bufnew(64);
-
-	if (text == NULL) {
+	if (nodes == NULL) {
 		return;
 	}
 
-	/* Preallocate enough space for our buffer to avoid expanding while copying */
-	if (bufgrow(text, doc_size) != BUF_OK) {
-		bufrelease(text);
+	bufrelease(nodes->text);
+	free(nodes->nodes);
+	free(nodes);
+}
 
-		return;
-	}
+int sd_markdown_render_nodes(struct sd_nodes* nodes, const uint8_t* document, size_t doc_size, struct sd_markdown* md)
+{
+	const struct sd_markdown_config* cfg = md->cfg;
+	void* opaque = md->opaque;
+	struct sd_markdown_config node_cfg;
 
-	/* reset the references table */
-	memset(&md->refs, 0x00, REF_TABLE_SIZE * sizeof(void*));
+	/* the same parsing, recording the nodes instead of rendering them */
+	memcpy(&node_cfg, cfg, sizeof(struct sd_markdown_config));
+	node_callbacks(&node_cfg.cb, &cfg->cb);
 
-	int footnotes_enabled = md->ext_flags & MKDEXT_FOOTNOTES;
+	/* read-only, as nothing is rendered into it */
+	struct buf ob = {NULL, 0, 0, 0, nodes->text->growth, nodes->text->max_size};
 
-	/* reset the footnotes lists */
-	if (footnotes_enabled != 0) {
-		memset(&md->footnotes_found, 0x00, sizeof(md->footnotes_found));
-		memset(&md->footnotes_used, 0x00, sizeof(md->footnotes_used));
-	}
+	nodes->count = 0;
+	nodes->text->size = 0;
 
-	/* first pass: looking for references, copying everything else */
-	size_t beg = 0;
+	md->cfg = &node_cfg;
+	md->opaque = md;
+	md->stream_ob = NULL;
+	md->nodes = nodes;
+	md->node_top = 0;
+	md->node_status = 0;
 
-	/*
-	 * Skip a possible UTF-8 BOM, even though the Unicode standard
-	 * discourages having these in UTF-8 documents
-	 */
-	if ((doc_size >= 3) && (memcmp(document, UTF8_BOM, 3) == 0)) {
-		beg += 3;
+	int status = render_document(&ob, document, doc_size, md);
+
+	if (md->node_status == 0) {
+		node_reorder(md);
+	} else {
+		nodes->count = 0;
+		nodes->text->size = 0;
 	}
 
-	size_t end;
+	md->cfg = cfg;
+	md->opaque = opaque;
+	md->nodes = NULL;
 
-	while (beg < doc_size) { /* iterating over lines */
-		if ((footnotes_enabled != 0) && (is_footnote(document, beg, doc_size, &end, &md->footnotes_found) != 0)) {
-			beg = end;
-		} else if (is_ref(document, beg, doc_size, &end, md->refs) != 0) {
-			beg = end;
-		} else { /* skipping to the next line */
-			end = beg;
+	return (md->node_status != 0) ? (md->node_status) : (status);
+}
 
-			while ((end < doc_size) && (document[end] != '\n') && (document[end] != '\r')) {
-				end++;
-			}
+struct sd_markdown_session* sd_markdown_session_new(struct sd_markdown* md)
+{
+	struct sd_markdown_session* session = calloc(1, sizeof(struct sd_markdown_session));
 
-			/* adding the line body if present */
-			if (end > beg) {
-				expand_tabs(text, document + beg, end - beg);
-			}
+	if (session == NULL) {
+		return NULL;
+	}
 
-			while ((end < doc_size) && ((document[end] == '\n') || (document[end] == '\r'))) {
-				/* add one \n per newline */
-				if ((document[end] == '\n') || (((end + 1) < doc_size) && (document[end + 1] != '\n'))) {
-					bufputc(text, '\n');
-				}
+	session->md = md;
+	session->stage = bufnew(256);
+	session->ref_log = bufnew(64);
 
-				end++;
-			}
+	for (int i = 0; i < 2; ++i) {
+		session->gen[i].src = bufnew(1024);
+		session->gen[i].out = bufnew(1024);
+		session->gen[i].refs = bufnew(64);
 
-			beg = end;
+		if ((session->gen[i].src == NULL) || (session->gen[i].out == NULL) || (session->gen[i].refs == NULL)) {
+			sd_markdown_session_free(session);
+
+			return NULL;
 		}
 	}
 
-	/* pre-grow the output buffer to minimize allocations */
-	if (bufgrow(ob, MARKDOWN_GROW(text->size)) != BUF_OK) {
-		return;
-	}
+	if ((session->stage == NULL) || (session->ref_log == NULL)) {
+		sd_markdown_session_free(session);
 
-	/* second pass: actual rendering */
-	if (md->cb.doc_header != NULL) {
-		md->cb.doc_header(ob, md->opaque);
+		return NULL;
 	}
 
-	if (text->size != 0) {
-		/* adding a final newline if not already present */
-		if ((text->data[text->size - 1] != '\n') && (text->data[text->size - 1] != '\r')) {
-			bufputc(text, '\n');
-		}
+	return session;
+}
 
-		parse_block(ob, md, text->data, text->size);
-	}
+int sd_markdown_session_render(struct buf* ob, const uint8_t* document, size_t doc_size, struct sd_markdown_session* session)
+{
+	struct sd_markdown* md = session->md;
 
-	/* footnotes */
-	if (footnotes_enabled != 0) {
-		parse_footnote_list(ob, md, &md->footnotes_used);
-	}
+	md->stream_ob = NULL;
+	md->session = session;
 
-	if (md->cb.doc_footer != NULL) {
-		md->cb.doc_footer(ob, md->opaque);
-	}
+	int status = render_document(ob, document, doc_size, md);
 
-	if (md->cb.outline != NULL) {
-		md->cb.outline(ob, md->opaque);
+	md->session = NULL;
+
+	return status;
+}
+
+void sd_markdown_session_free(struct sd_markdown_session* session)
+{
+	if (session == NULL) {
+		return;
 	}
 
-	/* clean-up */
-	bufrelease(text);
-	free_link_refs(md->refs);
+	for (int i = 0; i < 2; ++i) {
+		struct session_gen* gen = &session->gen[i];
+
+		if ((gen->src != NULL) && (gen->out != NULL) && (gen->refs != NULL)) {
+			session_gen_reset(session->md, gen);
+		}
 
-	if (footnotes_enabled != 0) {
-		free_footnote_list(&md->footnotes_found, 1);
-		free_footnote_list(&md->footnotes_used, 0);
+		bufrelease(gen->src);
+		bufrelease(gen->out);
+		bufrelease(gen->refs);
+		free(gen->blocks);
 	}
 
-	assert(md->work_bufs[BUFFER_SPAN].size == 0);
-	assert(md->work_bufs[BUFFER_BLOCK].size == 0);
+	bufrelease(session->stage);
+	bufrelease(session->ref_log);
+	free(session->index);
+	free(session);
 }
 
-void sd_markdown_free(struct sd_markdown* md)
+/**
+ * releases the buffers owned by a parser or worker context
+ */
+static void rndr_release(struct sd_markdown* md)
 {
 	for (size_t i = 0; i < (size_t) md->work_bufs[BUFFER_SPAN].asize; ++i) {
 		bufrelease(md->work_bufs[BUFFER_SPAN].item[i]);
@@ -3607,12 +6641,84 @@ void sd_markdown_free(struct sd_markdown* md)
 		bufrelease(md->work_bufs[BUFFER_BLOCK].item[i]);
 	}
 
+	for (size_t i = 0; i < (size_t) md->work_bufs[BUFFER_MEMO].asize; ++i) {
+		bufrelease(md->work_bufs[BUFFER_MEMO].item[i]);
+	}
+
 	stack_free(&md->work_bufs[BUFFER_SPAN]);
 	stack_free(&md->work_bufs[BUFFER_BLOCK]);
+	stack_free(&md->work_bufs[BUFFER_MEMO]);
+	sd_arena_free(&md->arena);
+	bufrelease(md->ro_copy);
+	free(md->close.tags);
+	free(md->close.scratch);
+	bufrelease(md->text);
+	bufrelease(md->batch_ob);
+	free(md->refs.storage);
+	free(md->footnotes_found.storage);
+	stack_free(&md->footnotes_used);
+	free(md->node_slots);
+}
+
+void sd_markdown_free(struct sd_markdown* md)
+{
+#if !defined(_WIN32)
+	render_pool_free(md->pool);
+#endif
+
+	for (size_t i = 0; i < md->worker_count; ++i) {
+		rndr_release(md->workers[i]);
+		free(md->workers[i]);
+	}
+
+	free(md->workers);
+	rndr_release(md);
+	sd_markdown_config_free(md->own_cfg);
 
 	free(md);
 }
 
+int sd_markdown_render_key(struct sd_render_key* key, const uint8_t* document, size_t doc_size, const struct sd_markdown* md, unsigned int render_flags, sd_render_hook render_hook)
+{
+	key->doc_hash = hash_document(document, doc_size);
+	key->doc_size = doc_size;
+	key->callbacks = md->cfg->callbacks_hash;
+	key->ext_flags = md->cfg->ext_flags;
+	key->max_nesting = md->cfg->max_nesting;
+	key->render_flags = render_flags;
+	key->render_hook = render_hook;
+
+	/* the output of a render with a budget depends on more than the key */
+	return (md->has_budget != 0) ? (-1) : (0);
+}
+
+void sd_markdown_set_arena(struct sd_markdown* md, struct sd_arena* arena)
+{
+	md->ref_arena = (arena != NULL) ? (arena) : (&md->arena);
+}
+
+void sd_markdown_set_budget(struct sd_markdown* md, const struct sd_budget* budget)
+{
+	if (budget != NULL) {
+		md->budget = *budget;
+	} else {
+		memset(&md->budget, 0x00, sizeof(md->budget));
+	}
+
+	md->has_budget = (md->budget.max_output != 0) || (md->budget.max_triggers != 0) || (md->budget.max_time != 0) || (md->cfg->cb.done != NULL);
+}
+
+int sd_markdown_set_stats(struct sd_markdown* md, struct sd_stats* stats)
+{
+#ifdef SD_STATS
+	md->stats = stats;
+
+	return 0;
+#else
+	return (stats != NULL) ? (-1) : (0);
+#endif
+}
+
 void sd_version(int* ver_major, int* ver_minor, int* ver_revision)
 {
 	*ver_major = SUNDOWN_VER_MAJOR;
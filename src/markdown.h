@@ -21,6 +21,7 @@
 
 #include "buffer.h"
 #include "autolink.h"
+#include "arena.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -80,6 +81,48 @@ enum mkd_extensions
 	MKDEXT_FOOTNOTES = (1 << 9),
 };
 
+/**
+ * type of a parsed element, one per callback; as nodes of
+ * sd_markdown_render_nodes, links, images and code blocks carry their
+ * attributes as leaf children
+ */
+enum mkd_node
+{
+	MKDN_BLOCKCODE,
+	MKDN_BLOCKQUOTE,
+	MKDN_BLOCKHTML,
+	MKDN_HEADER,
+	MKDN_HRULE,
+	MKDN_LIST,
+	MKDN_LISTITEM,
+	MKDN_PARAGRAPH,
+	MKDN_TABLE,
+	MKDN_TABLE_ROW,
+	MKDN_TABLE_CELL,
+	MKDN_FOOTNOTES,
+	MKDN_FOOTNOTE_DEF,
+	MKDN_AUTOLINK,
+	MKDN_CODESPAN,
+	MKDN_DOUBLE_EMPHASIS,
+	MKDN_EMPHASIS,
+	MKDN_IMAGE,
+	MKDN_LINEBREAK,
+	MKDN_LINK,
+	MKDN_RAW_HTML_TAG,
+	MKDN_TRIPLE_EMPHASIS,
+	MKDN_INS,
+	MKDN_STRIKETHROUGH,
+	MKDN_SUPERSCRIPT,
+	MKDN_FOOTNOTE_REF,
+	MKDN_ENTITY,
+	MKDN_TEXT,
+
+	/* attributes */
+	MKDN_URL,
+	MKDN_TITLE,
+	MKDN_LANG,
+};
+
 /**
  * functions for rendering parsed data
  */
@@ -125,9 +168,178 @@ struct sd_callbacks
 
 	/* outliner */
 	void (*outline)(struct buf* ob, void* opaque);
+
+	/*
+	 * parallel and incremental rendering - NULL renders serially
+	 * fork returns a copy of the renderer state for a run of blocks rendered
+	 * on another thread or kept in a session cache, or NULL. join is then
+	 * called in document order: unless SD_JOIN_DISCARD is set, it merges the
+	 * copy and returns 0 when the run rendered from the same state as a
+	 * serial render would have; it releases the copy unless SD_JOIN_KEEP is
+	 * set, as a copy may be merged again by later renders
+	 */
+	void* (*fork)(void* opaque);
+	int (*join)(void* opaque, void* fork_opaque, int flags);
+
+	/*
+	 * containers rendered in place - NULL or 0 from open renders the children
+	 * into a buffer handed to the container callback; otherwise they are
+	 * rendered straight into ob, between open and close. type is
+	 * MKDN_BLOCKQUOTE, MKDN_LIST or MKDN_LISTITEM
+	 */
+	int (*open)(struct buf* ob, enum mkd_node type, int flags, void* opaque);
+	void (*close)(struct buf* ob, enum mkd_node type, int flags, void* opaque);
+
+	/*
+	 * early termination - NULL renders the whole document
+	 * done returns non-zero once the renderer needs no more of the document:
+	 * the render stops at the next block or span boundary as when out of
+	 * budget, and returns SD_BUDGET_EXCEEDED, done being checked again at
+	 * the end of the document. With fork and join, sd_markdown_render first
+	 * renders from prefixes of the document, skipping the reference pass
+	 * over the rest when the output cannot depend on it
+	 */
+	int (*done)(void* opaque);
+};
+
+struct sd_node
+{
+	enum mkd_node type;
+
+	/* list, listitem and table cell flags, header level, footnote number or autolink type */
+	unsigned int flags;
+
+	/* index of the parent node, SD_NODE_ROOT for top-level blocks */
+	size_t parent;
+
+	/* bytes of a leaf in sd_nodes.text, of all its descendants for a container */
+	size_t offset;
+	size_t size;
+};
+
+/**
+ * flat tree of a document, nodes in document order with parents first
+ */
+struct sd_nodes
+{
+	struct sd_node* nodes;
+	size_t count;
+	size_t asize;
+
+	/* text of the leaves, in document order */
+	struct buf* text;
+};
+
+/**
+ * block types timed by struct sd_stats
+ */
+enum sd_stats_block
+{
+	SD_STATS_HEADER,
+	SD_STATS_BLOCKHTML,
+	SD_STATS_HRULE,
+	SD_STATS_FENCEDCODE,
+	SD_STATS_TABLE,
+	SD_STATS_BLOCKQUOTE,
+	SD_STATS_BLOCKCODE,
+	SD_STATS_LIST,
+	SD_STATS_PARAGRAPH,
+	SD_STATS_BLOCK_COUNT
+};
+
+/**
+ * inline triggers counted by struct sd_stats
+ */
+enum sd_stats_trigger
+{
+	SD_STATS_EMPHASIS,
+	SD_STATS_CODESPAN,
+	SD_STATS_LINEBREAK,
+	SD_STATS_LINK,
+	SD_STATS_LANGLE,
+	SD_STATS_ESCAPE,
+	SD_STATS_ENTITY,
+	SD_STATS_AUTOLINK_URL,
+	SD_STATS_AUTOLINK_EMAIL,
+	SD_STATS_AUTOLINK_WWW,
+	SD_STATS_SUPERSCRIPT,
+	SD_STATS_TRIGGER_COUNT
+};
+
+/**
+ * instrumentation of a render, only filled in when built with SD_STATS
+ */
+struct sd_stats
+{
+	size_t bytes_in;
+	size_t bytes_out;
+
+	/* blocks parsed, and nanoseconds spent in them including their nested blocks */
+	size_t block_count[SD_STATS_BLOCK_COUNT];
+	uint64_t block_time[SD_STATS_BLOCK_COUNT];
+
+	size_t trigger_count[SD_STATS_TRIGGER_COUNT];
+
+	/* deepest nesting of the block and span work buffers */
+	size_t block_bufs_max;
+	size_t span_bufs_max;
+
+	/* reallocations made by bufgrow on the rendering thread */
+	size_t grow_count;
+
+	size_t ref_count;
+	size_t footnote_count;
+};
+
+/**
+ * bounds on the work of each render, 0 for no limit
+ */
+struct sd_budget
+{
+	/* bytes of output, checked as blocks and spans are parsed */
+	size_t max_output;
+
+	/* calls of the inline parsers */
+	size_t max_triggers;
+
+	/* nanoseconds of wall-clock time from the start of the render, on a
+	 * monotonic clock: CLOCK_MONOTONIC, or QueryPerformanceCounter on Windows */
+	uint64_t max_time;
+};
+
+/**
+ * extra callback of a renderer, outside of struct sd_callbacks, such as
+ * html_renderopt.link_attributes
+ */
+typedef void (*sd_render_hook)(void);
+
+/**
+ * identity of a render, for caching its output: renders of the same
+ * document with equal keys produce the same output
+ */
+struct sd_render_key
+{
+	uint64_t doc_hash;
+	size_t doc_size;
+
+	/* configuration of the parser, the callbacks by their addresses */
+	uint64_t callbacks;
+	unsigned int ext_flags;
+	size_t max_nesting;
+
+	/* flags of the renderer, such as those given to sdhtml_renderer, and its extra callback by its address */
+	unsigned int render_flags;
+	sd_render_hook render_hook;
 };
 
 struct sd_markdown;
+struct sd_markdown_config;
+struct sd_markdown_session;
+
+/**
+ * output sink of a streamed render, returns 0 on success
+ */
+typedef int (*sd_write_cb)(const uint8_t* data, size_t size, void* opaque);
 
 /* ********
  * FLAGS *
@@ -139,16 +351,131 @@ struct sd_markdown;
 /* <li> containing block data */
 #define MKD_LI_BLOCK 2
 
+/* join flags */
+#define SD_JOIN_DISCARD 1
+#define SD_JOIN_KEEP 2
+
+/* render status when the budget ran out, the output being cut short */
+#define SD_BUDGET_EXCEEDED 1
+
+/* parent of the top-level nodes */
+#define SD_NODE_ROOT ((size_t) -1)
+
 /* *********************
  * EXPORTED FUNCTIONS *
  **********************/
 
 extern struct sd_markdown* sd_markdown_new(unsigned int extensions, size_t max_nesting, const struct sd_callbacks* callbacks, void* opaque);
 
-extern void sd_markdown_render(struct buf* ob, const uint8_t* document, size_t doc_size, struct sd_markdown* md);
+/**
+ * compiles the extensions and callbacks into a read-only configuration,
+ * which any number of threads may share; it must outlive its parsers
+ */
+extern struct sd_markdown_config* sd_markdown_config_new(unsigned int extensions, size_t max_nesting, const struct sd_callbacks* callbacks);
+
+extern void sd_markdown_config_free(struct sd_markdown_config* cfg);
+
+/**
+ * creates a parser using a shared configuration; a parser only holds the
+ * state of a render and its warm buffers, and is used by one thread at a time
+ */
+extern struct sd_markdown* sd_markdown_new_with_config(const struct sd_markdown_config* cfg, void* opaque);
+
+/**
+ * renders a document into ob, returns 0 on success, SD_BUDGET_EXCEEDED, or
+ * -1 when out of memory or when a buffer would outgrow its maximal size,
+ * the output being then incomplete. The working buffers of the render
+ * follow the growth policy of ob, whose maximal size is 16MB unless
+ * bufsetgrowth(ob, growth, max_size) raises it
+ */
+extern int sd_markdown_render(struct buf* ob, const uint8_t* document, size_t doc_size, struct sd_markdown* md);
+
+/**
+ * renders count documents back to back into ob, keeping the parser warm in
+ * between; the output of document i is ob->data[offsets[i], offsets[i + 1])
+ * so offsets holds count + 1 entries. The renderer state carries over from
+ * one document to the next as with successive sd_markdown_render calls.
+ * returns 0, SD_BUDGET_EXCEEDED when any document was cut short, or -1
+ * when out of memory or over the maximal size of ob, the documents from
+ * the one that failed on being then left out with empty output
+ */
+extern int sd_markdown_render_batch(struct buf* ob, size_t* offsets, const uint8_t* const* documents, const size_t* sizes, size_t count, struct sd_markdown* md);
+
+/**
+ * renders like sd_markdown_render, splitting the top-level blocks over up
+ * to threads threads when the renderer supports it; the output is the same.
+ * the threads are kept by md for its next renders until sd_markdown_free
+ */
+extern int sd_markdown_render_parallel(struct buf* ob, const uint8_t* document, size_t doc_size, struct sd_markdown* md, unsigned int threads);
+
+/**
+ * renders like sd_markdown_render, handing the output to write after every
+ * top-level block; ob is only used as a staging buffer and is left empty.
+ * returns 0 on success, -1 as soon as write fails or as sd_markdown_render
+ * does, or SD_BUDGET_EXCEEDED
+ */
+extern int sd_markdown_render_stream(struct buf* ob, const uint8_t* document, size_t doc_size, struct sd_markdown* md, sd_write_cb write, void* opaque);
+
+/**
+ * creates a session rendering successive versions of a document with md:
+ * the top-level blocks whose source, references and renderer state are
+ * unchanged reuse the output of the previous render. The renderer options
+ * must stay the same, and the session be freed before md
+ */
+extern struct sd_markdown_session* sd_markdown_session_new(struct sd_markdown* md);
+
+/**
+ * renders like sd_markdown_render, through the cache of the session
+ */
+extern int sd_markdown_session_render(struct buf* ob, const uint8_t* document, size_t doc_size, struct sd_markdown_session* session);
+
+extern void sd_markdown_session_free(struct sd_markdown_session* session);
+
+extern struct sd_nodes* sd_nodes_new(void);
+
+extern void sd_nodes_free(struct sd_nodes* nodes);
+
+/**
+ * parses a document into nodes instead of rendering it, in a single pass
+ * without rendering into intermediate buffers. Blocks are all reported,
+ * spans and HTML blocks when md has their callbacks; the callbacks are not
+ * called. returns 0 on success, -1 when out of memory, or SD_BUDGET_EXCEEDED
+ */
+extern int sd_markdown_render_nodes(struct sd_nodes* nodes, const uint8_t* document, size_t doc_size, struct sd_markdown* md);
 
 extern void sd_markdown_free(struct sd_markdown* md);
 
+/**
+ * fills key in for a render of document by md, whose renderer was set up
+ * with render_flags and calls render_hook, NULL when it has none, such as
+ * (sd_render_hook) html_renderopt.link_attributes. The renderer state must
+ * be reset for every document, as the doc_header of sdhtml_renderer does.
+ * returns -1 when the output would not only depend on the key, md having
+ * a budget, and 0 otherwise
+ */
+extern int sd_markdown_render_key(struct sd_render_key* key, const uint8_t* document, size_t doc_size, const struct sd_markdown* md, unsigned int render_flags, sd_render_hook render_hook);
+
+/**
+ * makes the link references and footnotes of the following renders live in
+ * a caller-provided arena, which the caller then resets or frees; NULL
+ * restores the internal arena, reset at the end of every render
+ */
+extern void sd_markdown_set_arena(struct sd_markdown* md, struct sd_arena* arena);
+
+/**
+ * bounds the work of the following renders of md, which stop at a block or
+ * span boundary once a limit is reached, leaving the containers in progress
+ * closed; renders with a budget are not split over threads. NULL removes it
+ */
+extern void sd_markdown_set_budget(struct sd_markdown* md, const struct sd_budget* budget);
+
+/**
+ * fills stats in during the following renders of md, cleared at the start of
+ * each; blocks rendered by parallel workers are not counted. NULL stops it.
+ * returns 0 on success, -1 when the library was built without SD_STATS
+ */
+extern int sd_markdown_set_stats(struct sd_markdown* md, struct sd_stats* stats);
+
 extern void sd_version(int* major, int* minor, int* revision);
 
 #ifdef __cplusplus
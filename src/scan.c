@@ -0,0 +1,193 @@
+#include "scan.h"
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#define SCAN_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define SCAN_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SCAN_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+
+static inline size_t first_bit(unsigned int mask)
+{
+	unsigned long i;
+	_BitScanForward(&i, mask);
+
+	return i;
+}
+#else
+#define first_bit(mask) ((size_t) __builtin_ctz(mask))
+#endif
+
+void sd_charset_init(struct sd_charset* set)
+{
+	memset(set, 0x00, sizeof(struct sd_charset));
+}
+
+void sd_charset_add(struct sd_charset* set, uint8_t c)
+{
+	if (sd_charset_has(set, c) != 0) {
+		return;
+	}
+
+	set->bits[c >> 3] |= 1 << (c & 7);
+
+	/* bytes already covered by the range need no comparison */
+	if ((set->has_range != 0) && ((c < set->lo) || (c > set->hi))) {
+		return;
+	}
+
+	if (set->count < SD_CHARSET_MAX) {
+		set->chars[set->count++] = c;
+	} else {
+		set->scalar = 1;
+	}
+}
+
+void sd_charset_add_outside(struct sd_charset* set, uint8_t lo, uint8_t hi)
+{
+	/* a single range can be vectorized */
+	if (set->has_range != 0) {
+		set->scalar = 1;
+	}
+
+	set->has_range = 1;
+	set->lo = lo;
+	set->hi = hi;
+
+	for (unsigned int c = 0; c < 256; c++) {
+		if ((c < lo) || (c > hi)) {
+			set->bits[c >> 3] |= 1 << (c & 7);
+		}
+	}
+}
+
+void sd_charset_from_table(struct sd_charset* set, const uint8_t* table)
+{
+	sd_charset_init(set);
+
+	for (unsigned int c = 0; c < 256; c++) {
+		if (table[c] != 0) {
+			sd_charset_add(set, (uint8_t) c);
+		}
+	}
+}
+
+size_t sd_scan(const struct sd_charset* set, const uint8_t* data, size_t size)
+{
+	size_t i = 0;
+
+	if (set->scalar != 0) {
+		goto scalar;
+	}
+
+#if defined(SCAN_AVX2)
+	__m256i chars[SD_CHARSET_MAX];
+
+	for (size_t k = 0; k < set->count; k++) {
+		chars[k] = _mm256_set1_epi8((char) set->chars[k]);
+	}
+
+	/* x lies in [lo, hi] when (x - lo) saturates to 0 once hi - lo is taken off */
+	__m256i lo = _mm256_set1_epi8((char) set->lo);
+	__m256i width = _mm256_set1_epi8((char) (set->hi - set->lo));
+	__m256i zero = _mm256_setzero_si256();
+	__m256i ones = _mm256_cmpeq_epi8(zero, zero);
+
+	for (; (i + 32) <= size; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) (data + i));
+		__m256i m = zero;
+
+		for (size_t k = 0; k < set->count; k++) {
+			m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, chars[k]));
+		}
+
+		if (set->has_range != 0) {
+			__m256i in = _mm256_cmpeq_epi8(_mm256_subs_epu8(_mm256_sub_epi8(v, lo), width), zero);
+			m = _mm256_or_si256(m, _mm256_xor_si256(in, ones));
+		}
+
+		unsigned int mask = (unsigned int) _mm256_movemask_epi8(m);
+
+		if (mask != 0) {
+			return i + first_bit(mask);
+		}
+	}
+#elif defined(SCAN_SSE2)
+	__m128i chars[SD_CHARSET_MAX];
+
+	for (size_t k = 0; k < set->count; k++) {
+		chars[k] = _mm_set1_epi8((char) set->chars[k]);
+	}
+
+	/* x lies in [lo, hi] when (x - lo) saturates to 0 once hi - lo is taken off */
+	__m128i lo = _mm_set1_epi8((char) set->lo);
+	__m128i width = _mm_set1_epi8((char) (set->hi - set->lo));
+	__m128i zero = _mm_setzero_si128();
+	__m128i ones = _mm_cmpeq_epi8(zero, zero);
+
+	for (; (i + 16) <= size; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (data + i));
+		__m128i m = zero;
+
+		for (size_t k = 0; k < set->count; k++) {
+			m = _mm_or_si128(m, _mm_cmpeq_epi8(v, chars[k]));
+		}
+
+		if (set->has_range != 0) {
+			__m128i in = _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(v, lo), width), zero);
+			m = _mm_or_si128(m, _mm_xor_si128(in, ones));
+		}
+
+		unsigned int mask = (unsigned int) _mm_movemask_epi8(m);
+
+		if (mask != 0) {
+			return i + first_bit(mask);
+		}
+	}
+#elif defined(SCAN_NEON)
+	uint8x16_t chars[SD_CHARSET_MAX];
+
+	for (size_t k = 0; k < set->count; k++) {
+		chars[k] = vdupq_n_u8(set->chars[k]);
+	}
+
+	uint8x16_t lo = vdupq_n_u8(set->lo);
+	uint8x16_t hi = vdupq_n_u8(set->hi);
+
+	for (; (i + 16) <= size; i += 16) {
+		uint8x16_t v = vld1q_u8(data + i);
+		uint8x16_t m = vdupq_n_u8(0);
+
+		for (size_t k = 0; k < set->count; k++) {
+			m = vorrq_u8(m, vceqq_u8(v, chars[k]));
+		}
+
+		if (set->has_range != 0) {
+			m = vorrq_u8(m, vorrq_u8(vcltq_u8(v, lo), vcgtq_u8(v, hi)));
+		}
+
+		uint64x2_t w = vreinterpretq_u64_u8(m);
+
+		/* the exact position is found by the scalar loop */
+		if ((vgetq_lane_u64(w, 0) | vgetq_lane_u64(w, 1)) != 0) {
+			break;
+		}
+	}
+#endif
+
+scalar:
+	while ((i < size) && (sd_charset_has(set, data[i]) == 0)) {
+		i++;
+	}
+
+	return i;
+}
@@ -0,0 +1,57 @@
+#ifndef SCAN_H__
+#define SCAN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SD_CHARSET_MAX 16
+
+/**
+ * set of bytes looked for by sd_scan
+ */
+struct sd_charset
+{
+	/* members compared 16 or 32 bytes at a time */
+	uint8_t chars[SD_CHARSET_MAX];
+	size_t count;
+
+	/* when has_range is set, every byte outside [lo, hi] is a member */
+	int has_range;
+	uint8_t lo;
+	uint8_t hi;
+
+	/* too many members to be vectorized, only the bitmap is used */
+	int scalar;
+
+	/* membership bitmap */
+	uint8_t bits[32];
+};
+
+void sd_charset_init(struct sd_charset*);
+void sd_charset_add(struct sd_charset*, uint8_t c);
+void sd_charset_add_outside(struct sd_charset*, uint8_t lo, uint8_t hi);
+
+/**
+ * makes a set of the bytes having a non-zero entry in table
+ */
+void sd_charset_from_table(struct sd_charset*, const uint8_t* table);
+
+/**
+ * returns the offset of the first member of the set in data, or size
+ */
+size_t sd_scan(const struct sd_charset*, const uint8_t* data, size_t size);
+
+static inline int sd_charset_has(const struct sd_charset* set, uint8_t c)
+{
+	return (set->bits[c >> 3] >> (c & 7)) & 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif